@@ -141,9 +141,23 @@ int DistributedObjectStore::setup(const std::string &local_hostname,
                                   size_t local_buffer_size,
                                   const std::string &protocol,
                                   const std::string &rdma_devices,
-                                  const std::string &master_server_addr) {
+                                  const std::string &master_server_addr,
+                                  const std::string &hugepage, int numa_node,
+                                  int prefault_threads, bool shared_memory) {
     this->protocol = protocol;
 
+    SegmentMemoryConfig memory_config;
+    if (!parseHugePageMode(hugepage, memory_config.huge_page)) {
+        LOG(ERROR) << "Invalid hugepage mode: " << hugepage
+                   << ", expected none, hugetlb or thp";
+        return 1;
+    }
+    memory_config.numa_node = numa_node;
+    memory_config.prefault_threads = prefault_threads;
+    // Puts prefer segments on the node of this host the store is bound to
+    segment_location =
+        numa_node >= 0 ? "cpu:" + std::to_string(numa_node) : "";
+
     // Remove port if hostname already contains one
     std::string hostname = local_hostname;
     size_t colon_pos = hostname.find(":");
@@ -171,21 +185,30 @@ int DistributedObjectStore::setup(const std::string &local_hostname,
     }
 
     client_buffer_allocator_ =
-        std::make_unique<SimpleAllocator>(local_buffer_size);
+        std::make_unique<SimpleAllocator>(local_buffer_size, memory_config);
     rc = client_->RegisterLocalMemory(client_buffer_allocator_->getBase(),
-                                      local_buffer_size, "cpu:0", false, false);
+                                      local_buffer_size,
+                                      segment_location.empty()
+                                          ? "cpu:0"
+                                          : segment_location,
+                                      false, false);
     if (rc != ErrorCode::OK) {
         LOG(ERROR) << "Failed to register local memory: " << toString(rc);
         return 1;
     }
-    void *ptr = allocate_buffer_allocator_memory(global_segment_size);
+    // Workers on this host reach the segment through shared memory
+    SegmentMemoryConfig segment_config = memory_config;
+    segment_config.shared = shared_memory;
+    void *ptr =
+        allocate_buffer_allocator_memory(global_segment_size, segment_config);
     if (!ptr) {
         LOG(ERROR) << "Failed to allocate segment memory";
         return 1;
     }
-    segment_ptr_.reset(ptr);
+    segment_ptr_ = std::unique_ptr<void, SegmentDeleter>(
+        ptr, SegmentDeleter{global_segment_size, segment_config});
     rc = client_->MountSegment(this->local_hostname, segment_ptr_.get(),
-                               global_segment_size);
+                               global_segment_size, segment_location);
     if (rc != ErrorCode::OK) {
         LOG(ERROR) << "Failed to mount segment: " << toString(rc);
         return 1;
@@ -290,6 +313,7 @@ int DistributedObjectStore::put(const std::string &key,
     }
     ReplicateConfig config;
     config.replica_num = 1;  // TODO
+    config.preferred_location = segment_location;
 
     std::vector<Slice> slices;
     int ret = allocateSlices(slices, value);
@@ -228,6 +228,23 @@ int VLLMAdaptor::expUnregisterMemory(uintptr_t buffer_addr) {
     return engine_->unregisterLocalMemory(buffer);
 }
 
+int VLLMAdaptor::expRegisterMemoryBatch(
+    const std::vector<uintptr_t> &buffer_addrs,
+    const std::vector<size_t> &capacities) {
+    if (buffer_addrs.size() != capacities.size()) return -1;
+    std::vector<BufferEntry> buffer_list;
+    for (size_t i = 0; i < buffer_addrs.size(); ++i)
+        buffer_list.push_back({(void *)buffer_addrs[i], capacities[i]});
+    return engine_->registerLocalMemoryBatch(buffer_list, "cpu:0");
+}
+
+int VLLMAdaptor::expUnregisterMemoryBatch(
+    const std::vector<uintptr_t> &buffer_addrs) {
+    std::vector<void *> addr_list;
+    for (auto addr : buffer_addrs) addr_list.push_back((void *)addr);
+    return engine_->unregisterLocalMemoryBatch(addr_list);
+}
+
 namespace py = pybind11;
 
 PYBIND11_MODULE(mooncake_vllm_adaptor, m) {
@@ -241,10 +258,21 @@ PYBIND11_MODULE(mooncake_vllm_adaptor, m) {
         .def("writeBytesToBuffer", &VLLMAdaptor::writeBytesToBuffer)
         .def("readBytesFromBuffer", &VLLMAdaptor::readBytesFromBuffer)
         .def("expRegisterMemory", &VLLMAdaptor::expRegisterMemory)
-        .def("expUnregisterMemory", &VLLMAdaptor::expUnregisterMemory);
+        .def("expUnregisterMemory", &VLLMAdaptor::expUnregisterMemory)
+        .def("expRegisterMemoryBatch", &VLLMAdaptor::expRegisterMemoryBatch)
+        .def("expUnregisterMemoryBatch",
+             &VLLMAdaptor::expUnregisterMemoryBatch);
     py::class_<DistributedObjectStore>(m, "MooncakeDistributedStore")
         .def(py::init<>())
-        .def("setup", &DistributedObjectStore::setup)
+        .def("setup", &DistributedObjectStore::setup,
+             py::arg("local_hostname"), py::arg("metadata_server"),
+             py::arg("global_segment_size") = 1024 * 1024 * 16,
+             py::arg("local_buffer_size") = 1024 * 1024 * 16,
+             py::arg("protocol") = "tcp", py::arg("rdma_devices") = "",
+             py::arg("master_server_addr") = "127.0.0.1:50051",
+             py::arg("hugepage") = "none", py::arg("numa_node") = -1,
+             py::arg("prefault_threads") = 0,
+             py::arg("shared_memory") = true)
         .def("initAll", &DistributedObjectStore::initAll)
         .def("get", &DistributedObjectStore::get)
         .def("put", &DistributedObjectStore::put)
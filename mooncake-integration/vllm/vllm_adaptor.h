@@ -15,6 +15,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include <sys/time.h>
 
 #include <cstdlib>
@@ -78,6 +79,14 @@ class VLLMAdaptor {
     // must be called before VLLMAdaptor::~VLLMAdaptor()
     int expUnregisterMemory(uintptr_t buffer_addr);
 
+    // Registers many buffers, e.g. one per layer, with a single metadata
+    // update. Calling expRegisterMemory() for each of them costs time
+    // quadratic in the number of registered buffers.
+    int expRegisterMemoryBatch(const std::vector<uintptr_t> &buffer_addrs,
+                               const std::vector<size_t> &capacities);
+
+    int expUnregisterMemoryBatch(const std::vector<uintptr_t> &buffer_addrs);
+
    private:
     char *allocateRawBuffer(size_t capacity);
 
@@ -24,13 +24,16 @@ class AllocationStrategy {
      * @param allocators Container of mounted allocators, key is segment_name,
      *                  value is the corresponding allocator
      * @param objectSize Size of object to be allocated
+     * @param preferredLocation Location (e.g. "host/cpu:1") of the
+     *                  allocators to choose first, falling back to the others
+     *                  if none of them has space; empty for no preference
      * @return Selected allocator; returns nullptr if allocation is not possible
      *         or no suitable allocator is found
      */
     virtual std::shared_ptr<BufHandle> Allocate(
         const std::unordered_map<std::string, std::shared_ptr<BufferAllocator>>&
             allocators,
-        size_t objectSize) = 0;
+        size_t objectSize, const std::string& preferredLocation) = 0;
 };
 
 class RandomAllocationStrategy : public AllocationStrategy {
@@ -40,9 +43,26 @@ class RandomAllocationStrategy : public AllocationStrategy {
     std::shared_ptr<BufHandle> Allocate(
         const std::unordered_map<std::string, std::shared_ptr<BufferAllocator>>&
             allocators,
-        size_t objectSize) override {
+        size_t objectSize, const std::string& preferredLocation) override {
+        if (!preferredLocation.empty()) {
+            auto bufHandle =
+                AllocateRandomly(allocators, objectSize, &preferredLocation);
+            if (bufHandle) {
+                return bufHandle;
+            }
+        }
+        return AllocateRandomly(allocators, objectSize, nullptr);
+    }
+
+   private:
+    // Allocates from a random allocator with enough space, only considering
+    // allocators on location if it is not null
+    std::shared_ptr<BufHandle> AllocateRandomly(
+        const std::unordered_map<std::string, std::shared_ptr<BufferAllocator>>&
+            allocators,
+        size_t objectSize, const std::string* location) {
         // Because there is only one allocator, we can directly allocate from it
-        if (allocators.size() == 1) {
+        if (allocators.size() == 1 && !location) {
             auto& allocator = allocators.begin()->second;
             return allocator->allocate(objectSize);
         }
@@ -51,6 +71,9 @@ class RandomAllocationStrategy : public AllocationStrategy {
 
         for (const auto& kv : allocators) {
             auto& allocator = kv.second;
+            if (location && allocator->getLocation() != *location) {
+                continue;
+            }
             size_t capacity = allocator->capacity();
             size_t used = allocator->size();
             size_t available = capacity > used ? (capacity - used) : 0;
@@ -66,23 +89,24 @@ class RandomAllocationStrategy : public AllocationStrategy {
         }
 
         // Randomly select one from eligible allocators
-        std::uniform_int_distribution<size_t> dist(0, eligible.size() - 1);
-        size_t randomIndex = dist(rng_);
         const size_t max_try = 10;
         size_t try_count = 0;
         // Due to allocator fragmentation, we may fail to allocate memory even
-        while (try_count < max_try) {
-            auto& allocator = eligible[randomIndex];
-            auto bufHandle = allocator->allocate(objectSize);
+        // if there is enough space, so try another allocator then
+        while (try_count < max_try && !eligible.empty()) {
+            std::uniform_int_distribution<size_t> dist(0, eligible.size() - 1);
+            size_t randomIndex = dist(rng_);
+            auto bufHandle = eligible[randomIndex]->allocate(objectSize);
             if (bufHandle) {
                 return bufHandle;
             }
+            eligible[randomIndex] = eligible.back();
+            eligible.pop_back();
             try_count++;
         }
         return nullptr;
     }
 
-   private:
     std::mt19937 rng_;  // Mersenne Twister random number generator
 };
 
@@ -6,6 +6,7 @@
 
 #include "cachelib_memory_allocator/MemoryAllocator.h"
 #include "types.h"
+#include "utils.h"
 
 using facebook::cachelib::MemoryAllocator;
 using facebook::cachelib::PoolId;
@@ -36,7 +37,8 @@ namespace mooncake {
  */
 class BufferAllocator : public std::enable_shared_from_this<BufferAllocator> {
    public:
-    BufferAllocator(std::string segment_name, size_t base, size_t size);
+    BufferAllocator(std::string segment_name, size_t base, size_t size,
+                    std::string location = "");
 
     ~BufferAllocator();
 
@@ -47,10 +49,14 @@ class BufferAllocator : public std::enable_shared_from_this<BufferAllocator> {
     size_t capacity() const { return total_size_; }
     size_t size() const { return cur_size_.load(); }
     std::string getSegmentName() const { return segment_name_; }
+    // Host and NUMA location of the memory, e.g. "host/cpu:1", empty if
+    // unknown
+    const std::string& getLocation() const { return location_; }
 
    private:
     // metadata
     std::string segment_name_;
+    std::string location_;
     size_t base_;
     size_t total_size_;
     std::atomic<size_t> cur_size_{0};
@@ -66,7 +72,7 @@ class BufferAllocator : public std::enable_shared_from_this<BufferAllocator> {
 // BufferAllocator allocates an address
 class SimpleAllocator {
    public:
-    SimpleAllocator(size_t size);
+    SimpleAllocator(size_t size, const SegmentMemoryConfig& config = {});
     ~SimpleAllocator();
     void* allocate(size_t size);
     void deallocate(void* ptr, size_t size);
@@ -74,6 +80,8 @@ class SimpleAllocator {
 
    private:
     void* base_{nullptr};
+    size_t size_;
+    SegmentMemoryConfig config_;
 
     std::unique_ptr<char[]> header_region_start_;
     size_t header_region_size_;
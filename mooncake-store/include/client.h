@@ -93,10 +93,13 @@ class Client {
      * @param segment_name Unique identifier for the segment
      * @param buffer Memory buffer to register
      * @param size Size of the buffer in bytes
+     * @param location NUMA location of the buffer, e.g. "cpu:1". Puts from
+     * this host whose ReplicateConfig prefers this location are allocated
+     * from it first
      * @return ErrorCode indicating success/failure
      */
     ErrorCode MountSegment(const std::string& segment_name, const void* buffer,
-                           size_t size);
+                           size_t size, const std::string& location = "");
 
     /**
      * @brief Unregisters a memory segment from master
@@ -141,6 +144,10 @@ class Client {
      * @brief Internal helper functions for initialization and data transfer
      */
     ErrorCode ConnectToMaster(const std::string& master_addr);
+    // Location tag the master matches segments on: location (e.g. "cpu:1")
+    // qualified with this client's host, so that node numbers of different
+    // hosts never match
+    std::string HostLocation(const std::string& location) const;
     ErrorCode InitTransferEngine(const std::string& local_hostname,
                                  const std::string& metadata_connstring,
                                  const std::string& protocol,
@@ -45,7 +45,7 @@ class BufferAllocatorManager {
      * exists
      */
     ErrorCode AddSegment(const std::string& segment_name, uint64_t base,
-                         uint64_t size);
+                         uint64_t size, const std::string& location = "");
 
     /**
      * @brief Unregister a buffer
@@ -92,11 +92,14 @@ class MasterService {
 
     /**
      * @brief Mount a memory segment for buffer allocation
+     * @param location Host and NUMA location of the memory, e.g.
+     * "host/cpu:1", matched against ReplicateConfig::preferred_location
      * @return ErrorCode::OK on success, ErrorCode::INVALID_PARAMS if segment
      * exists or params invalid, ErrorCode::INTERNAL_ERROR if allocation fails
      */
     ErrorCode MountSegment(uint64_t buffer, uint64_t size,
-                           const std::string& segment_name);
+                           const std::string& segment_name,
+                           const std::string& location = "");
 
     /**
      * @brief Unmount a memory segment
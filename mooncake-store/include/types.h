@@ -199,10 +199,14 @@ inline std::ostream& operator<<(std::ostream& os,
  */
 struct ReplicateConfig {
     size_t replica_num{0};
+    // Location of the segments to allocate from first, e.g. "cpu:1" for the
+    // segments on node 1 of the writer's host, empty for no preference
+    std::string preferred_location;
 
     friend std::ostream& operator<<(std::ostream& os,
                                     const ReplicateConfig& config) noexcept {
         return os << "ReplicateConfig: { replica_num: " << config.replica_num
+                  << ", preferred_location: " << config.preferred_location
                   << " }";
     }
 };
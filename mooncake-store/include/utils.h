@@ -1,15 +1,60 @@
+#pragma once
+
 #include <cstddef>
 #include <cstdlib>
 #include <string>
 
 namespace mooncake {
+/*
+    @brief How the memory of a segment is backed.
+*/
+enum class HugePageMode {
+    NONE,     // base pages
+    HUGETLB,  // huge pages reserved in the hugetlb pool (MAP_HUGETLB)
+    THP,      // transparent huge pages (madvise MADV_HUGEPAGE)
+};
+
+/*
+    @brief Parses "none", "hugetlb" or "thp".
+    @return false if the name is not one of them.
+*/
+bool parseHugePageMode(const std::string &name, HugePageMode &mode);
+
+/*
+    @brief Options for the memory of a segment.
+*/
+struct SegmentMemoryConfig {
+    HugePageMode huge_page{HugePageMode::NONE};
+    // NUMA node the memory is bound to, -1 for the default policy
+    int numa_node{-1};
+    // Number of threads touching every page before the memory is returned,
+    // 0 to fault pages lazily on first use
+    int prefault_threads{0};
+    // Back the memory by a memfd, so that once registered with a transfer
+    // engine that has the shm transport, clients on this host map it instead
+    // of going through the network. Transparent huge pages then also depend
+    // on /sys/kernel/mm/transparent_hugepage/shmem_enabled.
+    bool shared{false};
+};
+
 /*
     @brief Allocates memory for the `BufferAllocator` class.
     @param total_size The total size of the memory to allocate.
-    @return A pointer to the allocated memory.
+    @param config Page size, NUMA binding, prefaulting and sharing of the
+    memory.
+    @return A pointer to the allocated memory, aligned to the slab size, or
+    nullptr on failure.
+*/
+void* allocate_buffer_allocator_memory(
+    size_t total_size, const SegmentMemoryConfig &config = {});
+
+/*
+    @brief Frees memory from `allocate_buffer_allocator_memory`.
+    @param total_size and config must be those it was allocated with.
 */
-void* allocate_buffer_allocator_memory(size_t total_size);
+void free_buffer_allocator_memory(void *ptr, size_t total_size,
+                                  const SegmentMemoryConfig &config = {});
 
 void **rdma_args(const std::string &device_name);
 
-}  // namespace mooncake
\ No newline at end of file
+}  // namespace mooncake
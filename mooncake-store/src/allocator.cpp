@@ -31,11 +31,14 @@ BufHandle::~BufHandle() {
 }
 
 BufferAllocator::BufferAllocator(std::string segmetn_name, size_t base,
-                                 size_t size)
-    : segment_name_(segmetn_name), base_(base), total_size_(size) {
+                                 size_t size, std::string location)
+    : segment_name_(segmetn_name),
+      location_(location),
+      base_(base),
+      total_size_(size) {
     VLOG(1) << "initializing_buffer_allocator segment_name=" << segmetn_name
             << " base_address=" << reinterpret_cast<void*>(base)
-            << " size=" << size;
+            << " size=" << size << " location=" << location;
 
     // Calculate the size of the header region.
     header_region_size_ =
@@ -107,12 +110,14 @@ void BufferAllocator::deallocate(BufHandle* handle) {
     }
 }
 
-SimpleAllocator::SimpleAllocator(size_t size) {
+SimpleAllocator::SimpleAllocator(size_t size,
+                                 const SegmentMemoryConfig& config)
+    : size_(size), config_(config) {
     LOG(INFO) << "initializing_simple_allocator size=" << size;
 
     try {
         // Allocate the base memory region
-        base_ = std::aligned_alloc(facebook::cachelib::Slab::kSize, size);
+        base_ = allocate_buffer_allocator_memory(size, config);
         if (!base_) {
             LOG(ERROR) << "base_memory_allocation_failed size=" << size;
             throw std::bad_alloc();
@@ -126,7 +131,7 @@ SimpleAllocator::SimpleAllocator(size_t size) {
 
         header_region_start_ = std::make_unique<char[]>(header_region_size_);
         if (!header_region_start_) {
-            std::free(base_);
+            free_buffer_allocator_memory(base_, size_, config_);
             LOG(ERROR) << "header_region_allocation_failed size="
                        << header_region_size_;
             throw std::bad_alloc();
@@ -140,7 +145,7 @@ SimpleAllocator::SimpleAllocator(size_t size) {
                 header_region_start_.get(), header_region_size_, base_, size);
 
         if (!memory_allocator_) {
-            std::free(base_);
+            free_buffer_allocator_memory(base_, size_, config_);
             LOG(ERROR) << "cachelib_memory_allocator_init_failed";
             throw std::runtime_error("Failed to initialize memory allocator");
         }
@@ -152,7 +157,7 @@ SimpleAllocator::SimpleAllocator(size_t size) {
 
     } catch (const std::exception& e) {
         if (base_) {
-            std::free(base_);
+            free_buffer_allocator_memory(base_, size_, config_);
             base_ = nullptr;
         }
         LOG(ERROR) << "simple_allocator_init_exception error=" << e.what();
@@ -166,7 +171,7 @@ SimpleAllocator::~SimpleAllocator() {
             memory_allocator_.reset();
         }
         if (base_) {
-            std::free(base_);
+            free_buffer_allocator_memory(base_, size_, config_);
             base_ = nullptr;
         }
         LOG(INFO) << "simple_allocator_destroyed status=success";
@@ -80,9 +80,23 @@ ErrorCode Client::InitTransferEngine(const std::string& local_hostname,
     }
     CHECK(transport) << "Failed to install transport";
 
+    // Objects held by the segments mounted by this client are copied
+    // directly instead of going through the network transport.
+    transport = transfer_engine_->installTransport("local", nullptr);
+    CHECK(transport) << "Failed to install local transport";
+
+    // Segments of other clients on this host that are backed by shared
+    // memory are mapped and copied directly as well.
+    transport = transfer_engine_->installTransport("shm", nullptr);
+    CHECK(transport) << "Failed to install shm transport";
+
     return ErrorCode::OK;
 }
 
+std::string Client::HostLocation(const std::string& location) const {
+    return parseHostNameWithPort(local_hostname_).first + "/" + location;
+}
+
 ErrorCode Client::Init(const std::string& local_hostname,
                        const std::string& metadata_connstring,
                        const std::string& protocol, void** protocol_args,
@@ -200,6 +214,10 @@ ErrorCode Client::Put(const ObjectKey& key, std::vector<Slice>& slices,
 
     auto* replica_config = start_request.mutable_config();
     replica_config->set_replica_num(config.replica_num);
+    if (!config.preferred_location.empty()) {
+        replica_config->set_preferred_location(
+            HostLocation(config.preferred_location));
+    }
 
     mooncake_store::PutStartResponse start_response;
     grpc::ClientContext start_context;
@@ -280,16 +298,21 @@ ErrorCode Client::Remove(const ObjectKey& key) const {
 }
 
 ErrorCode Client::MountSegment(const std::string& segment_name,
-                               const void* buffer, size_t size) {
+                               const void* buffer, size_t size,
+                               const std::string& location) {
     mooncake_store::MountSegmentRequest request;
     request.set_segment_name(segment_name);
     request.set_buffer(reinterpret_cast<uint64_t>(buffer));
     request.set_size(size);
+    if (!location.empty()) {
+        request.set_location(HostLocation(location));
+    }
     mooncake_store::MountSegmentResponse response;
     grpc::ClientContext context;
 
-    int rc = transfer_engine_->registerLocalMemory((void*)buffer, size, "cpu:0",
-                                                   true, true);
+    int rc = transfer_engine_->registerLocalMemory(
+        (void*)buffer, size, location.empty() ? "cpu:0" : location, true,
+        true);
     if (rc != 0) {
         LOG(ERROR) << "register_local_memory_failed segment_name="
                    << segment_name;
@@ -167,6 +167,7 @@ class MasterServiceImpl final : public mooncake_store::MasterService::Service {
         std::vector<ReplicaInfo> replica_list;
         ReplicateConfig config;
         config.replica_num = request->config().replica_num();
+        config.preferred_location = request->config().preferred_location();
         // Convert slice_lengths from repeated field to vector
         std::vector<uint64_t> slice_lengths;
         for (const auto& length : request->slice_lengths()) {
@@ -217,7 +218,8 @@ class MasterServiceImpl final : public mooncake_store::MasterService::Service {
         const mooncake_store::MountSegmentRequest* request,
         mooncake_store::MountSegmentResponse* response) override {
         ErrorCode error_code = master_service_->MountSegment(
-            request->buffer(), request->size(), request->segment_name());
+            request->buffer(), request->size(), request->segment_name(),
+            request->location());
         response->set_status_code(toInt(error_code));
         return grpc::Status::OK;
     }
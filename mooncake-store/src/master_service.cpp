@@ -25,7 +25,8 @@ std::string VectorToString(const std::vector<T>& vec) {
 }
 
 ErrorCode BufferAllocatorManager::AddSegment(const std::string& segment_name,
-                                             uint64_t base, uint64_t size) {
+                                             uint64_t base, uint64_t size,
+                                             const std::string& location) {
     std::unique_lock<std::shared_mutex> lock(allocator_mutex_);
 
     // Check if segment already exists
@@ -36,14 +37,15 @@ ErrorCode BufferAllocatorManager::AddSegment(const std::string& segment_name,
     }
 
     auto allocator =
-        std::make_shared<BufferAllocator>(segment_name, base, size);
+        std::make_shared<BufferAllocator>(segment_name, base, size, location);
     if (!allocator) {
         LOG(ERROR) << "segment_name=" << segment_name
                    << ", error=failed_to_create_allocator";
         return ErrorCode::INTERNAL_ERROR;
     }
     VLOG(1) << "segment_name=" << segment_name << ", base=" << base
-            << ", size=" << size << ", allocator_ptr=" << allocator.get()
+            << ", size=" << size << ", location=" << location
+            << ", allocator_ptr=" << allocator.get()
             << ", action=register_buffer";
     buf_allocators_[segment_name] = std::move(allocator);
     return ErrorCode::OK;
@@ -92,7 +94,8 @@ MasterService::~MasterService() {
 }
 
 ErrorCode MasterService::MountSegment(uint64_t buffer, uint64_t size,
-                                      const std::string& segment_name) {
+                                      const std::string& segment_name,
+                                      const std::string& location) {
     if (buffer == 0 || size == 0) {
         LOG(ERROR) << "buffer=" << buffer << ", size=" << size
                    << ", error=invalid_buffer_params";
@@ -100,8 +103,10 @@ ErrorCode MasterService::MountSegment(uint64_t buffer, uint64_t size,
     }
 
     VLOG(1) << "segment_name=" << segment_name << ", buffer=" << buffer
-            << ", size=" << size << ", action=mount_segment";
-    return buffer_allocator_manager_->AddSegment(segment_name, buffer, size);
+            << ", size=" << size << ", location=" << location
+            << ", action=mount_segment";
+    return buffer_allocator_manager_->AddSegment(segment_name, buffer, size,
+                                                 location);
 }
 
 ErrorCode MasterService::UnmountSegment(const std::string& segment_name) {
@@ -201,8 +206,8 @@ ErrorCode MasterService::PutStart(const std::string& key, uint64_t value_length,
             std::shared_lock<std::shared_mutex> alloc_lock(
                 buffer_allocator_manager_->GetMutex());
             const auto& allocators = buffer_allocator_manager_->GetAllocators();
-            auto handle =
-                allocation_strategy_->Allocate(allocators, chunk_size);
+            auto handle = allocation_strategy_->Allocate(
+                allocators, chunk_size, config.preferred_location);
             alloc_lock.unlock();
 
             if (!handle) {
@@ -2,17 +2,226 @@
 
 #include <Slab.h>
 #include <glog/logging.h>
+#include <numa.h>
+#include <numaif.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "transport/shm_transport/shm_transport.h"
 
 namespace mooncake {
-void* allocate_buffer_allocator_memory(size_t total_size) {
+bool parseHugePageMode(const std::string &name, HugePageMode &mode) {
+    if (name.empty() || name == "none") {
+        mode = HugePageMode::NONE;
+    } else if (name == "hugetlb") {
+        mode = HugePageMode::HUGETLB;
+    } else if (name == "thp") {
+        mode = HugePageMode::THP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static size_t getDefaultHugePageSize() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        size_t size_kb;
+        if (sscanf(line.c_str(), "Hugepagesize: %zu kB", &size_kb) == 1)
+            return size_kb << 10;
+    }
+    return 2 << 20;
+}
+
+// Memory that is bound or backed by huge pages is mapped directly, so the
+// policy applies to this segment only.
+static bool isMapped(const SegmentMemoryConfig &config) {
+    return config.huge_page != HugePageMode::NONE || config.numa_node >= 0 ||
+           config.shared;
+}
+
+static size_t getPageSize(const SegmentMemoryConfig &config) {
+    if (config.huge_page == HugePageMode::HUGETLB)
+        return getDefaultHugePageSize();
+    return sysconf(_SC_PAGESIZE);
+}
+
+static size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// Maps total_size bytes aligned to alignment, trimming the excess mapped
+// around it.
+static void *mapAligned(size_t total_size, size_t alignment,
+                        const SegmentMemoryConfig &config) {
+    const size_t page_size = getPageSize(config);
+    // The mapping is page aligned, so at most alignment - page_size bytes
+    // precede the first aligned address
+    const size_t slack = alignment > page_size ? alignment - page_size : 0;
+    const size_t map_size = alignUp(total_size, page_size) + slack;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (config.huge_page == HugePageMode::HUGETLB) flags |= MAP_HUGETLB;
+    void *addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to map segment memory, size: " << map_size;
+        return nullptr;
+    }
+
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t aligned_start = alignUp(start, alignment);
+    uintptr_t aligned_end = aligned_start + alignUp(total_size, page_size);
+    if (aligned_start > start) munmap(addr, aligned_start - start);
+    if (start + map_size > aligned_end)
+        munmap((void *)aligned_end, start + map_size - aligned_end);
+    return (void *)aligned_start;
+}
+
+// Maps total_size bytes of a new memfd aligned to alignment. The memfd is
+// handed to the shm transport, which publishes the memory to the other
+// processes on this host when it is registered.
+static void *mapShared(size_t total_size, size_t alignment,
+                       const SegmentMemoryConfig &config) {
+    const size_t page_size = getPageSize(config);
+    const size_t length = alignUp(total_size, page_size);
+    alignment = std::max(alignment, page_size);
+    unsigned int fd_flags = MFD_CLOEXEC;
+    if (config.huge_page == HugePageMode::HUGETLB) fd_flags |= MFD_HUGETLB;
+    int fd = memfd_create("mooncake-segment", fd_flags);
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to create memfd for segment memory";
+        return nullptr;
+    }
+    if (ftruncate(fd, length)) {
+        PLOG(ERROR) << "Failed to resize segment memfd to " << length;
+        close(fd);
+        return nullptr;
+    }
+
+    // Reserve address space to place the mapping at an aligned address
+    const size_t reserve_size = length + alignment;
+    void *reserved = mmap(nullptr, reserve_size, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to reserve segment memory, size: "
+                    << reserve_size;
+        close(fd);
+        return nullptr;
+    }
+    uintptr_t start = (uintptr_t)reserved;
+    uintptr_t aligned_start = alignUp(start, alignment);
+    uintptr_t aligned_end = aligned_start + length;
+    void *addr = mmap((void *)aligned_start, length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to map segment memfd, size: " << length;
+        munmap(reserved, reserve_size);
+        close(fd);
+        return nullptr;
+    }
+    if (aligned_start > start) munmap(reserved, aligned_start - start);
+    if (start + reserve_size > aligned_end)
+        munmap((void *)aligned_end, start + reserve_size - aligned_end);
+
+    if (ShmTransport::addSharedMemory(addr, length, fd)) {
+        LOG(ERROR) << "Failed to share segment memory at " << addr;
+        munmap(addr, length);
+        close(fd);
+        return nullptr;
+    }
+    return addr;
+}
+
+static int bindNumaNode(void *addr, size_t size, int node) {
+    if (numa_available() < 0 || node > numa_max_node()) {
+        LOG(ERROR) << "NUMA node " << node << " is not available";
+        return -1;
+    }
+    struct bitmask *mask = numa_allocate_nodemask();
+    numa_bitmask_setbit(mask, node);
+    long rc = mbind(addr, size, MPOL_BIND, mask->maskp, mask->size + 1, 0);
+    numa_bitmask_free(mask);
+    if (rc) {
+        PLOG(ERROR) << "Failed to bind segment memory to NUMA node " << node;
+        return -1;
+    }
+    return 0;
+}
+
+// Touches every page so that the page faults, and the zeroing of pages by
+// the kernel, are spread over several threads instead of the first users.
+static void prefault(void *addr, size_t size, size_t page_size,
+                     int num_threads) {
+    const size_t num_pages = (size + page_size - 1) / page_size;
+    const size_t pages_per_thread = (num_pages + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        size_t first = i * pages_per_thread;
+        size_t last = std::min(num_pages, first + pages_per_thread);
+        if (first >= last) break;
+        threads.emplace_back([=]() {
+            volatile char *base = (volatile char *)addr;
+            for (size_t page = first; page < last; ++page)
+                base[page * page_size] = 0;
+        });
+    }
+    for (auto &thread : threads) thread.join();
+}
+
+void* allocate_buffer_allocator_memory(size_t total_size,
+                                       const SegmentMemoryConfig &config) {
     const size_t alignment = facebook::cachelib::Slab::kSize;
     // Ensure total_size is a multiple of alignment
     if (total_size < alignment) {
         LOG(ERROR) << "Total size must be at least " << alignment;
         return nullptr;
     }
-    // Allocate aligned memory
-    return aligned_alloc(alignment, total_size);
+    if (!isMapped(config)) {
+        // Allocate aligned memory
+        void *addr = aligned_alloc(alignment, total_size);
+        if (addr && config.prefault_threads > 0)
+            prefault(addr, total_size, getPageSize(config),
+                     config.prefault_threads);
+        return addr;
+    }
+
+    void *addr = config.shared ? mapShared(total_size, alignment, config)
+                               : mapAligned(total_size, alignment, config);
+    if (!addr) return nullptr;
+    if (config.huge_page == HugePageMode::THP &&
+        madvise(addr, total_size, MADV_HUGEPAGE)) {
+        PLOG(WARNING) << "Failed to enable transparent huge pages";
+    }
+    // Bind before any page is touched, since faulted pages are not moved
+    if (config.numa_node >= 0 &&
+        bindNumaNode(addr, total_size, config.numa_node)) {
+        free_buffer_allocator_memory(addr, total_size, config);
+        return nullptr;
+    }
+    if (config.prefault_threads > 0)
+        prefault(addr, total_size, getPageSize(config),
+                 config.prefault_threads);
+    return addr;
+}
+
+void free_buffer_allocator_memory(void *ptr, size_t total_size,
+                                  const SegmentMemoryConfig &config) {
+    if (!ptr) return;
+    if (!isMapped(config)) {
+        free(ptr);
+        return;
+    }
+    if (config.shared) {
+        ShmTransport::freeSharedMemory(ptr);
+        return;
+    }
+    munmap(ptr, alignUp(total_size, getPageSize(config)));
 }
 
 std::string formatDeviceNames(const std::string &device_names) {
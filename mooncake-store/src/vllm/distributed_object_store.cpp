@@ -22,8 +22,20 @@ int DistributedObjectStore::setup(const std::string &local_hostname,
                                   size_t local_buffer_size,
                                   const std::string &protocol,
                                   const std::string &rdma_devices,
-                                  const std::string &master_server_addr) {
+                                  const std::string &master_server_addr,
+                                  const std::string &hugepage, int numa_node,
+                                  int prefault_threads, bool shared_memory) {
     this->protocol = protocol;
+    SegmentMemoryConfig memory_config;
+    if (!parseHugePageMode(hugepage, memory_config.huge_page)) {
+        LOG(ERROR) << "Invalid hugepage mode: " << hugepage
+                   << ", expected none, hugetlb or thp";
+        return 1;
+    }
+    memory_config.numa_node = numa_node;
+    memory_config.prefault_threads = prefault_threads;
+    segment_location =
+        numa_node >= 0 ? "cpu:" + std::to_string(numa_node) : "";
     this->local_hostname = local_hostname;  // Save the local hostname
     client_ = std::make_unique<mooncake::Client>();
 
@@ -32,18 +44,25 @@ int DistributedObjectStore::setup(const std::string &local_hostname,
                   master_server_addr);
 
     client_buffer_allocator_ =
-        std::make_unique<SimpleAllocator>(local_buffer_size);
+        std::make_unique<SimpleAllocator>(local_buffer_size, memory_config);
     ErrorCode rc =
         client_->RegisterLocalMemory(client_buffer_allocator_->getBase(),
-                                     local_buffer_size, "cpu:0", false, false);
-    segment_ptr_ =
-        (uint64_t)allocate_buffer_allocator_memory(global_segment_size);
+                                     local_buffer_size,
+                                     segment_location.empty()
+                                         ? "cpu:0"
+                                         : segment_location,
+                                     false, false);
+    // Workers on this host reach the segment through shared memory
+    SegmentMemoryConfig segment_config = memory_config;
+    segment_config.shared = shared_memory;
+    segment_ptr_ = (uint64_t)allocate_buffer_allocator_memory(
+        global_segment_size, segment_config);
     if (segment_ptr_ == 0) {
         LOG(ERROR) << "Failed to allocate segment memory";
         return 1;
     }
     rc = client_->MountSegment(local_hostname, (void *)segment_ptr_,
-                               global_segment_size);
+                               global_segment_size, segment_location);
     if (rc != ErrorCode::OK) {
         LOG(ERROR) << "Failed to mount segment: " << toString(rc);
         return 1;
@@ -121,6 +140,7 @@ int DistributedObjectStore::put(const std::string &key,
                                 const std::string &value) {
     ReplicateConfig config;
     config.replica_num = 1;  // TODO
+    config.preferred_location = segment_location;
 
     std::vector<Slice> slices;
     int ret = allocateSlices(slices, value);
@@ -169,7 +189,15 @@ namespace py = pybind11;
 PYBIND11_MODULE(distributed_object_store, m) {
     py::class_<DistributedObjectStore>(m, "DistributedObjectStore")
         .def(py::init<>())
-        .def("setup", &DistributedObjectStore::setup)
+        .def("setup", &DistributedObjectStore::setup,
+             py::arg("local_hostname"), py::arg("metadata_server"),
+             py::arg("global_segment_size") = 1024 * 1024 * 16,
+             py::arg("local_buffer_size") = 1024 * 1024 * 16,
+             py::arg("protocol") = "tcp", py::arg("rdma_devices") = "",
+             py::arg("master_server_addr") = "127.0.0.1:50051",
+             py::arg("hugepage") = "none", py::arg("numa_node") = -1,
+             py::arg("prefault_threads") = 0,
+             py::arg("shared_memory") = true)
         .def("initAll", &DistributedObjectStore::initAll)
         .def("get", &DistributedObjectStore::get)
         .def("put", &DistributedObjectStore::put)
@@ -19,7 +19,9 @@ class DistributedObjectStore {
               size_t local_buffer_size = 1024 * 1024 * 16,
               const std::string &protocol = "tcp",
               const std::string &rdma_devices = "",
-              const std::string &master_server_addr = "127.0.0.1:50051");
+              const std::string &master_server_addr = "127.0.0.1:50051",
+              const std::string &hugepage = "none", int numa_node = -1,
+              int prefault_threads = 0, bool shared_memory = true);
 
     int initAll(const std::string &protocol, const std::string &device_name,
                 size_t mount_segment_size = 1024 * 1024 * 16);  // Default 16MB
@@ -51,4 +53,5 @@ class DistributedObjectStore {
     std::string protocol;
     std::string device_name;
     std::string local_hostname;
+    std::string segment_location;
 };
\ No newline at end of file
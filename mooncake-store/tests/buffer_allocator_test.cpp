@@ -172,6 +172,52 @@ TEST_F(SimpleAllocatorTest, StressTest) {
     }
 }
 
+// Test segment memory with huge pages, NUMA binding and prefaulting
+TEST_F(SimpleAllocatorTest, SegmentMemoryOptions) {
+    const size_t total_size = 1024 * 1024 * 16;  // 16MB
+    std::vector<SegmentMemoryConfig> configs(6);
+    configs[1].huge_page = HugePageMode::THP;
+    configs[1].prefault_threads = 4;
+    configs[2].numa_node = 0;
+    configs[2].prefault_threads = 1;
+    configs[3].huge_page = HugePageMode::HUGETLB;
+    configs[4].shared = true;
+    configs[4].numa_node = 0;
+    configs[5].shared = true;
+    configs[5].huge_page = HugePageMode::HUGETLB;
+
+    for (const auto& config : configs) {
+        void* base = allocate_buffer_allocator_memory(total_size, config);
+        if (!base && config.huge_page == HugePageMode::HUGETLB) {
+            LOG(WARNING) << "No huge pages reserved, skipping hugetlb";
+            continue;
+        }
+        ASSERT_NE(base, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(base) %
+                      facebook::cachelib::Slab::kSize,
+                  0);
+        std::memset(base, 0xFF, total_size);
+        free_buffer_allocator_memory(base, total_size, config);
+    }
+
+    SimpleAllocator allocator(total_size, configs[1]);
+    void* ptr = allocator.allocate(1024);
+    ASSERT_NE(ptr, nullptr);
+    std::memset(ptr, 0xFF, 1024);
+    allocator.deallocate(ptr, 1024);
+}
+
+TEST_F(SimpleAllocatorTest, ParseHugePageMode) {
+    HugePageMode mode;
+    EXPECT_TRUE(parseHugePageMode("thp", mode));
+    EXPECT_EQ(mode, HugePageMode::THP);
+    EXPECT_TRUE(parseHugePageMode("hugetlb", mode));
+    EXPECT_EQ(mode, HugePageMode::HUGETLB);
+    EXPECT_TRUE(parseHugePageMode("none", mode));
+    EXPECT_EQ(mode, HugePageMode::NONE);
+    EXPECT_FALSE(parseHugePageMode("2mb", mode));
+}
+
 }  // namespace mooncake
 
 int main(int argc, char** argv) {
@@ -546,4 +546,87 @@ TEST_F(MasterServiceTest, CleanupStaleHandlesTest) {
     EXPECT_EQ(ErrorCode::OBJECT_NOT_FOUND, service_->Remove(key2));
 }
 
+TEST_F(MasterServiceTest, PreferredLocationAllocation) {
+    std::unique_ptr<MasterService> service_(new MasterService());
+    constexpr size_t size = 1024 * 1024 * 16;
+    ASSERT_EQ(ErrorCode::OK,
+              service_->MountSegment(0x300000000, size, "segment_0",
+                                     "host_a/cpu:0"));
+    ASSERT_EQ(ErrorCode::OK,
+              service_->MountSegment(0x400000000, size, "segment_1",
+                                     "host_a/cpu:1"));
+    ASSERT_EQ(ErrorCode::OK,
+              service_->MountSegment(0x500000000, size, "segment_any"));
+
+    const uint64_t value_length = 1024 * 1024;
+    std::vector<uint64_t> slice_lengths = {value_length};
+    ReplicateConfig config;
+    config.replica_num = 1;
+    config.preferred_location = "host_a/cpu:1";
+
+    // Allocations stay on the preferred segment until it is full
+    size_t preferred_count = 0, fallback_count = 0;
+    for (int i = 0; i < 32; ++i) {
+        std::string key = "preferred_key_" + std::to_string(i);
+        ASSERT_EQ(ErrorCode::OK,
+                  service_->PutStart(key, value_length, slice_lengths, config,
+                                     replica_list));
+        ASSERT_EQ(1, replica_list.size());
+        ASSERT_EQ(1, replica_list[0].handles.size());
+        if (replica_list[0].handles[0]->segment_name == "segment_1") {
+            EXPECT_EQ(0, fallback_count) << "preferred segment skipped";
+            preferred_count++;
+        } else {
+            fallback_count++;
+        }
+        replica_list.clear();
+    }
+    EXPECT_GT(preferred_count, 0);
+    EXPECT_GT(fallback_count, 0);
+
+    // Unknown locations fall back to any segment
+    config.preferred_location = "host_a/cpu:7";
+    ASSERT_EQ(ErrorCode::OK,
+              service_->PutStart("unknown_location_key", value_length,
+                                 slice_lengths, config, replica_list));
+}
+
+TEST_F(MasterServiceTest, PreferredLocationIsPerHost) {
+    std::unique_ptr<MasterService> service_(new MasterService());
+    constexpr size_t size = 1024 * 1024 * 16;
+    ASSERT_EQ(ErrorCode::OK, service_->MountSegment(0x300000000, size,
+                                                    "host_a", "host_a/cpu:1"));
+    ASSERT_EQ(ErrorCode::OK, service_->MountSegment(0x400000000, size,
+                                                    "host_b", "host_b/cpu:1"));
+
+    const uint64_t value_length = 1024 * 1024;
+    std::vector<uint64_t> slice_lengths = {value_length};
+    ReplicateConfig config;
+    config.replica_num = 1;
+
+    // Node 1 of host_b is never preferred by a writer on host_a while node 1
+    // of host_a has space
+    config.preferred_location = "host_a/cpu:1";
+    for (int i = 0; i < 8; ++i) {
+        std::string key = "host_a_key_" + std::to_string(i);
+        ASSERT_EQ(ErrorCode::OK,
+                  service_->PutStart(key, value_length, slice_lengths, config,
+                                     replica_list));
+        ASSERT_EQ(1, replica_list.size());
+        EXPECT_EQ("host_a", replica_list[0].handles[0]->segment_name);
+        replica_list.clear();
+    }
+
+    config.preferred_location = "host_b/cpu:1";
+    for (int i = 0; i < 8; ++i) {
+        std::string key = "host_b_key_" + std::to_string(i);
+        ASSERT_EQ(ErrorCode::OK,
+                  service_->PutStart(key, value_length, slice_lengths, config,
+                                     replica_list));
+        ASSERT_EQ(1, replica_list.size());
+        EXPECT_EQ("host_b", replica_list[0].handles[0]->segment_name);
+        replica_list.clear();
+    }
+}
+
 }  // namespace mooncake::test
@@ -3,19 +3,33 @@ package main
 import (
 	"flag"
 	"net/http"
+	"strconv"
 	"sync"
+	"time"
 
 	"github.com/gin-gonic/gin"
 )
 
 const jsonContentType = "application/json; charset=utf-8"
 
+// Number of recent changes kept for watchers to catch up with
+const maxChangeLog = 4096
+
 type MetadataStore struct {
 	store sync.Map
+
+	// Every change gets the next revision. changes holds the keys of the
+	// last len(changes) revisions, and notify is closed on every change.
+	mu       sync.Mutex
+	revision int64
+	changes  []string
+	notify   chan struct{}
 }
 
 var (
-	metadataStore = MetadataStore{}
+	metadataStore = MetadataStore{notify: make(chan struct{})}
+	// Revisions restart with the server, watchers tell them apart by epoch
+	epoch = strconv.FormatInt(time.Now().UnixNano(), 10)
 )
 
 func (m *MetadataStore) Get(key string) ([]byte, bool) {
@@ -28,10 +42,42 @@ func (m *MetadataStore) Get(key string) ([]byte, bool) {
 
 func (m *MetadataStore) Set(key string, value []byte) {
 	m.store.Store(key, value)
+	m.recordChange(key)
 }
 
 func (m *MetadataStore) Delete(key string) {
 	m.store.Delete(key)
+	m.recordChange(key)
+}
+
+func (m *MetadataStore) recordChange(key string) {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	m.revision++
+	m.changes = append(m.changes, key)
+	if len(m.changes) > maxChangeLog {
+		m.changes = append([]string(nil), m.changes[len(m.changes)/2:]...)
+	}
+	close(m.notify)
+	m.notify = make(chan struct{})
+}
+
+// Changes returns the keys changed after revision, the current revision,
+// whether the changes are no longer known, and a channel closed on the
+// next change.
+func (m *MetadataStore) Changes(watchEpoch string, revision int64) ([]string, int64, bool, chan struct{}) {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	keys := []string{}
+	if revision < 0 {
+		return keys, m.revision, false, m.notify
+	}
+	if watchEpoch != epoch || revision > m.revision ||
+		revision < m.revision-int64(len(m.changes)) {
+		return keys, m.revision, true, m.notify
+	}
+	keys = append(keys, m.changes[int64(len(m.changes))-(m.revision-revision):]...)
+	return keys, m.revision, false, m.notify
 }
 
 func getQueryKey(c *gin.Context) string {
@@ -65,6 +111,36 @@ func deleteMetadata(c *gin.Context) {
 	c.Data(http.StatusOK, jsonContentType, []byte(`metadata deleted`))
 }
 
+// Long poll: waits up to timeout seconds for keys changed after revision
+func watchMetadata(c *gin.Context) {
+	revision, err := strconv.ParseInt(c.DefaultQuery("revision", "-1"), 10, 64)
+	if err != nil {
+		c.Data(http.StatusBadRequest, jsonContentType, []byte(`invalid revision`))
+		return
+	}
+	timeout, err := strconv.Atoi(c.DefaultQuery("timeout", "0"))
+	if err != nil {
+		c.Data(http.StatusBadRequest, jsonContentType, []byte(`invalid timeout`))
+		return
+	}
+	deadline := time.After(time.Duration(timeout) * time.Second)
+	for {
+		keys, current, reset, notify := metadataStore.Changes(c.Query("epoch"), revision)
+		if revision < 0 || reset || len(keys) > 0 || timeout <= 0 {
+			c.JSON(http.StatusOK, gin.H{"epoch": epoch, "revision": current, "keys": keys, "reset": reset})
+			return
+		}
+		select {
+		case <-notify:
+		case <-deadline:
+			c.JSON(http.StatusOK, gin.H{"epoch": epoch, "revision": current, "keys": keys, "reset": false})
+			return
+		case <-c.Request.Context().Done():
+			return
+		}
+	}
+}
+
 func main() {
 	address := flag.String("addr", ":8080", "HTTP server address (default :8080)")
 	flag.Parse()
@@ -74,6 +150,7 @@ func main() {
 	r.GET("/metadata", getMetadata)
 	r.PUT("/metadata", putMetadata)
 	r.DELETE("/metadata", deleteMetadata)
+	r.GET("/metadata/watch", watchMetadata)
 
 	r.Run(*address)
 }
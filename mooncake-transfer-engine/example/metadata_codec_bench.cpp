@@ -0,0 +1,115 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the JSON and binary encodings of segment descriptors, including
+// the JSON text conversion done by the metadata storage plugins.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include "segment_desc_codec.h"
+
+DEFINE_int32(buffer_count, 1024, "Number of buffers in the segment");
+DEFINE_int32(device_count, 8, "Number of RDMA devices in the segment");
+DEFINE_int32(iterations, 1000, "Encode and decode iterations per format");
+
+using namespace mooncake;
+
+using SegmentDesc = TransferMetadata::SegmentDesc;
+
+static SegmentDesc makeSegment() {
+    SegmentDesc desc;
+    desc.name = "192.168.0.1:12345";
+    desc.protocol = "rdma";
+    std::string preferred, avail;
+    for (int i = 0; i < FLAGS_device_count; ++i) {
+        std::string name = "mlx5_" + std::to_string(i);
+        desc.devices.push_back(
+            {name, (uint16_t)i, "fe80:0000:0000:0000:0000:0000:0000:00" +
+                                    std::to_string(10 + i)});
+        auto &list = (i < FLAGS_device_count / 2) ? preferred : avail;
+        list += (list.empty() ? "\"" : ",\"") + name + "\"";
+    }
+    desc.topology.parse("{\"cpu:0\": [[" + preferred + "], [" + avail +
+                        "]], \"cpu:1\": [[" + avail + "], [" + preferred +
+                        "]]}");
+    for (int i = 0; i < FLAGS_buffer_count; ++i) {
+        TransferMetadata::BufferDesc buffer;
+        buffer.name = "cpu:" + std::to_string(i % 2);
+        buffer.addr = 0x7f0000000000ull + (uint64_t)i * (64ull << 20);
+        buffer.length = 64ull << 20;
+        for (int j = 0; j < FLAGS_device_count; ++j) {
+            buffer.lkey.push_back(0x100000 + i * FLAGS_device_count + j);
+            buffer.rkey.push_back(0x200000 + i * FLAGS_device_count + j);
+        }
+        desc.buffers.push_back(buffer);
+    }
+    desc.indexBuffers();
+    return desc;
+}
+
+static void benchmark(const SegmentDesc &desc, bool use_binary) {
+    using namespace std::chrono;
+    std::string text;
+    auto start = steady_clock::now();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+        Json::Value value;
+        if (SegmentDescCodec::encode(desc, use_binary, value)) {
+            LOG(ERROR) << "Failed to encode segment descriptor";
+            exit(EXIT_FAILURE);
+        }
+        text = Json::FastWriter{}.write(value);
+    }
+    auto encode_us =
+        duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    start = steady_clock::now();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+        Json::Value value;
+        Json::Reader reader;
+        SegmentDesc decoded;
+        if (!reader.parse(text, value) ||
+            SegmentDescCodec::decode(value, decoded)) {
+            LOG(ERROR) << "Failed to decode segment descriptor";
+            exit(EXIT_FAILURE);
+        }
+    }
+    auto decode_us =
+        duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    std::cout << std::left << std::setw(8) << (use_binary ? "binary" : "json")
+              << " size " << std::setw(10) << text.size() << " encode "
+              << std::setw(10) << std::fixed << std::setprecision(2)
+              << (double)encode_us / FLAGS_iterations << " us decode "
+              << (double)decode_us / FLAGS_iterations << " us" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, false);
+    if (FLAGS_buffer_count <= 0 || FLAGS_device_count <= 0 ||
+        FLAGS_iterations <= 0) {
+        LOG(ERROR) << "buffer_count, device_count and iterations must be "
+                      "positive";
+        exit(EXIT_FAILURE);
+    }
+    auto desc = makeSegment();
+    benchmark(desc, false);
+    benchmark(desc, true);
+    return 0;
+}
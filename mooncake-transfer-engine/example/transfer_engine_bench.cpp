@@ -26,6 +26,7 @@
 #include <unordered_map>
 
 #include "common/base/status.h"
+#include "config.h"
 #include "transfer_engine.h"
 #include "transport/transport.h"
 
@@ -62,6 +63,9 @@ DEFINE_string(mode, "initiator",
 DEFINE_string(operation, "read", "Operation type: read or write");
 
 DEFINE_string(protocol, "rdma", "Transfer protocol: rdma|tcp");
+DEFINE_string(tcp_backend, "asio",
+              "Backend of the tcp transport: asio|io_uring, valid if "
+              "protocol=tcp");
 
 DEFINE_string(device_name, "mlx5_2",
               "Device name to use, valid if protocol=rdma");
@@ -284,6 +288,7 @@ int initiator() {
             args[1] = nullptr;
             xport = engine->installTransport("rdma", args);
         } else if (FLAGS_protocol == "tcp") {
+            globalConfig().tcp_use_io_uring = FLAGS_tcp_backend == "io_uring";
             xport = engine->installTransport("tcp", nullptr);
         } else {
             LOG(ERROR) << "Unsupported protocol";
@@ -377,6 +382,7 @@ int target() {
             args[1] = nullptr;
             engine->installTransport("rdma", args);
         } else if (FLAGS_protocol == "tcp") {
+            globalConfig().tcp_use_io_uring = FLAGS_tcp_backend == "io_uring";
             engine->installTransport("tcp", nullptr);
         } else {
             LOG(ERROR) << "Unsupported protocol";
@@ -413,9 +419,25 @@ void check_total_buffer_size() {
     }
 }
 
+void check_tcp_backend() {
+    if (FLAGS_tcp_backend == "asio") return;
+#ifdef USE_IO_URING
+    if (FLAGS_tcp_backend == "io_uring") return;
+#else
+    if (FLAGS_tcp_backend == "io_uring") {
+        LOG(ERROR) << "Unsupported tcp backend: io_uring is not built, "
+                      "rebuild with -DUSE_IO_URING=ON";
+        exit(EXIT_FAILURE);
+    }
+#endif
+    LOG(ERROR) << "Unsupported tcp backend: must be 'asio' or 'io_uring'";
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, false);
     check_total_buffer_size();
+    check_tcp_backend();
 
     if (FLAGS_mode == "initiator")
         return initiator();
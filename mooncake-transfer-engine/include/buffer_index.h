@@ -0,0 +1,58 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUFFER_INDEX_H
+#define BUFFER_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace mooncake {
+// Sorted interval index over the buffers of a segment, so that the buffer
+// holding an address range is found by binary search instead of scanning
+// every buffer. Buffers are identified by their position in the list the
+// index was built from, and may overlap.
+class BufferIndex {
+   public:
+    // (addr, length) of each buffer, in buffer id order
+    using RangeList = std::vector<std::pair<uint64_t, uint64_t>>;
+
+    void build(const RangeList &range_list);
+
+    // Returns the lowest buffer id not less than min_id whose buffer holds
+    // [addr, addr + length), or -1 if there is none.
+    int find(uint64_t addr, uint64_t length, int min_id = 0) const;
+
+    // Start address of a buffer
+    uint64_t addr(int buffer_id) const { return addr_list_[buffer_id]; }
+
+    size_t size() const { return addr_list_.size(); }
+
+   private:
+    struct Entry {
+        uint64_t addr;
+        uint64_t end;
+        // Largest end of this entry and all entries before it
+        uint64_t max_end;
+        int buffer_id;
+    };
+
+    std::vector<Entry> entry_list_;  // sorted by addr
+    std::vector<uint64_t> addr_list_;
+};
+}  // namespace mooncake
+
+#endif  // BUFFER_INDEX_H
@@ -18,6 +18,7 @@
 #include <glog/logging.h>
 #include <numa.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -102,7 +103,8 @@ static inline ssize_t writeFully(int fd, const void *buf, size_t len) {
     char *pos = (char *)buf;
     size_t nbytes = len;
     while (nbytes) {
-        ssize_t rc = write(fd, pos, nbytes);
+        // No SIGPIPE if the peer has closed the socket
+        ssize_t rc = send(fd, pos, nbytes, MSG_NOSIGNAL);
         if (rc < 0 && (errno == EAGAIN || errno == EINTR))
             continue;
         else if (rc < 0) {
@@ -325,6 +327,13 @@ class TicketLock {
         }
     }
 
+    bool try_lock() {
+        int ticket = now_serving_.load(std::memory_order_relaxed);
+        return next_ticket_.compare_exchange_strong(
+            ticket, ticket + 1, std::memory_order_acquire,
+            std::memory_order_relaxed);
+    }
+
     void unlock() { now_serving_.fetch_add(1, std::memory_order_release); }
 
    private:
@@ -350,7 +359,8 @@ class SimpleRandom {
         return current;
     }
 
-    uint32_t next(uint32_t max) { return next() % max; }
+    // Scales by the high bits, as the low bits of an LCG have short periods
+    uint32_t next(uint32_t max) { return ((uint64_t)next() * max) >> 32; }
 
    private:
     uint32_t current;
@@ -22,6 +22,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <mutex>
+#include <string>
 
 namespace mooncake {
 struct GlobalConfig {
@@ -35,12 +36,26 @@ struct GlobalConfig {
     size_t max_sge = 4;
     size_t max_wr = 256;
     size_t max_inline = 64;
+    int signal_interval = 16;
     ibv_mtu mtu_length = IBV_MTU_4096;
     uint16_t handshake_port = 12001;
     int workers_per_ctx = 2;
     bool verbose = false;
     size_t slice_size = 65536;
+    size_t max_slice_size = 4ull << 20;
     int retry_cnt = 8;
+    int local_copy_workers = 4;
+    int tcp_connections_per_peer = 8;
+    int tcp_stripe_count = 4;
+    int tcp_io_threads = 4;
+    int tcp_io_numa_socket = -1;
+    bool tcp_use_io_uring = false;
+    bool use_rdma_simulator = false;
+    std::string rdma_simulator_options;
+    bool use_binary_metadata = false;
+    bool disable_metadata_watch = false;
+    bool redis_keyspace_events = false;
+    bool sample_memory_location = false;
 };
 
 void loadGlobalConfig(GlobalConfig &config);
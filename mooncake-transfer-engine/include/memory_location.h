@@ -21,8 +21,6 @@
 
 #include "common.h"
 
-const int pagesize = 4096;
-
 namespace mooncake {
 struct MemoryLocationEntry {
     uint64_t start;
@@ -32,8 +30,15 @@ struct MemoryLocationEntry {
 
 // Get CPU numa node id
 // TODO: support getting cuda device id from unified address.
+//
+// Pages are probed at the page size backing the range (e.g. 2 MB or 1 GB for
+// hugetlb mappings), and large ranges are probed by several threads. If
+// sample is set, only a bounded number of evenly spaced pages are probed and
+// node boundaries between them are located by binary search, so a run of
+// pages on another node that falls between two samples may be missed.
 const std::vector<MemoryLocationEntry> getMemoryLocation(void *start,
-                                                         size_t len);
+                                                         size_t len,
+                                                         bool sample = false);
 
 }  // namespace mooncake
 
@@ -23,7 +23,9 @@ namespace mooncake {
 class MultiTransport {
    public:
     using BatchID = Transport::BatchID;
+    using SegmentID = Transport::SegmentID;
     using TransferRequest = Transport::TransferRequest;
+    using VectoredTransferRequest = Transport::VectoredTransferRequest;
     using TransferStatus = Transport::TransferStatus;
     using BatchDesc = Transport::BatchDesc;
 
@@ -41,6 +43,9 @@ class MultiTransport {
     Status submitTransfer(BatchID batch_id,
                        const std::vector<TransferRequest> &entries);
 
+    Status submitVectoredTransfer(
+        BatchID batch_id, const std::vector<VectoredTransferRequest> &entries);
+
     Status getTransferStatus(BatchID batch_id, size_t task_id,
                           TransferStatus &status);
 
@@ -52,7 +57,8 @@ class MultiTransport {
     std::vector<Transport *> listTransports();
 
    private:
-    Transport *selectTransport(const TransferRequest &entry);
+    Transport *selectTransport(SegmentID target_id, uint64_t target_offset,
+                               size_t length);
 
    private:
     std::shared_ptr<TransferMetadata> metadata_;
@@ -0,0 +1,57 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SEGMENT_DESC_CODEC_H
+#define SEGMENT_DESC_CODEC_H
+
+#include <jsoncpp/json/json.h>
+
+#include <string>
+
+#include "transfer_metadata.h"
+
+namespace mooncake {
+// Encoding of segment descriptors in the metadata storage. A descriptor is
+// stored either as a JSON object, or as a JSON object tagged with
+// "format": "binary" whose "data" is the compact binary encoding in base64.
+// Decoding accepts both, so peers that publish JSON stay readable by all
+// peers, and binary descriptors (MC_BINARY_METADATA) only have to be read
+// by peers that know the tag.
+//
+// The binary encoding starts with a version byte. Addresses and lengths are
+// fixed-width little-endian, counts, string lengths and keys are varints.
+struct SegmentDescCodec {
+    using SegmentDesc = TransferMetadata::SegmentDesc;
+
+    static const uint8_t kBinaryVersion = 1;
+
+    // Returns 0 on success, ERR_METADATA for unsupported or malformed
+    // descriptors. Decoded descriptors are indexed.
+    static int encodeJson(const SegmentDesc &desc, Json::Value &value);
+
+    static int decodeJson(const Json::Value &value, SegmentDesc &desc);
+
+    static int encodeBinary(const SegmentDesc &desc, std::string &data);
+
+    static int decodeBinary(const std::string &data, SegmentDesc &desc);
+
+    // The stored value, binary if use_binary is set
+    static int encode(const SegmentDesc &desc, bool use_binary,
+                      Json::Value &value);
+
+    static int decode(const Json::Value &value, SegmentDesc &desc);
+};
+}  // namespace mooncake
+
+#endif  // SEGMENT_DESC_CODEC_H
@@ -54,6 +54,9 @@ struct TopologyEntry {
 using TopologyMatrix =
     std::unordered_map<std::string /* storage type */, TopologyEntry>;
 
+// Returns the current load of a device, such as its outstanding bytes
+using DeviceLoadFunc = std::function<uint64_t(int /* device id */)>;
+
 class Topology {
    public:
     Topology();
@@ -68,13 +71,23 @@ class Topology {
 
     int parse(const std::string &topology_json);
 
+    // Like parse(), with the entries in the order of the JSON keys
+    int load(const std::vector<TopologyEntry> &entry_list);
+
     int disableDevice(const std::string &device_name);
 
     std::string toString() const;
 
     Json::Value toJson() const;
 
-    int selectDevice(const std::string storage_type, int retry_count = 0);
+    // On the first attempt, picks a random preferred device, or the less
+    // loaded of two random preferred devices if device_load is given. Later
+    // attempts walk the preferred and available devices in turn.
+    int selectDevice(const std::string storage_type, int retry_count = 0,
+                     const DeviceLoadFunc &device_load = nullptr);
+
+    // Number of devices selectDevice() picks from on the first attempt.
+    int getDeviceCount(const std::string &storage_type) const;
 
     TopologyMatrix getMatrix() const { return matrix_; }
 
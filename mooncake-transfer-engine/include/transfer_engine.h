@@ -36,6 +36,7 @@
 
 namespace mooncake {
 using TransferRequest = Transport::TransferRequest;
+using VectoredTransferRequest = Transport::VectoredTransferRequest;
 using TransferStatus = Transport::TransferStatus;
 using TransferStatusEnum = Transport::TransferStatusEnum;
 using SegmentHandle = Transport::SegmentHandle;
@@ -67,6 +68,10 @@ class TransferEngine {
 
     int closeSegment(SegmentHandle handle);
 
+    // Each call copies the local segment descriptor and, if update_metadata
+    // is set, publishes it, so registering N buffers one at a time costs
+    // O(N^2). Concurrent calls share publishes; registerLocalMemoryBatch()
+    // registers many buffers in linear time.
     int registerLocalMemory(void *addr, size_t length,
                             const std::string &location,
                             bool remote_accessible = true,
@@ -92,6 +97,11 @@ class TransferEngine {
         return multi_transports_->submitTransfer(batch_id, entries);
     }
 
+    Status submitVectoredTransfer(
+        BatchID batch_id, const std::vector<VectoredTransferRequest> &entries) {
+        return multi_transports_->submitVectoredTransfer(batch_id, entries);
+    }
+
     Status getTransferStatus(BatchID batch_id, size_t task_id,
                              TransferStatus &status) {
         return multi_transports_->getTransferStatus(batch_id, task_id, status);
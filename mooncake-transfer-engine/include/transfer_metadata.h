@@ -20,13 +20,17 @@
 #include <netdb.h>
 
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 
+#include "buffer_index.h"
 #include "common.h"
 #include "topology.h"
 
@@ -56,6 +60,17 @@ class TransferMetadata {
         std::unordered_map<std::string, std::string> local_path_map;
     };
 
+    struct ShmBufferDesc {
+        uint64_t addr;
+        uint64_t length;
+        std::string path;
+        uint64_t offset;  // file offset of addr
+        // Identity of the file, so that peers can check that path, which is
+        // only meaningful in the owner's pid namespace, opened the same file
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+    };
+
     using SegmentID = uint64_t;
 
     struct SegmentDesc {
@@ -68,6 +83,20 @@ class TransferMetadata {
         // this is for nvmeof.
         std::vector<NVMeoFBufferDesc> nvmeof_buffers;
         // TODO : make these two a union or a std::variant
+        // this is for shm, buffers that same-host peers can map directly.
+        std::string host_id;
+        std::vector<ShmBufferDesc> shm_buffers;
+        // this is for tcp, the port of its data server if not the rpc port
+        uint16_t tcp_data_port = 0;
+
+        // Address lookup for buffers and shm_buffers. NVMe-oF buffers are
+        // laid out back to back from offset 0. Rebuilt by indexBuffers(),
+        // which must be called whenever the buffer lists change.
+        BufferIndex buffer_index;
+        BufferIndex nvmeof_buffer_index;
+        BufferIndex shm_buffer_index;
+
+        void indexBuffers();
     };
 
     struct RpcMetaDesc {
@@ -80,6 +109,10 @@ class TransferMetadata {
         std::string peer_nic_path;
         std::vector<uint32_t> qp_num;
         std::string reply_msg;  // on error
+        // Address of the NIC at local_nic_path, so that the receiver needs
+        // not fetch the segment of the sender. Empty gid if not sent.
+        std::string local_gid;
+        uint16_t local_lid = 0;
     };
 
    public:
@@ -93,6 +126,16 @@ class TransferMetadata {
     std::shared_ptr<SegmentDesc> getSegmentDescByID(SegmentID segment_id,
                                                     bool force_update = false);
 
+    // Like getSegmentDescByID(), but does not take a reference, for hot
+    // paths. The result is owned by a table cached by the calling thread,
+    // and may be freed by its next segment lookup of any kind. It must not
+    // be kept across such calls nor passed to other threads; use
+    // getSegmentDescByID() for that.
+    SegmentDesc *peekSegmentDescByID(SegmentID segment_id);
+
+    // Publishes the local segment. Concurrent calls are coalesced: a call
+    // made while another one is publishing waits for it, then publishes
+    // once for all callers that were waiting.
     int updateLocalSegmentDesc(SegmentID segment_id = LOCAL_SEGMENT_ID);
 
     int updateSegmentDesc(const std::string &segment_name,
@@ -112,6 +155,21 @@ class TransferMetadata {
 
     int removeLocalMemoryBuffer(void *addr, bool update_metadata);
 
+    // Like the above for many buffers, with a single copy of the local
+    // segment and a single update of the metadata.
+    int addLocalMemoryBuffers(const std::vector<BufferDesc> &buffer_list,
+                              bool update_metadata);
+
+    int removeLocalMemoryBuffers(const std::vector<void *> &addr_list,
+                                 bool update_metadata);
+
+    int setLocalHostId(const std::string &host_id);
+
+    int addLocalShmBuffer(const ShmBufferDesc &buffer_desc,
+                          bool update_metadata);
+
+    int removeLocalShmBuffer(void *addr, bool update_metadata);
+
     int addLocalSegment(SegmentID segment_id, const std::string &segment_name,
                         std::shared_ptr<SegmentDesc> &&desc);
 
@@ -123,8 +181,19 @@ class TransferMetadata {
 
     const RpcMetaDesc &localRpcMeta() const { return local_rpc_meta_; }
 
+    // With a "p2p://" connection string, there is no metadata server. Each
+    // process serves its own segment descriptors from its handshake daemon,
+    // which listens at the port in its server name.
+    bool isPeerToPeer() const { return p2p_mode_; }
+
+    // Whether segments changed by other nodes are refreshed as soon as the
+    // metadata storage reports them, rather than on the next forced update.
+    bool isWatching() const { return watching_; }
+
     using OnReceiveHandShake = std::function<int(const HandShakeDesc &peer_desc,
                                                  HandShakeDesc &local_desc)>;
+    // Starts the daemon if it is not running yet. on_receive_handshake may
+    // be empty if the daemon only serves metadata for now.
     int startHandshakeDaemon(OnReceiveHandShake on_receive_handshake,
                              uint16_t listen_port);
 
@@ -132,12 +201,87 @@ class TransferMetadata {
                       const HandShakeDesc &local_desc,
                       HandShakeDesc &peer_desc);
 
+    // Called with the name of a cached segment whose descriptor was replaced
+    // or dropped, or was removed from the metadata storage, after the change.
+    using OnSegmentChanged = std::function<void(const std::string &name)>;
+
+    // Returns an id for removeSegmentListener()
+    int addSegmentListener(OnSegmentChanged on_change);
+
+    // The listener is not called any more once this returns
+    void removeSegmentListener(int listener_id);
+
+   private:
+    // Segments known to this process. A table is never changed once
+    // published, updates publish a changed copy instead.
+    struct SegmentTable {
+        std::unordered_map<SegmentID, std::shared_ptr<SegmentDesc>>
+            id_to_desc;
+        std::unordered_map<std::string, SegmentID> name_to_id;
+    };
+
+    // The current segment table. Every thread keeps the last table it read,
+    // so lookups are wait-free until the table changes. The result stays
+    // valid until the calling thread calls segmentTable() again.
+    const SegmentTable &segmentTable();
+
+    // Publishes a copy of the current table changed by update
+    void updateSegmentTable(const std::function<void(SegmentTable &)> &update);
+
+    // Replaces the local segment descriptor with a copy changed by update.
+    // Returns ERR_ADDRESS_NOT_REGISTERED and keeps the descriptor if update
+    // returns false.
+    int updateLocalSegment(const std::function<bool(SegmentDesc &)> &update);
+
+    // Like getSegmentDesc(), but concurrent fetches of the same segment
+    // share one request, and a segment that was not found is not fetched
+    // again for a short while.
+    std::shared_ptr<SegmentDesc> fetchSegmentDesc(
+        const std::string &segment_name);
+
+    // Fetches key from the handshake daemon of server_name
+    int queryPeerMetadata(const std::string &server_name,
+                          const std::string &key, Json::Value &value);
+
+    // Handles a message received by the handshake daemon
+    int onReceiveRequest(const Json::Value &peer, Json::Value &local);
+
+    // Refreshes the cached descriptor of a segment changed in the metadata
+    // storage, called by the storage plugin when it can watch keys
+    void onSegmentChanged(const std::string &key);
+
+    void notifySegmentListeners(const std::vector<std::string> &name_list);
+
    private:
-    // local cache
-    RWSpinlock segment_lock_;
-    std::unordered_map<uint64_t, std::shared_ptr<SegmentDesc>>
-        segment_id_to_desc_map_;
-    std::unordered_map<std::string, uint64_t> segment_name_to_id_map_;
+    // Serializes updates of segment_table_, which readers load atomically
+    std::mutex segment_mutex_;
+    std::shared_ptr<const SegmentTable> segment_table_;
+    std::atomic<uint64_t> segment_table_version_;
+
+    // Listeners are called under listener_mutex_, so that none is running
+    // once it is removed
+    std::mutex listener_mutex_;
+    std::unordered_map<int, OnSegmentChanged> listener_map_;
+    int next_listener_id_ = 0;
+    std::atomic<bool> has_listener_{false};
+
+    // Fetches in flight, and segments not found with the time they may be
+    // fetched again
+    std::mutex fetch_mutex_;
+    std::unordered_map<std::string,
+                       std::shared_future<std::shared_ptr<SegmentDesc>>>
+        fetch_map_;
+    // Segment name -> deadline of the negative entry, in nanoseconds
+    std::unordered_map<std::string, int64_t> missing_segment_map_;
+
+    // Publishing of the local segment. Callers take a ticket, and a publish
+    // covers all tickets taken before it started.
+    std::mutex publish_mutex_;
+    std::condition_variable publish_cond_;
+    bool publishing_ = false;
+    uint64_t publish_ticket_ = 0;
+    uint64_t published_ticket_ = 0;
+    int publish_result_ = 0;
 
     RWSpinlock rpc_meta_lock_;
     std::unordered_map<std::string, RpcMetaDesc> rpc_meta_map_;
@@ -145,6 +289,12 @@ class TransferMetadata {
 
     std::atomic<SegmentID> next_segment_id_;
 
+    bool p2p_mode_ = false;
+    bool watching_ = false;
+    std::mutex handshake_mutex_;  // guards the fields below
+    bool daemon_running_ = false;
+    OnReceiveHandShake on_receive_handshake_;
+
     std::shared_ptr<HandShakePlugin> handshake_plugin_;
     std::shared_ptr<MetadataStoragePlugin> storage_plugin_;
 };
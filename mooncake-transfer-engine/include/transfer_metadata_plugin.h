@@ -28,6 +28,18 @@ struct MetadataStoragePlugin {
     virtual bool get(const std::string &key, Json::Value &value) = 0;
     virtual bool set(const std::string &key, const Json::Value &value) = 0;
     virtual bool remove(const std::string &key) = 0;
+
+    // Called when a key under the watched prefix is set or removed by any
+    // node. An empty key means that changes may have been missed, e.g.
+    // while reconnecting, and all keys should be read again.
+    using OnChangeCallBack = std::function<void(const std::string &key)>;
+
+    // Starts calling on_change from a background thread until the plugin
+    // is destroyed. Returns false if the backend cannot watch keys.
+    virtual bool watch(const std::string & /* prefix */,
+                       OnChangeCallBack /* on_change */) {
+        return false;
+    }
 };
 
 struct HandShakePlugin {
@@ -0,0 +1,100 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LOCAL_TRANSPORT_H_
+#define LOCAL_TRANSPORT_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "transfer_metadata.h"
+#include "transport/transport.h"
+
+namespace mooncake {
+// Serves transfers whose target is the local segment of this engine with
+// plain memory copies. Large requests are split into chunks and copied by a
+// pool of worker threads, using non-temporal stores to avoid polluting the
+// cache with data that will not be read back by this process.
+class LocalTransport : public Transport {
+   public:
+    LocalTransport();
+
+    ~LocalTransport();
+
+    Status submitTransfer(BatchID batch_id,
+                          const std::vector<TransferRequest> &entries) override;
+
+    Status submitTransferTask(
+        const std::vector<TransferRequest *> &request_list,
+        const std::vector<TransferTask *> &task_list) override;
+
+    Status getTransferStatus(BatchID batch_id, size_t task_id,
+                             TransferStatus &status) override;
+
+    // Copy length bytes, switching to non-temporal stores for large copies.
+    static void memoryCopy(void *dest, const void *source, size_t length);
+
+   protected:
+    int install(std::string &local_server_name,
+                std::shared_ptr<TransferMetadata> meta,
+                std::shared_ptr<Topology> topo) override;
+
+    // Split [source, source + length) <-> [dest, dest + length) into slices
+    // of the given task and copy them, inline for small requests and by the
+    // worker threads otherwise. hold is released once all slices are copied,
+    // so it may own the memory of dest.
+    void submitCopy(TransferRequest::OpCode opcode, void *source, void *dest,
+                    size_t length, TransferTask &task,
+                    std::shared_ptr<void> hold = nullptr);
+
+   private:
+    int registerLocalMemory(void *addr, size_t length,
+                            const std::string &location, bool remote_accessible,
+                            bool update_metadata) override;
+
+    int unregisterLocalMemory(void *addr, bool update_metadata) override;
+
+    int registerLocalMemoryBatch(const std::vector<BufferEntry> &buffer_list,
+                                 const std::string &location) override;
+
+    int unregisterLocalMemoryBatch(
+        const std::vector<void *> &addr_list) override;
+
+    const char *getName() const override { return "local"; }
+
+    void copyWorker();
+
+    static void processSlice(Slice *slice);
+
+   private:
+    std::atomic<bool> running_;
+    std::vector<std::thread> worker_thread_;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cond_;
+    struct CopyJob {
+        Slice *slice;
+        std::shared_ptr<void> hold;
+    };
+    std::deque<CopyJob> slice_queue_;
+};
+}  // namespace mooncake
+
+#endif  // LOCAL_TRANSPORT_H_
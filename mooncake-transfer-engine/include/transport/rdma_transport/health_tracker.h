@@ -0,0 +1,101 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HEALTH_TRACKER_H
+#define HEALTH_TRACKER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "common.h"
+
+namespace mooncake {
+// Health of one NIC or NIC path. Only updated by HealthTracker.
+struct HealthState {
+    std::atomic<int> failure_count{0};
+    std::atomic<uint64_t> backoff_ns{0};
+    std::atomic<uint64_t> retry_ts{0};     // the next probe is allowed then
+    std::atomic<uint64_t> last_use_ts{0};  // last failure or lookup
+};
+
+// Health of NICs or NIC paths. After failure_threshold consecutive failures
+// a NIC is unhealthy and backs off: it is avoided for initial_backoff,
+// doubled on each further failure up to max_backoff. When the backoff
+// expires, one probe is let through per backoff period, and the first
+// success makes the NIC healthy again.
+//
+// Callers that own one HealthState per NIC, like local devices, pass it in;
+// a healthy NIC then costs one atomic load per call. Other NICs are keyed by
+// name: while no name has failed, a call costs one atomic load too, and
+// otherwise a read lock of one of kShardCount shards. Named entries that
+// nobody failed or asked about for two max_backoff periods, e.g. because
+// their segment is gone, are evicted.
+class HealthTracker {
+   public:
+    // Current time in nanoseconds
+    using Clock = int64_t (*)();
+
+    HealthTracker(uint64_t initial_backoff_ns, uint64_t max_backoff_ns,
+                  int failure_threshold = 1,
+                  Clock clock = getCurrentTimeInNano);
+
+    // name is only used for logging
+    void markFailure(HealthState &state, const std::string &name);
+
+    void markSuccess(HealthState &state, const std::string &name);
+
+    // Returns false if the NIC is backing off. Returning true for an
+    // unhealthy NIC grants the probe, so callers should only ask when they
+    // are about to use the NIC.
+    bool healthy(HealthState &state);
+
+    void markFailure(const std::string &name);
+
+    void markSuccess(const std::string &name);
+
+    bool healthy(const std::string &name);
+
+    // True if no named entry exists, so callers may skip building names
+    bool empty() const {
+        return entry_count_.load(std::memory_order_relaxed) == 0;
+    }
+
+   private:
+    struct Shard {
+        RWSpinlock lock;
+        std::unordered_map<std::string, HealthState> entry_map;
+    };
+
+    Shard &shardOf(const std::string &name);
+
+    // Evicts idle named entries, at most once per max_backoff
+    void evictIdleEntries(uint64_t current_ts);
+
+    static const size_t kShardCount = 16;
+
+    const uint64_t initial_backoff_ns_;
+    const uint64_t max_backoff_ns_;
+    const int failure_threshold_;
+    const Clock clock_;
+
+    Shard shard_list_[kShardCount];
+    // Number of named entries, read without locks on the data path
+    std::atomic<size_t> entry_count_;
+    std::atomic<uint64_t> next_eviction_ts_;
+};
+}  // namespace mooncake
+
+#endif  // HEALTH_TRACKER_H
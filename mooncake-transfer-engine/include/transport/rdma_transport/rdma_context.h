@@ -85,11 +85,14 @@ class RdmaContext {
 
    public:
     // Device name, such as `mlx5_3`
-    std::string deviceName() const { return device_name_; }
+    const std::string &deviceName() const { return device_name_; }
 
     // NIC Path, such as `192.168.3.76@mlx5_3`
     std::string nicPath() const;
 
+    // Failures of this device, see RdmaTransport::deviceHealth()
+    HealthState &health() { return health_; }
+
    public:
     uint16_t lid() const { return lid_; }
 
@@ -109,6 +112,9 @@ class RdmaContext {
 
     ibv_mtu activeMTU() const { return active_mtu_; }
 
+    // Largest message the port accepts in one work request.
+    size_t maxMsgSize() const { return max_msg_size_; }
+
     ibv_comp_channel *compChannel();
 
     int compVector();
@@ -127,6 +133,15 @@ class RdmaContext {
 
     int socketId();
 
+    // Bytes of the slices submitted to this device and not finished yet
+    uint64_t outstandingBytes() const {
+        return outstanding_bytes_.load(std::memory_order_relaxed);
+    }
+
+    void releaseOutstandingBytes(uint64_t length) {
+        outstanding_bytes_.fetch_sub(length, std::memory_order_relaxed);
+    }
+
    private:
     int openRdmaDevice(const std::string &device_name, uint8_t port,
                        int gid_index);
@@ -156,6 +171,7 @@ class RdmaContext {
     int gid_index_ = -1;
     int active_speed_ = -1;
     ibv_mtu active_mtu_;
+    size_t max_msg_size_ = SIZE_MAX;
     ibv_gid gid_;
 
     RWSpinlock memory_regions_lock_;
@@ -172,6 +188,8 @@ class RdmaContext {
     std::atomic<int> next_cq_list_index_;
 
     std::shared_ptr<WorkerPool> worker_pool_;
+    std::atomic<uint64_t> outstanding_bytes_;
+    HealthState health_;
 
     volatile bool active_;
 };
@@ -95,7 +95,16 @@ class RdmaEndPoint {
     const std::string toString() const;
 
    public:
-    // Submit some work requests to HW
+    // Set in wr_id of the work requests posted without IBV_SEND_SIGNALED.
+    // Such a work request only produces a CQE on error, and it is then
+    // handled by the CQE of the signaled one ending its group.
+    static const uint64_t kUnsignaledFlag = 1;
+
+    // Submit some work requests to HW, to a QP no other worker is posting
+    // to if there is one
+    // Only every signal_interval-th work request and the last one of each
+    // call are signaled, see Transport::Slice::rdma.covered_slice
+    // Small writes are sent inline
     // Submitted tasks (success/failed) are removed in slice_list
     // Failed tasks (which must be submitted) are inserted in failed_slice_list
     int submitPostSend(std::vector<Transport::Slice *> &slice_list,
@@ -104,6 +113,15 @@ class RdmaEndPoint {
    private:
     std::vector<uint32_t> qpNum() const;
 
+    // Posts a prefix of slice_list to a QP, with its post lock held. Returns
+    // true if the endpoint must be reset.
+    bool postSend(int qp_index, std::vector<Transport::Slice *> &slice_list,
+                  std::vector<Transport::Slice *> &failed_slice_list);
+
+    // Post a signaled empty write ending the group of the posted unsignaled
+    // slice, whose signaled work request could not be posted.
+    int postGroupEnd(int qp_index, Transport::Slice *slice);
+
     int doSetupConnection(const std::string &peer_gid, uint16_t peer_lid,
                           std::vector<uint32_t> peer_qp_num_list,
                           std::string *reply_msg = nullptr);
@@ -122,7 +140,10 @@ class RdmaEndPoint {
     std::string peer_nic_path_;
 
     volatile int *wr_depth_list_;
+    // Held while posting to the QP of the same index, and checking its depth
+    std::unique_ptr<TicketLock[]> post_lock_list_;
     int max_wr_depth_;
+    size_t max_inline_bytes_;
 
     volatile bool active_;
     volatile int *cq_outstanding_;
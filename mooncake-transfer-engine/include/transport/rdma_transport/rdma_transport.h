@@ -19,6 +19,7 @@
 
 #include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -28,6 +29,7 @@
 #include <vector>
 
 #include "topology.h"
+#include "transport/rdma_transport/health_tracker.h"
 #include "transfer_metadata.h"
 #include "transport/transport.h"
 
@@ -80,6 +82,10 @@ class RdmaTransport : public Transport {
         const std::vector<TransferRequest *> &request_list,
         const std::vector<TransferTask *> &task_list) override;
 
+    Status submitVectoredTransferTask(
+        const std::vector<VectoredTransferRequest *> &request_list,
+        const std::vector<TransferTask *> &task_list) override;
+
     Status getTransferStatus(BatchID batch_id,
                              std::vector<TransferStatus> &status);
 
@@ -109,11 +115,58 @@ class RdmaTransport : public Transport {
 
    public:
     static int selectDevice(SegmentDesc *desc, uint64_t offset, size_t length,
-                            int &buffer_id, int &device_id, int retry_cnt = 0);
+                            int &buffer_id, int &device_id, int retry_cnt = 0,
+                            const DeviceLoadFunc &device_load = nullptr);
+
+    // Return the index of the buffer covering [offset, offset + length), or
+    // -1 if no such buffer exists.
+    static int findBuffer(SegmentDesc *desc, uint64_t offset, size_t length);
+
+    // Slice size for a request of length bytes whose local buffer starts at
+    // offset. Requests are spread over every QP of the devices preferred for
+    // that buffer, within [slice_size, max_slice_size] of the global config.
+    // Requests needing more work requests than the QPs hold get larger
+    // slices, up to max_msg_size; the slices beyond that wait in the queues.
+    static size_t selectSliceSize(SegmentDesc *desc, uint64_t offset,
+                                  size_t length,
+                                  size_t max_msg_size = SIZE_MAX);
+
+    // Like selectDevice() with retries, for a local buffer. Skips inactive
+    // devices, and unhealthy ones unless no other device is left.
+    int selectLocalDevice(SegmentDesc *desc, uint64_t offset, size_t length,
+                          int &buffer_id, int &device_id,
+                          const DeviceLoadFunc &device_load);
+
+    // Like selectDevice(), for a peer buffer. Skips the peer NICs that are
+    // backing off unless all of them are.
+    int selectPeerDevice(SegmentDesc *desc, uint64_t offset, size_t length,
+                         int &buffer_id, int &device_id, int retry_cnt = 0);
+
+    // Failures of local devices, whose state is RdmaContext::health()
+    HealthTracker &deviceHealth() { return device_health_; }
+
+    // Failures of peer NICs, keyed by NIC path
+    HealthTracker &peerHealth() { return peer_health_; }
+
+   private:
+    // Registers [addr, addr + length) with all devices, and appends the
+    // buffers to publish for it to buffer_list.
+    int registerMemoryRegions(void *addr, size_t length,
+                              const std::string &name,
+                              std::vector<BufferDesc> &buffer_list);
+
+    // Load of the local devices for selectDevice(): the bytes outstanding on
+    // each device plus assigned_bytes, those picked for it by the caller but
+    // not submitted yet.
+    DeviceLoadFunc localDeviceLoad(const std::vector<uint64_t> &assigned_bytes);
 
    private:
     std::vector<std::shared_ptr<RdmaContext>> context_list_;
     std::shared_ptr<Topology> local_topology_;
+    // Smallest max_msg_sz of the local devices.
+    size_t max_msg_size_ = SIZE_MAX;
+    HealthTracker device_health_;
+    HealthTracker peer_health_;
 };
 
 using TransferRequest = Transport::TransferRequest;
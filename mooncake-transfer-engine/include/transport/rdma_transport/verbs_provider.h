@@ -0,0 +1,100 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VERBS_PROVIDER_H
+#define VERBS_PROVIDER_H
+
+#include <infiniband/verbs.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mooncake {
+// The libibverbs entry points used by the RDMA transport. They follow the
+// signatures and error conventions of the ibv_* functions of the same name.
+class VerbsProvider {
+   public:
+    virtual ~VerbsProvider() {}
+
+    virtual int forkInit() = 0;
+
+    virtual ibv_device **getDeviceList(int *num_devices) = 0;
+
+    virtual void freeDeviceList(ibv_device **list) = 0;
+
+    virtual const char *getDeviceName(ibv_device *device) = 0;
+
+    virtual ibv_context *openDevice(ibv_device *device) = 0;
+
+    virtual int closeDevice(ibv_context *context) = 0;
+
+    virtual int queryDevice(ibv_context *context,
+                            ibv_device_attr *device_attr) = 0;
+
+    virtual int queryPort(ibv_context *context, uint8_t port_num,
+                          ibv_port_attr *port_attr) = 0;
+
+    virtual int queryGid(ibv_context *context, uint8_t port_num, int index,
+                         ibv_gid *gid) = 0;
+
+    virtual int queryGidEx(ibv_context *context, uint32_t port_num,
+                           uint32_t gid_index, ibv_gid_entry *entry,
+                           uint32_t flags) = 0;
+
+    virtual int getAsyncEvent(ibv_context *context,
+                              ibv_async_event *event) = 0;
+
+    virtual void ackAsyncEvent(ibv_async_event *event) = 0;
+
+    virtual ibv_pd *allocPd(ibv_context *context) = 0;
+
+    virtual int deallocPd(ibv_pd *pd) = 0;
+
+    virtual ibv_mr *regMr(ibv_pd *pd, void *addr, size_t length,
+                          int access) = 0;
+
+    virtual int deregMr(ibv_mr *mr) = 0;
+
+    virtual ibv_comp_channel *createCompChannel(ibv_context *context) = 0;
+
+    virtual int destroyCompChannel(ibv_comp_channel *channel) = 0;
+
+    virtual ibv_cq *createCq(ibv_context *context, int cqe, void *cq_context,
+                             ibv_comp_channel *channel, int comp_vector) = 0;
+
+    virtual int destroyCq(ibv_cq *cq) = 0;
+
+    virtual ibv_qp *createQp(ibv_pd *pd, ibv_qp_init_attr *qp_init_attr) = 0;
+
+    virtual int destroyQp(ibv_qp *qp) = 0;
+
+    virtual int modifyQp(ibv_qp *qp, ibv_qp_attr *attr, int attr_mask) = 0;
+
+    virtual int postSend(ibv_qp *qp, ibv_send_wr *wr,
+                         ibv_send_wr **bad_wr) = 0;
+
+    virtual int pollCq(ibv_cq *cq, int num_entries, ibv_wc *wc) = 0;
+};
+
+// The provider used by the RDMA transport. It is a VerbsSimulator if
+// MC_RDMA_SIMULATOR is set, and forwards to libibverbs otherwise.
+VerbsProvider &verbs();
+
+// Replaces the provider returned by verbs(). Must be called before any RDMA
+// resource is created, usually before the RDMA transport is installed.
+void setVerbsProvider(std::shared_ptr<VerbsProvider> provider);
+}  // namespace mooncake
+
+#endif  // VERBS_PROVIDER_H
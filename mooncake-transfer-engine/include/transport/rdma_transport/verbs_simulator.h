@@ -0,0 +1,164 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VERBS_SIMULATOR_H
+#define VERBS_SIMULATOR_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "transport/rdma_transport/verbs_provider.h"
+
+namespace mooncake {
+// Software RNICs for running the RDMA transport on hosts without RDMA
+// hardware. Each device is one port with a shared link of the configured
+// bandwidth. RC QPs execute RDMA READ/WRITE work requests with memcpy when
+// their completion is due, validating lkeys and rkeys like a real device.
+// A failed work request moves its QP to the error state, and the following
+// ones are flushed.
+//
+// Peers are QPs of the same simulator, so all engines using it must live in
+// one process. A single engine can reach its own segment as well.
+class VerbsSimulator : public VerbsProvider {
+   public:
+    struct Options {
+        // Devices are named sim_0, sim_1, ...
+        int device_count = 2;
+        // Added to the completion time of every work request
+        uint64_t latency_ns = 2000;
+        // Bytes per second of each device, 0 for unlimited
+        uint64_t bandwidth = 25000000000ull;
+        // Probability for a work request to fail with IBV_WC_RETRY_EXC_ERR
+        double error_rate = 0;
+
+        // Parses "devices=N,latency_us=N,bandwidth_gbps=N,error_rate=F",
+        // where any key may be omitted. Returns 0 on success.
+        int parse(const std::string &spec);
+    };
+
+    VerbsSimulator();
+
+    explicit VerbsSimulator(const Options &options);
+
+    ~VerbsSimulator();
+
+    static std::string deviceName(int index);
+
+    // Whether name is that of a simulated device, which has no sysfs entry
+    static bool isSimulatedDevice(const std::string &name);
+
+    // The next count work requests to complete fail as if the peer did not
+    // respond.
+    void injectErrors(int count) { injected_error_count_ += count; }
+
+    // The next count calls of postSend() with several work requests reject
+    // the last one with ENOMEM, as if the send queue were full.
+    void injectPostErrors(int count) { injected_post_error_count_ += count; }
+
+    // Work requests executed, including failed ones.
+    uint64_t completedCount() const { return completed_count_; }
+
+    int forkInit() override { return 0; }
+
+    ibv_device **getDeviceList(int *num_devices) override;
+
+    void freeDeviceList(ibv_device **list) override;
+
+    const char *getDeviceName(ibv_device *device) override;
+
+    ibv_context *openDevice(ibv_device *device) override;
+
+    int closeDevice(ibv_context *context) override;
+
+    int queryDevice(ibv_context *context,
+                    ibv_device_attr *device_attr) override;
+
+    int queryPort(ibv_context *context, uint8_t port_num,
+                  ibv_port_attr *port_attr) override;
+
+    int queryGid(ibv_context *context, uint8_t port_num, int index,
+                 ibv_gid *gid) override;
+
+    int queryGidEx(ibv_context *context, uint32_t port_num, uint32_t gid_index,
+                   ibv_gid_entry *entry, uint32_t flags) override;
+
+    int getAsyncEvent(ibv_context *context, ibv_async_event *event) override;
+
+    void ackAsyncEvent(ibv_async_event *event) override {}
+
+    ibv_pd *allocPd(ibv_context *context) override;
+
+    int deallocPd(ibv_pd *pd) override;
+
+    ibv_mr *regMr(ibv_pd *pd, void *addr, size_t length, int access) override;
+
+    int deregMr(ibv_mr *mr) override;
+
+    ibv_comp_channel *createCompChannel(ibv_context *context) override;
+
+    int destroyCompChannel(ibv_comp_channel *channel) override;
+
+    ibv_cq *createCq(ibv_context *context, int cqe, void *cq_context,
+                     ibv_comp_channel *channel, int comp_vector) override;
+
+    int destroyCq(ibv_cq *cq) override;
+
+    ibv_qp *createQp(ibv_pd *pd, ibv_qp_init_attr *qp_init_attr) override;
+
+    int destroyQp(ibv_qp *qp) override;
+
+    int modifyQp(ibv_qp *qp, ibv_qp_attr *attr, int attr_mask) override;
+
+    int postSend(ibv_qp *qp, ibv_send_wr *wr, ibv_send_wr **bad_wr) override;
+
+    int pollCq(ibv_cq *cq, int num_entries, ibv_wc *wc) override;
+
+   private:
+    struct Device;
+    struct MemoryRegion;
+    struct CompletionQueue;
+    struct QueuePair;
+    struct WorkRequest;
+
+    ibv_wc_status validate(const WorkRequest &request);
+
+    ibv_wc_status execute(WorkRequest &request);
+
+    bool checkAccess(uint32_t key, ibv_context *context, uint64_t addr,
+                     size_t length, int access);
+
+    void discardWorkRequests(QueuePair *qp);
+
+   private:
+    const Options options_;
+    std::vector<std::unique_ptr<Device>> device_list_;
+
+    // Guards the maps below, which are looked up when work requests execute
+    std::mutex mutex_;
+    std::unordered_map<uint32_t, MemoryRegion *> mr_map_;
+    std::unordered_map<uint32_t, QueuePair *> qp_map_;
+    uint32_t next_key_;
+    uint32_t next_qp_num_;
+
+    std::atomic<int> injected_error_count_;
+    std::atomic<int> injected_post_error_count_;
+    std::atomic<uint64_t> completed_count_;
+};
+}  // namespace mooncake
+
+#endif  // VERBS_SIMULATOR_H
@@ -31,11 +31,29 @@ class WorkerPool {
     int submitPostSend(const std::vector<Transport::Slice *> &slice_list);
 
    private:
+    using SliceList = std::vector<Transport::Slice *>;
+
+    const static int kShardCount = 8;
+
     void performPostSend(int thread_id);
 
+    // Posts the pending slices of a shard unless another worker is doing
+    // so. Returns false if the shard had nothing to post or was busy.
+    bool processShard(int shard_id, SliceList &failed_slice_list);
+
     void performPollCq(int thread_id);
 
-    void redispatch(std::vector<Transport::Slice *> &slice_list, int thread_id);
+    void processCompletion(Transport::Slice *slice, ibv_wc_status status,
+                           SliceList &retry_slice_list,
+                           int &processed_slice_count);
+
+    // Records the outcome of a completion in the health of the local device
+    // and of the peer NIC
+    void updateHealth(const std::string &peer_nic_path, ibv_wc_status status);
+
+    void redispatch(SliceList &slice_list);
+
+    void enqueue(SliceList (&slice_list_map)[kShardCount]);
 
     void transferWorker(int thread_id);
 
@@ -56,15 +74,22 @@ class WorkerPool {
     std::mutex cond_mutex_;
     std::condition_variable cond_var_;
 
-    using SliceList = std::vector<Transport::Slice *>;
-
-    const static int kShardCount = 8;
+    // Slices submitted to each shard, by peer NIC. Large submissions to a
+    // peer NIC are spread over several shards.
     std::unordered_map<std::string, SliceList> slice_queue_[kShardCount];
     std::atomic<uint64_t> slice_queue_count_[kShardCount];
     TicketLock slice_queue_lock_[kShardCount];
 
-    std::vector<std::unordered_map<std::string, SliceList>>
-        collective_slice_queue_;
+    // Slices taken from slice_queue_ but not posted yet. A shard is posted
+    // by one worker at a time, the one holding its post lock, so the slices
+    // of a shard to each peer NIC are posted in order. Slices to one peer
+    // NIC in different shards are not: no order holds between them, like
+    // between slices posted to different QPs of an endpoint. Shards are
+    // homed to workers round-robin, and idle workers steal the others.
+    std::unordered_map<std::string, SliceList> post_queue_[kShardCount];
+    std::atomic<uint64_t> post_queue_count_[kShardCount];
+    TicketLock post_lock_[kShardCount];
+    int post_redispatch_counter_[kShardCount];
 
     std::atomic<uint64_t> submitted_slice_count_, processed_slice_count_;
 };
@@ -0,0 +1,113 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHM_TRANSPORT_H_
+#define SHM_TRANSPORT_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "transfer_metadata.h"
+#include "transport/local_transport/local_transport.h"
+
+namespace mooncake {
+// Same-host transport. Memory obtained from allocateSharedMemory() is backed
+// by a memfd; once registered, its /proc/<pid>/fd path and file identity are
+// published in the segment descriptor. Peers on the same host map that file
+// once, after checking that the path leads to the same file in their pid
+// namespace, and serve reads and writes with the memory copy engine of
+// LocalTransport. Mappings of a segment are dropped when its descriptor
+// changes or is removed.
+class ShmTransport : public LocalTransport {
+   public:
+    ShmTransport();
+
+    ~ShmTransport();
+
+    Status submitTransferTask(
+        const std::vector<TransferRequest *> &request_list,
+        const std::vector<TransferTask *> &task_list) override;
+
+    // Returns true if [target_offset, target_offset + length) of the segment
+    // lives in shared memory of a process on this host that can be mapped.
+    bool reachable(const SegmentDesc &desc, uint64_t target_offset,
+                   size_t length);
+
+    static void *allocateSharedMemory(size_t size);
+
+    // Makes [addr, addr + length), mapped by the caller with MAP_SHARED from
+    // offset 0 of the memfd fd, shared like allocateSharedMemory() memory.
+    // Takes ownership of fd.
+    static int addSharedMemory(void *addr, size_t length, int fd);
+
+    // Unmaps memory of allocateSharedMemory() or addSharedMemory() and
+    // closes its memfd.
+    static int freeSharedMemory(void *addr);
+
+    // Identifies the running kernel, and therefore the host.
+    static const std::string &hostId();
+
+   protected:
+    int install(std::string &local_server_name,
+                std::shared_ptr<TransferMetadata> meta,
+                std::shared_ptr<Topology> topo) override;
+
+   private:
+    int registerLocalMemory(void *addr, size_t length,
+                            const std::string &location, bool remote_accessible,
+                            bool update_metadata) override;
+
+    int unregisterLocalMemory(void *addr, bool update_metadata) override;
+
+    int registerLocalMemoryBatch(const std::vector<BufferEntry> &buffer_list,
+                                 const std::string &location) override;
+
+    int unregisterLocalMemoryBatch(
+        const std::vector<void *> &addr_list) override;
+
+    const char *getName() const override { return "shm"; }
+
+    // Address of target_offset in this process, or nullptr. If hold is given,
+    // it keeps the mapping alive after the segment is evicted.
+    char *translate(const SegmentDesc &desc, uint64_t target_offset,
+                    size_t length, std::shared_ptr<void> *hold = nullptr);
+
+   private:
+    struct MappedRegion {
+        char *addr;
+        size_t length;
+        size_t padding;  // distance from the page boundary to the buffer
+
+        ~MappedRegion();
+    };
+
+    // Segment name -> buffer key -> mapping, nullptr if the mapping failed
+    using RegionMap =
+        std::unordered_map<std::string, std::shared_ptr<MappedRegion>>;
+
+    std::shared_ptr<MappedRegion> mapRegion(
+        const SegmentDesc &desc,
+        const TransferMetadata::ShmBufferDesc &buffer_desc);
+
+    RWSpinlock mapping_lock_;
+    std::unordered_map<std::string, RegionMap> mapping_map_;
+    int listener_id_ = -1;
+};
+}  // namespace mooncake
+
+#endif  // SHM_TRANSPORT_H_
@@ -0,0 +1,215 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCP_CONNECTION_POOL_H_
+#define TCP_CONNECTION_POOL_H_
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "transport/tcp_transport/tcp_frame.h"
+#include "transport/transport.h"
+
+namespace mooncake {
+// Connections to one peer segment, as seen by TcpTransport.
+class TcpConnectionPoolBase {
+   public:
+    virtual ~TcpConnectionPoolBase() {}
+
+    // Queues slices to the peer segment, may be called from any thread.
+    virtual void enqueue(
+        const std::vector<Transport::Slice *> &slice_list) = 0;
+
+    // Called once no connection to the peer could be made and the pending
+    // slices have failed, so that the owner resolves the peer again for
+    // later transfers.
+    std::function<void()> on_unreachable_;
+};
+
+// Persistent connections to one peer segment, shared by the TCP transport
+// backends. Pending slices are sent in batches over the least loaded
+// connection, new connections are opened while all of them are busy, and
+// the slices of a broken connection are retried on the others.
+//
+// Connection is the active end of a connection of the backend. It provides
+// start(), send(slice_list), inflightBytes() and the on_close_ and
+// on_complete_ callbacks. A backend implements post() and connect(); all
+// other functions run in the thread that post() hands tasks to, so no
+// locking is needed.
+template <typename Connection>
+class TcpConnectionPool
+    : public TcpConnectionPoolBase,
+      public std::enable_shared_from_this<TcpConnectionPool<Connection>> {
+   public:
+    using Slice = Transport::Slice;
+
+    TcpConnectionPool(const std::string &host, uint16_t port,
+                      int max_connections)
+        : host_(host),
+          port_(port),
+          connection_limit_(max_connections),
+          connecting_count_(0),
+          max_connections_(max_connections),
+          limit_restore_ts_(0) {}
+
+    void enqueue(const std::vector<Slice *> &slice_list) override {
+        auto pool = this->shared_from_this();
+        post([pool, slice_list]() {
+            pool->pending_list_.insert(pool->pending_list_.end(),
+                                       slice_list.begin(), slice_list.end());
+            pool->dispatch();
+        });
+    }
+
+   protected:
+    // Runs task in the thread of the pool.
+    virtual void post(std::function<void()> task) = 0;
+
+    // Starts connecting to host_:port_. The attempt ends with a call to
+    // onConnected() or onConnectFailed() in the thread of the pool, never
+    // within connect() itself.
+    virtual void connect() = 0;
+
+    void onConnected(std::shared_ptr<Connection> connection) {
+        connecting_count_--;
+        // Neither references the other, the pool owns the connection
+        std::weak_ptr<TcpConnectionPool> weak_pool = this->shared_from_this();
+        connection->on_close_ = [weak_pool, ptr = connection.get()](
+                                    std::vector<Slice *> &slice_list) {
+            auto pool = weak_pool.lock();
+            if (pool) {
+                pool->onConnectionClosed(ptr, slice_list);
+            } else {
+                for (auto slice : slice_list) slice->markFailed();
+            }
+        };
+        connection->on_complete_ = [weak_pool]() {
+            auto pool = weak_pool.lock();
+            if (pool && !pool->pending_list_.empty()) pool->dispatch();
+        };
+        connection_list_.push_back(connection);
+        connection->start();
+        dispatch();
+    }
+
+    void onConnectFailed(const std::string &reason) {
+        LOG(ERROR) << "TcpTransport: Failed to connect to " << host_ << ":"
+                   << port_ << ": " << reason;
+        connecting_count_--;
+        int connection_count = connection_list_.size() + connecting_count_;
+        if (connection_count) {
+            max_connections_ = connection_count;
+            limit_restore_ts_ =
+                getCurrentTimeInNano() + kConnectionLimitBackoffNs;
+            dispatch();
+            return;
+        }
+        // No connection is left to serve pending slices
+        for (auto slice : pending_list_) slice->markFailed();
+        pending_list_.clear();
+        auto pool = this->shared_from_this();  // may be the last reference
+        if (on_unreachable_) on_unreachable_();
+    }
+
+    const std::string host_;
+    const uint16_t port_;
+
+   private:
+    void dispatch() {
+        // The peer may accept more connections by now, e.g. after closing
+        // connections of other clients
+        if (max_connections_ < connection_limit_ &&
+            getCurrentTimeInNano() >= limit_restore_ts_)
+            max_connections_ = connection_limit_;
+        while (!pending_list_.empty()) {
+            std::shared_ptr<Connection> connection;
+            if (!connection_list_.empty())
+                connection = *std::min_element(
+                    connection_list_.begin(), connection_list_.end(),
+                    [](const std::shared_ptr<Connection> &lhs,
+                       const std::shared_ptr<Connection> &rhs) {
+                        return lhs->inflightBytes() < rhs->inflightBytes();
+                    });
+            // Once all connections are busy, let pending slices wait for
+            // new connections as long as the pool may grow.
+            int connection_count = connection_list_.size() + connecting_count_;
+            if (!connection ||
+                (connection->inflightBytes() >= kConnectionBusyBytes &&
+                 connection_count < max_connections_)) {
+                uint64_t pending_bytes = 0;
+                for (auto slice : pending_list_) pending_bytes += slice->length;
+                int wanted = (pending_bytes + kConnectionBusyBytes - 1) /
+                             kConnectionBusyBytes;
+                while (connecting_count_ < wanted &&
+                       connection_count++ < max_connections_) {
+                    connecting_count_++;
+                    connect();
+                }
+                return;
+            }
+
+            std::vector<Slice *> slice_list;
+            size_t batch_bytes = 0;
+            while (!pending_list_.empty() &&
+                   slice_list.size() < kMaxBatchEntries) {
+                auto slice = pending_list_.front();
+                if (!slice_list.empty() &&
+                    batch_bytes + slice->length > kMaxBatchBytes)
+                    break;
+                pending_list_.pop_front();
+                slice_list.push_back(slice);
+                batch_bytes += slice->length;
+            }
+            connection->send(slice_list);
+        }
+    }
+
+    void onConnectionClosed(Connection *connection,
+                            std::vector<Slice *> &slice_list) {
+        for (auto iter = connection_list_.begin();
+             iter != connection_list_.end(); ++iter) {
+            if (iter->get() == connection) {
+                connection_list_.erase(iter);
+                break;
+            }
+        }
+        for (auto slice : slice_list) {
+            if (slice->tcp.retry_cnt++ < kMaxSliceRetryCount)
+                pending_list_.push_front(slice);
+            else
+                slice->markFailed();
+        }
+        dispatch();
+    }
+
+    const int connection_limit_;
+    int connecting_count_;
+    // Lowered when the peer refuses further connections, until
+    // limit_restore_ts_
+    int max_connections_;
+    int64_t limit_restore_ts_;
+    std::vector<std::shared_ptr<Connection>> connection_list_;
+    std::deque<Slice *> pending_list_;
+};
+}  // namespace mooncake
+
+#endif  // TCP_CONNECTION_POOL_H_
@@ -0,0 +1,69 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCP_FRAME_H_
+#define TCP_FRAME_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mooncake {
+// Wire format and connection policy shared by the TCP transport backends.
+
+const static uint32_t kFrameMagic = 0x4d435446;  // "MCTF"
+// Upper bound of the entries carried by a received frame
+const static uint32_t kMaxFrameEntries = 1024;
+// Small slices to the same peer are packed into one frame until it carries
+// kMaxBatchEntries entries or kMaxBatchBytes bytes of data.
+const static size_t kMaxBatchEntries = 64;
+const static size_t kMaxBatchBytes = 65536;
+// A new connection is opened to a peer once every connection carries at
+// least this many bytes of outstanding requests.
+const static uint64_t kConnectionBusyBytes = 1ull << 20;
+// Requests are striped over parallel connections in stripes of at least
+// this size.
+const static size_t kMinStripeSize = 1ull << 20;
+// A peer that refused a connection is limited to the connections it
+// accepted for this long, then the configured limit applies again.
+const static uint64_t kConnectionLimitBackoffNs = 1000000000ull;
+// Reconnect attempts of a slice whose connection broke
+const static uint32_t kMaxSliceRetryCount = 2;
+
+// Every message on a connection is a frame: a FrameHeader, entry_count
+// FrameEntry records and the payload. In a request frame the payload is the
+// data of the WRITE entries; in a response frame it is the data of the
+// successful READ entries, both concatenated in entry order. Responses carry
+// the request_id of their requests, so a connection can have any number of
+// requests in flight and they may complete in any order. All fields are
+// little endian.
+struct FrameHeader {
+    uint32_t magic;
+    uint32_t entry_count;
+    uint64_t payload_size;
+};
+
+struct FrameEntry {
+    uint64_t request_id;
+    uint64_t addr;  // remote address, unused in responses
+    uint64_t size;
+    uint8_t opcode;
+    uint8_t status;  // 0 if succeeded, unused in requests
+    uint8_t reserved[6];
+};
+
+static_assert(sizeof(FrameHeader) == 16, "unexpected FrameHeader layout");
+static_assert(sizeof(FrameEntry) == 32, "unexpected FrameEntry layout");
+}  // namespace mooncake
+
+#endif  // TCP_FRAME_H_
@@ -34,6 +34,7 @@
 namespace mooncake {
 class TransferMetadata;
 class TcpContext;
+class TcpConnectionPoolBase;
 
 class TcpTransport : public Transport {
    public:
@@ -53,39 +54,72 @@ class TcpTransport : public Transport {
         const std::vector<TransferRequest *> &request_list,
         const std::vector<TransferTask *> &task_list) override;
 
+    Status submitVectoredTransferTask(
+        const std::vector<VectoredTransferRequest *> &request_list,
+        const std::vector<TransferTask *> &task_list) override;
+
     Status getTransferStatus(BatchID batch_id, size_t task_id,
                           TransferStatus &status) override;
 
-   private:
+   protected:
     int install(std::string &local_server_name,
                 std::shared_ptr<TransferMetadata> meta,
-                std::shared_ptr<Topology> topo);
+                std::shared_ptr<Topology> topo) override;
 
-    int allocateLocalSegmentID();
+    // Starts serving peers and sending slices, before the local segment is
+    // published. Sets data_port_ to the port peers connect to.
+    virtual int startEventLoop();
+
+    // The port to listen on. In peer-to-peer mode the handshake daemon has
+    // the rpc port, so any free port is used and published in the segment.
+    uint16_t listenPort() const;
+
+    // Creates the connections to a peer segment listening on host:port.
+    virtual std::shared_ptr<TcpConnectionPoolBase> createConnectionPool(
+        SegmentID target_id, const std::string &host, uint16_t port);
+
+    // Whether peers may access [addr, addr + size) of the local segment.
+    bool validateAccess(uint64_t addr, uint64_t size);
 
     int registerLocalMemory(void *addr, size_t length,
                             const std::string &location, bool remote_accessible,
-                            bool update_metadata);
+                            bool update_metadata) override;
 
-    int unregisterLocalMemory(void *addr, bool update_metadata = false);
+    int unregisterLocalMemory(void *addr,
+                              bool update_metadata = false) override;
+
+    uint16_t data_port_ = 0;
+
+   private:
+    int allocateLocalSegmentID();
 
     int registerLocalMemoryBatch(
         const std::vector<Transport::BufferEntry> &buffer_list,
-        const std::string &location);
+        const std::string &location) override;
 
     int unregisterLocalMemoryBatch(
         const std::vector<void *> &addr_list) override;
 
-    void worker();
+    void worker(size_t index);
 
     void startTransfer(Slice *slice);
 
+    // Hands slices of the same target segment to its connection pool.
+    void enqueueSlices(const std::vector<Slice *> &slice_list);
+
+    std::shared_ptr<TcpConnectionPoolBase> getConnectionPool(
+        SegmentID target_id);
+
     const char *getName() const override { return "tcp"; }
 
    private:
     TcpContext *context_;
     std::atomic_bool running_;
-    std::thread thread_;
+    std::vector<std::thread> thread_list_;
+
+    RWSpinlock pool_lock_;
+    std::unordered_map<SegmentID, std::shared_ptr<TcpConnectionPoolBase>>
+        pool_map_;
 };
 }  // namespace mooncake
 
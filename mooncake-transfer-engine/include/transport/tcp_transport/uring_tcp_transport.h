@@ -0,0 +1,67 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef URING_TCP_TRANSPORT_H_
+#define URING_TCP_TRANSPORT_H_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "transport/tcp_transport/tcp_transport.h"
+
+namespace mooncake {
+class UringWorker;
+
+// TCP transport backend built on io_uring, selected instead of the
+// Boost.Asio backend at install time if MC_TCP_IO_URING is set. It speaks
+// the same frame protocol, so peers using either backend interoperate.
+//
+// Each io thread owns a ring. Operations of all its connections are
+// submitted in one batch per loop iteration, frames are received by
+// multishot receives into a provided buffer ring, buffers registered with
+// registerLocalMemory() become fixed buffers of every ring, and large
+// frames are sent with zero-copy sends.
+class UringTcpTransport : public TcpTransport {
+   public:
+    UringTcpTransport();
+
+    ~UringTcpTransport();
+
+   protected:
+    int startEventLoop() override;
+
+    std::shared_ptr<TcpConnectionPoolBase> createConnectionPool(
+        SegmentID target_id, const std::string &host,
+        uint16_t port) override;
+
+    int registerLocalMemory(void *addr, size_t length,
+                            const std::string &location, bool remote_accessible,
+                            bool update_metadata) override;
+
+    int unregisterLocalMemory(void *addr,
+                              bool update_metadata = false) override;
+
+   private:
+    void acceptConnections();
+
+   private:
+    std::vector<std::unique_ptr<UringWorker>> worker_list_;
+    int listen_fd_;
+    size_t next_worker_;  // only accessed by the thread of worker 0
+};
+}  // namespace mooncake
+
+#endif  // URING_TCP_TRANSPORT_H_
@@ -25,6 +25,7 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "common/base/status.h"
 #include "transfer_metadata.h"
@@ -59,6 +60,28 @@ class Transport {
         size_t length;
     };
 
+    struct BufferEntry {
+        void *addr;
+        size_t length;
+    };
+
+    /// Scatter-gather request: the local buffers in source_list are laid out
+    /// back-to-back in the remote range starting at target_offset. WRITE
+    /// gathers them into the remote range, READ scatters the remote range
+    /// into them.
+    struct VectoredTransferRequest {
+        TransferRequest::OpCode opcode;
+        std::vector<BufferEntry> source_list;
+        SegmentID target_id;
+        uint64_t target_offset;
+
+        size_t length() const {
+            size_t total = 0;
+            for (auto &entry : source_list) total += entry.length;
+            return total;
+        }
+    };
+
     enum TransferStatusEnum {
         WAITING,
         PENDING,
@@ -87,6 +110,16 @@ class Transport {
         SliceStatus status;
         TransferTask *task;
 
+        // Local side of a slice built from a VectoredTransferRequest. If not
+        // empty, the entries replace source_addr and their lengths sum up to
+        // length. lkey is only filled by RdmaTransport.
+        struct SGEntry {
+            void *addr;
+            size_t length;
+            uint32_t lkey;
+        };
+        std::vector<SGEntry> sg_list;
+
         union {
             struct {
                 uint64_t dest_addr;
@@ -94,6 +127,12 @@ class Transport {
                 uint32_t dest_rkey;
                 int rkey_index;
                 volatile int *qp_depth;
+                // Previous unsignaled slice posted in the same group, which
+                // completes together with the signaled slice ending it.
+                Slice *covered_slice;
+                // Work requests without a slice posted in the same group,
+                // see RdmaEndPoint::postGroupEnd().
+                int extra_wr_count;
                 uint32_t retry_cnt;
                 uint32_t max_retry_cnt;
             } rdma;
@@ -102,6 +141,7 @@ class Transport {
             } local;
             struct {
                 uint64_t dest_addr;
+                uint32_t retry_cnt;
             } tcp;
             struct {
                 const char *file_path;
@@ -169,6 +209,12 @@ class Transport {
             "Transport::submitTransferTask is not implemented");
     }
 
+    /// @brief Submit scatter-gather requests, one task per request. The
+    /// default implementation splits each request into contiguous ones.
+    virtual Status submitVectoredTransferTask(
+        const std::vector<VectoredTransferRequest *> &request_list,
+        const std::vector<TransferTask *> &task_list);
+
     /// @brief Get the status of a submitted transfer. This function shall not
     /// be called again after completion.
     /// @return Return 1 on completed (either success or failure); 0 if still in
@@ -178,11 +224,6 @@ class Transport {
 
     std::shared_ptr<TransferMetadata> &meta() { return metadata_; }
 
-    struct BufferEntry {
-        void *addr;
-        size_t length;
-    };
-
    protected:
     virtual int install(std::string &local_server_name,
                         std::shared_ptr<TransferMetadata> meta,
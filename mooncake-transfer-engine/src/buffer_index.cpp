@@ -0,0 +1,61 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "buffer_index.h"
+
+#include <algorithm>
+
+namespace mooncake {
+void BufferIndex::build(const RangeList &range_list) {
+    entry_list_.clear();
+    addr_list_.clear();
+    entry_list_.reserve(range_list.size());
+    addr_list_.reserve(range_list.size());
+    for (size_t i = 0; i < range_list.size(); ++i) {
+        auto &range = range_list[i];
+        entry_list_.push_back(
+            {range.first, range.first + range.second, 0, (int)i});
+        addr_list_.push_back(range.first);
+    }
+    std::sort(entry_list_.begin(), entry_list_.end(),
+              [](const Entry &lhs, const Entry &rhs) {
+                  if (lhs.addr != rhs.addr) return lhs.addr < rhs.addr;
+                  return lhs.buffer_id < rhs.buffer_id;
+              });
+    uint64_t max_end = 0;
+    for (auto &entry : entry_list_) {
+        max_end = std::max(max_end, entry.end);
+        entry.max_end = max_end;
+    }
+}
+
+int BufferIndex::find(uint64_t addr, uint64_t length, int min_id) const {
+    // Candidates start at or before addr. Walk back from the last of them
+    // until no earlier buffer reaches the end of the range, which is after
+    // one step unless buffers overlap.
+    auto iter = std::upper_bound(
+        entry_list_.begin(), entry_list_.end(), addr,
+        [](uint64_t addr, const Entry &entry) { return addr < entry.addr; });
+    const uint64_t end = addr + length;
+    int buffer_id = -1;
+    while (iter != entry_list_.begin()) {
+        --iter;
+        if (iter->max_end < end) break;
+        if (iter->end >= end && iter->buffer_id >= min_id &&
+            (buffer_id < 0 || iter->buffer_id < buffer_id))
+            buffer_id = iter->buffer_id;
+    }
+    return buffer_id;
+}
+}  // namespace mooncake
@@ -154,6 +154,16 @@ void loadGlobalConfig(GlobalConfig &config) {
                 << "Ignore value from environment variable MC_WORKERS_PER_CTX";
     }
 
+    const char *signal_interval_env = std::getenv("MC_SIGNAL_INTERVAL");
+    if (signal_interval_env) {
+        int val = atoi(signal_interval_env);
+        if (val > 0 && val <= 1024)
+            config.signal_interval = val;
+        else
+            LOG(WARNING)
+                << "Ignore value from environment variable MC_SIGNAL_INTERVAL";
+    }
+
     const char *slice_size_env = std::getenv("MC_SLICE_SIZE");
     if (slice_size_env) {
         size_t val = atoi(slice_size_env);
@@ -164,6 +174,16 @@ void loadGlobalConfig(GlobalConfig &config) {
                 << "Ignore value from environment variable MC_SLICE_SIZE";
     }
 
+    const char *max_slice_size_env = std::getenv("MC_MAX_SLICE_SIZE");
+    if (max_slice_size_env) {
+        size_t val = atoll(max_slice_size_env);
+        if (val > 0)
+            config.max_slice_size = val;
+        else
+            LOG(WARNING)
+                << "Ignore value from environment variable MC_MAX_SLICE_SIZE";
+    }
+
     const char *retry_cnt_env = std::getenv("MC_RETRY_CNT");
     if (retry_cnt_env) {
         size_t val = atoi(retry_cnt_env);
@@ -174,6 +194,91 @@ void loadGlobalConfig(GlobalConfig &config) {
                 << "Ignore value from environment variable MC_RETRY_CNT";
     }
 
+    const char *local_copy_workers_env = std::getenv("MC_LOCAL_COPY_WORKERS");
+    if (local_copy_workers_env) {
+        int val = atoi(local_copy_workers_env);
+        if (val > 0 && val <= 64)
+            config.local_copy_workers = val;
+        else
+            LOG(WARNING) << "Ignore value from environment variable "
+                            "MC_LOCAL_COPY_WORKERS";
+    }
+
+    const char *tcp_connections_per_peer_env =
+        std::getenv("MC_TCP_CONNECTIONS_PER_PEER");
+    if (tcp_connections_per_peer_env) {
+        int val = atoi(tcp_connections_per_peer_env);
+        if (val > 0 && val <= 256)
+            config.tcp_connections_per_peer = val;
+        else
+            LOG(WARNING) << "Ignore value from environment variable "
+                            "MC_TCP_CONNECTIONS_PER_PEER";
+    }
+
+    const char *tcp_stripe_count_env = std::getenv("MC_TCP_STRIPE_COUNT");
+    if (tcp_stripe_count_env) {
+        int val = atoi(tcp_stripe_count_env);
+        if (val > 0 && val <= 256)
+            config.tcp_stripe_count = val;
+        else
+            LOG(WARNING) << "Ignore value from environment variable "
+                            "MC_TCP_STRIPE_COUNT";
+    }
+
+    const char *tcp_io_threads_env = std::getenv("MC_TCP_IO_THREADS");
+    if (tcp_io_threads_env) {
+        int val = atoi(tcp_io_threads_env);
+        if (val > 0 && val <= 64)
+            config.tcp_io_threads = val;
+        else
+            LOG(WARNING) << "Ignore value from environment variable "
+                            "MC_TCP_IO_THREADS";
+    }
+
+    const char *tcp_io_numa_socket_env = std::getenv("MC_TCP_IO_NUMA_SOCKET");
+    if (tcp_io_numa_socket_env) {
+        int val = atoi(tcp_io_numa_socket_env);
+        if (val >= 0)
+            config.tcp_io_numa_socket = val;
+        else
+            LOG(WARNING) << "Ignore value from environment variable "
+                            "MC_TCP_IO_NUMA_SOCKET";
+    }
+
+    const char *tcp_io_uring_env = std::getenv("MC_TCP_IO_URING");
+    if (tcp_io_uring_env) {
+        config.tcp_use_io_uring = true;
+    }
+
+    const char *rdma_simulator_env = std::getenv("MC_RDMA_SIMULATOR");
+    if (rdma_simulator_env) {
+        config.use_rdma_simulator = true;
+        config.rdma_simulator_options = rdma_simulator_env;
+    }
+
+    const char *binary_metadata_env = std::getenv("MC_BINARY_METADATA");
+    if (binary_metadata_env) {
+        config.use_binary_metadata = true;
+    }
+
+    const char *disable_metadata_watch_env =
+        std::getenv("MC_DISABLE_METADATA_WATCH");
+    if (disable_metadata_watch_env) {
+        config.disable_metadata_watch = true;
+    }
+
+    const char *redis_keyspace_events_env =
+        std::getenv("MC_REDIS_KEYSPACE_EVENTS");
+    if (redis_keyspace_events_env) {
+        config.redis_keyspace_events = true;
+    }
+
+    const char *sample_memory_location_env =
+        std::getenv("MC_SAMPLE_MEMORY_LOCATION");
+    if (sample_memory_location_env) {
+        config.sample_memory_location = true;
+    }
+
     const char *verbose_env = std::getenv("MC_VERBOSE");
     if (verbose_env) {
         config.verbose = true;
@@ -222,7 +327,31 @@ void dumpGlobalConfig() {
     LOG(INFO) << "max_sge = " << config.max_sge;
     LOG(INFO) << "max_wr = " << config.max_wr;
     LOG(INFO) << "max_inline = " << config.max_inline;
+    LOG(INFO) << "signal_interval = " << config.signal_interval;
     LOG(INFO) << "mtu_length = " << mtuLengthToString(config.mtu_length);
+    LOG(INFO) << "slice_size = " << config.slice_size;
+    LOG(INFO) << "max_slice_size = " << config.max_slice_size;
+    LOG(INFO) << "local_copy_workers = " << config.local_copy_workers;
+    LOG(INFO) << "tcp_connections_per_peer = "
+              << config.tcp_connections_per_peer;
+    LOG(INFO) << "tcp_stripe_count = " << config.tcp_stripe_count;
+    LOG(INFO) << "tcp_io_threads = " << config.tcp_io_threads;
+    LOG(INFO) << "tcp_io_numa_socket = " << config.tcp_io_numa_socket;
+    LOG(INFO) << "tcp_use_io_uring = "
+              << (config.tcp_use_io_uring ? "true" : "false");
+    LOG(INFO) << "use_rdma_simulator = "
+              << (config.use_rdma_simulator ? "true" : "false");
+    if (config.use_rdma_simulator)
+        LOG(INFO) << "rdma_simulator_options = "
+                  << config.rdma_simulator_options;
+    LOG(INFO) << "use_binary_metadata = "
+              << (config.use_binary_metadata ? "true" : "false");
+    LOG(INFO) << "disable_metadata_watch = "
+              << (config.disable_metadata_watch ? "true" : "false");
+    LOG(INFO) << "redis_keyspace_events = "
+              << (config.redis_keyspace_events ? "true" : "false");
+    LOG(INFO) << "sample_memory_location = "
+              << (config.sample_memory_location ? "true" : "false");
     LOG(INFO) << "verbose = " << (config.verbose ? "true" : "false");
 }
 
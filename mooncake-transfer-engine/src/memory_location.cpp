@@ -14,9 +14,29 @@
 
 #include "memory_location.h"
 
+#include <linux/magic.h>
+#include <sys/vfs.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
 namespace mooncake {
+// Pages probed by one numa_move_pages call
+static const size_t kProbeChunkPages = 16384;
+static const size_t kMaxProbeThreads = 16;
+// Pages probed before the binary search when sampling
+static const size_t kMaxSamplePages = 4096;
 
-uintptr_t alignPage(uintptr_t address) { return address & ~(pagesize - 1); }
+// First page of a run of pages on the same node, -1 if unknown
+struct PageRun {
+    size_t page;
+    int node;
+};
+
+uintptr_t alignPage(uintptr_t address, size_t page_size) {
+    return address & ~(page_size - 1);
+}
 
 std::string genCpuNodeName(int node) {
     if (node >= 0) return "cpu:" + std::to_string(node);
@@ -25,42 +45,200 @@ std::string genCpuNodeName(int node) {
     return "*";
 }
 
+static size_t getDefaultHugePageSize() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        size_t size_kb;
+        if (sscanf(line.c_str(), "Hugepagesize: %zu kB", &size_kb) == 1)
+            return size_kb << 10;
+    }
+    return 0;
+}
+
+// Page size of a hugetlb mapping, or 0 for other mappings. Transparent huge
+// pages may be split, so they are not treated as huge pages.
+static size_t getHugePageSize(const std::string &path) {
+    if (path.rfind("/anon_hugepage", 0) == 0) return getDefaultHugePageSize();
+    if (path.empty() || path[0] != '/') return 0;
+    struct statfs fs;
+    if (statfs(path.c_str(), &fs) || fs.f_type != HUGETLBFS_MAGIC) return 0;
+    return fs.f_bsize;
+}
+
+// Smallest page size of the mappings holding [start, end)
+static size_t getPageSize(uintptr_t start, uintptr_t end) {
+    const size_t base_page_size = sysconf(_SC_PAGESIZE);
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    size_t page_size = 0;
+    while (std::getline(maps, line)) {
+        uintptr_t vma_start, vma_end;
+        int path_pos = -1;
+        if (sscanf(line.c_str(), "%lx-%lx %*s %*s %*s %*s %n", &vma_start,
+                   &vma_end, &path_pos) < 2)
+            continue;
+        if (vma_end <= start) continue;
+        if (vma_start >= end) break;
+        size_t vma_page_size =
+            path_pos < 0 ? 0 : getHugePageSize(line.substr(path_pos));
+        if (!vma_page_size) return base_page_size;
+        if (!page_size || vma_page_size < page_size) page_size = vma_page_size;
+    }
+    return page_size ? page_size : base_page_size;
+}
+
+// Returns 0 on success, or -errno of numa_move_pages.
+static int queryPageNodes(std::vector<void *> &pages, std::vector<int> &nodes) {
+    nodes.resize(pages.size());
+    if (numa_move_pages(0, pages.size(), pages.data(), nullptr, nodes.data(),
+                        0))
+        return -errno;
+    for (auto &node : nodes)
+        if (node < 0) node = -1;
+    return 0;
+}
+
+static int queryPageNode(uintptr_t base, size_t page_size, size_t page,
+                         int &node) {
+    std::vector<void *> pages{(void *)(base + page * page_size)};
+    std::vector<int> nodes;
+    int rc = queryPageNodes(pages, nodes);
+    if (rc) return rc;
+    node = nodes[0];
+    return 0;
+}
+
+static void appendPageRun(std::vector<PageRun> &run_list, size_t page,
+                          int node) {
+    if (run_list.empty() || run_list.back().node != node)
+        run_list.push_back({page, node});
+}
+
+// Probes every page, in chunks spread over several threads.
+static int probeAllPages(uintptr_t base, size_t page_size, size_t num_pages,
+                         std::vector<PageRun> &run_list) {
+    const size_t num_chunks =
+        (num_pages + kProbeChunkPages - 1) / kProbeChunkPages;
+    std::vector<std::vector<PageRun>> chunk_run_list(num_chunks);
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<int> result(0);
+    auto worker = [&]() {
+        std::vector<void *> pages;
+        std::vector<int> nodes;
+        size_t chunk;
+        while (!result.load(std::memory_order_relaxed) &&
+               (chunk = next_chunk.fetch_add(1)) < num_chunks) {
+            size_t first = chunk * kProbeChunkPages;
+            size_t count = std::min(kProbeChunkPages, num_pages - first);
+            pages.resize(count);
+            for (size_t i = 0; i < count; ++i)
+                pages[i] = (void *)(base + (first + i) * page_size);
+            int rc = queryPageNodes(pages, nodes);
+            if (rc) {
+                result = rc;
+                return;
+            }
+            for (size_t i = 0; i < count; ++i)
+                appendPageRun(chunk_run_list[chunk], first + i, nodes[i]);
+        }
+    };
+
+    size_t num_threads =
+        std::min({num_chunks, kMaxProbeThreads,
+                  (size_t)std::max(1u, std::thread::hardware_concurrency())});
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads) thread.join();
+    if (result) return result;
+
+    for (auto &chunk_runs : chunk_run_list)
+        for (auto &run : chunk_runs)
+            appendPageRun(run_list, run.page, run.node);
+    return 0;
+}
+
+// Probes evenly spaced pages, then binary searches for the node boundaries
+// between adjacent samples on different nodes.
+static int probeSampledPages(uintptr_t base, size_t page_size,
+                             size_t num_pages, std::vector<PageRun> &run_list) {
+    const size_t stride = (num_pages + kMaxSamplePages - 1) / kMaxSamplePages;
+    std::vector<size_t> sample_list;
+    std::vector<void *> pages;
+    for (size_t page = 0; page < num_pages; page += stride)
+        sample_list.push_back(page);
+    if (sample_list.back() != num_pages - 1)
+        sample_list.push_back(num_pages - 1);
+    for (auto page : sample_list)
+        pages.push_back((void *)(base + page * page_size));
+    std::vector<int> nodes;
+    int rc = queryPageNodes(pages, nodes);
+    if (rc) return rc;
+
+    run_list.push_back({0, nodes[0]});
+    for (size_t i = 1; i < sample_list.size(); ++i) {
+        // Pages from lo to the boundary are on the node of the last run, the
+        // first page after the boundary is on another node
+        size_t lo = sample_list[i - 1];
+        while (run_list.back().node != nodes[i]) {
+            lo = std::max(lo, run_list.back().page);
+            size_t hi = sample_list[i];
+            int hi_node = nodes[i];
+            while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                int mid_node = -1;
+                rc = queryPageNode(base, page_size, mid, mid_node);
+                if (rc) return rc;
+                if (mid_node == run_list.back().node) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                    hi_node = mid_node;
+                }
+            }
+            run_list.push_back({hi, hi_node});
+        }
+    }
+    return 0;
+}
+
 const std::vector<MemoryLocationEntry> getMemoryLocation(void *start,
-                                                         size_t len) {
+                                                         size_t len,
+                                                         bool sample) {
     std::vector<MemoryLocationEntry> entries;
+    if (!len) {
+        entries.push_back({(uint64_t)start, len, "*"});
+        return entries;
+    }
 
     // start and end address may not be page aligned.
-    uintptr_t aligned_start = alignPage((uintptr_t)start);
-    int n = (uintptr_t(start) - aligned_start + len + pagesize - 1) / pagesize;
-    void **pages = (void **)malloc(sizeof(void *) * n);
-    int *status = (int *)malloc(sizeof(int) * n);
-
-    for (int i = 0; i < n; i++) {
-        pages[i] = (void *)((char *)aligned_start + i * pagesize);
-    }
+    const size_t page_size =
+        getPageSize((uintptr_t)start, (uintptr_t)start + len);
+    uintptr_t aligned_start = alignPage((uintptr_t)start, page_size);
+    size_t n = ((uintptr_t)start - aligned_start + len + page_size - 1) /
+               page_size;
 
-    int rc = numa_move_pages(0, n, pages, nullptr, status, 0);
-    if (rc != 0) {
-        PLOG(WARNING) << "Failed to get NUMA node, addr: " << start
-                      << ", len: " << len;
+    std::vector<PageRun> run_list;
+    int rc = (sample && n > kMaxSamplePages)
+                 ? probeSampledPages(aligned_start, page_size, n, run_list)
+                 : probeAllPages(aligned_start, page_size, n, run_list);
+    if (rc) {
+        LOG(WARNING) << "Failed to get NUMA node, addr: " << start
+                     << ", len: " << len << ": " << strerror(-rc);
         entries.push_back({(uint64_t)start, len, "*"});
         return entries;
     }
 
-    int node = status[0];
-    uint64_t start_addr = (uint64_t)start;
-    uint64_t new_start_addr;
-    for (int i = 1; i < n; i++) {
-        if (status[i] != node) {
-            new_start_addr = alignPage((uint64_t)start) + i * pagesize;
-            entries.push_back({start_addr, size_t(new_start_addr - start_addr),
-                               genCpuNodeName(node)});
-            start_addr = new_start_addr;
-            node = status[i];
-        }
+    for (size_t i = 0; i < run_list.size(); ++i) {
+        uint64_t run_start =
+            i ? aligned_start + run_list[i].page * page_size : (uint64_t)start;
+        uint64_t run_end = (uint64_t)start + len;
+        if (i + 1 < run_list.size())
+            run_end = aligned_start + run_list[i + 1].page * page_size;
+        entries.push_back({run_start, size_t(run_end - run_start),
+                           genCpuNodeName(run_list[i].node)});
     }
-    entries.push_back(
-        {start_addr, (uint64_t)start + len - start_addr, genCpuNodeName(node)});
     return entries;
 }
 
@@ -14,12 +14,18 @@
 
 #include "multi_transport.h"
 
+#include "config.h"
+#include "transport/local_transport/local_transport.h"
 #include "transport/rdma_transport/rdma_transport.h"
+#include "transport/shm_transport/shm_transport.h"
 #include "transport/tcp_transport/tcp_transport.h"
 #include "transport/transport.h"
 #ifdef USE_NVMEOF
 #include "transport/nvmeof_transport/nvmeof_transport.h"
 #endif
+#ifdef USE_IO_URING
+#include "transport/tcp_transport/uring_tcp_transport.h"
+#endif
 
 namespace mooncake {
 MultiTransport::MultiTransport(std::shared_ptr<TransferMetadata> metadata,
@@ -81,7 +87,8 @@ Status MultiTransport::submitTransfer(
     };
     std::unordered_map<Transport *, SubmitTasks> submit_tasks;
     for (auto &request : entries) {
-        auto transport = selectTransport(request);
+        auto transport = selectTransport(
+            request.target_id, request.target_offset, request.length);
         if (!transport) {
             return Status::InvalidArgument(
                 "SelectTransport failed for SegmentID: " +
@@ -105,6 +112,49 @@ Status MultiTransport::submitTransfer(
     return Status::OK();
 }
 
+Status MultiTransport::submitVectoredTransfer(
+    BatchID batch_id, const std::vector<VectoredTransferRequest> &entries) {
+    auto &batch_desc = *((BatchDesc *)(batch_id));
+    if (batch_desc.task_list.size() + entries.size() > batch_desc.batch_size) {
+        LOG(ERROR) << "MultiTransport: Exceed the limitation of batch capacity";
+        return Status::TooManyRequests(
+            "Exceed the limitation of batch capacity");
+    }
+
+    size_t task_id = batch_desc.task_list.size();
+    batch_desc.task_list.resize(task_id + entries.size());
+    struct SubmitTasks {
+        std::vector<VectoredTransferRequest *> request_list;
+        std::vector<Transport::TransferTask *> task_list;
+    };
+    std::unordered_map<Transport *, SubmitTasks> submit_tasks;
+    for (auto &request : entries) {
+        auto transport = selectTransport(
+            request.target_id, request.target_offset, request.length());
+        if (!transport) {
+            return Status::InvalidArgument(
+                "SelectTransport failed for SegmentID: " +
+                std::to_string(request.target_id));
+        }
+        auto &task = batch_desc.task_list[task_id];
+        ++task_id;
+        submit_tasks[transport].request_list.push_back(
+            (VectoredTransferRequest *)&request);
+        submit_tasks[transport].task_list.push_back(&task);
+    }
+    for (auto &entry : submit_tasks) {
+        auto status = entry.first->submitVectoredTransferTask(
+            entry.second.request_list, entry.second.task_list);
+        if (!status.ok()) {
+            LOG(ERROR) << "MultiTransport: Failed to submit vectored transfer "
+                          "task to "
+                       << entry.first->getName();
+            return status;
+        }
+    }
+    return Status::OK();
+}
+
 Status MultiTransport::getTransferStatus(BatchID batch_id, size_t task_id,
                                       TransferStatus &status) {
     auto &batch_desc = *((BatchDesc *)(batch_id));
@@ -114,9 +164,10 @@ Status MultiTransport::getTransferStatus(BatchID batch_id, size_t task_id,
             "MultiTransport: task id is equal to or larger than task_count");
     }
     auto &task = batch_desc.task_list[task_id];
-    status.transferred_bytes = task.transferred_bytes;
     uint64_t success_slice_count = task.success_slice_count;
     uint64_t failed_slice_count = task.failed_slice_count;
+    // Read after the counters, as markSuccess() adds the bytes first
+    status.transferred_bytes = task.transferred_bytes;
     if (success_slice_count + failed_slice_count == task.slice_count) {
         if (failed_slice_count) {
             status.s = Transport::TransferStatusEnum::FAILED;
@@ -136,7 +187,16 @@ Transport *MultiTransport::installTransport(const std::string &proto,
     if (std::string(proto) == "rdma") {
         transport = new RdmaTransport();
     } else if (std::string(proto) == "tcp") {
-        transport = new TcpTransport();
+#ifdef USE_IO_URING
+        if (globalConfig().tcp_use_io_uring)
+            transport = new UringTcpTransport();
+        else
+#endif
+            transport = new TcpTransport();
+    } else if (std::string(proto) == "local") {
+        transport = new LocalTransport();
+    } else if (std::string(proto) == "shm") {
+        transport = new ShmTransport();
     }
 #ifdef USE_NVMEOF
     else if (std::string(proto) == "nvmeof") {
@@ -158,15 +218,25 @@ Transport *MultiTransport::installTransport(const std::string &proto,
     return transport;
 }
 
-Transport *MultiTransport::selectTransport(const TransferRequest &entry) {
-    if (entry.target_id == LOCAL_SEGMENT_ID && transport_map_.count("local"))
+Transport *MultiTransport::selectTransport(SegmentID target_id,
+                                          uint64_t target_offset,
+                                          size_t length) {
+    if (target_id == LOCAL_SEGMENT_ID && transport_map_.count("local"))
         return transport_map_["local"].get();
-    auto target_segment_desc = metadata_->getSegmentDescByID(entry.target_id);
+    auto target_segment_desc = metadata_->peekSegmentDescByID(target_id);
     if (!target_segment_desc) {
         LOG(ERROR) << "MultiTransport: Incorrect target segment id "
-                   << entry.target_id;
+                   << target_id;
         return nullptr;
     }
+    if (transport_map_.count("shm")) {
+        // Prefer mapping the memory of peers running on the same host
+        auto shm_transport =
+            static_cast<ShmTransport *>(transport_map_["shm"].get());
+        if (shm_transport->reachable(*target_segment_desc, target_offset,
+                                     length))
+            return shm_transport;
+    }
     auto proto = target_segment_desc->protocol;
     if (!transport_map_.count(proto)) {
         LOG(ERROR) << "MultiTransport: Transport " << proto << " not installed";
@@ -0,0 +1,496 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "segment_desc_codec.h"
+
+#include <algorithm>
+
+#include "error.h"
+
+namespace mooncake {
+namespace {
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string encodeBase64(const std::string &data) {
+    std::string result;
+    result.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+        uint32_t word = (uint8_t)data[i] << 16 | (uint8_t)data[i + 1] << 8 |
+                        (uint8_t)data[i + 2];
+        result.push_back(kBase64Chars[word >> 18]);
+        result.push_back(kBase64Chars[(word >> 12) & 63]);
+        result.push_back(kBase64Chars[(word >> 6) & 63]);
+        result.push_back(kBase64Chars[word & 63]);
+    }
+    if (i < data.size()) {
+        uint32_t word = (uint8_t)data[i] << 16;
+        if (i + 1 < data.size()) word |= (uint8_t)data[i + 1] << 8;
+        result.push_back(kBase64Chars[word >> 18]);
+        result.push_back(kBase64Chars[(word >> 12) & 63]);
+        result.push_back(i + 1 < data.size() ? kBase64Chars[(word >> 6) & 63]
+                                             : '=');
+        result.push_back('=');
+    }
+    return result;
+}
+
+bool decodeBase64(const std::string &text, std::string &data) {
+    static const std::vector<int> kDecodeTable = []() {
+        std::vector<int> table(256, -1);
+        for (int i = 0; i < 64; ++i) table[(uint8_t)kBase64Chars[i]] = i;
+        return table;
+    }();
+    if (text.size() % 4) return false;
+    data.clear();
+    data.reserve(text.size() / 4 * 3);
+    for (size_t i = 0; i < text.size(); i += 4) {
+        uint32_t word = 0;
+        int padding = 0;
+        for (size_t j = 0; j < 4; ++j) {
+            char c = text[i + j];
+            if (c == '=' && i + 4 == text.size() && j >= 2) {
+                padding++;
+                word <<= 6;
+                continue;
+            }
+            int value = kDecodeTable[(uint8_t)c];
+            if (value < 0 || padding) return false;
+            word = word << 6 | value;
+        }
+        data.push_back(word >> 16);
+        if (padding < 2) data.push_back((word >> 8) & 255);
+        if (padding < 1) data.push_back(word & 255);
+    }
+    return true;
+}
+
+class BinaryWriter {
+   public:
+    explicit BinaryWriter(std::string &data) : data_(data) {}
+
+    void putFixed(uint64_t value, size_t size) {
+        for (size_t i = 0; i < size; ++i) data_.push_back((value >> (8 * i)));
+    }
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            data_.push_back((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        data_.push_back(value);
+    }
+
+    void putString(const std::string &value) {
+        putVarint(value.size());
+        data_.append(value);
+    }
+
+    void putStringList(const std::vector<std::string> &list) {
+        putVarint(list.size());
+        for (auto &entry : list) putString(entry);
+    }
+
+    void putKeyList(const std::vector<uint32_t> &list) {
+        putVarint(list.size());
+        for (auto key : list) putVarint(key);
+    }
+
+   private:
+    std::string &data_;
+};
+
+// Every getter returns false once the data is exhausted or malformed.
+class BinaryReader {
+   public:
+    explicit BinaryReader(const std::string &data)
+        : pos_((const uint8_t *)data.data()), end_(pos_ + data.size()) {}
+
+    bool getFixed(uint64_t &value, size_t size) {
+        if ((size_t)(end_ - pos_) < size) return false;
+        value = 0;
+        for (size_t i = 0; i < size; ++i)
+            value |= (uint64_t)pos_[i] << (8 * i);
+        pos_ += size;
+        return true;
+    }
+
+    bool getVarint(uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos_ == end_) return false;
+            uint8_t byte = *pos_++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    // Counts are bounded by the bytes left, so that corrupted data cannot
+    // make the decoder reserve huge vectors.
+    bool getCount(uint64_t &count) {
+        return getVarint(count) && count <= (uint64_t)(end_ - pos_);
+    }
+
+    bool getString(std::string &value) {
+        uint64_t size;
+        if (!getCount(size)) return false;
+        value.assign((const char *)pos_, size);
+        pos_ += size;
+        return true;
+    }
+
+    bool getStringList(std::vector<std::string> &list) {
+        uint64_t count;
+        if (!getCount(count)) return false;
+        list.resize(count);
+        for (auto &entry : list)
+            if (!getString(entry)) return false;
+        return true;
+    }
+
+    bool getKeyList(std::vector<uint32_t> &list) {
+        uint64_t count, key;
+        if (!getCount(count)) return false;
+        list.resize(count);
+        for (auto &entry : list) {
+            if (!getVarint(key) || key > UINT32_MAX) return false;
+            entry = key;
+        }
+        return true;
+    }
+
+    bool done() const { return pos_ == end_; }
+
+   private:
+    const uint8_t *pos_;
+    const uint8_t *end_;
+};
+}  // namespace
+
+int SegmentDescCodec::encodeJson(const SegmentDesc &desc, Json::Value &value) {
+    Json::Value segmentJSON;
+    segmentJSON["name"] = desc.name;
+    segmentJSON["protocol"] = desc.protocol;
+
+    if (segmentJSON["protocol"] == "rdma") {
+        Json::Value devicesJSON(Json::arrayValue);
+        for (const auto &device : desc.devices) {
+            Json::Value deviceJSON;
+            deviceJSON["name"] = device.name;
+            deviceJSON["lid"] = device.lid;
+            deviceJSON["gid"] = device.gid;
+            devicesJSON.append(deviceJSON);
+        }
+        segmentJSON["devices"] = devicesJSON;
+
+        Json::Value buffersJSON(Json::arrayValue);
+        for (const auto &buffer : desc.buffers) {
+            Json::Value bufferJSON;
+            bufferJSON["name"] = buffer.name;
+            bufferJSON["addr"] = static_cast<Json::UInt64>(buffer.addr);
+            bufferJSON["length"] = static_cast<Json::UInt64>(buffer.length);
+            Json::Value rkeyJSON(Json::arrayValue);
+            for (auto &entry : buffer.rkey) rkeyJSON.append(entry);
+            bufferJSON["rkey"] = rkeyJSON;
+            Json::Value lkeyJSON(Json::arrayValue);
+            for (auto &entry : buffer.lkey) lkeyJSON.append(entry);
+            bufferJSON["lkey"] = lkeyJSON;
+            buffersJSON.append(bufferJSON);
+        }
+        segmentJSON["buffers"] = buffersJSON;
+        segmentJSON["priority_matrix"] = desc.topology.toJson();
+    } else if (segmentJSON["protocol"] == "tcp") {
+        Json::Value buffersJSON(Json::arrayValue);
+        for (const auto &buffer : desc.buffers) {
+            Json::Value bufferJSON;
+            bufferJSON["name"] = buffer.name;
+            bufferJSON["addr"] = static_cast<Json::UInt64>(buffer.addr);
+            bufferJSON["length"] = static_cast<Json::UInt64>(buffer.length);
+            buffersJSON.append(bufferJSON);
+        }
+        segmentJSON["buffers"] = buffersJSON;
+        if (desc.tcp_data_port)
+            segmentJSON["tcp_data_port"] = desc.tcp_data_port;
+    } else {
+        LOG(ERROR) << "Unsupported segment descriptor for register, name "
+                   << desc.name << " protocol " << desc.protocol;
+        return ERR_METADATA;
+    }
+
+    if (!desc.shm_buffers.empty()) {
+        segmentJSON["host_id"] = desc.host_id;
+        Json::Value shmBuffersJSON(Json::arrayValue);
+        for (const auto &buffer : desc.shm_buffers) {
+            Json::Value bufferJSON;
+            bufferJSON["addr"] = static_cast<Json::UInt64>(buffer.addr);
+            bufferJSON["length"] = static_cast<Json::UInt64>(buffer.length);
+            bufferJSON["path"] = buffer.path;
+            bufferJSON["offset"] = static_cast<Json::UInt64>(buffer.offset);
+            bufferJSON["dev"] = static_cast<Json::UInt64>(buffer.dev);
+            bufferJSON["ino"] = static_cast<Json::UInt64>(buffer.ino);
+            shmBuffersJSON.append(bufferJSON);
+        }
+        segmentJSON["shm_buffers"] = shmBuffersJSON;
+    }
+
+    value = std::move(segmentJSON);
+    return 0;
+}
+
+int SegmentDescCodec::decodeJson(const Json::Value &segmentJSON,
+                                 SegmentDesc &desc) {
+    desc.name = segmentJSON["name"].asString();
+    desc.protocol = segmentJSON["protocol"].asString();
+
+    if (desc.protocol == "rdma") {
+        for (const auto &deviceJSON : segmentJSON["devices"]) {
+            TransferMetadata::DeviceDesc device;
+            device.name = deviceJSON["name"].asString();
+            device.lid = deviceJSON["lid"].asUInt();
+            device.gid = deviceJSON["gid"].asString();
+            if (device.name.empty() || device.gid.empty()) return ERR_METADATA;
+            desc.devices.push_back(device);
+        }
+
+        for (const auto &bufferJSON : segmentJSON["buffers"]) {
+            TransferMetadata::BufferDesc buffer;
+            buffer.name = bufferJSON["name"].asString();
+            buffer.addr = bufferJSON["addr"].asUInt64();
+            buffer.length = bufferJSON["length"].asUInt64();
+            for (const auto &rkeyJSON : bufferJSON["rkey"])
+                buffer.rkey.push_back(rkeyJSON.asUInt());
+            for (const auto &lkeyJSON : bufferJSON["lkey"])
+                buffer.lkey.push_back(lkeyJSON.asUInt());
+            if (buffer.name.empty() || !buffer.addr || !buffer.length ||
+                buffer.rkey.empty() ||
+                buffer.rkey.size() != buffer.lkey.size())
+                return ERR_METADATA;
+            desc.buffers.push_back(buffer);
+        }
+
+        int ret = desc.topology.parse(
+            segmentJSON["priority_matrix"].toStyledString());
+        if (ret) {
+            LOG(WARNING) << "Corrupted segment descriptor, name " << desc.name
+                         << " protocol " << desc.protocol;
+        }
+    } else if (desc.protocol == "tcp") {
+        for (const auto &bufferJSON : segmentJSON["buffers"]) {
+            TransferMetadata::BufferDesc buffer;
+            buffer.name = bufferJSON["name"].asString();
+            buffer.addr = bufferJSON["addr"].asUInt64();
+            buffer.length = bufferJSON["length"].asUInt64();
+            if (buffer.name.empty() || !buffer.addr || !buffer.length)
+                return ERR_METADATA;
+            desc.buffers.push_back(buffer);
+        }
+        desc.tcp_data_port = segmentJSON["tcp_data_port"].asUInt();
+    } else if (desc.protocol == "nvmeof") {
+        for (const auto &bufferJSON : segmentJSON["buffers"]) {
+            TransferMetadata::NVMeoFBufferDesc buffer;
+            buffer.file_path = bufferJSON["file_path"].asString();
+            buffer.length = bufferJSON["length"].asUInt64();
+            const Json::Value &local_path_map = bufferJSON["local_path_map"];
+            for (const auto &key : local_path_map.getMemberNames()) {
+                buffer.local_path_map[key] = local_path_map[key].asString();
+            }
+            desc.nvmeof_buffers.push_back(buffer);
+        }
+    } else {
+        LOG(ERROR) << "Unsupported segment descriptor, name " << desc.name
+                   << " protocol " << desc.protocol;
+        return ERR_METADATA;
+    }
+
+    desc.host_id = segmentJSON["host_id"].asString();
+    for (const auto &bufferJSON : segmentJSON["shm_buffers"]) {
+        TransferMetadata::ShmBufferDesc buffer;
+        buffer.addr = bufferJSON["addr"].asUInt64();
+        buffer.length = bufferJSON["length"].asUInt64();
+        buffer.path = bufferJSON["path"].asString();
+        buffer.offset = bufferJSON["offset"].asUInt64();
+        buffer.dev = bufferJSON["dev"].asUInt64();
+        buffer.ino = bufferJSON["ino"].asUInt64();
+        if (!buffer.addr || !buffer.length || buffer.path.empty())
+            return ERR_METADATA;
+        desc.shm_buffers.push_back(buffer);
+    }
+
+    desc.indexBuffers();
+    return 0;
+}
+
+int SegmentDescCodec::encodeBinary(const SegmentDesc &desc,
+                                   std::string &data) {
+    if (desc.protocol != "rdma" && desc.protocol != "tcp") {
+        LOG(ERROR) << "Unsupported segment descriptor for register, name "
+                   << desc.name << " protocol " << desc.protocol;
+        return ERR_METADATA;
+    }
+    const bool is_rdma = desc.protocol == "rdma";
+
+    data.clear();
+    BinaryWriter writer(data);
+    writer.putFixed(kBinaryVersion, 1);
+    writer.putString(desc.name);
+    writer.putString(desc.protocol);
+    writer.putFixed(is_rdma ? 0 : desc.tcp_data_port, 2);
+
+    writer.putVarint(is_rdma ? desc.devices.size() : 0);
+    if (is_rdma) {
+        for (auto &device : desc.devices) {
+            writer.putString(device.name);
+            writer.putFixed(device.lid, 2);
+            writer.putString(device.gid);
+        }
+    }
+
+    // In name order, like the keys of the JSON priority matrix, so that
+    // devices get the same ids whichever encoding is used
+    std::vector<const TopologyEntry *> entry_list;
+    auto matrix = desc.topology.getMatrix();
+    if (is_rdma)
+        for (auto &entry : matrix) entry_list.push_back(&entry.second);
+    std::sort(entry_list.begin(), entry_list.end(),
+              [](const TopologyEntry *lhs, const TopologyEntry *rhs) {
+                  return lhs->name < rhs->name;
+              });
+    writer.putVarint(entry_list.size());
+    for (auto entry : entry_list) {
+        writer.putString(entry->name);
+        writer.putStringList(entry->preferred_hca);
+        writer.putStringList(entry->avail_hca);
+    }
+
+    writer.putVarint(desc.buffers.size());
+    static const std::vector<uint32_t> kNoKeys;
+    for (auto &buffer : desc.buffers) {
+        writer.putString(buffer.name);
+        writer.putFixed(buffer.addr, 8);
+        writer.putFixed(buffer.length, 8);
+        writer.putKeyList(is_rdma ? buffer.rkey : kNoKeys);
+        writer.putKeyList(is_rdma ? buffer.lkey : kNoKeys);
+    }
+
+    writer.putString(desc.shm_buffers.empty() ? "" : desc.host_id);
+    writer.putVarint(desc.shm_buffers.size());
+    for (auto &buffer : desc.shm_buffers) {
+        writer.putFixed(buffer.addr, 8);
+        writer.putFixed(buffer.length, 8);
+        writer.putString(buffer.path);
+        writer.putFixed(buffer.offset, 8);
+        writer.putFixed(buffer.dev, 8);
+        writer.putFixed(buffer.ino, 8);
+    }
+    return 0;
+}
+
+int SegmentDescCodec::decodeBinary(const std::string &data,
+                                   SegmentDesc &desc) {
+    BinaryReader reader(data);
+    uint64_t version, count, value;
+    if (!reader.getFixed(version, 1) || version != kBinaryVersion)
+        return ERR_METADATA;
+    if (!reader.getString(desc.name) || !reader.getString(desc.protocol))
+        return ERR_METADATA;
+    if (desc.protocol != "rdma" && desc.protocol != "tcp") {
+        LOG(ERROR) << "Unsupported segment descriptor, name " << desc.name
+                   << " protocol " << desc.protocol;
+        return ERR_METADATA;
+    }
+    const bool is_rdma = desc.protocol == "rdma";
+    if (!reader.getFixed(value, 2)) return ERR_METADATA;
+    if (!is_rdma) desc.tcp_data_port = value;
+
+    if (!reader.getCount(count)) return ERR_METADATA;
+    desc.devices.resize(count);
+    for (auto &device : desc.devices) {
+        if (!reader.getString(device.name) || !reader.getFixed(value, 2) ||
+            !reader.getString(device.gid))
+            return ERR_METADATA;
+        device.lid = value;
+        if (device.name.empty() || device.gid.empty()) return ERR_METADATA;
+    }
+
+    if (!reader.getCount(count)) return ERR_METADATA;
+    std::vector<TopologyEntry> entry_list(count);
+    for (auto &entry : entry_list) {
+        if (!reader.getString(entry.name) ||
+            !reader.getStringList(entry.preferred_hca) ||
+            !reader.getStringList(entry.avail_hca))
+            return ERR_METADATA;
+    }
+    if (is_rdma) desc.topology.load(entry_list);
+
+    if (!reader.getCount(count)) return ERR_METADATA;
+    desc.buffers.resize(count);
+    for (auto &buffer : desc.buffers) {
+        if (!reader.getString(buffer.name) ||
+            !reader.getFixed(buffer.addr, 8) ||
+            !reader.getFixed(buffer.length, 8) ||
+            !reader.getKeyList(buffer.rkey) || !reader.getKeyList(buffer.lkey))
+            return ERR_METADATA;
+        if (buffer.name.empty() || !buffer.addr || !buffer.length)
+            return ERR_METADATA;
+        if (is_rdma && (buffer.rkey.empty() ||
+                        buffer.rkey.size() != buffer.lkey.size()))
+            return ERR_METADATA;
+    }
+
+    if (!reader.getString(desc.host_id) || !reader.getCount(count))
+        return ERR_METADATA;
+    desc.shm_buffers.resize(count);
+    for (auto &buffer : desc.shm_buffers) {
+        if (!reader.getFixed(buffer.addr, 8) ||
+            !reader.getFixed(buffer.length, 8) ||
+            !reader.getString(buffer.path) ||
+            !reader.getFixed(buffer.offset, 8) ||
+            !reader.getFixed(buffer.dev, 8) || !reader.getFixed(buffer.ino, 8))
+            return ERR_METADATA;
+        if (!buffer.addr || !buffer.length || buffer.path.empty())
+            return ERR_METADATA;
+    }
+    if (!reader.done()) return ERR_METADATA;
+
+    desc.indexBuffers();
+    return 0;
+}
+
+int SegmentDescCodec::encode(const SegmentDesc &desc, bool use_binary,
+                             Json::Value &value) {
+    if (!use_binary) return encodeJson(desc, value);
+    std::string data;
+    int ret = encodeBinary(desc, data);
+    if (ret) return ret;
+    value = Json::Value(Json::objectValue);
+    value["format"] = "binary";
+    value["data"] = encodeBase64(data);
+    return 0;
+}
+
+int SegmentDescCodec::decode(const Json::Value &value, SegmentDesc &desc) {
+    if (!value.isObject()) return ERR_METADATA;
+    if (!value.isMember("format")) return decodeJson(value, desc);
+    if (value["format"].asString() != "binary") {
+        LOG(ERROR) << "Unsupported segment descriptor format "
+                   << value["format"].asString();
+        return ERR_METADATA;
+    }
+    std::string data;
+    if (!decodeBase64(value["data"].asString(), data)) return ERR_METADATA;
+    return decodeBinary(data, desc);
+}
+}  // namespace mooncake
@@ -36,6 +36,8 @@
 #include <sys/types.h>
 
 #include "topology.h"
+#include "transport/rdma_transport/verbs_provider.h"
+#include "transport/rdma_transport/verbs_simulator.h"
 
 namespace mooncake {
 struct InfinibandDevice {
@@ -48,14 +50,22 @@ static std::vector<InfinibandDevice> listInfiniBandDevices() {
     int num_devices = 0;
     std::vector<InfinibandDevice> devices;
 
-    struct ibv_device **device_list = ibv_get_device_list(&num_devices);
+    // Through verbs(), so that the devices of MC_RDMA_SIMULATOR are found
+    struct ibv_device **device_list = verbs().getDeviceList(&num_devices);
     if (!device_list || num_devices <= 0) {
         LOG(WARNING) << "No IB devices found";
+        if (device_list) verbs().freeDeviceList(device_list);
         return {};
     }
 
     for (int i = 0; i < num_devices; ++i) {
-        std::string device_name = ibv_get_device_name(device_list[i]);
+        std::string device_name = verbs().getDeviceName(device_list[i]);
+        if (VerbsSimulator::isSimulatedDevice(device_name)) {
+            devices.push_back(InfinibandDevice{.name = std::move(device_name),
+                                               .pci_bus_id = "",
+                                               .numa_node = -1});
+            continue;
+        }
 
         char path[PATH_MAX + 32];
         char resolved_path[PATH_MAX];
@@ -78,6 +88,7 @@ static std::vector<InfinibandDevice> listInfiniBandDevices() {
                                            .pci_bus_id = std::move(pci_bus_id),
                                            .numa_node = numa_node});
     }
+    verbs().freeDeviceList(device_list);
     return devices;
 }
 
@@ -245,6 +256,12 @@ int Topology::parse(const std::string &topology_json) {
     return resolve();
 }
 
+int Topology::load(const std::vector<TopologyEntry> &entry_list) {
+    matrix_.clear();
+    for (auto &entry : entry_list) matrix_[entry.name] = entry;
+    return resolve();
+}
+
 std::string Topology::toString() const {
     Json::Value value(Json::objectValue);
     for (auto &entry : matrix_) {
@@ -260,16 +277,24 @@ Json::Value Topology::toJson() const {
     return root;
 }
 
-int Topology::selectDevice(const std::string storage_type, int retry_count) {
+int Topology::selectDevice(const std::string storage_type, int retry_count,
+                           const DeviceLoadFunc &device_load) {
     if (resolved_matrix_.count(storage_type) == 0) return ERR_DEVICE_NOT_FOUND;
 
     auto &entry = resolved_matrix_[storage_type];
     if (retry_count == 0) {
-        int rand_value = SimpleRandom::Get().next();
-        if (!entry.preferred_hca.empty())
-            return entry.preferred_hca[rand_value % entry.preferred_hca.size()];
-        else
-            return entry.avail_hca[rand_value % entry.avail_hca.size()];
+        auto &hca_list =
+            entry.preferred_hca.empty() ? entry.avail_hca : entry.preferred_hca;
+        if (hca_list.empty()) return ERR_DEVICE_NOT_FOUND;
+        size_t index = SimpleRandom::Get().next(hca_list.size());
+        if (!device_load || hca_list.size() < 2) return hca_list[index];
+        // Power of two choices
+        size_t other_index =
+            (index + 1 + SimpleRandom::Get().next(hca_list.size() - 1)) %
+            hca_list.size();
+        if (device_load(hca_list[other_index]) < device_load(hca_list[index]))
+            return hca_list[other_index];
+        return hca_list[index];
     } else {
         size_t index = (retry_count - 1) %
                        (entry.preferred_hca.size() + entry.avail_hca.size());
@@ -283,6 +308,14 @@ int Topology::selectDevice(const std::string storage_type, int retry_count) {
     return 0;
 }
 
+int Topology::getDeviceCount(const std::string &storage_type) const {
+    auto iter = resolved_matrix_.find(storage_type);
+    if (iter == resolved_matrix_.end()) return 0;
+    if (!iter->second.preferred_hca.empty())
+        return iter->second.preferred_hca.size();
+    return iter->second.avail_hca.size();
+}
+
 int Topology::resolve() {
     std::map<std::string, int> hca_id_map;
     int next_hca_map_index = 0;
@@ -33,6 +33,18 @@ int TransferEngine::init(const std::string &metadata_conn_string,
     int ret = metadata_->addRpcMetaEntry(local_server_name_, desc);
     if (ret) return ret;
 
+    if (metadata_->isPeerToPeer()) {
+        // Peers find the handshake daemon by the server name
+        if (parseHostNameWithPort(local_server_name).second != rpc_port) {
+            LOG(ERROR) << "Server name " << local_server_name
+                       << " must end with the rpc port " << rpc_port
+                       << " in peer-to-peer metadata mode";
+            return ERR_INVALID_ARGUMENT;
+        }
+        ret = metadata_->startHandshakeDaemon(nullptr, rpc_port);
+        if (ret) return ret;
+    }
+
     if (auto_discover_) {
         // discover topology automatically
         local_topology_->discover();
@@ -43,6 +55,10 @@ int TransferEngine::init(const std::string &metadata_conn_string,
         } else {
             multi_transports_->installTransport("tcp", nullptr);
         }
+        // transfers targeting the local segment are served by memcpy
+        multi_transports_->installTransport("local", nullptr);
+        // same-host peers with shared memory segments are served by mmap
+        multi_transports_->installTransport("shm", nullptr);
         // TODO: install other transports automatically
     }
 
@@ -16,18 +16,24 @@
 
 #include <jsoncpp/json/value.h>
 
+#include <algorithm>
 #include <cassert>
 #include <set>
+#include <unordered_set>
 
 #include "common.h"
 #include "config.h"
 #include "error.h"
+#include "segment_desc_codec.h"
 #include "transfer_metadata_plugin.h"
 
 namespace mooncake {
 
 const static std::string kCommonKeyPrefix = "mooncake/";
 const static std::string kRpcMetaPrefix = kCommonKeyPrefix + "rpc_meta/";
+const static std::string kPeerToPeerPrefix = "p2p://";
+// Handshake daemon requests that are not endpoint handshakes carry a type
+const static std::string kGetMetadataRequest = "get_metadata";
 
 // mooncake/segments/[...]
 static inline std::string getFullMetadataKey(const std::string &segment_name) {
@@ -38,6 +44,10 @@ static inline std::string getFullMetadataKey(const std::string &segment_name) {
         return kCommonKeyPrefix + segment_name;
 }
 
+// Versions of segment tables, shared by all TransferMetadata instances so
+// that threads can tell their tables apart. 0 is never used.
+static std::atomic<uint64_t> next_segment_table_version(1);
+
 struct TransferHandshakeUtil {
     static Json::Value encode(const TransferMetadata::HandShakeDesc &desc) {
         Json::Value root;
@@ -47,6 +57,10 @@ struct TransferHandshakeUtil {
         for (const auto &qp : desc.qp_num) qpNums.append(qp);
         root["qp_num"] = qpNums;
         root["reply_msg"] = desc.reply_msg;
+        if (!desc.local_gid.empty()) {
+            root["local_gid"] = desc.local_gid;
+            root["local_lid"] = desc.local_lid;
+        }
         return root;
     }
 
@@ -57,6 +71,8 @@ struct TransferHandshakeUtil {
         for (const auto &qp : root["qp_num"])
             desc.qp_num.push_back(qp.asUInt());
         desc.reply_msg = root["reply_msg"].asString();
+        desc.local_gid = root["local_gid"].asString();
+        desc.local_lid = (uint16_t)root["local_lid"].asUInt();
         if (globalConfig().verbose) {
             LOG(INFO) << "TransferHandshakeUtil::decode: local_nic_path "
                       << desc.local_nic_path << " peer_nic_path "
@@ -67,7 +83,9 @@ struct TransferHandshakeUtil {
     }
 };
 
-TransferMetadata::TransferMetadata(const std::string &conn_string) {
+TransferMetadata::TransferMetadata(const std::string &conn_string)
+    : p2p_mode_(conn_string.compare(0, kPeerToPeerPrefix.size(),
+                                    kPeerToPeerPrefix) == 0) {
     handshake_plugin_ = HandShakePlugin::Create(conn_string);
     storage_plugin_ = MetadataStoragePlugin::Create(conn_string);
     if (!handshake_plugin_ || !storage_plugin_) {
@@ -75,58 +93,26 @@ TransferMetadata::TransferMetadata(const std::string &conn_string) {
                    << conn_string;
     }
     next_segment_id_.store(1);
+    segment_table_ = std::make_shared<SegmentTable>();
+    segment_table_version_.store(next_segment_table_version.fetch_add(1));
+    if (storage_plugin_ && !globalConfig().disable_metadata_watch)
+        watching_ = storage_plugin_->watch(
+            kCommonKeyPrefix,
+            [this](const std::string &key) { onSegmentChanged(key); });
 }
 
-TransferMetadata::~TransferMetadata() { handshake_plugin_.reset(); }
+TransferMetadata::~TransferMetadata() {
+    handshake_plugin_.reset();
+    // Stops watching before the segment cache goes away
+    storage_plugin_.reset();
+}
 
 int TransferMetadata::updateSegmentDesc(const std::string &segment_name,
                                         const SegmentDesc &desc) {
     Json::Value segmentJSON;
-    segmentJSON["name"] = desc.name;
-    segmentJSON["protocol"] = desc.protocol;
-
-    if (segmentJSON["protocol"] == "rdma") {
-        Json::Value devicesJSON(Json::arrayValue);
-        for (const auto &device : desc.devices) {
-            Json::Value deviceJSON;
-            deviceJSON["name"] = device.name;
-            deviceJSON["lid"] = device.lid;
-            deviceJSON["gid"] = device.gid;
-            devicesJSON.append(deviceJSON);
-        }
-        segmentJSON["devices"] = devicesJSON;
-
-        Json::Value buffersJSON(Json::arrayValue);
-        for (const auto &buffer : desc.buffers) {
-            Json::Value bufferJSON;
-            bufferJSON["name"] = buffer.name;
-            bufferJSON["addr"] = static_cast<Json::UInt64>(buffer.addr);
-            bufferJSON["length"] = static_cast<Json::UInt64>(buffer.length);
-            Json::Value rkeyJSON(Json::arrayValue);
-            for (auto &entry : buffer.rkey) rkeyJSON.append(entry);
-            bufferJSON["rkey"] = rkeyJSON;
-            Json::Value lkeyJSON(Json::arrayValue);
-            for (auto &entry : buffer.lkey) lkeyJSON.append(entry);
-            bufferJSON["lkey"] = lkeyJSON;
-            buffersJSON.append(bufferJSON);
-        }
-        segmentJSON["buffers"] = buffersJSON;
-        segmentJSON["priority_matrix"] = desc.topology.toJson();
-    } else if (segmentJSON["protocol"] == "tcp") {
-        Json::Value buffersJSON(Json::arrayValue);
-        for (const auto &buffer : desc.buffers) {
-            Json::Value bufferJSON;
-            bufferJSON["name"] = buffer.name;
-            bufferJSON["addr"] = static_cast<Json::UInt64>(buffer.addr);
-            bufferJSON["length"] = static_cast<Json::UInt64>(buffer.length);
-            buffersJSON.append(bufferJSON);
-        }
-        segmentJSON["buffers"] = buffersJSON;
-    } else {
-        LOG(ERROR) << "Unsupported segment descriptor for register, name "
-                   << desc.name << " protocol " << desc.protocol;
-        return ERR_METADATA;
-    }
+    int ret = SegmentDescCodec::encode(
+        desc, globalConfig().use_binary_metadata, segmentJSON);
+    if (ret) return ret;
 
     if (!storage_plugin_->set(getFullMetadataKey(segment_name), segmentJSON)) {
         LOG(ERROR) << "Failed to register segment descriptor, name "
@@ -134,6 +120,8 @@ int TransferMetadata::updateSegmentDesc(const std::string &segment_name,
         return ERR_METADATA;
     }
 
+    std::lock_guard<std::mutex> lock(fetch_mutex_);
+    missing_segment_map_.erase(segment_name);
     return 0;
 }
 
@@ -146,219 +134,459 @@ int TransferMetadata::removeSegmentDesc(const std::string &segment_name) {
     return 0;
 }
 
+void TransferMetadata::SegmentDesc::indexBuffers() {
+    BufferIndex::RangeList range_list;
+    for (auto &buffer : buffers)
+        range_list.emplace_back(buffer.addr, buffer.length);
+    buffer_index.build(range_list);
+
+    range_list.clear();
+    uint64_t offset = 0;
+    for (auto &buffer : nvmeof_buffers) {
+        range_list.emplace_back(offset, buffer.length);
+        offset += buffer.length;
+    }
+    nvmeof_buffer_index.build(range_list);
+
+    range_list.clear();
+    for (auto &buffer : shm_buffers)
+        range_list.emplace_back(buffer.addr, buffer.length);
+    shm_buffer_index.build(range_list);
+}
+
 std::shared_ptr<TransferMetadata::SegmentDesc> TransferMetadata::getSegmentDesc(
     const std::string &segment_name) {
     Json::Value segmentJSON;
-    if (!storage_plugin_->get(getFullMetadataKey(segment_name), segmentJSON)) {
+    auto key = getFullMetadataKey(segment_name);
+    if (!storage_plugin_->get(key, segmentJSON) &&
+        (!p2p_mode_ || queryPeerMetadata(segment_name, key, segmentJSON))) {
         LOG(WARNING) << "Failed to retrieve segment descriptor, name "
                      << segment_name;
         return nullptr;
     }
 
     auto desc = std::make_shared<SegmentDesc>();
-    desc->name = segmentJSON["name"].asString();
-    desc->protocol = segmentJSON["protocol"].asString();
-
-    if (desc->protocol == "rdma") {
-        for (const auto &deviceJSON : segmentJSON["devices"]) {
-            DeviceDesc device;
-            device.name = deviceJSON["name"].asString();
-            device.lid = deviceJSON["lid"].asUInt();
-            device.gid = deviceJSON["gid"].asString();
-            if (device.name.empty() || device.gid.empty()) {
-                LOG(WARNING) << "Corrupted segment descriptor, name "
-                             << segment_name << " protocol " << desc->protocol;
-                return nullptr;
-            }
-            desc->devices.push_back(device);
-        }
+    if (SegmentDescCodec::decode(segmentJSON, *desc)) {
+        LOG(WARNING) << "Corrupted segment descriptor, name " << segment_name
+                     << " protocol " << desc->protocol;
+        return nullptr;
+    }
+    return desc;
+}
 
-        for (const auto &bufferJSON : segmentJSON["buffers"]) {
-            BufferDesc buffer;
-            buffer.name = bufferJSON["name"].asString();
-            buffer.addr = bufferJSON["addr"].asUInt64();
-            buffer.length = bufferJSON["length"].asUInt64();
-            for (const auto &rkeyJSON : bufferJSON["rkey"])
-                buffer.rkey.push_back(rkeyJSON.asUInt());
-            for (const auto &lkeyJSON : bufferJSON["lkey"])
-                buffer.lkey.push_back(lkeyJSON.asUInt());
-            if (buffer.name.empty() || !buffer.addr || !buffer.length ||
-                buffer.rkey.empty() ||
-                buffer.rkey.size() != buffer.lkey.size()) {
-                LOG(WARNING) << "Corrupted segment descriptor, name "
-                             << segment_name << " protocol " << desc->protocol;
-                return nullptr;
-            }
-            desc->buffers.push_back(buffer);
-        }
+std::shared_ptr<TransferMetadata::SegmentDesc>
+TransferMetadata::fetchSegmentDesc(const std::string &segment_name) {
+    // Segments not found are cached briefly, so that transfers to a peer
+    // that is gone do not send a request each.
+    const int64_t kMissingSegmentTimeout = 1000000000ll;  // 1s
+    std::unique_lock<std::mutex> lock(fetch_mutex_);
+    auto missing_iter = missing_segment_map_.find(segment_name);
+    if (missing_iter != missing_segment_map_.end()) {
+        if (getCurrentTimeInNano() < missing_iter->second) return nullptr;
+        missing_segment_map_.erase(missing_iter);
+    }
+    auto iter = fetch_map_.find(segment_name);
+    if (iter != fetch_map_.end()) {
+        // Wait for the fetch in flight
+        auto future = iter->second;
+        lock.unlock();
+        return future.get();
+    }
 
-        int ret = desc->topology.parse(
-            segmentJSON["priority_matrix"].toStyledString());
-        if (ret) {
-            LOG(WARNING) << "Corrupted segment descriptor, name "
-                         << segment_name << " protocol " << desc->protocol;
-        }
-    } else if (desc->protocol == "tcp") {
-        for (const auto &bufferJSON : segmentJSON["buffers"]) {
-            BufferDesc buffer;
-            buffer.name = bufferJSON["name"].asString();
-            buffer.addr = bufferJSON["addr"].asUInt64();
-            buffer.length = bufferJSON["length"].asUInt64();
-            if (buffer.name.empty() || !buffer.addr || !buffer.length) {
-                LOG(WARNING) << "Corrupted segment descriptor, name "
-                             << segment_name << " protocol " << desc->protocol;
-                return nullptr;
+    // Ends the fetch on every path, so that waiters never hang
+    struct FetchGuard {
+        TransferMetadata *metadata;
+        const std::string &segment_name;
+        std::promise<std::shared_ptr<SegmentDesc>> promise;
+        std::shared_ptr<SegmentDesc> segment_desc;
+        std::exception_ptr error;
+
+        ~FetchGuard() {
+            {
+                std::lock_guard<std::mutex> lock(metadata->fetch_mutex_);
+                metadata->fetch_map_.erase(segment_name);
+                if (!segment_desc && !error)
+                    metadata->missing_segment_map_[segment_name] =
+                        getCurrentTimeInNano() + kMissingSegmentTimeout;
             }
-            desc->buffers.push_back(buffer);
+            if (error)
+                promise.set_exception(error);
+            else
+                promise.set_value(segment_desc);
         }
-    } else if (desc->protocol == "nvmeof") {
-        for (const auto &bufferJSON : segmentJSON["buffers"]) {
-            NVMeoFBufferDesc buffer;
-            buffer.file_path = bufferJSON["file_path"].asString();
-            buffer.length = bufferJSON["length"].asUInt64();
-            const Json::Value &local_path_map = bufferJSON["local_path_map"];
-            for (const auto &key : local_path_map.getMemberNames()) {
-                buffer.local_path_map[key] = local_path_map[key].asString();
+    } guard{this, segment_name, {}, nullptr, nullptr};
+    fetch_map_[segment_name] = guard.promise.get_future().share();
+    lock.unlock();
+
+    try {
+        guard.segment_desc = getSegmentDesc(segment_name);
+    } catch (...) {
+        guard.error = std::current_exception();
+        throw;
+    }
+    return guard.segment_desc;
+}
+
+const TransferMetadata::SegmentTable &TransferMetadata::segmentTable() {
+    // The last table read by this thread, which keeps it alive. Versions
+    // are unique across TransferMetadata instances.
+    struct CachedTable {
+        uint64_t version = 0;
+        std::shared_ptr<const SegmentTable> table;
+    };
+    thread_local CachedTable cached_table;
+    uint64_t version = segment_table_version_.load(std::memory_order_acquire);
+    if (cached_table.version != version) {
+        // The table may be newer than version, which only costs another
+        // reload on the next call
+        cached_table.table = std::atomic_load(&segment_table_);
+        cached_table.version = version;
+    }
+    return *cached_table.table;
+}
+
+void TransferMetadata::updateSegmentTable(
+    const std::function<void(SegmentTable &)> &update) {
+    std::vector<std::string> changed_list;
+    {
+        std::lock_guard<std::mutex> lock(segment_mutex_);
+        auto segment_table = std::make_shared<SegmentTable>(*segment_table_);
+        update(*segment_table);
+        if (has_listener_.load(std::memory_order_relaxed)) {
+            for (auto &entry : segment_table_->id_to_desc) {
+                if (entry.first == LOCAL_SEGMENT_ID) continue;
+                auto iter = segment_table->id_to_desc.find(entry.first);
+                if (iter == segment_table->id_to_desc.end() ||
+                    iter->second != entry.second)
+                    changed_list.push_back(entry.second->name);
             }
-            desc->nvmeof_buffers.push_back(buffer);
         }
-    } else {
-        LOG(ERROR) << "Unsupported segment descriptor, name " << segment_name
-                   << " protocol " << desc->protocol;
-        return nullptr;
+        std::atomic_store(&segment_table_,
+                          std::shared_ptr<const SegmentTable>(
+                              std::move(segment_table)));
+        segment_table_version_.store(next_segment_table_version.fetch_add(1),
+                                     std::memory_order_release);
     }
+    if (!changed_list.empty()) notifySegmentListeners(changed_list);
+}
 
-    return desc;
+int TransferMetadata::addSegmentListener(OnSegmentChanged on_change) {
+    std::lock_guard<std::mutex> lock(listener_mutex_);
+    int listener_id = next_listener_id_++;
+    listener_map_[listener_id] = std::move(on_change);
+    has_listener_ = true;
+    return listener_id;
+}
+
+void TransferMetadata::removeSegmentListener(int listener_id) {
+    std::lock_guard<std::mutex> lock(listener_mutex_);
+    listener_map_.erase(listener_id);
+    has_listener_ = !listener_map_.empty();
+}
+
+void TransferMetadata::notifySegmentListeners(
+    const std::vector<std::string> &name_list) {
+    std::lock_guard<std::mutex> lock(listener_mutex_);
+    for (auto &entry : listener_map_)
+        for (auto &name : name_list) entry.second(name);
 }
 
 int TransferMetadata::syncSegmentCache(const std::string &segment_name) {
-    RWSpinlock::WriteGuard guard(segment_lock_);
-    for (auto &entry : segment_id_to_desc_map_) {
+    std::vector<std::pair<SegmentID, std::string>> segment_list;
+    for (auto &entry : segmentTable().id_to_desc) {
         if (entry.first == LOCAL_SEGMENT_ID) continue;
         if (!segment_name.empty() && entry.second->name != segment_name)
             continue;
-        auto segment_desc = getSegmentDesc(entry.second->name);
-        if (segment_desc)
-            entry.second = segment_desc;
-        else
-            LOG(WARNING) << "segment " << entry.second->name
-                         << " is now invalid";
+        segment_list.emplace_back(entry.first, entry.second->name);
+    }
+    for (auto &entry : segment_list) {
+        auto segment_desc = fetchSegmentDesc(entry.second);
+        if (!segment_desc) {
+            LOG(WARNING) << "segment " << entry.second << " is now invalid";
+            continue;
+        }
+        updateSegmentTable([&](SegmentTable &segment_table) {
+            auto iter = segment_table.id_to_desc.find(entry.first);
+            if (iter != segment_table.id_to_desc.end())
+                iter->second = segment_desc;
+        });
     }
     return 0;
 }
 
+void TransferMetadata::onSegmentChanged(const std::string &key) {
+    if (key.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(fetch_mutex_);
+            missing_segment_map_.clear();
+        }
+        syncSegmentCache("");
+        return;
+    }
+
+    // Inverse of getFullMetadataKey()
+    if (key.compare(0, kCommonKeyPrefix.size(), kCommonKeyPrefix) != 0 ||
+        key.compare(0, kRpcMetaPrefix.size(), kRpcMetaPrefix) == 0)
+        return;
+    auto segment_name = key.substr(kCommonKeyPrefix.size());
+    const std::string kRamPrefix = "ram/";
+    if (segment_name.compare(0, kRamPrefix.size(), kRamPrefix) == 0 &&
+        segment_name.find('/', kRamPrefix.size()) == std::string::npos)
+        segment_name = segment_name.substr(kRamPrefix.size());
+
+    {
+        std::lock_guard<std::mutex> lock(fetch_mutex_);
+        missing_segment_map_.erase(segment_name);
+    }
+    auto &segment_table = segmentTable();
+    auto iter = segment_table.name_to_id.find(segment_name);
+    if (iter == segment_table.name_to_id.end() ||
+        iter->second == LOCAL_SEGMENT_ID)
+        return;
+    SegmentID segment_id = iter->second;
+
+    // Not through fetchSegmentDesc(), a fetch in flight may have started
+    // before the change. A removed segment keeps its descriptor, as the
+    // peer may be restarting, but resources derived from it are released.
+    auto segment_desc = getSegmentDesc(segment_name);
+    if (!segment_desc) {
+        if (has_listener_.load(std::memory_order_relaxed))
+            notifySegmentListeners({segment_name});
+        return;
+    }
+    updateSegmentTable([&](SegmentTable &segment_table) {
+        auto iter = segment_table.id_to_desc.find(segment_id);
+        if (iter != segment_table.id_to_desc.end())
+            iter->second = segment_desc;
+    });
+    if (globalConfig().verbose)
+        LOG(INFO) << "Segment " << segment_name << " updated by watch";
+}
+
 std::shared_ptr<TransferMetadata::SegmentDesc>
 TransferMetadata::getSegmentDescByName(const std::string &segment_name,
                                        bool force_update) {
     if (!force_update) {
-        RWSpinlock::ReadGuard guard(segment_lock_);
-        auto iter = segment_name_to_id_map_.find(segment_name);
-        if (iter != segment_name_to_id_map_.end())
-            return segment_id_to_desc_map_[iter->second];
+        auto &segment_table = segmentTable();
+        auto iter = segment_table.name_to_id.find(segment_name);
+        if (iter != segment_table.name_to_id.end())
+            return segment_table.id_to_desc.at(iter->second);
     }
 
-    RWSpinlock::WriteGuard guard(segment_lock_);
-    auto iter = segment_name_to_id_map_.find(segment_name);
-    SegmentID segment_id;
-    if (iter != segment_name_to_id_map_.end())
-        segment_id = iter->second;
-    else
-        segment_id = next_segment_id_.fetch_add(1);
-    auto segment_desc = this->getSegmentDesc(segment_name);
+    // Fetch without segment_mutex_, transfers to other segments go on
+    auto segment_desc = fetchSegmentDesc(segment_name);
     if (!segment_desc) return nullptr;
-    segment_id_to_desc_map_[segment_id] = segment_desc;
-    segment_name_to_id_map_[segment_name] = segment_id;
+    updateSegmentTable([&](SegmentTable &segment_table) {
+        auto iter = segment_table.name_to_id.find(segment_name);
+        if (iter == segment_table.name_to_id.end()) {
+            SegmentID segment_id = next_segment_id_.fetch_add(1);
+            segment_table.id_to_desc[segment_id] = segment_desc;
+            segment_table.name_to_id[segment_name] = segment_id;
+        } else if (force_update) {
+            segment_table.id_to_desc[iter->second] = segment_desc;
+        } else {
+            segment_desc = segment_table.id_to_desc[iter->second];
+        }
+    });
     return segment_desc;
 }
 
 std::shared_ptr<TransferMetadata::SegmentDesc>
 TransferMetadata::getSegmentDescByID(SegmentID segment_id, bool force_update) {
-    if (force_update) {
-        RWSpinlock::WriteGuard guard(segment_lock_);
-        if (!segment_id_to_desc_map_.count(segment_id)) return nullptr;
-        auto segment_desc =
-            getSegmentDesc(segment_id_to_desc_map_[segment_id]->name);
-        if (!segment_desc) return nullptr;
-        segment_id_to_desc_map_[segment_id] = segment_desc;
-        return segment_id_to_desc_map_[segment_id];
-    } else {
-        RWSpinlock::ReadGuard guard(segment_lock_);
-        if (!segment_id_to_desc_map_.count(segment_id)) return nullptr;
-        return segment_id_to_desc_map_[segment_id];
-    }
+    auto &segment_table = segmentTable();
+    auto iter = segment_table.id_to_desc.find(segment_id);
+    if (iter == segment_table.id_to_desc.end()) return nullptr;
+    if (!force_update) return iter->second;
+
+    auto segment_desc = fetchSegmentDesc(iter->second->name);
+    if (!segment_desc) return nullptr;
+    bool found = false;
+    updateSegmentTable([&](SegmentTable &segment_table) {
+        auto iter = segment_table.id_to_desc.find(segment_id);
+        if (iter == segment_table.id_to_desc.end()) return;
+        iter->second = segment_desc;
+        found = true;
+    });
+    return found ? segment_desc : nullptr;
+}
+
+TransferMetadata::SegmentDesc *TransferMetadata::peekSegmentDescByID(
+    SegmentID segment_id) {
+    auto &segment_table = segmentTable();
+    auto iter = segment_table.id_to_desc.find(segment_id);
+    if (iter == segment_table.id_to_desc.end()) return nullptr;
+    return iter->second.get();
 }
 
 TransferMetadata::SegmentID TransferMetadata::getSegmentID(
     const std::string &segment_name) {
     {
-        RWSpinlock::ReadGuard guard(segment_lock_);
-        if (segment_name_to_id_map_.count(segment_name))
-            return segment_name_to_id_map_[segment_name];
+        auto &segment_table = segmentTable();
+        auto iter = segment_table.name_to_id.find(segment_name);
+        if (iter != segment_table.name_to_id.end()) return iter->second;
     }
 
-    RWSpinlock::WriteGuard guard(segment_lock_);
-    if (segment_name_to_id_map_.count(segment_name))
-        return segment_name_to_id_map_[segment_name];
-    auto segment_desc = this->getSegmentDesc(segment_name);
+    auto segment_desc = fetchSegmentDesc(segment_name);
     if (!segment_desc) return -1;
-    SegmentID id = next_segment_id_.fetch_add(1);
-    segment_id_to_desc_map_[id] = segment_desc;
-    segment_name_to_id_map_[segment_name] = id;
+    SegmentID id;
+    updateSegmentTable([&](SegmentTable &segment_table) {
+        auto iter = segment_table.name_to_id.find(segment_name);
+        if (iter != segment_table.name_to_id.end()) {
+            id = iter->second;
+            return;
+        }
+        id = next_segment_id_.fetch_add(1);
+        segment_table.id_to_desc[id] = segment_desc;
+        segment_table.name_to_id[segment_name] = id;
+    });
     return id;
 }
 
 int TransferMetadata::updateLocalSegmentDesc(uint64_t segment_id) {
-    RWSpinlock::ReadGuard guard(segment_lock_);
-    auto desc = segment_id_to_desc_map_[segment_id];
-    return this->updateSegmentDesc(desc->name, *desc);
+    if (segment_id != LOCAL_SEGMENT_ID) {
+        auto desc = getSegmentDescByID(segment_id);
+        if (!desc) return ERR_INVALID_ARGUMENT;
+        return this->updateSegmentDesc(desc->name, *desc);
+    }
+
+    // Registering many buffers one by one from several threads would
+    // otherwise write the whole descriptor for every buffer.
+    std::unique_lock<std::mutex> lock(publish_mutex_);
+    uint64_t ticket = ++publish_ticket_;
+    publish_cond_.wait(lock, [&]() {
+        return published_ticket_ >= ticket || !publishing_;
+    });
+    if (published_ticket_ >= ticket) return publish_result_;
+    publishing_ = true;
+    uint64_t covered_ticket = publish_ticket_;
+    lock.unlock();
+
+    int ret = ERR_INVALID_ARGUMENT;
+    auto desc = getSegmentDescByID(LOCAL_SEGMENT_ID);
+    if (desc) ret = this->updateSegmentDesc(desc->name, *desc);
+
+    lock.lock();
+    publishing_ = false;
+    published_ticket_ = covered_ticket;
+    publish_result_ = ret;
+    publish_cond_.notify_all();
+    return ret;
 }
 
 int TransferMetadata::addLocalSegment(SegmentID segment_id,
                                       const std::string &segment_name,
                                       std::shared_ptr<SegmentDesc> &&desc) {
-    RWSpinlock::WriteGuard guard(segment_lock_);
-    segment_id_to_desc_map_[segment_id] = desc;
-    segment_name_to_id_map_[segment_name] = segment_id;
+    updateSegmentTable([&](SegmentTable &segment_table) {
+        segment_table.id_to_desc[segment_id] = desc;
+        segment_table.name_to_id[segment_name] = segment_id;
+    });
     return 0;
 }
 
+int TransferMetadata::updateLocalSegment(
+    const std::function<bool(SegmentDesc &)> &update) {
+    int ret = ERR_INVALID_ARGUMENT;
+    updateSegmentTable([&](SegmentTable &segment_table) {
+        auto iter = segment_table.id_to_desc.find(LOCAL_SEGMENT_ID);
+        if (iter == segment_table.id_to_desc.end() || !iter->second) return;
+        // Descriptors may be in use by other threads, change a copy
+        auto new_segment_desc = std::make_shared<SegmentDesc>(*iter->second);
+        if (!update(*new_segment_desc)) {
+            ret = ERR_ADDRESS_NOT_REGISTERED;
+            return;
+        }
+        iter->second = new_segment_desc;
+        ret = 0;
+    });
+    return ret;
+}
+
 int TransferMetadata::addLocalMemoryBuffer(const BufferDesc &buffer_desc,
                                            bool update_metadata) {
-    {
-        RWSpinlock::WriteGuard guard(segment_lock_);
-        auto new_segment_desc = std::make_shared<SegmentDesc>();
-        auto &segment_desc = segment_id_to_desc_map_[LOCAL_SEGMENT_ID];
-        *new_segment_desc = *segment_desc;
-        segment_desc = new_segment_desc;
-        segment_desc->buffers.push_back(buffer_desc);
+    return addLocalMemoryBuffers({buffer_desc}, update_metadata);
+}
+
+int TransferMetadata::removeLocalMemoryBuffer(void *addr,
+                                              bool update_metadata) {
+    return removeLocalMemoryBuffers({addr}, update_metadata);
+}
+
+int TransferMetadata::addLocalMemoryBuffers(
+    const std::vector<BufferDesc> &buffer_list, bool update_metadata) {
+    int ret = updateLocalSegment([&](SegmentDesc &segment_desc) {
+        segment_desc.buffers.insert(segment_desc.buffers.end(),
+                                    buffer_list.begin(), buffer_list.end());
+        segment_desc.indexBuffers();
+        return true;
+    });
+    if (ret) return ret;
+    if (update_metadata) return updateLocalSegmentDesc();
+    return 0;
+}
+
+int TransferMetadata::removeLocalMemoryBuffers(
+    const std::vector<void *> &addr_list, bool update_metadata) {
+    std::unordered_set<uint64_t> addr_set;
+    for (auto addr : addr_list) addr_set.insert((uint64_t)addr);
+    size_t removed_count = 0;
+    int ret = updateLocalSegment([&](SegmentDesc &segment_desc) {
+        auto &buffers = segment_desc.buffers;
+        auto iter = std::remove_if(buffers.begin(), buffers.end(),
+                                   [&](const BufferDesc &buffer) {
+                                       return addr_set.count(buffer.addr);
+                                   });
+        removed_count = buffers.end() - iter;
+        if (!removed_count) return false;
+        buffers.erase(iter, buffers.end());
+        segment_desc.indexBuffers();
+        return true;
+    });
+    if (ret) return ret;
+    if (update_metadata) {
+        ret = updateLocalSegmentDesc();
+        if (ret) return ret;
     }
+    // Some of the addresses were not registered
+    if (removed_count < addr_set.size()) return ERR_ADDRESS_NOT_REGISTERED;
+    return 0;
+}
+
+int TransferMetadata::setLocalHostId(const std::string &host_id) {
+    return updateLocalSegment([&](SegmentDesc &segment_desc) {
+        segment_desc.host_id = host_id;
+        return true;
+    });
+}
+
+int TransferMetadata::addLocalShmBuffer(const ShmBufferDesc &buffer_desc,
+                                        bool update_metadata) {
+    int ret = updateLocalSegment([&](SegmentDesc &segment_desc) {
+        segment_desc.shm_buffers.push_back(buffer_desc);
+        segment_desc.indexBuffers();
+        return true;
+    });
+    if (ret) return ret;
     if (update_metadata) return updateLocalSegmentDesc();
     return 0;
 }
 
-int TransferMetadata::removeLocalMemoryBuffer(void *addr,
-                                              bool update_metadata) {
-    bool addr_exist = false;
-    {
-        RWSpinlock::WriteGuard guard(segment_lock_);
-        auto new_segment_desc = std::make_shared<SegmentDesc>();
-        auto &segment_desc = segment_id_to_desc_map_[LOCAL_SEGMENT_ID];
-        *new_segment_desc = *segment_desc;
-        segment_desc = new_segment_desc;
-        for (auto iter = segment_desc->buffers.begin();
-             iter != segment_desc->buffers.end(); ++iter) {
+int TransferMetadata::removeLocalShmBuffer(void *addr, bool update_metadata) {
+    int ret = updateLocalSegment([&](SegmentDesc &segment_desc) {
+        for (auto iter = segment_desc.shm_buffers.begin();
+             iter != segment_desc.shm_buffers.end(); ++iter) {
             if (iter->addr == (uint64_t)addr) {
-                segment_desc->buffers.erase(iter);
-                addr_exist = true;
-                break;
+                segment_desc.shm_buffers.erase(iter);
+                segment_desc.indexBuffers();
+                return true;
             }
         }
-    }
-    if (addr_exist) {
-        if (update_metadata) return updateLocalSegmentDesc();
-        return 0;
-    }
-    return ERR_ADDRESS_NOT_REGISTERED;
+        return false;
+    });
+    // Buffers not backed by shared memory are never published as shm buffers
+    if (ret == ERR_ADDRESS_NOT_REGISTERED) return 0;
+    if (ret) return ret;
+    if (update_metadata) return updateLocalSegmentDesc();
+    return 0;
 }
 
 int TransferMetadata::addRpcMetaEntry(const std::string &server_name,
@@ -391,6 +619,12 @@ int TransferMetadata::getRpcMetaEntry(const std::string &server_name,
             return 0;
         }
     }
+    if (p2p_mode_) {
+        auto hostname_port = parseHostNameWithPort(server_name);
+        desc.ip_or_host_name = hostname_port.first;
+        desc.rpc_port = hostname_port.second;
+        return 0;
+    }
     RWSpinlock::WriteGuard guard(rpc_meta_lock_);
     Json::Value rpcMetaJSON;
     if (!storage_plugin_->get(kRpcMetaPrefix + server_name, rpcMetaJSON)) {
@@ -405,17 +639,68 @@ int TransferMetadata::getRpcMetaEntry(const std::string &server_name,
 
 int TransferMetadata::startHandshakeDaemon(
     OnReceiveHandShake on_receive_handshake, uint16_t listen_port) {
-    return handshake_plugin_->startDaemon(
-        [on_receive_handshake](const Json::Value &peer,
-                               Json::Value &local) -> int {
-            HandShakeDesc local_desc, peer_desc;
-            TransferHandshakeUtil::decode(peer, peer_desc);
-            int ret = on_receive_handshake(peer_desc, local_desc);
-            if (ret) return ret;
-            local = TransferHandshakeUtil::encode(local_desc);
-            return 0;
+    std::lock_guard<std::mutex> lock(handshake_mutex_);
+    if (on_receive_handshake) on_receive_handshake_ = on_receive_handshake;
+    if (daemon_running_) return 0;
+    int ret = handshake_plugin_->startDaemon(
+        [this](const Json::Value &peer, Json::Value &local) -> int {
+            return onReceiveRequest(peer, local);
         },
         listen_port);
+    if (ret) return ret;
+    daemon_running_ = true;
+    return 0;
+}
+
+int TransferMetadata::onReceiveRequest(const Json::Value &peer,
+                                       Json::Value &local) {
+    if (peer["type"].asString() == kGetMetadataRequest) {
+        // Only keys of this process are served, a metadata server has
+        // all of them anyway
+        Json::Value value;
+        if (p2p_mode_ && storage_plugin_->get(peer["key"].asString(), value))
+            local["value"] = value;
+        else
+            local["reply_msg"] = "metadata not found";
+        return 0;
+    }
+
+    OnReceiveHandShake on_receive_handshake;
+    {
+        std::lock_guard<std::mutex> lock(handshake_mutex_);
+        on_receive_handshake = on_receive_handshake_;
+    }
+    HandShakeDesc local_desc, peer_desc;
+    if (!on_receive_handshake) {
+        local_desc.reply_msg = "handshakes are not accepted";
+        local = TransferHandshakeUtil::encode(local_desc);
+        return ERR_INVALID_ARGUMENT;
+    }
+    TransferHandshakeUtil::decode(peer, peer_desc);
+    int ret = on_receive_handshake(peer_desc, local_desc);
+    if (ret) return ret;
+    local = TransferHandshakeUtil::encode(local_desc);
+    return 0;
+}
+
+int TransferMetadata::queryPeerMetadata(const std::string &server_name,
+                                        const std::string &key,
+                                        Json::Value &value) {
+    RpcMetaDesc peer_location;
+    if (getRpcMetaEntry(server_name, peer_location)) return ERR_METADATA;
+    Json::Value request, reply;
+    request["type"] = kGetMetadataRequest;
+    request["key"] = key;
+    int ret = handshake_plugin_->send(peer_location.ip_or_host_name,
+                                      peer_location.rpc_port, request, reply);
+    if (ret) return ret;
+    if (!reply.isMember("value")) {
+        LOG(WARNING) << "Failed to fetch " << key << " from " << server_name
+                     << ": " << reply["reply_msg"].asString();
+        return ERR_METADATA;
+    }
+    value = reply["value"];
+    return 0;
 }
 
 int TransferMetadata::sendHandshake(const std::string &peer_server_name,
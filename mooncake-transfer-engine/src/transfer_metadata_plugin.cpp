@@ -18,6 +18,7 @@
 #include <bits/stdint-uintn.h>
 #include <jsoncpp/json/value.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 
 #ifdef USE_REDIS
@@ -30,10 +31,19 @@
 
 #ifdef USE_ETCD
 #include <etcd/SyncClient.hpp>
+#include <etcd/Watcher.hpp>
 #endif  // USE_ETCD
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <unordered_map>
 
 #include "common.h"
 #include "config.h"
@@ -54,9 +64,20 @@ struct RedisStoragePlugin : public MetadataStoragePlugin {
         }
     }
 
-    virtual ~RedisStoragePlugin() {}
+    virtual ~RedisStoragePlugin() {
+        if (watch_running_) {
+            watch_running_ = false;
+            {
+                // Wakes up the watch thread blocked on the connection
+                std::lock_guard<std::mutex> lock(watch_mutex_);
+                if (watch_client_) shutdown(watch_client_->fd, SHUT_RDWR);
+            }
+            watch_thread_.join();
+        }
+    }
 
     virtual bool get(const std::string &key, Json::Value &value) {
+        std::lock_guard<std::mutex> lock(mutex_);
         Json::Reader reader;
         redisReply *resp =
             (redisReply *)redisCommand(client_, "GET %s", key.c_str());
@@ -75,6 +96,7 @@ struct RedisStoragePlugin : public MetadataStoragePlugin {
     }
 
     virtual bool set(const std::string &key, const Json::Value &value) {
+        std::lock_guard<std::mutex> lock(mutex_);
         Json::FastWriter writer;
         const std::string json_file = writer.write(value);
         if (globalConfig().verbose)
@@ -92,6 +114,7 @@ struct RedisStoragePlugin : public MetadataStoragePlugin {
     }
 
     virtual bool remove(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
         redisReply *resp =
             (redisReply *)redisCommand(client_, "DEL %s", key.c_str());
         if (!resp) {
@@ -103,8 +126,132 @@ struct RedisStoragePlugin : public MetadataStoragePlugin {
         return true;
     }
 
+    virtual bool watch(const std::string &prefix, OnChangeCallBack on_change) {
+        if (!client_ || !enableKeyspaceEvents()) return false;
+        watch_running_ = true;
+        watch_thread_ = std::thread([this, prefix, on_change]() {
+            bool reconnect = false;
+            while (watch_running_) {
+                if (reconnect) {
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                    if (!watch_running_) break;
+                }
+                if (!subscribe(prefix)) {
+                    reconnect = true;
+                    continue;
+                }
+                // Changes made while disconnected were not notified
+                if (reconnect) on_change("");
+                receiveEvents(on_change);
+                std::lock_guard<std::mutex> lock(watch_mutex_);
+                redisFree(watch_client_);
+                watch_client_ = nullptr;
+                reconnect = true;
+            }
+        });
+        return true;
+    }
+
+    // Keyspace notifications are off by default and changing them affects
+    // every user of the server, so the ones for string commands and DEL are
+    // only turned on if MC_REDIS_KEYSPACE_EVENTS is set, without dropping
+    // those already enabled. Returns false if they remain off.
+    bool enableKeyspaceEvents() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        redisReply *resp = (redisReply *)redisCommand(
+            client_, "CONFIG GET notify-keyspace-events");
+        std::string flags;
+        if (resp && resp->type == REDIS_REPLY_ARRAY && resp->elements == 2)
+            flags = resp->element[1]->str;
+        if (resp) freeReplyObject(resp);
+        bool all = flags.find('A') != std::string::npos;
+        if (flags.find('K') != std::string::npos &&
+            (all || (flags.find('$') != std::string::npos &&
+                     flags.find('g') != std::string::npos)))
+            return true;
+        if (!globalConfig().redis_keyspace_events) {
+            LOG(WARNING) << "RedisStoragePlugin: keyspace notifications are "
+                            "off on "
+                         << metadata_uri_
+                         << ", segment descriptors are not watched. Add K$g "
+                            "to notify-keyspace-events in the redis "
+                            "configuration, or set MC_REDIS_KEYSPACE_EVENTS "
+                            "to let Mooncake do so";
+            return false;
+        }
+        flags += "K$g";
+        resp = (redisReply *)redisCommand(
+            client_, "CONFIG SET notify-keyspace-events %s", flags.c_str());
+        bool ok = resp && resp->type != REDIS_REPLY_ERROR;
+        if (!ok)
+            LOG(WARNING) << "RedisStoragePlugin: unable to enable keyspace "
+                            "notifications on "
+                         << metadata_uri_
+                         << ", enable them in the redis configuration";
+        if (resp) freeReplyObject(resp);
+        return ok;
+    }
+
+    bool subscribe(const std::string &prefix) {
+        auto hostname_port = parseHostNameWithPort(metadata_uri_);
+        redisContext *client =
+            redisConnect(hostname_port.first.c_str(), hostname_port.second);
+        if (!client || client->err) {
+            LOG(WARNING) << "RedisStoragePlugin: unable to connect "
+                         << metadata_uri_ << " for watching";
+            if (client) redisFree(client);
+            return false;
+        }
+        redisReply *resp = (redisReply *)redisCommand(
+            client, "PSUBSCRIBE __keyspace@*__:%s*", prefix.c_str());
+        if (!resp || resp->type == REDIS_REPLY_ERROR) {
+            LOG(WARNING) << "RedisStoragePlugin: unable to subscribe "
+                            "keyspace notifications from "
+                         << metadata_uri_;
+            if (resp) freeReplyObject(resp);
+            redisFree(client);
+            return false;
+        }
+        freeReplyObject(resp);
+        std::lock_guard<std::mutex> lock(watch_mutex_);
+        watch_client_ = client;
+        if (!watch_running_) shutdown(watch_client_->fd, SHUT_RDWR);
+        return true;
+    }
+
+    // Messages are ["pmessage", pattern, "__keyspace@<db>__:<key>", event]
+    void receiveEvents(const OnChangeCallBack &on_change) {
+        const std::string kChannelDelimiter = "__:";
+        while (watch_running_) {
+            redisReply *resp = nullptr;
+            if (redisGetReply(watch_client_, (void **)&resp) != REDIS_OK) {
+                if (watch_running_)
+                    LOG(WARNING) << "RedisStoragePlugin: lost watch "
+                                    "connection to "
+                                 << metadata_uri_;
+                return;
+            }
+            if (resp->type == REDIS_REPLY_ARRAY && resp->elements == 4 &&
+                resp->element[2]->type == REDIS_REPLY_STRING) {
+                std::string channel(resp->element[2]->str,
+                                    resp->element[2]->len);
+                auto pos = channel.find(kChannelDelimiter);
+                if (pos != std::string::npos)
+                    on_change(channel.substr(pos + kChannelDelimiter.size()));
+            }
+            freeReplyObject(resp);
+        }
+    }
+
     redisContext *client_;
+    std::mutex mutex_;  // the connection is not thread-safe
     const std::string metadata_uri_;
+
+    // Subscriptions need a connection of their own
+    std::atomic<bool> watch_running_{false};
+    std::thread watch_thread_;
+    std::mutex watch_mutex_;  // guards watch_client_
+    redisContext *watch_client_ = nullptr;
 };
 #endif  // USE_REDIS
 
@@ -121,6 +268,11 @@ struct HTTPStoragePlugin : public MetadataStoragePlugin {
     }
 
     virtual ~HTTPStoragePlugin() {
+        if (watch_running_) {
+            watch_running_ = false;
+            watch_thread_.join();
+        }
+        if (watch_client_) curl_easy_cleanup(watch_client_);
         curl_easy_cleanup(client_);
         curl_global_cleanup();
     }
@@ -140,6 +292,7 @@ struct HTTPStoragePlugin : public MetadataStoragePlugin {
     }
 
     virtual bool get(const std::string &key, Json::Value &value) {
+        std::lock_guard<std::mutex> lock(mutex_);
         curl_easy_reset(client_);
         curl_easy_setopt(client_, CURLOPT_TIMEOUT_MS, 3000);  // 3s timeout
 
@@ -177,6 +330,7 @@ struct HTTPStoragePlugin : public MetadataStoragePlugin {
     }
 
     virtual bool set(const std::string &key, const Json::Value &value) {
+        std::lock_guard<std::mutex> lock(mutex_);
         curl_easy_reset(client_);
         curl_easy_setopt(client_, CURLOPT_TIMEOUT_MS, 3000);  // 3s timeout
 
@@ -223,6 +377,7 @@ struct HTTPStoragePlugin : public MetadataStoragePlugin {
     }
 
     virtual bool remove(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
         curl_easy_reset(client_);
         curl_easy_setopt(client_, CURLOPT_TIMEOUT_MS, 3000);  // 3s timeout
 
@@ -256,8 +411,110 @@ struct HTTPStoragePlugin : public MetadataStoragePlugin {
         return true;
     }
 
+    // Long-polls GET <metadata_uri>/watch?epoch=E&revision=R&timeout=T. The
+    // server answers {"epoch": E, "revision": R, "keys": [...], "reset": b}
+    // with the keys changed after revision R, waiting up to T seconds for
+    // one. reset is set if it no longer knows them, e.g. after a restart,
+    // which changes its epoch. Revision -1 returns the current revision.
+    virtual bool watch(const std::string &prefix, OnChangeCallBack on_change) {
+        watch_client_ = curl_easy_init();
+        if (!watch_client_) return false;
+        WatchState state;
+        if (!pollChanges(state, 0)) {
+            LOG(INFO) << "HTTPStoragePlugin: " << metadata_uri_
+                      << " does not support watching";
+            return false;
+        }
+        watch_running_ = true;
+        watch_thread_ = std::thread([this, prefix, on_change, state]() {
+            const int kPollTimeout = 30;  // seconds
+            WatchState current_state = state;
+            bool reconnect = false;
+            while (watch_running_) {
+                WatchState next_state = current_state;
+                if (!pollChanges(next_state, kPollTimeout)) {
+                    reconnect = true;
+                    for (int i = 0; i < 10 && watch_running_; ++i)
+                        std::this_thread::sleep_for(
+                            std::chrono::milliseconds(100));
+                    continue;
+                }
+                if (reconnect || next_state.reset) {
+                    on_change("");
+                } else {
+                    for (auto &key : next_state.keys)
+                        if (key.compare(0, prefix.size(), prefix) == 0)
+                            on_change(key);
+                }
+                reconnect = false;
+                current_state = next_state;
+            }
+        });
+        return true;
+    }
+
+    struct WatchState {
+        std::string epoch;
+        int64_t revision = -1;
+        std::vector<std::string> keys;
+        bool reset = false;
+    };
+
+    static int watchProgressCallback(void *clientp, curl_off_t, curl_off_t,
+                                     curl_off_t, curl_off_t) {
+        auto plugin = static_cast<HTTPStoragePlugin *>(clientp);
+        return plugin->watch_running_ ? 0 : 1;  // nonzero aborts
+    }
+
+    bool pollChanges(WatchState &state, int timeout) {
+        curl_easy_reset(watch_client_);
+        curl_easy_setopt(watch_client_, CURLOPT_TIMEOUT_MS,
+                         (timeout + 3) * 1000);
+        std::string url = metadata_uri_ + "/watch?epoch=" + state.epoch +
+                          "&revision=" + std::to_string(state.revision) +
+                          "&timeout=" + std::to_string(timeout);
+        curl_easy_setopt(watch_client_, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(watch_client_, CURLOPT_WRITEFUNCTION, writeCallback);
+        std::string readBuffer;
+        curl_easy_setopt(watch_client_, CURLOPT_WRITEDATA, &readBuffer);
+        if (timeout) {
+            curl_easy_setopt(watch_client_, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(watch_client_, CURLOPT_XFERINFOFUNCTION,
+                             watchProgressCallback);
+            curl_easy_setopt(watch_client_, CURLOPT_XFERINFODATA, this);
+        }
+        CURLcode res = curl_easy_perform(watch_client_);
+        if (res != CURLE_OK) {
+            if (watch_running_ || !timeout)
+                LOG(WARNING) << "Error from http client, GET " << url
+                             << " error: " << curl_easy_strerror(res);
+            return false;
+        }
+        long responseCode;
+        curl_easy_getinfo(watch_client_, CURLINFO_RESPONSE_CODE,
+                          &responseCode);
+        Json::Value value;
+        Json::Reader reader;
+        if (responseCode != 200 || !reader.parse(readBuffer, value) ||
+            !value.isObject())
+            return false;
+        state.reset = value["reset"].asBool() ||
+                      value["epoch"].asString() != state.epoch;
+        state.epoch = value["epoch"].asString();
+        state.revision = value["revision"].asInt64();
+        state.keys.clear();
+        for (auto &key : value["keys"]) state.keys.push_back(key.asString());
+        return true;
+    }
+
     CURL *client_;
+    std::mutex mutex_;  // the easy handle is not thread-safe
     const std::string metadata_uri_;
+
+    // Long polls have a handle of their own
+    CURL *watch_client_ = nullptr;
+    std::atomic<bool> watch_running_{false};
+    std::thread watch_thread_;
 };
 #endif  // USE_HTTP
 
@@ -266,7 +523,16 @@ struct EtcdStoragePlugin : public MetadataStoragePlugin {
     EtcdStoragePlugin(const std::string &metadata_uri)
         : client_(metadata_uri), metadata_uri_(metadata_uri) {}
 
-    virtual ~EtcdStoragePlugin() {}
+    virtual ~EtcdStoragePlugin() {
+        if (watch_running_) {
+            watch_running_ = false;
+            {
+                std::lock_guard<std::mutex> lock(watch_mutex_);
+                if (watcher_) watcher_->Cancel();
+            }
+            watch_thread_.join();
+        }
+    }
 
     virtual bool get(const std::string &key, Json::Value &value) {
         Json::Reader reader;
@@ -310,11 +576,196 @@ struct EtcdStoragePlugin : public MetadataStoragePlugin {
         return true;
     }
 
+    // A watcher ends when the connection is lost. It is then created again
+    // with backoff, resuming after the last revision seen so that no change
+    // is missed. If it cannot resume, e.g. because that revision has been
+    // compacted, it starts over from the current one and reports a reset.
+    virtual bool watch(const std::string &prefix, OnChangeCallBack on_change) {
+        watch_running_ = true;
+        watch_thread_ = std::thread([this, prefix, on_change]() {
+            const int kMinBackoff = 100, kMaxBackoff = 10000;  // ms
+            int backoff = 0;
+            bool reconnect = false;
+            while (watch_running_) {
+                for (int i = 0; i < backoff / 100 && watch_running_; ++i)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                int64_t revision = next_revision_;
+                {
+                    std::lock_guard<std::mutex> lock(watch_mutex_);
+                    if (!watch_running_) break;
+                    auto callback = [this, on_change](etcd::Response resp) {
+                        onWatchEvents(resp, on_change);
+                    };
+                    if (revision)
+                        watcher_ = std::make_unique<etcd::Watcher>(
+                            metadata_uri_, prefix, revision, callback, true);
+                    else
+                        watcher_ = std::make_unique<etcd::Watcher>(
+                            metadata_uri_, prefix, callback, true);
+                }
+                // Changes made while disconnected were not notified
+                if (reconnect && !revision) on_change("");
+                reconnect = true;
+                watcher_->Wait();
+                if (!watch_running_) break;
+                LOG(WARNING) << "EtcdStoragePlugin: lost watch on "
+                             << metadata_uri_ << ", reconnecting";
+                if (next_revision_ == revision) {
+                    // Nothing was received, and the revision may have been
+                    // compacted meanwhile
+                    backoff = std::min(std::max(backoff * 2, kMinBackoff),
+                                       kMaxBackoff);
+                    next_revision_ = 0;
+                } else {
+                    backoff = kMinBackoff;
+                }
+            }
+        });
+        return true;
+    }
+
+    void onWatchEvents(etcd::Response &resp,
+                       const OnChangeCallBack &on_change) {
+        if (!resp.is_ok()) {
+            LOG(WARNING) << "EtcdStoragePlugin: watch error from "
+                         << metadata_uri_ << ": " << resp.error_message();
+            return;
+        }
+        for (auto &event : resp.events()) {
+            on_change(event.kv().key());
+            next_revision_ = event.kv().modified_index() + 1;
+        }
+    }
+
     etcd::SyncClient client_;
     const std::string metadata_uri_;
+    std::atomic<bool> watch_running_{false};
+    std::thread watch_thread_;
+    std::mutex watch_mutex_;  // guards watcher_
+    std::unique_ptr<etcd::Watcher> watcher_;
+    // Revision to resume watching from, 0 for the current one
+    std::atomic<int64_t> next_revision_{0};
 };
 #endif  // USE_ETCD
 
+// Keys kept in the process. Plugins created with the same "memory://<name>"
+// share them, while "memory://" alone gets keys of its own. Changes are
+// passed to the watching plugins of the store, each of which reports them
+// from a thread of its own.
+struct MemoryStoragePlugin : public MetadataStoragePlugin {
+    struct Store {
+        std::mutex mutex;
+        std::unordered_map<std::string, Json::Value> value_map;
+
+        std::mutex watch_mutex;  // guards watcher_list
+        std::vector<MemoryStoragePlugin *> watcher_list;
+
+        void notify(const std::string &key) {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            for (auto watcher : watcher_list) watcher->enqueueChange(key);
+        }
+    };
+
+    MemoryStoragePlugin(const std::string &name) {
+        if (name.empty()) {
+            store_ = std::make_shared<Store>();
+            return;
+        }
+        static std::mutex registry_mutex;
+        static std::unordered_map<std::string, std::shared_ptr<Store>>
+            registry;
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto &store = registry[name];
+        if (!store) store = std::make_shared<Store>();
+        store_ = store;
+    }
+
+    virtual ~MemoryStoragePlugin() {
+        if (!watch_thread_.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(store_->watch_mutex);
+            auto &watcher_list = store_->watcher_list;
+            watcher_list.erase(
+                std::find(watcher_list.begin(), watcher_list.end(), this));
+        }
+        {
+            std::lock_guard<std::mutex> lock(change_mutex_);
+            watch_running_ = false;
+        }
+        change_cond_.notify_all();
+        watch_thread_.join();
+    }
+
+    virtual bool get(const std::string &key, Json::Value &value) {
+        std::lock_guard<std::mutex> lock(store_->mutex);
+        auto iter = store_->value_map.find(key);
+        if (iter == store_->value_map.end()) return false;
+        value = iter->second;
+        return true;
+    }
+
+    virtual bool set(const std::string &key, const Json::Value &value) {
+        if (globalConfig().verbose)
+            LOG(INFO) << "MemoryStoragePlugin: set: key=" << key;
+        {
+            std::lock_guard<std::mutex> lock(store_->mutex);
+            store_->value_map[key] = value;
+        }
+        store_->notify(key);
+        return true;
+    }
+
+    virtual bool remove(const std::string &key) {
+        {
+            std::lock_guard<std::mutex> lock(store_->mutex);
+            store_->value_map.erase(key);
+        }
+        store_->notify(key);
+        return true;
+    }
+
+    virtual bool watch(const std::string &prefix, OnChangeCallBack on_change) {
+        if (watch_thread_.joinable()) return false;
+        watch_prefix_ = prefix;
+        watch_running_ = true;
+        watch_thread_ = std::thread([this, on_change]() {
+            std::unique_lock<std::mutex> lock(change_mutex_);
+            while (true) {
+                change_cond_.wait(lock, [this] {
+                    return !watch_running_ || !change_list_.empty();
+                });
+                if (!watch_running_) return;
+                auto key = std::move(change_list_.front());
+                change_list_.pop_front();
+                lock.unlock();
+                on_change(key);
+                lock.lock();
+            }
+        });
+        std::lock_guard<std::mutex> lock(store_->watch_mutex);
+        store_->watcher_list.push_back(this);
+        return true;
+    }
+
+    void enqueueChange(const std::string &key) {
+        if (key.compare(0, watch_prefix_.size(), watch_prefix_) != 0) return;
+        {
+            std::lock_guard<std::mutex> lock(change_mutex_);
+            change_list_.push_back(key);
+        }
+        change_cond_.notify_all();
+    }
+
+    std::shared_ptr<Store> store_;
+
+    std::string watch_prefix_;
+    std::thread watch_thread_;
+    std::mutex change_mutex_;  // guards the fields below
+    std::condition_variable change_cond_;
+    bool watch_running_ = false;
+    std::deque<std::string> change_list_;
+};
+
 std::pair<std::string, std::string> parseConnectionString(
     const std::string &conn_string) {
     std::pair<std::string, std::string> result;
@@ -357,6 +808,16 @@ std::shared_ptr<MetadataStoragePlugin> MetadataStoragePlugin::Create(
     }
 #endif  // USE_HTTP
 
+    if (parsed_conn_string.first == "memory") {
+        return std::make_shared<MemoryStoragePlugin>(parsed_conn_string.second);
+    }
+
+    // Peer-to-peer mode only stores the keys of this process, others are
+    // fetched from the handshake daemons of their owners
+    if (parsed_conn_string.first == "p2p") {
+        return std::make_shared<MemoryStoragePlugin>("");
+    }
+
     LOG(FATAL) << "Unable to find metadata storage plugin "
                << parsed_conn_string.first;
     return nullptr;
@@ -382,6 +843,13 @@ static inline const std::string getNetworkAddress(struct sockaddr *addr) {
     return "";
 }
 
+// Handshake messages are length-prefixed JSON. A connection carries any
+// number of request/reply exchanges, so each process keeps one connection
+// per peer daemon. Concurrent sends to the same peer are coalesced into a
+// single {"type": "batch", "requests": [...]} exchange, answered with
+// {"type": "batch", "replies": [...]}. Daemons that close connections after
+// one exchange, or do not know batches, are detected and served one
+// message per connection.
 struct SocketHandShakePlugin : public HandShakePlugin {
     SocketHandShakePlugin() : listener_running_(false), listen_fd_(-1) {}
 
@@ -394,11 +862,13 @@ struct SocketHandShakePlugin : public HandShakePlugin {
     }
 
     virtual ~SocketHandShakePlugin() {
-        closeListen();
         if (listener_running_) {
             listener_running_ = false;
             listener_.join();
         }
+        closeListen();
+        for (auto &entry : channel_map_)
+            if (entry.second->conn_fd >= 0) close(entry.second->conn_fd);
     }
 
     virtual int startDaemon(OnReceiveCallBack on_recv_callback,
@@ -416,16 +886,6 @@ struct SocketHandShakePlugin : public HandShakePlugin {
             return ERR_SOCKET;
         }
 
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        if (setsockopt(listen_fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                       sizeof(timeout))) {
-            PLOG(ERROR) << "SocketHandShakePlugin: setsockopt(SO_RCVTIMEO)";
-            closeListen();
-            return ERR_SOCKET;
-        }
-
         if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) {
             PLOG(ERROR) << "SocketHandShakePlugin: setsockopt(SO_REUSEADDR)";
             closeListen();
@@ -440,7 +900,7 @@ struct SocketHandShakePlugin : public HandShakePlugin {
             return ERR_SOCKET;
         }
 
-        if (listen(listen_fd_, 5)) {
+        if (listen(listen_fd_, SOMAXCONN)) {
             PLOG(ERROR) << "SocketHandShakePlugin: listen()";
             closeListen();
             return ERR_SOCKET;
@@ -448,70 +908,260 @@ struct SocketHandShakePlugin : public HandShakePlugin {
 
         listener_running_ = true;
         listener_ = std::thread([this, on_recv_callback]() {
+            // Connections stay open until their peers close them
+            std::vector<int> conn_list;
+            std::vector<pollfd> poll_list;
             while (listener_running_) {
-                sockaddr_in addr;
-                socklen_t addr_len = sizeof(sockaddr_in);
-                int conn_fd = accept(listen_fd_, (sockaddr *)&addr, &addr_len);
-                if (conn_fd < 0) {
-                    if (errno != EWOULDBLOCK)
-                        PLOG(ERROR) << "SocketHandShakePlugin: accept()";
+                poll_list.assign(1, {listen_fd_, POLLIN, 0});
+                for (int conn_fd : conn_list)
+                    poll_list.push_back({conn_fd, POLLIN, 0});
+                // Wakes up periodically to check listener_running_
+                int ret = poll(poll_list.data(), poll_list.size(), 1000);
+                if (ret < 0) {
+                    if (errno != EINTR)
+                        PLOG(ERROR) << "SocketHandShakePlugin: poll()";
                     continue;
                 }
 
-                if (addr.sin_family != AF_INET && addr.sin_family != AF_INET6) {
-                    LOG(ERROR) << "SocketHandShakePlugin: unsupported socket "
-                                  "type, should be AF_INET or AF_INET6";
-                    close(conn_fd);
-                    continue;
+                std::vector<int> next_conn_list;
+                for (size_t i = 1; i < poll_list.size(); ++i) {
+                    int conn_fd = poll_list[i].fd;
+                    if (!poll_list[i].revents ||
+                        serveRequest(conn_fd, on_recv_callback))
+                        next_conn_list.push_back(conn_fd);
+                    else
+                        close(conn_fd);
                 }
+                conn_list.swap(next_conn_list);
 
-                struct timeval timeout;
-                timeout.tv_sec = 60;
-                timeout.tv_usec = 0;
-                if (setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                               sizeof(timeout))) {
-                    PLOG(ERROR)
-                        << "SocketHandShakePlugin: setsockopt(SO_RCVTIMEO)";
-                    close(conn_fd);
-                    continue;
+                if (poll_list[0].revents & POLLIN) {
+                    int conn_fd = acceptConnection();
+                    if (conn_fd >= 0) conn_list.push_back(conn_fd);
                 }
+            }
+            for (int conn_fd : conn_list) close(conn_fd);
+        });
 
-                auto peer_hostname =
-                    getNetworkAddress((struct sockaddr *)&addr);
-                if (globalConfig().verbose)
-                    LOG(INFO) << "SocketHandShakePlugin: new connection: "
-                              << peer_hostname.c_str();
-
-                Json::Value local, peer;
-                Json::Reader reader;
-                if (!reader.parse(readString(conn_fd), peer)) {
-                    LOG(ERROR) << "SocketHandShakePlugin: failed to receive "
-                                  "handshake message: "
-                                  "malformed json format, check tcp connection";
-                    close(conn_fd);
-                    continue;
-                }
+        return 0;
+    }
 
-                on_recv_callback(peer, local);
-                int ret = writeString(conn_fd, Json::FastWriter{}.write(local));
-                if (ret) {
-                    LOG(ERROR) << "SocketHandShakePlugin: failed to send "
-                                  "handshake message: "
-                                  "malformed json format, check tcp connection";
-                    close(conn_fd);
-                    continue;
-                }
+    int acceptConnection() {
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(sockaddr_in);
+        int conn_fd = accept(listen_fd_, (sockaddr *)&addr, &addr_len);
+        if (conn_fd < 0) {
+            if (errno != EWOULDBLOCK && errno != EINTR)
+                PLOG(ERROR) << "SocketHandShakePlugin: accept()";
+            return -1;
+        }
+
+        if (addr.sin_family != AF_INET && addr.sin_family != AF_INET6) {
+            LOG(ERROR) << "SocketHandShakePlugin: unsupported socket "
+                          "type, should be AF_INET or AF_INET6";
+            close(conn_fd);
+            return -1;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = 60;
+        timeout.tv_usec = 0;
+        if (setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof(timeout))) {
+            PLOG(ERROR) << "SocketHandShakePlugin: setsockopt(SO_RCVTIMEO)";
+            close(conn_fd);
+            return -1;
+        }
+
+        if (globalConfig().verbose)
+            LOG(INFO) << "SocketHandShakePlugin: new connection: "
+                      << getNetworkAddress((struct sockaddr *)&addr);
+        return conn_fd;
+    }
+
+    // Answers one message from a readable connection. Returns false if
+    // the connection should be closed.
+    bool serveRequest(int conn_fd, const OnReceiveCallBack &on_recv_callback) {
+        char byte;
+        ssize_t ret = recv(conn_fd, &byte, 1, MSG_PEEK);
+        if (ret == 0) return false;  // closed by the peer
+        if (ret < 0 && errno != EAGAIN && errno != EINTR) return false;
 
-                close(conn_fd);
+        Json::Value local, peer;
+        Json::Reader reader;
+        if (!reader.parse(readString(conn_fd), peer)) {
+            LOG(ERROR) << "SocketHandShakePlugin: failed to receive "
+                          "handshake message: "
+                          "malformed json format, check tcp connection";
+            return false;
+        }
+
+        if (peer["type"].asString() == "batch") {
+            local["type"] = "batch";
+            Json::Value replies(Json::arrayValue);
+            for (auto &request : peer["requests"]) {
+                Json::Value reply;
+                on_recv_callback(request, reply);
+                replies.append(reply);
             }
-            return;
-        });
+            local["replies"] = replies;
+        } else {
+            on_recv_callback(peer, local);
+        }
 
-        return 0;
+        if (writeString(conn_fd, Json::FastWriter{}.write(local))) {
+            LOG(ERROR) << "SocketHandShakePlugin: failed to send "
+                          "handshake message: "
+                          "malformed json format, check tcp connection";
+            return false;
+        }
+        return true;
     }
 
     virtual int send(std::string ip_or_host_name, uint16_t rpc_port,
                      const Json::Value &local, Json::Value &peer) {
+        auto channel = getChannel(ip_or_host_name, rpc_port);
+        PendingRequest request{&local, &peer, 0, false};
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->pending_list.push_back(&request);
+        channel->cond.wait(
+            lock, [&]() { return request.done || !channel->sending; });
+        if (request.done) return request.ret;
+
+        // Sends the pending requests in batches, until this one is done
+        channel->sending = true;
+        while (!request.done) {
+            const size_t kMaxBatchSize = 64;
+            size_t count =
+                std::min(channel->pending_list.size(), kMaxBatchSize);
+            std::vector<PendingRequest *> batch(
+                channel->pending_list.begin(),
+                channel->pending_list.begin() + count);
+            channel->pending_list.erase(channel->pending_list.begin(),
+                                        channel->pending_list.begin() + count);
+            lock.unlock();
+            exchangeBatch(*channel, batch);
+            lock.lock();
+            for (auto entry : batch) entry->done = true;
+            channel->cond.notify_all();
+        }
+        channel->sending = false;
+        channel->cond.notify_all();
+        return request.ret;
+    }
+
+    struct PendingRequest {
+        const Json::Value *local;
+        Json::Value *peer;
+        int ret;
+        bool done;
+    };
+
+    // Connection and pending requests to one peer daemon. Only the thread
+    // that is sending uses conn_fd and the flags.
+    struct PeerChannel {
+        std::string ip_or_host_name;
+        uint16_t rpc_port;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool sending = false;
+        std::deque<PendingRequest *> pending_list;
+
+        int conn_fd = -1;
+        int exchange_count = 0;  // completed over conn_fd
+        // Until the peer closes a new connection after its first exchange,
+        // as legacy daemons do.
+        bool persistent = true;
+        bool batch_supported = true;
+    };
+
+    std::shared_ptr<PeerChannel> getChannel(const std::string &ip_or_host_name,
+                                            uint16_t rpc_port) {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        auto &channel =
+            channel_map_[ip_or_host_name + ":" + std::to_string(rpc_port)];
+        if (!channel) {
+            channel = std::make_shared<PeerChannel>();
+            channel->ip_or_host_name = ip_or_host_name;
+            channel->rpc_port = rpc_port;
+        }
+        return channel;
+    }
+
+    void exchangeBatch(PeerChannel &channel,
+                       const std::vector<PendingRequest *> &batch) {
+        if (batch.size() > 1 && channel.batch_supported) {
+            Json::Value local, peer;
+            local["type"] = "batch";
+            Json::Value requests(Json::arrayValue);
+            for (auto entry : batch) requests.append(*entry->local);
+            local["requests"] = requests;
+            int ret = exchange(channel, local, peer);
+            if (ret) {
+                for (auto entry : batch) entry->ret = ret;
+                return;
+            }
+            auto &replies = peer["replies"];
+            if (replies.isArray() && replies.size() == batch.size()) {
+                for (size_t i = 0; i < batch.size(); ++i)
+                    *batch[i]->peer = replies[(int)i];
+                return;
+            }
+            LOG(INFO) << "SocketHandShakePlugin: " << channel.ip_or_host_name
+                      << ":" << channel.rpc_port
+                      << " does not support batched handshakes";
+            channel.batch_supported = false;
+        }
+        for (auto entry : batch)
+            entry->ret = exchange(channel, *entry->local, *entry->peer);
+    }
+
+    // One request/reply exchange, over the open connection if there is
+    // one. A connection closed by the peer meanwhile is opened again.
+    int exchange(PeerChannel &channel, const Json::Value &local,
+                 Json::Value &peer) {
+        const std::string message = Json::FastWriter{}.write(local);
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            bool reused = channel.conn_fd >= 0;
+            if (!reused) {
+                int ret = connectPeer(channel);
+                if (ret) return ret;
+                channel.exchange_count = 0;
+            }
+            std::string reply;
+            if (!writeString(channel.conn_fd, message))
+                reply = readString(channel.conn_fd);
+            if (reply.empty()) {
+                close(channel.conn_fd);
+                channel.conn_fd = -1;
+                if (!reused) {
+                    LOG(ERROR) << "SocketHandShakePlugin: failed to exchange "
+                                  "handshake message with "
+                               << channel.ip_or_host_name << ":"
+                               << channel.rpc_port;
+                    return ERR_SOCKET;
+                }
+                if (channel.exchange_count == 1) channel.persistent = false;
+                continue;
+            }
+
+            ++channel.exchange_count;
+            if (!channel.persistent) {
+                close(channel.conn_fd);
+                channel.conn_fd = -1;
+            }
+            Json::Reader reader;
+            if (!reader.parse(reply, peer)) {
+                LOG(ERROR) << "SocketHandShakePlugin: failed to receive "
+                              "handshake message: "
+                              "malformed json format, check tcp connection";
+                return ERR_MALFORMED_JSON;
+            }
+            return 0;
+        }
+        return ERR_SOCKET;
+    }
+
+    int connectPeer(PeerChannel &channel) {
         struct addrinfo hints;
         struct addrinfo *result, *rp;
         memset(&hints, 0, sizeof(hints));
@@ -519,41 +1169,34 @@ struct SocketHandShakePlugin : public HandShakePlugin {
         hints.ai_socktype = SOCK_STREAM;
 
         char service[16];
-        sprintf(service, "%u", rpc_port);
-        if (getaddrinfo(ip_or_host_name.c_str(), service, &hints, &result)) {
+        sprintf(service, "%u", channel.rpc_port);
+        if (getaddrinfo(channel.ip_or_host_name.c_str(), service, &hints,
+                        &result)) {
             PLOG(ERROR)
                 << "SocketHandShakePlugin: failed to get IP address of peer "
                    "server "
-                << ip_or_host_name << ":" << rpc_port
+                << channel.ip_or_host_name << ":" << channel.rpc_port
                 << ", check DNS and /etc/hosts, or use IPv4 address instead";
             return ERR_DNS;
         }
 
-        int ret = 0;
+        int ret = ERR_SOCKET;
         for (rp = result; rp; rp = rp->ai_next) {
-            ret = doSend(rp, local, peer);
-            if (ret == 0) {
-                freeaddrinfo(result);
-                return 0;
-            }
-            if (ret == ERR_MALFORMED_JSON) {
-                return ret;
-            }
+            ret = doConnect(rp, channel.conn_fd);
+            if (ret == 0) break;
         }
 
         freeaddrinfo(result);
         return ret;
     }
 
-    int doSend(struct addrinfo *addr, const Json::Value &local,
-               Json::Value &peer) {
+    int doConnect(struct addrinfo *addr, int &conn_fd) {
         if (globalConfig().verbose)
             LOG(INFO) << "SocketHandShakePlugin: connecting "
                       << getNetworkAddress(addr->ai_addr);
 
         int on = 1;
-        int conn_fd =
-            socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        conn_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
         if (conn_fd == -1) {
             PLOG(ERROR) << "SocketHandShakePlugin: socket()";
             return ERR_SOCKET;
@@ -561,6 +1204,7 @@ struct SocketHandShakePlugin : public HandShakePlugin {
         if (setsockopt(conn_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) {
             PLOG(ERROR) << "SocketHandShakePlugin: setsockopt(SO_REUSEADDR)";
             close(conn_fd);
+            conn_fd = -1;
             return ERR_SOCKET;
         }
 
@@ -571,6 +1215,7 @@ struct SocketHandShakePlugin : public HandShakePlugin {
                        sizeof(timeout))) {
             PLOG(ERROR) << "SocketHandShakePlugin: setsockopt(SO_RCVTIMEO)";
             close(conn_fd);
+            conn_fd = -1;
             return ERR_SOCKET;
         }
 
@@ -578,34 +1223,18 @@ struct SocketHandShakePlugin : public HandShakePlugin {
             PLOG(ERROR) << "SocketHandShakePlugin: connect()"
                         << getNetworkAddress(addr->ai_addr);
             close(conn_fd);
+            conn_fd = -1;
             return ERR_SOCKET;
         }
-
-        int ret = writeString(conn_fd, Json::FastWriter{}.write(local));
-        if (ret) {
-            LOG(ERROR)
-                << "SocketHandShakePlugin: failed to send handshake message: "
-                   "malformed json format, check tcp connection";
-            close(conn_fd);
-            return ret;
-        }
-
-        Json::Reader reader;
-        if (!reader.parse(readString(conn_fd), peer)) {
-            LOG(ERROR) << "SocketHandShakePlugin: failed to receive handshake "
-                          "message: "
-                          "malformed json format, check tcp connection";
-            close(conn_fd);
-            return ERR_MALFORMED_JSON;
-        }
-
-        close(conn_fd);
         return 0;
     }
 
     std::atomic<bool> listener_running_;
     std::thread listener_;
     int listen_fd_;
+
+    std::mutex channel_mutex_;  // guards channel_map_
+    std::unordered_map<std::string, std::shared_ptr<PeerChannel>> channel_map_;
 };
 
 std::shared_ptr<HandShakePlugin> HandShakePlugin::Create(
@@ -0,0 +1,254 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/local_transport/local_transport.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifdef USE_CUDA
+#include <cuda_runtime.h>
+#endif  // USE_CUDA
+
+#include "config.h"
+
+namespace mooncake {
+// Requests smaller than this are copied by the submitting thread.
+const static size_t kInlineCopyThreshold = 65536;
+// Granularity of the work handed to the copy workers.
+const static size_t kCopyChunkSize = 1ull << 20;
+// Copies at least this large bypass the cache on the destination side.
+const static size_t kNonTemporalThreshold = 262144;
+
+LocalTransport::LocalTransport() : running_(false) {}
+
+LocalTransport::~LocalTransport() {
+    if (running_) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            running_ = false;
+        }
+        queue_cond_.notify_all();
+        for (auto &thread : worker_thread_) thread.join();
+    }
+}
+
+int LocalTransport::install(std::string &local_server_name,
+                            std::shared_ptr<TransferMetadata> meta,
+                            std::shared_ptr<Topology> topo) {
+    metadata_ = meta;
+    local_server_name_ = local_server_name;
+    running_ = true;
+    for (int i = 0; i < globalConfig().local_copy_workers; ++i)
+        worker_thread_.emplace_back(&LocalTransport::copyWorker, this);
+    return 0;
+}
+
+int LocalTransport::registerLocalMemory(void *addr, size_t length,
+                                        const std::string &location,
+                                        bool remote_accessible,
+                                        bool update_metadata) {
+    // Buffers are published by the network transports, nothing to do here.
+    return 0;
+}
+
+int LocalTransport::unregisterLocalMemory(void *addr, bool update_metadata) {
+    return 0;
+}
+
+int LocalTransport::registerLocalMemoryBatch(
+    const std::vector<BufferEntry> &buffer_list, const std::string &location) {
+    return 0;
+}
+
+int LocalTransport::unregisterLocalMemoryBatch(
+    const std::vector<void *> &addr_list) {
+    return 0;
+}
+
+Status LocalTransport::submitTransfer(
+    BatchID batch_id, const std::vector<TransferRequest> &entries) {
+    auto &batch_desc = *((BatchDesc *)(batch_id));
+    if (batch_desc.task_list.size() + entries.size() > batch_desc.batch_size) {
+        LOG(ERROR) << "LocalTransport: Exceed the limitation of current "
+                      "batch's capacity";
+        return Status::InvalidArgument(
+            "LocalTransport: Exceed the limitation of capacity, batch id: " +
+            std::to_string(batch_id));
+    }
+
+    size_t task_id = batch_desc.task_list.size();
+    batch_desc.task_list.resize(task_id + entries.size());
+    std::vector<TransferRequest *> request_list;
+    std::vector<TransferTask *> task_list;
+    for (auto &request : entries) {
+        request_list.push_back((TransferRequest *)&request);
+        task_list.push_back(&batch_desc.task_list[task_id++]);
+    }
+    return submitTransferTask(request_list, task_list);
+}
+
+Status LocalTransport::submitTransferTask(
+    const std::vector<TransferRequest *> &request_list,
+    const std::vector<TransferTask *> &task_list) {
+    auto local_segment_desc = metadata_->getSegmentDescByID(LOCAL_SEGMENT_ID);
+    if (!local_segment_desc) {
+        LOG(ERROR) << "LocalTransport: Local segment is not published by any "
+                      "other transport";
+        return Status::InvalidArgument(
+            "LocalTransport: local segment not found");
+    }
+    for (size_t index = 0; index < request_list.size(); ++index) {
+        auto &request = *request_list[index];
+        if (local_segment_desc->buffer_index.find(request.target_offset,
+                                                  request.length) < 0) {
+            LOG(ERROR) << "LocalTransport: Address not registered "
+                       << (void *)request.target_offset;
+            return Status::AddressNotRegistered(
+                "LocalTransport: not registered, address: " +
+                std::to_string(request.target_offset));
+        }
+        submitCopy(request.opcode, request.source,
+                   (void *)request.target_offset, request.length,
+                   *task_list[index]);
+    }
+    return Status::OK();
+}
+
+Status LocalTransport::getTransferStatus(BatchID batch_id, size_t task_id,
+                                         TransferStatus &status) {
+    auto &batch_desc = *((BatchDesc *)(batch_id));
+    const size_t task_count = batch_desc.task_list.size();
+    if (task_id >= task_count) {
+        return Status::InvalidArgument(
+            "LocalTransport::getTransportStatus invalid argument, batch id: " +
+            std::to_string(batch_id));
+    }
+    auto &task = batch_desc.task_list[task_id];
+    uint64_t success_slice_count = task.success_slice_count;
+    uint64_t failed_slice_count = task.failed_slice_count;
+    // Read after the counters, as markSuccess() adds the bytes first
+    status.transferred_bytes = task.transferred_bytes;
+    if (success_slice_count + failed_slice_count == task.slice_count) {
+        if (failed_slice_count)
+            status.s = TransferStatusEnum::FAILED;
+        else
+            status.s = TransferStatusEnum::COMPLETED;
+        task.is_finished = true;
+    } else {
+        status.s = TransferStatusEnum::WAITING;
+    }
+    return Status::OK();
+}
+
+void LocalTransport::submitCopy(TransferRequest::OpCode opcode, void *source,
+                                void *dest, size_t length, TransferTask &task,
+                                std::shared_ptr<void> hold) {
+    task.total_bytes += length;
+    if (length < kInlineCopyThreshold) {
+        Slice slice;
+        slice.source_addr = source;
+        slice.length = length;
+        slice.opcode = opcode;
+        slice.local.dest_addr = dest;
+        slice.task = &task;
+        slice.status = Slice::PENDING;
+        task.slice_count += 1;
+        processSlice(&slice);
+        return;
+    }
+
+    std::vector<Slice *> slice_list;
+    for (uint64_t offset = 0; offset < length; offset += kCopyChunkSize) {
+        auto slice = new Slice();
+        slice->source_addr = (char *)source + offset;
+        slice->length = std::min(length - offset, kCopyChunkSize);
+        slice->opcode = opcode;
+        slice->local.dest_addr = (char *)dest + offset;
+        slice->task = &task;
+        slice->status = Slice::PENDING;
+        slice_list.push_back(slice);
+    }
+    // Account all slices before any of them may complete.
+    task.slice_count += slice_list.size();
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        for (auto slice : slice_list) slice_queue_.push_back({slice, hold});
+    }
+    queue_cond_.notify_all();
+}
+
+void LocalTransport::copyWorker() {
+    while (true) {
+        CopyJob job;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_cond_.wait(
+                lock, [this] { return !running_ || !slice_queue_.empty(); });
+            if (slice_queue_.empty()) return;
+            job = std::move(slice_queue_.front());
+            slice_queue_.pop_front();
+        }
+        processSlice(job.slice);
+        delete job.slice;
+    }
+}
+
+void LocalTransport::processSlice(Slice *slice) {
+    if (slice->opcode == TransferRequest::READ)
+        memoryCopy(slice->source_addr, slice->local.dest_addr, slice->length);
+    else
+        memoryCopy(slice->local.dest_addr, slice->source_addr, slice->length);
+    slice->markSuccess();
+}
+
+void LocalTransport::memoryCopy(void *dest, const void *source,
+                                size_t length) {
+#ifdef USE_CUDA
+    cudaMemcpy(dest, source, length, cudaMemcpyDefault);
+#elif defined(__x86_64__)
+    if (length < kNonTemporalThreshold) {
+        memcpy(dest, source, length);
+        return;
+    }
+    char *dest_ptr = (char *)dest;
+    const char *source_ptr = (const char *)source;
+    size_t head = (64 - ((uintptr_t)dest_ptr & 63)) & 63;
+    memcpy(dest_ptr, source_ptr, head);
+    dest_ptr += head;
+    source_ptr += head;
+    length -= head;
+    for (; length >= 64; length -= 64, dest_ptr += 64, source_ptr += 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)source_ptr);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(source_ptr + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(source_ptr + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(source_ptr + 48));
+        _mm_stream_si128((__m128i *)dest_ptr, v0);
+        _mm_stream_si128((__m128i *)(dest_ptr + 16), v1);
+        _mm_stream_si128((__m128i *)(dest_ptr + 32), v2);
+        _mm_stream_si128((__m128i *)(dest_ptr + 48), v3);
+    }
+    _mm_sfence();
+    memcpy(dest_ptr, source_ptr, length);
+#else
+    memcpy(dest, source, length);
+#endif
+}
+}  // namespace mooncake
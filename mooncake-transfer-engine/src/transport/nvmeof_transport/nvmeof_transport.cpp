@@ -133,11 +133,17 @@ int NVMeoFTransport::submitTransfer(
         assert(desc->protocol == "nvmeof");
         // TODO: solving iterator invalidation due to vector resize
         // Handle File Offset
-        uint32_t buffer_id = 0;
         uint64_t segment_start = request.target_offset;
         uint64_t segment_end = request.target_offset + request.length;
-        uint64_t current_offset = 0;
-        for (auto &buffer_desc : desc->nvmeof_buffers) {
+        // Buffers are back to back, start from the one holding segment_start
+        auto &buffer_index = desc->nvmeof_buffer_index;
+        int first_buffer_id = buffer_index.find(segment_start, 1);
+        if (first_buffer_id < 0) first_buffer_id = buffer_index.size();
+        for (uint32_t buffer_id = first_buffer_id;
+             buffer_id < desc->nvmeof_buffers.size(); ++buffer_id) {
+            auto &buffer_desc = desc->nvmeof_buffers[buffer_id];
+            uint64_t current_offset = buffer_index.addr(buffer_id);
+            if (current_offset >= segment_end) break;
             bool is_overlap = overlap(
                 (void *)segment_start, request.length, (void *)current_offset,
                 buffer_desc
@@ -174,8 +180,6 @@ int NVMeoFTransport::submitTransfer(
                                       nvmeof_desc.desc_idx_, request.opcode,
                                       fh);
             }
-            ++buffer_id;
-            current_offset += buffer_desc.length;
         }
 
         nvmeof_desc.transfer_status.push_back(
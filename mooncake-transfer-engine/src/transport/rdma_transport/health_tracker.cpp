@@ -0,0 +1,143 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/rdma_transport/health_tracker.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+
+namespace mooncake {
+HealthTracker::HealthTracker(uint64_t initial_backoff_ns,
+                             uint64_t max_backoff_ns, int failure_threshold,
+                             Clock clock)
+    : initial_backoff_ns_(initial_backoff_ns),
+      max_backoff_ns_(std::max(max_backoff_ns, initial_backoff_ns)),
+      failure_threshold_(std::max(failure_threshold, 1)),
+      clock_(clock),
+      entry_count_(0),
+      next_eviction_ts_(0) {}
+
+void HealthTracker::markFailure(HealthState &state, const std::string &name) {
+    uint64_t current_ts = clock_();
+    state.last_use_ts.store(current_ts, std::memory_order_relaxed);
+    int failure_count =
+        state.failure_count.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (failure_count < failure_threshold_) return;
+    uint64_t backoff_ns;
+    if (failure_count == failure_threshold_) {
+        backoff_ns = initial_backoff_ns_;
+        LOG(WARNING) << "HealthTracker: " << name << " is unhealthy";
+    } else {
+        backoff_ns = std::min(
+            state.backoff_ns.load(std::memory_order_relaxed) * 2,
+            max_backoff_ns_);
+    }
+    state.backoff_ns.store(backoff_ns, std::memory_order_relaxed);
+    state.retry_ts.store(current_ts + backoff_ns, std::memory_order_relaxed);
+}
+
+void HealthTracker::markSuccess(HealthState &state, const std::string &name) {
+    if (!state.failure_count.load(std::memory_order_relaxed)) return;
+    if (state.failure_count.exchange(0, std::memory_order_relaxed) >=
+        failure_threshold_)
+        LOG(INFO) << "HealthTracker: " << name << " has recovered";
+}
+
+bool HealthTracker::healthy(HealthState &state) {
+    if (state.failure_count.load(std::memory_order_relaxed) <
+        failure_threshold_)
+        return true;
+    uint64_t current_ts = clock_();
+    state.last_use_ts.store(current_ts, std::memory_order_relaxed);
+    uint64_t retry_ts = state.retry_ts.load(std::memory_order_relaxed);
+    if (current_ts < retry_ts) return false;
+    // Only one of the callers racing here gets the probe
+    return state.retry_ts.compare_exchange_strong(
+        retry_ts, current_ts + state.backoff_ns.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+}
+
+HealthTracker::Shard &HealthTracker::shardOf(const std::string &name) {
+    return shard_list_[std::hash<std::string>{}(name) % kShardCount];
+}
+
+void HealthTracker::markFailure(const std::string &name) {
+    auto &shard = shardOf(name);
+    {
+        RWSpinlock::ReadGuard guard(shard.lock);
+        auto iter = shard.entry_map.find(name);
+        if (iter != shard.entry_map.end()) {
+            markFailure(iter->second, name);
+            return;
+        }
+    }
+    RWSpinlock::WriteGuard guard(shard.lock);
+    auto result = shard.entry_map.try_emplace(name);
+    if (result.second) entry_count_.fetch_add(1, std::memory_order_relaxed);
+    markFailure(result.first->second, name);
+}
+
+void HealthTracker::markSuccess(const std::string &name) {
+    if (empty()) return;
+    auto &shard = shardOf(name);
+    {
+        RWSpinlock::ReadGuard guard(shard.lock);
+        if (!shard.entry_map.count(name)) return;
+    }
+    RWSpinlock::WriteGuard guard(shard.lock);
+    auto iter = shard.entry_map.find(name);
+    if (iter == shard.entry_map.end()) return;
+    markSuccess(iter->second, name);
+    shard.entry_map.erase(iter);
+    entry_count_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool HealthTracker::healthy(const std::string &name) {
+    if (empty()) return true;
+    evictIdleEntries(clock_());
+    auto &shard = shardOf(name);
+    RWSpinlock::ReadGuard guard(shard.lock);
+    auto iter = shard.entry_map.find(name);
+    if (iter == shard.entry_map.end()) return true;
+    return healthy(iter->second);
+}
+
+void HealthTracker::evictIdleEntries(uint64_t current_ts) {
+    uint64_t eviction_ts = next_eviction_ts_.load(std::memory_order_relaxed);
+    if (current_ts < eviction_ts ||
+        !next_eviction_ts_.compare_exchange_strong(
+            eviction_ts, current_ts + max_backoff_ns_,
+            std::memory_order_relaxed))
+        return;
+    const uint64_t kIdleTime = 2 * max_backoff_ns_;
+    for (auto &shard : shard_list_) {
+        RWSpinlock::WriteGuard guard(shard.lock);
+        for (auto iter = shard.entry_map.begin();
+             iter != shard.entry_map.end();) {
+            auto last_use_ts =
+                iter->second.last_use_ts.load(std::memory_order_relaxed);
+            if (last_use_ts + kIdleTime <= current_ts) {
+                LOG(INFO) << "HealthTracker: " << iter->first
+                          << " is evicted after being idle";
+                iter = shard.entry_map.erase(iter);
+                entry_count_.fetch_sub(1, std::memory_order_relaxed);
+            } else {
+                ++iter;
+            }
+        }
+    }
+}
+}  // namespace mooncake
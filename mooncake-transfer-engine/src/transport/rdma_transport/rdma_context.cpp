@@ -27,6 +27,7 @@
 #include "transport/rdma_transport/endpoint_store.h"
 #include "transport/rdma_transport/rdma_endpoint.h"
 #include "transport/rdma_transport/rdma_transport.h"
+#include "transport/rdma_transport/verbs_provider.h"
 #include "transport/rdma_transport/worker_pool.h"
 #include "transport/transport.h"
 
@@ -45,10 +46,11 @@ RdmaContext::RdmaContext(RdmaTransport &engine, const std::string &device_name)
       next_comp_vector_index_(0),
       next_cq_list_index_(0),
       worker_pool_(nullptr),
+      outstanding_bytes_(0),
       active_(true) {
     static std::once_flag g_once_flag;
     auto fork_init = []() {
-        int ret = ibv_fork_init();
+        int ret = verbs().forkInit();
         if (ret) PLOG(ERROR) << "RDMA context setup failed: fork compatibility";
     };
     std::call_once(g_once_flag, fork_init);
@@ -68,7 +70,7 @@ int RdmaContext::construct(size_t num_cq_list, size_t num_comp_channels,
         return ERR_CONTEXT;
     }
 
-    pd_ = ibv_alloc_pd(context_);
+    pd_ = verbs().allocPd(context_);
     if (!pd_) {
         PLOG(ERROR) << "Failed to allocate new protection domain on device "
                     << device_name_;
@@ -78,7 +80,7 @@ int RdmaContext::construct(size_t num_cq_list, size_t num_comp_channels,
     num_comp_channel_ = num_comp_channels;
     comp_channel_ = new ibv_comp_channel *[num_comp_channels];
     for (size_t i = 0; i < num_comp_channels; ++i) {
-        comp_channel_[i] = ibv_create_comp_channel(context_);
+        comp_channel_[i] = verbs().createCompChannel(context_);
         if (!comp_channel_[i]) {
             PLOG(ERROR) << "Failed to create completion channel on device "
                         << device_name_;
@@ -108,10 +110,9 @@ int RdmaContext::construct(size_t num_cq_list, size_t num_comp_channels,
 
     cq_list_.resize(num_cq_list);
     for (size_t i = 0; i < num_cq_list; ++i) {
-        auto cq =
-            ibv_create_cq(context_, max_cqe,
-                          (void *)&cq_list_[i].outstanding /* CQ context */,
-                          compChannel(), compVector());
+        void *cq_context = (void *)&cq_list_[i].outstanding;
+        auto cq = verbs().createCq(context_, max_cqe, cq_context,
+                                   compChannel(), compVector());
         if (!cq) {
             PLOG(ERROR) << "Failed to create completion queue";
             close(event_fd_);
@@ -148,7 +149,7 @@ int RdmaContext::deconstruct() {
     endpoint_store_->destroyQPs();
 
     for (auto &entry : memory_region_list_) {
-        int ret = ibv_dereg_mr(entry);
+        int ret = verbs().deregMr(entry);
         if (ret) {
             PLOG(ERROR) << "Failed to unregister memory region";
         }
@@ -156,7 +157,7 @@ int RdmaContext::deconstruct() {
     memory_region_list_.clear();
 
     for (size_t i = 0; i < cq_list_.size(); ++i) {
-        int ret = ibv_destroy_cq(cq_list_[i].native);
+        int ret = verbs().destroyCq(cq_list_[i].native);
         if (ret) {
             PLOG(ERROR) << "Failed to destroy completion queue";
         }
@@ -171,20 +172,20 @@ int RdmaContext::deconstruct() {
     if (comp_channel_) {
         for (size_t i = 0; i < num_comp_channel_; ++i)
             if (comp_channel_[i])
-                if (ibv_destroy_comp_channel(comp_channel_[i]))
+                if (verbs().destroyCompChannel(comp_channel_[i]))
                     LOG(ERROR) << "Failed to destroy completion channel";
         delete[] comp_channel_;
         comp_channel_ = nullptr;
     }
 
     if (pd_) {
-        if (ibv_dealloc_pd(pd_))
+        if (verbs().deallocPd(pd_))
             PLOG(ERROR) << "Failed to deallocate protection domain";
         pd_ = nullptr;
     }
 
     if (context_) {
-        if (ibv_close_device(context_))
+        if (verbs().closeDevice(context_))
             PLOG(ERROR) << "Failed to close device context";
         context_ = nullptr;
     }
@@ -196,7 +197,7 @@ int RdmaContext::deconstruct() {
 }
 
 int RdmaContext::registerMemoryRegion(void *addr, size_t length, int access) {
-    ibv_mr *mr = ibv_reg_mr(pd_, addr, length, access);
+    ibv_mr *mr = verbs().regMr(pd_, addr, length, access);
     if (!mr) {
         PLOG(ERROR) << "Failed to register memory " << addr;
         return ERR_CONTEXT;
@@ -226,7 +227,7 @@ int RdmaContext::unregisterMemoryRegion(void *addr) {
              iter != memory_region_list_.end(); ++iter) {
             if ((*iter)->addr <= addr &&
                 addr < (char *)((*iter)->addr) + (*iter)->length) {
-                if (ibv_dereg_mr(*iter)) {
+                if (verbs().deregMr(*iter)) {
                     LOG(ERROR) << "Failed to unregister memory " << addr;
                     return ERR_CONTEXT;
                 }
@@ -340,7 +341,7 @@ int RdmaContext::getBestGidIndex(const std::string &device_name,
     struct ibv_gid_entry gid_entry;
 
     for (i = 0; i < port_attr.gid_tbl_len; i++) {
-        if (ibv_query_gid_ex(context, port, i, &gid_entry, 0)) {
+        if (verbs().queryGidEx(context, port, i, &gid_entry, 0)) {
             PLOG(ERROR) << "Failed to query GID " << i << " on "
                         << device_name << "/" << port;
             continue; // if gid is invalid ibv_query_gid_ex() will return !0
@@ -359,63 +360,63 @@ int RdmaContext::openRdmaDevice(const std::string &device_name, uint8_t port,
                                 int gid_index) {
     int num_devices = 0;
     struct ibv_context *context = nullptr;
-    struct ibv_device **devices = ibv_get_device_list(&num_devices);
+    struct ibv_device **devices = verbs().getDeviceList(&num_devices);
     if (!devices || num_devices <= 0) {
         LOG(ERROR) << "ibv_get_device_list failed";
         return ERR_DEVICE_NOT_FOUND;
     }
 
     for (int i = 0; i < num_devices; ++i) {
-        if (device_name != ibv_get_device_name(devices[i])) continue;
+        if (device_name != verbs().getDeviceName(devices[i])) continue;
 
-        context = ibv_open_device(devices[i]);
+        context = verbs().openDevice(devices[i]);
         if (!context) {
             LOG(ERROR) << "ibv_open_device(" << device_name << ") failed";
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 
         ibv_port_attr attr;
-        int ret = ibv_query_port(context, port, &attr);
+        int ret = verbs().queryPort(context, port, &attr);
         if (ret) {
             PLOG(ERROR) << "Failed to query port " << port << " on "
                         << device_name;
-            if (ibv_close_device(context)) {
+            if (verbs().closeDevice(context)) {
                 PLOG(ERROR) << "ibv_close_device(" << device_name << ") failed";
             }
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 
         if (attr.state != IBV_PORT_ACTIVE) {
             LOG(WARNING) << "Device " << device_name << " port not active";
-            if (ibv_close_device(context)) {
+            if (verbs().closeDevice(context)) {
                 PLOG(ERROR) << "ibv_close_device(" << device_name << ") failed";
             }
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 
         ibv_device_attr device_attr;
-        ret = ibv_query_device(context, &device_attr);
+        ret = verbs().queryDevice(context, &device_attr);
         if (ret) {
             PLOG(WARNING) << "Failed to query attributes on " << device_name;
-            if (ibv_close_device(context)) {
+            if (verbs().closeDevice(context)) {
                 PLOG(ERROR) << "ibv_close_device(" << device_name << ") failed";
             }
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 
         ibv_port_attr port_attr;
-        ret = ibv_query_port(context, port, &port_attr);
+        ret = verbs().queryPort(context, port, &port_attr);
         if (ret) {
             PLOG(WARNING) << "Failed to query port attributes on "
                           << device_name << "/" << port;
-            if (ibv_close_device(context)) {
+            if (verbs().closeDevice(context)) {
                 PLOG(ERROR) << "ibv_close_device(" << device_name << ") failed";
             }
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 
@@ -429,14 +430,14 @@ int RdmaContext::openRdmaDevice(const std::string &device_name, uint8_t port,
             }
         }
 
-        ret = ibv_query_gid(context, port, gid_index, &gid_);
+        ret = verbs().queryGid(context, port, gid_index, &gid_);
         if (ret) {
             PLOG(ERROR) << "Failed to query GID " << gid_index << " on "
                         << device_name << "/" << port;
-            if (ibv_close_device(context)) {
+            if (verbs().closeDevice(context)) {
                 PLOG(ERROR) << "ibv_close_device(" << device_name << ") failed";
             }
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 
@@ -444,10 +445,10 @@ int RdmaContext::openRdmaDevice(const std::string &device_name, uint8_t port,
         if (isNullGid(&gid_)) {
             LOG(WARNING) << "GID is NULL, please check your GID index by "
                             "specifying MC_GID_INDEX";
-            if (ibv_close_device(context)) {
+            if (verbs().closeDevice(context)) {
                 PLOG(ERROR) << "ibv_close_device(" << device_name << ") failed";
             }
-            ibv_free_device_list(devices);
+            verbs().freeDeviceList(devices);
             return ERR_CONTEXT;
         }
 #endif  // CONFIG_SKIP_NULL_GID_CHECK
@@ -457,13 +458,14 @@ int RdmaContext::openRdmaDevice(const std::string &device_name, uint8_t port,
         lid_ = attr.lid;
         active_mtu_ = attr.active_mtu;
         active_speed_ = attr.active_speed;
+        if (attr.max_msg_sz) max_msg_size_ = attr.max_msg_sz;
         gid_index_ = gid_index;
 
-        ibv_free_device_list(devices);
+        verbs().freeDeviceList(devices);
         return 0;
     }
 
-    ibv_free_device_list(devices);
+    verbs().freeDeviceList(devices);
     LOG(ERROR) << "No matched device found: " << device_name;
     return ERR_DEVICE_NOT_FOUND;
 }
@@ -493,7 +495,7 @@ int RdmaContext::joinNonblockingPollList(int event_fd, int data_fd) {
 }
 
 int RdmaContext::poll(int num_entries, ibv_wc *wc, int cq_index) {
-    int nr_poll = ibv_poll_cq(cq_list_[cq_index].native, num_entries, wc);
+    int nr_poll = verbs().pollCq(cq_list_[cq_index].native, num_entries, wc);
     if (nr_poll < 0) {
         LOG(ERROR) << "Failed to poll CQ " << cq_index << " of device "
                    << device_name_;
@@ -504,6 +506,11 @@ int RdmaContext::poll(int num_entries, ibv_wc *wc, int cq_index) {
 
 int RdmaContext::submitPostSend(
     const std::vector<Transport::Slice *> &slice_list) {
-    return worker_pool_->submitPostSend(slice_list);
+    uint64_t length = 0;
+    for (auto &slice : slice_list) length += slice->length;
+    outstanding_bytes_.fetch_add(length, std::memory_order_relaxed);
+    int ret = worker_pool_->submitPostSend(slice_list);
+    if (ret) outstanding_bytes_.fetch_sub(length, std::memory_order_relaxed);
+    return ret;
 }
 }  // namespace mooncake
\ No newline at end of file
@@ -16,10 +16,12 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 
 #include "config.h"
+#include "transport/rdma_transport/verbs_provider.h"
 
 namespace mooncake {
 const static uint8_t MAX_HOP_LIMIT = 16;
@@ -29,6 +31,7 @@ const static uint8_t RETRY_CNT = 7;
 RdmaEndPoint::RdmaEndPoint(RdmaContext &context)
     : context_(context),
       status_(INITIALIZING),
+      max_inline_bytes_(0),
       active_(true),
       cq_outstanding_(nullptr) {}
 
@@ -48,11 +51,13 @@ int RdmaEndPoint::construct(ibv_cq *cq, size_t num_qp_list,
     cq_outstanding_ = (volatile int *)cq->cq_context;
 
     max_wr_depth_ = (int)max_wr_depth;
+    max_inline_bytes_ = max_inline_bytes;
     wr_depth_list_ = new volatile int[num_qp_list];
     if (!wr_depth_list_) {
         LOG(ERROR) << "Failed to allocate memory for work request depth list";
         return ERR_MEMORY;
     }
+    post_lock_list_.reset(new TicketLock[num_qp_list]);
     for (size_t i = 0; i < num_qp_list; ++i) {
         wr_depth_list_[i] = 0;
         ibv_qp_init_attr attr;
@@ -64,11 +69,14 @@ int RdmaEndPoint::construct(ibv_cq *cq, size_t num_qp_list,
         attr.cap.max_send_wr = attr.cap.max_recv_wr = max_wr_depth;
         attr.cap.max_send_sge = attr.cap.max_recv_sge = max_sge_per_wr;
         attr.cap.max_inline_data = max_inline_bytes;
-        qp_list_[i] = ibv_create_qp(context_.pd(), &attr);
+        qp_list_[i] = verbs().createQp(context_.pd(), &attr);
         if (!qp_list_[i]) {
             PLOG(ERROR) << "Failed to create QP";
             return ERR_ENDPOINT;
         }
+        // The provider reports the inline size it actually supports
+        max_inline_bytes_ =
+            std::min(max_inline_bytes_, (size_t)attr.cap.max_inline_data);
     }
 
     status_.store(UNCONNECTED, std::memory_order_relaxed);
@@ -81,7 +89,7 @@ int RdmaEndPoint::deconstruct() {
             LOG(WARNING)
                 << "Outstanding work requests found, CQ will not be generated";
 
-        if (ibv_destroy_qp(qp_list_[i])) {
+        if (verbs().destroyQp(qp_list_[i])) {
             PLOG(ERROR) << "Failed to destroy QP";
             return ERR_ENDPOINT;
         }
@@ -112,6 +120,8 @@ int RdmaEndPoint::setupConnectionsByActive() {
     local_desc.local_nic_path = context_.nicPath();
     local_desc.peer_nic_path = peer_nic_path_;
     local_desc.qp_num = qpNum();
+    local_desc.local_gid = context_.gid();
+    local_desc.local_lid = context_.lid();
 
     auto peer_server_name = getServerNameFromNicPath(peer_nic_path_);
     auto peer_nic_name = getNicNameFromNicPath(peer_nic_path_);
@@ -130,6 +140,9 @@ int RdmaEndPoint::setupConnectionsByActive() {
         return ERR_REJECT_HANDSHAKE;
     }
 
+    if (!peer_desc.local_gid.empty())
+        return doSetupConnection(peer_desc.local_gid, peer_desc.local_lid,
+                                 peer_desc.qp_num);
     auto segment_desc =
         context_.engine().meta()->getSegmentDescByName(peer_server_name);
     if (segment_desc) {
@@ -168,7 +181,16 @@ int RdmaEndPoint::setupConnectionsByPassive(const HandShakeDesc &peer_desc,
     local_desc.local_nic_path = context_.nicPath();
     local_desc.peer_nic_path = peer_nic_path_;
     local_desc.qp_num = qpNum();
-
+    local_desc.local_gid = context_.gid();
+    local_desc.local_lid = context_.lid();
+
+    // Runs on the thread of the handshake daemon, which also serves the
+    // segments of this process to peers. Fetching the segment of the peer
+    // here, from its daemon in peer-to-peer mode, may wait for a peer that
+    // is waiting for us, so it is only done for peers not sending their NIC.
+    if (!peer_desc.local_gid.empty())
+        return doSetupConnection(peer_desc.local_gid, peer_desc.local_lid,
+                                 peer_desc.qp_num, &local_desc.reply_msg);
     auto segment_desc =
         context_.engine().meta()->getSegmentDescByName(peer_server_name);
     if (segment_desc) {
@@ -197,7 +219,7 @@ void RdmaEndPoint::disconnectUnlocked() {
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RESET;
     for (size_t i = 0; i < qp_list_.size(); ++i) {
-        int ret = ibv_modify_qp(qp_list_[i], &attr, IBV_QP_STATE);
+        int ret = verbs().modifyQp(qp_list_[i], &attr, IBV_QP_STATE);
         if (ret) PLOG(ERROR) << "Failed to modify QP to RESET";
     }
     peer_nic_path_.clear();
@@ -224,32 +246,87 @@ bool RdmaEndPoint::hasOutstandingSlice() const {
 int RdmaEndPoint::submitPostSend(
     std::vector<Transport::Slice *> &slice_list,
     std::vector<Transport::Slice *> &failed_slice_list) {
-    RWSpinlock::WriteGuard guard(lock_);
-    int qp_index = SimpleRandom::Get().next(qp_list_.size());
+    bool reset = false;
+    {
+        // Workers post to different QPs in parallel, connecting and
+        // disconnecting exclude them all
+        RWSpinlock::ReadGuard guard(lock_);
+        int qp_count = qp_list_.size();
+        int qp_index = SimpleRandom::Get().next(qp_count);
+        bool locked = false;
+        for (int i = 0; i < qp_count && !locked; ++i) {
+            if (post_lock_list_[(qp_index + i) % qp_count].try_lock()) {
+                qp_index = (qp_index + i) % qp_count;
+                locked = true;
+            }
+        }
+        if (!locked) post_lock_list_[qp_index].lock();
+        reset = postSend(qp_index, slice_list, failed_slice_list);
+        post_lock_list_[qp_index].unlock();
+    }
+    if (reset) {
+        RWSpinlock::WriteGuard guard(lock_);
+        disconnectUnlocked();
+    }
+    return 0;
+}
+
+bool RdmaEndPoint::postSend(
+    int qp_index, std::vector<Transport::Slice *> &slice_list,
+    std::vector<Transport::Slice *> &failed_slice_list) {
     int wr_count = std::min(max_wr_depth_ - wr_depth_list_[qp_index],
                             (int)slice_list.size());
     wr_count =
         std::min(int(globalConfig().max_cqe) - *cq_outstanding_, wr_count);
-    if (wr_count <= 0) return 0;
+    if (wr_count <= 0) return false;
+
+    int sge_count = 0;
+    for (int i = 0; i < wr_count; ++i)
+        sge_count += std::max(size_t(1), slice_list[i]->sg_list.size());
 
+    const int kSignalInterval = globalConfig().signal_interval;
+    Transport::Slice *unsignaled_slice = nullptr;
     ibv_send_wr wr_list[wr_count], *bad_wr = nullptr;
-    ibv_sge sge_list[wr_count];
+    ibv_sge sge_list[sge_count];
     memset(wr_list, 0, sizeof(ibv_send_wr) * wr_count);
-    for (int i = 0; i < wr_count; ++i) {
+    for (int i = 0, sge_index = 0; i < wr_count; ++i) {
         auto slice = slice_list[i];
-        auto &sge = sge_list[i];
-        sge.addr = (uint64_t)slice->source_addr;
-        sge.length = slice->length;
-        sge.lkey = slice->rdma.source_lkey;
+        auto sge = &sge_list[sge_index];
+        int num_sge = 0;
+        if (slice->sg_list.empty()) {
+            sge[0].addr = (uint64_t)slice->source_addr;
+            sge[0].length = slice->length;
+            sge[0].lkey = slice->rdma.source_lkey;
+            num_sge = 1;
+        } else {
+            for (auto &entry : slice->sg_list) {
+                sge[num_sge].addr = (uint64_t)entry.addr;
+                sge[num_sge].length = entry.length;
+                sge[num_sge].lkey = entry.lkey;
+                num_sge++;
+            }
+        }
+        sge_index += num_sge;
 
         auto &wr = wr_list[i];
         wr.wr_id = (uint64_t)slice;
         wr.opcode = slice->opcode == Transport::TransferRequest::READ
                         ? IBV_WR_RDMA_READ
                         : IBV_WR_RDMA_WRITE;
-        wr.num_sge = 1;
-        wr.sg_list = &sge;
-        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.num_sge = num_sge;
+        wr.sg_list = sge;
+        if (wr.opcode == IBV_WR_RDMA_WRITE &&
+            slice->length <= max_inline_bytes_)
+            wr.send_flags |= IBV_SEND_INLINE;
+        slice->rdma.covered_slice = unsignaled_slice;
+        slice->rdma.extra_wr_count = 0;
+        if ((i + 1) % kSignalInterval == 0 || i + 1 == wr_count) {
+            wr.send_flags |= IBV_SEND_SIGNALED;
+            unsignaled_slice = nullptr;
+        } else {
+            wr.wr_id |= kUnsignaledFlag;
+            unsignaled_slice = slice;
+        }
         wr.next = (i + 1 == wr_count) ? nullptr : &wr_list[i + 1];
         wr.imm_data = 0;
         wr.wr.rdma.remote_addr = slice->rdma.dest_addr;
@@ -265,18 +342,53 @@ int RdmaEndPoint::submitPostSend(
     }
     __sync_fetch_and_add(&wr_depth_list_[qp_index], wr_count);
     __sync_fetch_and_add(cq_outstanding_, wr_count);
-    int rc = ibv_post_send(qp_list_[qp_index], wr_list, &bad_wr);
+    int rc = verbs().postSend(qp_list_[qp_index], wr_list, &bad_wr);
     if (rc) {
         PLOG(ERROR) << "Failed to ibv_post_send";
-        while (bad_wr) {
-            int i = bad_wr - wr_list;
-            failed_slice_list.push_back(slice_list[i]);
-            __sync_fetch_and_sub(&wr_depth_list_[qp_index], 1);
-            __sync_fetch_and_sub(cq_outstanding_, 1);
-            bad_wr = bad_wr->next;
+        int posted = bad_wr ? bad_wr - wr_list : wr_count;
+        int unposted = wr_count - posted;
+        // Posted work requests stay in the send queue and keep their share
+        // of the depth. Unsignaled ones after the last signaled one would
+        // never report completion, so their group is ended by an empty write
+        // taking the slot of the first unposted work request.
+        if (posted > 0 && (wr_list[posted - 1].wr_id & kUnsignaledFlag)) {
+            if (postGroupEnd(qp_index, slice_list[posted - 1]) == 0) {
+                --unposted;
+            } else {
+                // Nothing in the send queue is executed or completed after
+                // the reset, so the whole call is submitted again.
+                __sync_fetch_and_sub(cq_outstanding_, wr_count);
+                failed_slice_list.insert(failed_slice_list.end(),
+                                         slice_list.begin(),
+                                         slice_list.begin() + wr_count);
+                slice_list.erase(slice_list.begin(),
+                                 slice_list.begin() + wr_count);
+                return true;
+            }
         }
+        for (int i = posted; i < wr_count; ++i)
+            failed_slice_list.push_back(slice_list[i]);
+        __sync_fetch_and_sub(&wr_depth_list_[qp_index], unposted);
+        __sync_fetch_and_sub(cq_outstanding_, unposted);
     }
     slice_list.erase(slice_list.begin(), slice_list.begin() + wr_count);
+    return false;
+}
+
+int RdmaEndPoint::postGroupEnd(int qp_index, Transport::Slice *slice) {
+    ibv_send_wr wr, *bad_wr = nullptr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uint64_t)slice;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = slice->rdma.dest_addr;
+    wr.wr.rdma.rkey = slice->rdma.dest_rkey;
+    slice->rdma.extra_wr_count = 1;
+    if (verbs().postSend(qp_list_[qp_index], &wr, &bad_wr)) {
+        PLOG(ERROR) << "Failed to ibv_post_send the end of a group";
+        slice->rdma.extra_wr_count = 0;
+        return ERR_ENDPOINT;
+    }
     return 0;
 }
 
@@ -321,7 +433,7 @@ int RdmaEndPoint::doSetupConnection(int qp_index, const std::string &peer_gid,
     ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RESET;
-    int ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+    int ret = verbs().modifyQp(qp, &attr, IBV_QP_STATE);
     if (ret) {
         std::string message = "Failed to modify QP to RESET";
         PLOG(ERROR) << "[Handshake] " << message;
@@ -336,7 +448,7 @@ int RdmaEndPoint::doSetupConnection(int qp_index, const std::string &peer_gid,
     attr.pkey_index = 0;
     attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
                            IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
-    ret = ibv_modify_qp(
+    ret = verbs().modifyQp(
         qp, &attr,
         IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
     if (ret) {
@@ -375,10 +487,10 @@ int RdmaEndPoint::doSetupConnection(int qp_index, const std::string &peer_gid,
     attr.rq_psn = 0;
     attr.max_dest_rd_atomic = 16;
     attr.min_rnr_timer = 12;  // 12 in previous implementation
-    ret = ibv_modify_qp(qp, &attr,
-                        IBV_QP_STATE | IBV_QP_PATH_MTU | IBV_QP_MIN_RNR_TIMER |
-                            IBV_QP_AV | IBV_QP_MAX_DEST_RD_ATOMIC |
-                            IBV_QP_DEST_QPN | IBV_QP_RQ_PSN);
+    ret = verbs().modifyQp(
+        qp, &attr,
+        IBV_QP_STATE | IBV_QP_PATH_MTU | IBV_QP_MIN_RNR_TIMER | IBV_QP_AV |
+            IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN);
     if (ret) {
         std::string message =
             "Failed to modify QP to RTR, check mtu, gid, peer lid, peer qp num";
@@ -395,10 +507,10 @@ int RdmaEndPoint::doSetupConnection(int qp_index, const std::string &peer_gid,
     attr.rnr_retry = 7;  // or 7,RNR error
     attr.sq_psn = 0;
     attr.max_rd_atomic = 16;
-    ret = ibv_modify_qp(qp, &attr,
-                        IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
-                            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
-                            IBV_QP_MAX_QP_RD_ATOMIC);
+    ret = verbs().modifyQp(qp, &attr,
+                           IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                               IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                               IBV_QP_MAX_QP_RD_ATOMIC);
     if (ret) {
         std::string message = "Failed to modify QP to RTS";
         PLOG(ERROR) << "[Handshake] " << message;
@@ -18,10 +18,12 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
-#include <future>
+#include <functional>
 #include <set>
+#include <thread>
 
 #include "common.h"
 #include "config.h"
@@ -31,14 +33,23 @@
 #include "transport/rdma_transport/rdma_endpoint.h"
 
 namespace mooncake {
-RdmaTransport::RdmaTransport() {}
+const static uint64_t kInitialBackoffInNano = 10000000;  // 10ms
+const static uint64_t kMaxBackoffInNano = 10000000000;   // 10s
+// Failures of a local device may come from its peers, so it is only
+// avoided after failing with several of them in a row.
+const static int kDeviceFailureThreshold = 4;
+
+RdmaTransport::RdmaTransport()
+    : device_health_(kInitialBackoffInNano, kMaxBackoffInNano,
+                     kDeviceFailureThreshold),
+      peer_health_(kInitialBackoffInNano, kMaxBackoffInNano) {}
 
 RdmaTransport::~RdmaTransport() {
 #ifdef CONFIG_USE_BATCH_DESC_SET
     for (auto &entry : batch_desc_set_) delete entry.second;
     batch_desc_set_.clear();
 #endif
-    metadata_->removeSegmentDesc(local_server_name_);
+    if (metadata_) metadata_->removeSegmentDesc(local_server_name_);
     batch_desc_set_.clear();
     context_list_.clear();
 }
@@ -88,6 +99,15 @@ int RdmaTransport::registerLocalMemory(void *addr, size_t length,
                                        bool remote_accessible,
                                        bool update_metadata) {
     (void)remote_accessible;
+    std::vector<BufferDesc> buffer_list;
+    int ret = registerMemoryRegions(addr, length, name, buffer_list);
+    if (ret) return ret;
+    return metadata_->addLocalMemoryBuffers(buffer_list, update_metadata);
+}
+
+int RdmaTransport::registerMemoryRegions(void *addr, size_t length,
+                                         const std::string &name,
+                                         std::vector<BufferDesc> &buffer_list) {
     BufferDesc buffer_desc;
     const static int access_rights = IBV_ACCESS_LOCAL_WRITE |
                                      IBV_ACCESS_REMOTE_WRITE |
@@ -103,22 +123,19 @@ int RdmaTransport::registerLocalMemory(void *addr, size_t length,
     // when the name is "*".
     if (name == "*") {
         const std::vector<MemoryLocationEntry> entries =
-            getMemoryLocation(addr, length);
+            getMemoryLocation(addr, length,
+                              globalConfig().sample_memory_location);
         for (auto &entry : entries) {
             buffer_desc.name = entry.location;
             buffer_desc.addr = entry.start;
             buffer_desc.length = entry.len;
-            int rc =
-                metadata_->addLocalMemoryBuffer(buffer_desc, update_metadata);
-            if (rc) return rc;
+            buffer_list.push_back(buffer_desc);
         }
     } else {
         buffer_desc.name = name;
         buffer_desc.addr = (uint64_t)addr;
         buffer_desc.length = length;
-        int rc = metadata_->addLocalMemoryBuffer(buffer_desc, update_metadata);
-
-        if (rc) return rc;
+        buffer_list.push_back(buffer_desc);
     }
 
     return 0;
@@ -151,46 +168,64 @@ int RdmaTransport::allocateLocalSegmentID() {
     return 0;
 }
 
+// Runs task(0) ... task(count - 1) on at most one thread per hardware
+// thread, the calling one included.
+static void parallelFor(size_t count,
+                        const std::function<void(size_t)> &task) {
+    std::atomic<size_t> next_index(0);
+    auto worker = [&]() {
+        for (size_t i = next_index++; i < count; i = next_index++) task(i);
+    };
+    size_t num_threads = std::min(
+        count, (size_t)std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads) thread.join();
+}
+
 int RdmaTransport::registerLocalMemoryBatch(
     const std::vector<RdmaTransport::BufferEntry> &buffer_list,
     const std::string &location) {
-    std::vector<std::future<int>> results;
-    for (auto &buffer : buffer_list) {
-        results.emplace_back(
-            std::async(std::launch::async, [this, buffer, location]() -> int {
-                return registerLocalMemory(buffer.addr, buffer.length, location,
-                                           true, false);
-            }));
-    }
-
+    // Memory regions are registered in parallel, and the buffers are
+    // published at once.
+    std::vector<int> results(buffer_list.size());
+    std::vector<std::vector<BufferDesc>> buffer_desc_list(buffer_list.size());
+    parallelFor(buffer_list.size(), [&](size_t i) {
+        results[i] = registerMemoryRegions(buffer_list[i].addr,
+                                           buffer_list[i].length, location,
+                                           buffer_desc_list[i]);
+    });
+
+    std::vector<BufferDesc> registered_buffer_list;
     for (size_t i = 0; i < buffer_list.size(); ++i) {
-        if (results[i].get()) {
+        if (results[i]) {
             LOG(WARNING) << "RdmaTransport: Failed to register memory: addr "
                          << buffer_list[i].addr << " length "
                          << buffer_list[i].length;
+            continue;
         }
+        registered_buffer_list.insert(registered_buffer_list.end(),
+                                      buffer_desc_list[i].begin(),
+                                      buffer_desc_list[i].end());
     }
 
-    return metadata_->updateLocalSegmentDesc();
+    return metadata_->addLocalMemoryBuffers(registered_buffer_list, true);
 }
 
 int RdmaTransport::unregisterLocalMemoryBatch(
     const std::vector<void *> &addr_list) {
-    std::vector<std::future<int>> results;
-    for (auto &addr : addr_list) {
-        results.emplace_back(
-            std::async(std::launch::async, [this, addr]() -> int {
-                return unregisterLocalMemory(addr, false);
-            }));
-    }
-
-    for (size_t i = 0; i < addr_list.size(); ++i) {
-        if (results[i].get())
-            LOG(WARNING) << "RdmaTransport: Failed to unregister memory: addr "
-                         << addr_list[i];
-    }
-
-    return metadata_->updateLocalSegmentDesc();
+    int rc = metadata_->removeLocalMemoryBuffers(addr_list, true);
+    if (rc && rc != ERR_ADDRESS_NOT_REGISTERED) return rc;
+    if (rc)
+        LOG(WARNING) << "RdmaTransport: Failed to unregister some of the "
+                        "memory: not registered";
+
+    parallelFor(addr_list.size(), [&](size_t i) {
+        for (auto &context : context_list_)
+            context->unregisterMemoryRegion(addr_list[i]);
+    });
+    return 0;
 }
 
 Status RdmaTransport::submitTransfer(BatchID batch_id,
@@ -209,17 +244,22 @@ Status RdmaTransport::submitTransfer(BatchID batch_id,
     size_t task_id = batch_desc.task_list.size();
     batch_desc.task_list.resize(task_id + entries.size());
     auto local_segment_desc = metadata_->getSegmentDescByID(LOCAL_SEGMENT_ID);
-    const size_t kBlockSize = globalConfig().slice_size;
     const int kMaxRetryCount = globalConfig().retry_cnt;
+    std::vector<uint64_t> assigned_bytes(context_list_.size(), 0);
+    auto device_load = localDeviceLoad(assigned_bytes);
 
     for (auto &request : entries) {
         TransferTask &task = batch_desc.task_list[task_id];
         ++task_id;
+        const size_t slice_size =
+            selectSliceSize(local_segment_desc.get(),
+                            (uint64_t)request.source, request.length,
+                            max_msg_size_);
         for (uint64_t offset = 0; offset < request.length;
-             offset += kBlockSize) {
+             offset += slice_size) {
             auto slice = new Slice();
             slice->source_addr = (char *)request.source + offset;
-            slice->length = std::min(request.length - offset, kBlockSize);
+            slice->length = std::min(request.length - offset, slice_size);
             slice->opcode = request.opcode;
             slice->rdma.dest_addr = request.target_offset + offset;
             slice->rdma.retry_cnt = 0;
@@ -228,22 +268,10 @@ Status RdmaTransport::submitTransfer(BatchID batch_id,
             slice->target_id = request.target_id;
             slice->status = Slice::PENDING;
 
-            int buffer_id = -1, device_id = -1, retry_cnt = 0;
-            while (retry_cnt < kMaxRetryCount) {
-                if (selectDevice(local_segment_desc.get(),
-                                 (uint64_t)slice->source_addr, slice->length,
-                                 buffer_id, device_id, retry_cnt++))
-                    continue;
-                auto &context = context_list_[device_id];
-                if (!context->active()) continue;
-                slice->rdma.source_lkey =
-                    local_segment_desc->buffers[buffer_id].lkey[device_id];
-                slices_to_post[context].push_back(slice);
-                task.total_bytes += slice->length;
-                task.slice_count++;
-                break;
-            }
-            if (device_id < 0) {
+            int buffer_id = -1, device_id = -1;
+            if (selectLocalDevice(local_segment_desc.get(),
+                                  (uint64_t)slice->source_addr, slice->length,
+                                  buffer_id, device_id, device_load)) {
                 LOG(ERROR)
                     << "RdmaTransport: Address not registered by any device(s) "
                     << slice->source_addr;
@@ -252,6 +280,12 @@ Status RdmaTransport::submitTransfer(BatchID batch_id,
                     + std::to_string(
                         reinterpret_cast<uintptr_t>(slice->source_addr)));
             }
+            slice->rdma.source_lkey =
+                local_segment_desc->buffers[buffer_id].lkey[device_id];
+            slices_to_post[context_list_[device_id]].push_back(slice);
+            assigned_bytes[device_id] += slice->length;
+            task.total_bytes += slice->length;
+            task.slice_count++;
         }
     }
     for (auto &entry : slices_to_post)
@@ -265,16 +299,21 @@ Status RdmaTransport::submitTransferTask(
     std::unordered_map<std::shared_ptr<RdmaContext>, std::vector<Slice *>>
         slices_to_post;
     auto local_segment_desc = metadata_->getSegmentDescByID(LOCAL_SEGMENT_ID);
-    const size_t kBlockSize = globalConfig().slice_size;
     const int kMaxRetryCount = globalConfig().retry_cnt;
+    std::vector<uint64_t> assigned_bytes(context_list_.size(), 0);
+    auto device_load = localDeviceLoad(assigned_bytes);
     for (size_t index = 0; index < request_list.size(); ++index) {
         auto &request = *request_list[index];
         auto &task = *task_list[index];
+        const size_t slice_size =
+            selectSliceSize(local_segment_desc.get(),
+                            (uint64_t)request.source, request.length,
+                            max_msg_size_);
         for (uint64_t offset = 0; offset < request.length;
-             offset += kBlockSize) {
+             offset += slice_size) {
             auto slice = new Slice();
             slice->source_addr = (char *)request.source + offset;
-            slice->length = std::min(request.length - offset, kBlockSize);
+            slice->length = std::min(request.length - offset, slice_size);
             slice->opcode = request.opcode;
             slice->rdma.dest_addr = request.target_offset + offset;
             slice->rdma.retry_cnt = 0;
@@ -283,31 +322,119 @@ Status RdmaTransport::submitTransferTask(
             slice->target_id = request.target_id;
             slice->status = Slice::PENDING;
 
-            int buffer_id = -1, device_id = -1, retry_cnt = 0;
-            while (retry_cnt < kMaxRetryCount) {
-                if (selectDevice(local_segment_desc.get(),
-                                 (uint64_t)slice->source_addr, slice->length,
-                                 buffer_id, device_id, retry_cnt++))
-                    continue;
-                auto &context = context_list_[device_id];
-                if (!context->active()) continue;
-                slice->rdma.source_lkey =
+            int buffer_id = -1, device_id = -1;
+            if (selectLocalDevice(local_segment_desc.get(),
+                                  (uint64_t)slice->source_addr, slice->length,
+                                  buffer_id, device_id, device_load)) {
+                LOG(ERROR)
+                    << "RdmaTransport: Address not registered by any device(s) "
+                    << slice->source_addr;
+                return Status::AddressNotRegistered(
+                    "RdmaTransport: not registered by any device(s), address: "
+                    + std::to_string(
+                        reinterpret_cast<uintptr_t>(slice->source_addr)));
+            }
+            slice->rdma.source_lkey =
+                local_segment_desc->buffers[buffer_id].lkey[device_id];
+            slices_to_post[context_list_[device_id]].push_back(slice);
+            assigned_bytes[device_id] += slice->length;
+            task.total_bytes += slice->length;
+            task.slice_count++;
+        }
+    }
+    for (auto &entry : slices_to_post)
+        entry.first->submitPostSend(entry.second);
+    return Status::OK();
+}
+
+Status RdmaTransport::submitVectoredTransferTask(
+    const std::vector<VectoredTransferRequest *> &request_list,
+    const std::vector<TransferTask *> &task_list) {
+    std::unordered_map<std::shared_ptr<RdmaContext>, std::vector<Slice *>>
+        slices_to_post;
+    auto local_segment_desc = metadata_->getSegmentDescByID(LOCAL_SEGMENT_ID);
+    const size_t kMaxSge = globalConfig().max_sge;
+    const int kMaxRetryCount = globalConfig().retry_cnt;
+    std::vector<uint64_t> assigned_bytes(context_list_.size(), 0);
+    auto device_load = localDeviceLoad(assigned_bytes);
+    for (size_t index = 0; index < request_list.size(); ++index) {
+        auto &request = *request_list[index];
+        auto &task = *task_list[index];
+        auto &source_list = request.source_list;
+        size_t source_index = 0, source_offset = 0;
+        uint64_t target_offset = request.target_offset;
+        const size_t slice_size = selectSliceSize(
+            local_segment_desc.get(),
+            source_list.empty() ? 0 : (uint64_t)source_list[0].addr,
+            request.length(), max_msg_size_);
+        while (true) {
+            while (source_index < source_list.size() &&
+                   !source_list[source_index].length)
+                ++source_index;
+            if (source_index == source_list.size()) break;
+
+            // Gather up to kMaxSge local pieces, slice_size bytes in total,
+            // into a single work request.
+            auto slice = new Slice();
+            slice->length = 0;
+            while (source_index < source_list.size() &&
+                   slice->sg_list.size() < kMaxSge &&
+                   slice->length < slice_size) {
+                auto &entry = source_list[source_index];
+                size_t length = std::min(entry.length - source_offset,
+                                         slice_size - slice->length);
+                if (length)
+                    slice->sg_list.push_back(
+                        {(char *)entry.addr + source_offset, length, 0});
+                slice->length += length;
+                source_offset += length;
+                if (source_offset == entry.length) {
+                    ++source_index;
+                    source_offset = 0;
+                }
+            }
+            slice->source_addr = slice->sg_list[0].addr;
+            slice->opcode = request.opcode;
+            slice->rdma.dest_addr = target_offset;
+            slice->rdma.retry_cnt = 0;
+            slice->rdma.max_retry_cnt = kMaxRetryCount;
+            slice->task = &task;
+            slice->target_id = request.target_id;
+            slice->status = Slice::PENDING;
+            target_offset += slice->length;
+
+            int buffer_id = -1, device_id = -1;
+            if (selectLocalDevice(local_segment_desc.get(),
+                                  (uint64_t)slice->source_addr,
+                                  slice->sg_list[0].length, buffer_id,
+                                  device_id, device_load))
+                device_id = -1;
+            for (auto &sge : slice->sg_list) {
+                if (device_id < 0) break;
+                buffer_id = findBuffer(local_segment_desc.get(),
+                                       (uint64_t)sge.addr, sge.length);
+                if (buffer_id < 0) {
+                    device_id = -1;
+                    break;
+                }
+                sge.lkey =
                     local_segment_desc->buffers[buffer_id].lkey[device_id];
-                slices_to_post[context].push_back(slice);
-                task.total_bytes += slice->length;
-                // task.slices.push_back(slice);
-                task.slice_count += 1;
-                break;
             }
             if (device_id < 0) {
                 LOG(ERROR)
                     << "RdmaTransport: Address not registered by any device(s) "
                     << slice->source_addr;
+                auto source_addr = slice->source_addr;
+                delete slice;
                 return Status::AddressNotRegistered(
                     "RdmaTransport: not registered by any device(s), address: "
-                    + std::to_string(
-                        reinterpret_cast<uintptr_t>(slice->source_addr)));
+                    + std::to_string(reinterpret_cast<uintptr_t>(source_addr)));
             }
+            slice->rdma.source_lkey = slice->sg_list[0].lkey;
+            slices_to_post[context_list_[device_id]].push_back(slice);
+            assigned_bytes[device_id] += slice->length;
+            task.total_bytes += slice->length;
+            task.slice_count += 1;
         }
     }
     for (auto &entry : slices_to_post)
@@ -349,9 +476,10 @@ Status RdmaTransport::getTransferStatus(BatchID batch_id, size_t task_id,
             std::to_string(batch_id));
     }
     auto &task = batch_desc.task_list[task_id];
-    status.transferred_bytes = task.transferred_bytes;
     uint64_t success_slice_count = task.success_slice_count;
     uint64_t failed_slice_count = task.failed_slice_count;
+    // Read after the counters, as markSuccess() adds the bytes first
+    status.transferred_bytes = task.transferred_bytes;
     if (success_slice_count + failed_slice_count ==
         task.slice_count) {
         if (failed_slice_count)
@@ -413,6 +541,7 @@ int RdmaTransport::initializeRdmaResources() {
                                      config.max_cqe, config.max_ep_per_ctx);
         if (ret) return ret;
         device_speed_list.push_back(context->activeSpeed());
+        max_msg_size_ = std::min(max_msg_size_, context->maxMsgSize());
         context_list_.push_back(context);
     }
 
@@ -431,16 +560,112 @@ int RdmaTransport::startHandshakeDaemon(std::string &local_server_name) {
 // Return 0 if successful, ERR_ADDRESS_NOT_REGISTERED otherwise.
 int RdmaTransport::selectDevice(SegmentDesc *desc, uint64_t offset,
                                 size_t length, int &buffer_id, int &device_id,
-                                int retry_count) {
-    for (buffer_id = 0; buffer_id < (int)desc->buffers.size(); ++buffer_id) {
+                                int retry_count,
+                                const DeviceLoadFunc &device_load) {
+    auto &buffer_index = desc->buffer_index;
+    for (buffer_id = buffer_index.find(offset, length); buffer_id >= 0;
+         buffer_id = buffer_index.find(offset, length, buffer_id + 1)) {
         auto &buffer_desc = desc->buffers[buffer_id];
-        if (buffer_desc.addr > offset ||
-            offset + length > buffer_desc.addr + buffer_desc.length)
-            continue;
-        device_id = desc->topology.selectDevice(buffer_desc.name, retry_count);
+        device_id = desc->topology.selectDevice(buffer_desc.name, retry_count,
+                                                device_load);
         if (device_id >= 0) return 0;
     }
 
     return ERR_ADDRESS_NOT_REGISTERED;
 }
+
+int RdmaTransport::selectLocalDevice(SegmentDesc *desc, uint64_t offset,
+                                     size_t length, int &buffer_id,
+                                     int &device_id,
+                                     const DeviceLoadFunc &device_load) {
+    // Active devices that are not backing off come first. If there are
+    // none, fall back to the first active device.
+    const int kMaxRetryCount = globalConfig().retry_cnt;
+    int fallback_buffer_id = -1, fallback_device_id = -1;
+    for (int retry_cnt = 0; retry_cnt < kMaxRetryCount; ++retry_cnt) {
+        if (selectDevice(desc, offset, length, buffer_id, device_id, retry_cnt,
+                         device_load))
+            continue;
+        auto &context = context_list_[device_id];
+        if (!context->active()) continue;
+        if (device_health_.healthy(context->health())) return 0;
+        if (fallback_device_id < 0) {
+            fallback_buffer_id = buffer_id;
+            fallback_device_id = device_id;
+        }
+    }
+    buffer_id = fallback_buffer_id;
+    device_id = fallback_device_id;
+    return device_id < 0 ? ERR_ADDRESS_NOT_REGISTERED : 0;
+}
+
+int RdmaTransport::selectPeerDevice(SegmentDesc *desc, uint64_t offset,
+                                    size_t length, int &buffer_id,
+                                    int &device_id, int retry_cnt) {
+    int ret = selectDevice(desc, offset, length, buffer_id, device_id,
+                           retry_cnt);
+    if (ret || peer_health_.empty() ||
+        peer_health_.healthy(
+            MakeNicPath(desc->name, desc->devices[device_id].name)))
+        return ret;
+    // Try the next ones in retry order, then keep the first choice if all
+    // of them are backing off.
+    for (size_t i = 1; i <= desc->devices.size(); ++i) {
+        int next_buffer_id, next_device_id;
+        if (selectDevice(desc, offset, length, next_buffer_id, next_device_id,
+                         retry_cnt + i))
+            continue;
+        if (peer_health_.healthy(MakeNicPath(
+                desc->name, desc->devices[next_device_id].name))) {
+            buffer_id = next_buffer_id;
+            device_id = next_device_id;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+DeviceLoadFunc RdmaTransport::localDeviceLoad(
+    const std::vector<uint64_t> &assigned_bytes) {
+    return [this, &assigned_bytes](int device_id) -> uint64_t {
+        return context_list_[device_id]->outstandingBytes() +
+               assigned_bytes[device_id];
+    };
+}
+
+size_t RdmaTransport::selectSliceSize(SegmentDesc *desc, uint64_t offset,
+                                      size_t length, size_t max_msg_size) {
+    const size_t kMinSliceSize = globalConfig().slice_size;
+    const size_t kMaxSliceSize =
+        std::max(globalConfig().max_slice_size, kMinSliceSize);
+    const size_t kSliceAlignment = 4096;
+    int device_count = 0;
+    int buffer_id = desc ? findBuffer(desc, offset, 1) : -1;
+    if (buffer_id >= 0)
+        device_count =
+            desc->topology.getDeviceCount(desc->buffers[buffer_id].name);
+    size_t qp_count = std::max(device_count, 1) * globalConfig().num_qp_per_ep;
+
+    // One slice per QP the request may be posted to, but none smaller than
+    // kMinSliceSize, so small requests are sent as a single slice.
+    size_t slice_count = std::min(length / kMinSliceSize, qp_count);
+    if (slice_count <= 1)
+        return std::min(std::max(length, kMinSliceSize), max_msg_size);
+    size_t slice_size = (length + slice_count - 1) / slice_count;
+    slice_size = (slice_size + kSliceAlignment - 1) & ~(kSliceAlignment - 1);
+    slice_size = std::min(slice_size, kMaxSliceSize);
+
+    // Huge requests would still need more work requests than all QPs can
+    // hold, grow the slices instead, but never past what the devices accept
+    // in one work request. The slices that still don't fit wait in the queues
+    // until earlier ones complete.
+    size_t max_slice_count = qp_count * globalConfig().max_wr;
+    size_t min_slice_size = (length + max_slice_count - 1) / max_slice_count;
+    return std::min(std::max(slice_size, min_slice_size), max_msg_size);
+}
+
+int RdmaTransport::findBuffer(SegmentDesc *desc, uint64_t offset,
+                              size_t length) {
+    return desc->buffer_index.find(offset, length);
+}
 }  // namespace mooncake
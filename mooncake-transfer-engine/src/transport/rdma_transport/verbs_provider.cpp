@@ -0,0 +1,155 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/rdma_transport/verbs_provider.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "config.h"
+#include "transport/rdma_transport/verbs_simulator.h"
+
+namespace mooncake {
+class IbVerbsProvider : public VerbsProvider {
+   public:
+    int forkInit() override { return ibv_fork_init(); }
+
+    ibv_device **getDeviceList(int *num_devices) override {
+        return ibv_get_device_list(num_devices);
+    }
+
+    void freeDeviceList(ibv_device **list) override {
+        ibv_free_device_list(list);
+    }
+
+    const char *getDeviceName(ibv_device *device) override {
+        return ibv_get_device_name(device);
+    }
+
+    ibv_context *openDevice(ibv_device *device) override {
+        return ibv_open_device(device);
+    }
+
+    int closeDevice(ibv_context *context) override {
+        return ibv_close_device(context);
+    }
+
+    int queryDevice(ibv_context *context,
+                    ibv_device_attr *device_attr) override {
+        return ibv_query_device(context, device_attr);
+    }
+
+    int queryPort(ibv_context *context, uint8_t port_num,
+                  ibv_port_attr *port_attr) override {
+        return ibv_query_port(context, port_num, port_attr);
+    }
+
+    int queryGid(ibv_context *context, uint8_t port_num, int index,
+                 ibv_gid *gid) override {
+        return ibv_query_gid(context, port_num, index, gid);
+    }
+
+    int queryGidEx(ibv_context *context, uint32_t port_num, uint32_t gid_index,
+                   ibv_gid_entry *entry, uint32_t flags) override {
+        return ibv_query_gid_ex(context, port_num, gid_index, entry, flags);
+    }
+
+    int getAsyncEvent(ibv_context *context, ibv_async_event *event) override {
+        return ibv_get_async_event(context, event);
+    }
+
+    void ackAsyncEvent(ibv_async_event *event) override {
+        ibv_ack_async_event(event);
+    }
+
+    ibv_pd *allocPd(ibv_context *context) override {
+        return ibv_alloc_pd(context);
+    }
+
+    int deallocPd(ibv_pd *pd) override { return ibv_dealloc_pd(pd); }
+
+    ibv_mr *regMr(ibv_pd *pd, void *addr, size_t length, int access) override {
+        return ibv_reg_mr(pd, addr, length, access);
+    }
+
+    int deregMr(ibv_mr *mr) override { return ibv_dereg_mr(mr); }
+
+    ibv_comp_channel *createCompChannel(ibv_context *context) override {
+        return ibv_create_comp_channel(context);
+    }
+
+    int destroyCompChannel(ibv_comp_channel *channel) override {
+        return ibv_destroy_comp_channel(channel);
+    }
+
+    ibv_cq *createCq(ibv_context *context, int cqe, void *cq_context,
+                     ibv_comp_channel *channel, int comp_vector) override {
+        return ibv_create_cq(context, cqe, cq_context, channel, comp_vector);
+    }
+
+    int destroyCq(ibv_cq *cq) override { return ibv_destroy_cq(cq); }
+
+    ibv_qp *createQp(ibv_pd *pd, ibv_qp_init_attr *qp_init_attr) override {
+        return ibv_create_qp(pd, qp_init_attr);
+    }
+
+    int destroyQp(ibv_qp *qp) override { return ibv_destroy_qp(qp); }
+
+    int modifyQp(ibv_qp *qp, ibv_qp_attr *attr, int attr_mask) override {
+        return ibv_modify_qp(qp, attr, attr_mask);
+    }
+
+    int postSend(ibv_qp *qp, ibv_send_wr *wr, ibv_send_wr **bad_wr) override {
+        return ibv_post_send(qp, wr, bad_wr);
+    }
+
+    int pollCq(ibv_cq *cq, int num_entries, ibv_wc *wc) override {
+        return ibv_poll_cq(cq, num_entries, wc);
+    }
+};
+
+static std::mutex g_provider_mutex;
+static std::shared_ptr<VerbsProvider> g_provider;
+// Read without the mutex by the data path
+static std::atomic<VerbsProvider *> g_provider_ptr(nullptr);
+
+VerbsProvider &verbs() {
+    auto provider = g_provider_ptr.load(std::memory_order_acquire);
+    if (provider) return *provider;
+    std::lock_guard<std::mutex> lock(g_provider_mutex);
+    if (!g_provider) {
+        auto &config = globalConfig();
+        if (config.use_rdma_simulator) {
+            VerbsSimulator::Options options;
+            if (options.parse(config.rdma_simulator_options))
+                LOG(WARNING) << "Ignore invalid options of MC_RDMA_SIMULATOR: "
+                             << config.rdma_simulator_options;
+            LOG(INFO) << "RDMA transport runs on the verbs simulator";
+            g_provider = std::make_shared<VerbsSimulator>(options);
+        } else {
+            g_provider = std::make_shared<IbVerbsProvider>();
+        }
+        g_provider_ptr.store(g_provider.get(), std::memory_order_release);
+    }
+    return *g_provider;
+}
+
+void setVerbsProvider(std::shared_ptr<VerbsProvider> provider) {
+    std::lock_guard<std::mutex> lock(g_provider_mutex);
+    g_provider = provider;
+    g_provider_ptr.store(g_provider.get(), std::memory_order_release);
+}
+}  // namespace mooncake
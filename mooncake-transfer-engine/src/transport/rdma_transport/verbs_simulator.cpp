@@ -0,0 +1,563 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/rdma_transport/verbs_simulator.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+
+#include "common.h"
+#include "error.h"
+
+namespace mooncake {
+const static uint32_t kMaxInlineData = 256;
+const static uint32_t kFirstQpNum = 0x100;
+
+static uint64_t nowInNano() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// The ibv_* object handed out is the first member of each structure below,
+// so the pointers passed back by the caller are converted by a cast.
+struct VerbsSimulator::Device {
+    ibv_device device;
+    int index;
+    // Time the link finishes the data of all work requests posted so far
+    std::atomic<uint64_t> busy_until;
+};
+
+struct VerbsSimulator::MemoryRegion {
+    ibv_mr mr;
+    int access;
+};
+
+struct VerbsSimulator::WorkRequest {
+    QueuePair *qp;
+    uint64_t wr_id;
+    ibv_wr_opcode opcode;
+    bool signaled;
+    std::vector<ibv_sge> sge_list;
+    std::string inline_data;  // replaces sge_list if the WR is inline
+    uint64_t remote_addr;
+    uint32_t rkey;
+    size_t length;
+};
+
+struct VerbsSimulator::CompletionQueue {
+    ibv_cq cq;
+    // Held while polling, so that work requests of a QP execute in order
+    std::mutex poll_mutex;
+    std::mutex mutex;
+    // Keyed by (due time, posting sequence)
+    std::map<std::pair<uint64_t, uint64_t>, WorkRequest> pending_map;
+    uint64_t next_sequence = 0;
+};
+
+struct VerbsSimulator::QueuePair {
+    ibv_qp qp;
+    Device *device;
+    CompletionQueue *send_cq;
+    ibv_qp_cap cap;
+    std::atomic<int> state;
+    std::atomic<uint32_t> dest_qp_num;
+    std::atomic<int> outstanding;
+};
+
+int VerbsSimulator::Options::parse(const std::string &spec) {
+    Options options = *this;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        auto pos = item.find('=');
+        if (pos == std::string::npos) return ERR_INVALID_ARGUMENT;
+        auto key = item.substr(0, pos);
+        auto value_str = item.substr(pos + 1);
+        char *end = nullptr;
+        double value = strtod(value_str.c_str(), &end);
+        if (value_str.empty() || *end || value < 0) return ERR_INVALID_ARGUMENT;
+        if (key == "devices" && value >= 1)
+            options.device_count = (int)value;
+        else if (key == "latency_us")
+            options.latency_ns = value * 1000;
+        else if (key == "bandwidth_gbps")
+            options.bandwidth = value * 1e9 / 8;
+        else if (key == "error_rate" && value <= 1)
+            options.error_rate = value;
+        else
+            return ERR_INVALID_ARGUMENT;
+    }
+    *this = options;
+    return 0;
+}
+
+VerbsSimulator::VerbsSimulator() : VerbsSimulator(Options()) {}
+
+VerbsSimulator::VerbsSimulator(const Options &options)
+    : options_(options),
+      next_key_(1),
+      next_qp_num_(kFirstQpNum),
+      injected_error_count_(0),
+      injected_post_error_count_(0),
+      completed_count_(0) {
+    for (int index = 0; index < options_.device_count; ++index) {
+        auto device = std::make_unique<Device>();
+        memset(&device->device, 0, sizeof(ibv_device));
+        auto name = deviceName(index);
+        strncpy(device->device.name, name.c_str(), IBV_SYSFS_NAME_MAX - 1);
+        strncpy(device->device.dev_name, name.c_str(), IBV_SYSFS_NAME_MAX - 1);
+        device->device.node_type = IBV_NODE_CA;
+        device->device.transport_type = IBV_TRANSPORT_IB;
+        device->index = index;
+        device->busy_until = 0;
+        device_list_.push_back(std::move(device));
+    }
+}
+
+VerbsSimulator::~VerbsSimulator() {}
+
+std::string VerbsSimulator::deviceName(int index) {
+    return "sim_" + std::to_string(index);
+}
+
+bool VerbsSimulator::isSimulatedDevice(const std::string &name) {
+    return name.compare(0, 4, "sim_") == 0;
+}
+
+ibv_device **VerbsSimulator::getDeviceList(int *num_devices) {
+    auto list = new ibv_device *[device_list_.size() + 1];
+    for (size_t i = 0; i < device_list_.size(); ++i)
+        list[i] = &device_list_[i]->device;
+    list[device_list_.size()] = nullptr;
+    if (num_devices) *num_devices = device_list_.size();
+    return list;
+}
+
+void VerbsSimulator::freeDeviceList(ibv_device **list) { delete[] list; }
+
+const char *VerbsSimulator::getDeviceName(ibv_device *device) {
+    return device->name;
+}
+
+ibv_context *VerbsSimulator::openDevice(ibv_device *device) {
+    int fd = eventfd(0, EFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    auto context = new ibv_context();
+    memset(context, 0, sizeof(ibv_context));
+    context->device = device;
+    context->cmd_fd = -1;
+    context->async_fd = fd;
+    context->num_comp_vectors = 1;
+    return context;
+}
+
+int VerbsSimulator::closeDevice(ibv_context *context) {
+    close(context->async_fd);
+    delete context;
+    return 0;
+}
+
+int VerbsSimulator::queryDevice(ibv_context *context,
+                                ibv_device_attr *device_attr) {
+    memset(device_attr, 0, sizeof(ibv_device_attr));
+    strncpy(device_attr->fw_ver, "simulator", sizeof(device_attr->fw_ver) - 1);
+    device_attr->max_mr_size = UINT64_MAX;
+    device_attr->max_qp = 1 << 16;
+    device_attr->max_qp_wr = 1 << 14;
+    device_attr->max_sge = 32;
+    device_attr->max_cq = 1 << 16;
+    device_attr->max_cqe = 1 << 22;
+    device_attr->max_mr = 1 << 24;
+    device_attr->max_pd = 1 << 16;
+    device_attr->max_qp_rd_atom = 16;
+    device_attr->max_qp_init_rd_atom = 16;
+    device_attr->phys_port_cnt = 1;
+    return 0;
+}
+
+int VerbsSimulator::queryPort(ibv_context *context, uint8_t port_num,
+                              ibv_port_attr *port_attr) {
+    if (port_num != 1) return EINVAL;
+    memset(port_attr, 0, sizeof(ibv_port_attr));
+    port_attr->state = IBV_PORT_ACTIVE;
+    port_attr->max_mtu = IBV_MTU_4096;
+    port_attr->active_mtu = IBV_MTU_4096;
+    port_attr->gid_tbl_len = 1;
+    port_attr->max_msg_sz = 1u << 31;
+    port_attr->active_width = 2;   // 4x
+    port_attr->active_speed = 32;  // EDR
+    port_attr->phys_state = 5;     // link up
+    port_attr->link_layer = IBV_LINK_LAYER_ETHERNET;
+    return 0;
+}
+
+int VerbsSimulator::queryGid(ibv_context *context, uint8_t port_num,
+                             int index, ibv_gid *gid) {
+    if (port_num != 1 || index != 0) return EINVAL;
+    // ::ffff:127.0.x.y, where x.y is the device index plus one
+    auto device = (Device *)context->device;
+    memset(gid, 0, sizeof(ibv_gid));
+    gid->raw[10] = gid->raw[11] = 0xff;
+    gid->raw[12] = 127;
+    gid->raw[14] = (device->index + 1) >> 8;
+    gid->raw[15] = (device->index + 1) & 0xff;
+    return 0;
+}
+
+int VerbsSimulator::queryGidEx(ibv_context *context, uint32_t port_num,
+                               uint32_t gid_index, ibv_gid_entry *entry,
+                               uint32_t flags) {
+    memset(entry, 0, sizeof(ibv_gid_entry));
+    int ret = queryGid(context, port_num, gid_index, &entry->gid);
+    if (ret) return ret;
+    entry->gid_index = gid_index;
+    entry->port_num = port_num;
+    entry->gid_type = IBV_GID_TYPE_ROCE_V2;
+    return 0;
+}
+
+int VerbsSimulator::getAsyncEvent(ibv_context *context,
+                                  ibv_async_event *event) {
+    errno = EAGAIN;
+    return -1;
+}
+
+ibv_pd *VerbsSimulator::allocPd(ibv_context *context) {
+    auto pd = new ibv_pd();
+    pd->context = context;
+    pd->handle = 0;
+    return pd;
+}
+
+int VerbsSimulator::deallocPd(ibv_pd *pd) {
+    delete pd;
+    return 0;
+}
+
+ibv_mr *VerbsSimulator::regMr(ibv_pd *pd, void *addr, size_t length,
+                              int access) {
+    auto region = new MemoryRegion();
+    memset(&region->mr, 0, sizeof(ibv_mr));
+    region->mr.context = pd->context;
+    region->mr.pd = pd;
+    region->mr.addr = addr;
+    region->mr.length = length;
+    region->access = access;
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t key = next_key_++;
+    region->mr.handle = key;
+    region->mr.lkey = key;
+    region->mr.rkey = key;
+    mr_map_[key] = region;
+    return &region->mr;
+}
+
+int VerbsSimulator::deregMr(ibv_mr *mr) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!mr_map_.erase(mr->lkey)) return EINVAL;
+    }
+    delete (MemoryRegion *)mr;
+    return 0;
+}
+
+ibv_comp_channel *VerbsSimulator::createCompChannel(ibv_context *context) {
+    int fd = eventfd(0, EFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    auto channel = new ibv_comp_channel();
+    channel->context = context;
+    channel->fd = fd;
+    channel->refcnt = 0;
+    return channel;
+}
+
+int VerbsSimulator::destroyCompChannel(ibv_comp_channel *channel) {
+    close(channel->fd);
+    delete channel;
+    return 0;
+}
+
+ibv_cq *VerbsSimulator::createCq(ibv_context *context, int cqe,
+                                 void *cq_context, ibv_comp_channel *channel,
+                                 int comp_vector) {
+    auto cq = new CompletionQueue();
+    memset(&cq->cq, 0, sizeof(ibv_cq));
+    cq->cq.context = context;
+    cq->cq.channel = channel;
+    cq->cq.cq_context = cq_context;
+    cq->cq.cqe = cqe;
+    return &cq->cq;
+}
+
+int VerbsSimulator::destroyCq(ibv_cq *cq) {
+    delete (CompletionQueue *)cq;
+    return 0;
+}
+
+ibv_qp *VerbsSimulator::createQp(ibv_pd *pd, ibv_qp_init_attr *qp_init_attr) {
+    if (qp_init_attr->qp_type != IBV_QPT_RC || !qp_init_attr->send_cq) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    qp_init_attr->cap.max_inline_data =
+        std::min(qp_init_attr->cap.max_inline_data, kMaxInlineData);
+    auto qp = new QueuePair();
+    memset(&qp->qp, 0, sizeof(ibv_qp));
+    qp->qp.context = pd->context;
+    qp->qp.qp_context = qp_init_attr->qp_context;
+    qp->qp.pd = pd;
+    qp->qp.send_cq = qp_init_attr->send_cq;
+    qp->qp.recv_cq = qp_init_attr->recv_cq;
+    qp->qp.qp_type = qp_init_attr->qp_type;
+    qp->qp.state = IBV_QPS_RESET;
+    qp->device = (Device *)pd->context->device;
+    qp->send_cq = (CompletionQueue *)qp_init_attr->send_cq;
+    qp->cap = qp_init_attr->cap;
+    qp->state = IBV_QPS_RESET;
+    qp->dest_qp_num = 0;
+    qp->outstanding = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    qp->qp.qp_num = next_qp_num_++;
+    qp->qp.handle = qp->qp.qp_num;
+    qp_map_[qp->qp.qp_num] = qp;
+    return &qp->qp;
+}
+
+int VerbsSimulator::destroyQp(ibv_qp *ibv_qp) {
+    auto qp = (QueuePair *)ibv_qp;
+    discardWorkRequests(qp);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        qp_map_.erase(qp->qp.qp_num);
+    }
+    delete qp;
+    return 0;
+}
+
+int VerbsSimulator::modifyQp(ibv_qp *ibv_qp, ibv_qp_attr *attr,
+                             int attr_mask) {
+    auto qp = (QueuePair *)ibv_qp;
+    if (attr_mask & IBV_QP_DEST_QPN) qp->dest_qp_num = attr->dest_qp_num;
+    if (attr_mask & IBV_QP_STATE) {
+        // Outstanding work requests are dropped without completion
+        if (attr->qp_state == IBV_QPS_RESET) discardWorkRequests(qp);
+        qp->state = attr->qp_state;
+        qp->qp.state = attr->qp_state;
+    }
+    return 0;
+}
+
+void VerbsSimulator::discardWorkRequests(QueuePair *qp) {
+    auto cq = qp->send_cq;
+    std::lock_guard<std::mutex> poll_lock(cq->poll_mutex);
+    std::lock_guard<std::mutex> lock(cq->mutex);
+    for (auto iter = cq->pending_map.begin(); iter != cq->pending_map.end();) {
+        if (iter->second.qp == qp)
+            iter = cq->pending_map.erase(iter);
+        else
+            ++iter;
+    }
+    qp->outstanding = 0;
+}
+
+int VerbsSimulator::postSend(ibv_qp *ibv_qp, ibv_send_wr *wr,
+                             ibv_send_wr **bad_wr) {
+    auto qp = (QueuePair *)ibv_qp;
+    int state = qp->state;
+    // Like a real device, a QP in the error state accepts and flushes them
+    if (state != IBV_QPS_RTS && state != IBV_QPS_ERR) {
+        *bad_wr = wr;
+        return EINVAL;
+    }
+    bool reject_last = false;
+    if (wr && wr->next) {
+        int error_count = injected_post_error_count_;
+        while (error_count > 0 &&
+               !injected_post_error_count_.compare_exchange_weak(
+                   error_count, error_count - 1))
+            ;
+        reject_last = error_count > 0;
+    }
+    for (; wr; wr = wr->next) {
+        if (reject_last && !wr->next) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+        if ((wr->opcode != IBV_WR_RDMA_WRITE &&
+             wr->opcode != IBV_WR_RDMA_READ) ||
+            wr->num_sge > (int)qp->cap.max_send_sge) {
+            *bad_wr = wr;
+            return EINVAL;
+        }
+        if (qp->outstanding >= (int)qp->cap.max_send_wr) {
+            *bad_wr = wr;
+            return ENOMEM;
+        }
+
+        WorkRequest request;
+        request.qp = qp;
+        request.wr_id = wr->wr_id;
+        request.opcode = wr->opcode;
+        request.signaled = wr->send_flags & IBV_SEND_SIGNALED;
+        request.remote_addr = wr->wr.rdma.remote_addr;
+        request.rkey = wr->wr.rdma.rkey;
+        request.length = 0;
+        for (int i = 0; i < wr->num_sge; ++i) {
+            request.sge_list.push_back(wr->sg_list[i]);
+            request.length += wr->sg_list[i].length;
+        }
+        if (wr->send_flags & IBV_SEND_INLINE) {
+            if (wr->opcode != IBV_WR_RDMA_WRITE ||
+                request.length > qp->cap.max_inline_data) {
+                *bad_wr = wr;
+                return EINVAL;
+            }
+            // The buffers may be reused as soon as we return
+            for (auto &sge : request.sge_list)
+                request.inline_data.append((char *)sge.addr, sge.length);
+            request.sge_list.clear();
+        }
+
+        // Work requests of a device share its link in posting order
+        uint64_t now = nowInNano();
+        uint64_t transfer_ns =
+            options_.bandwidth
+                ? (uint64_t)(request.length * 1e9 / options_.bandwidth)
+                : 0;
+        uint64_t start, busy_until = qp->device->busy_until;
+        do {
+            start = std::max(now, busy_until);
+        } while (!qp->device->busy_until.compare_exchange_weak(
+            busy_until, start + transfer_ns));
+        uint64_t due = start + transfer_ns + options_.latency_ns;
+
+        qp->outstanding++;
+        auto cq = qp->send_cq;
+        std::lock_guard<std::mutex> lock(cq->mutex);
+        cq->pending_map.emplace(std::make_pair(due, cq->next_sequence++),
+                                std::move(request));
+    }
+    return 0;
+}
+
+int VerbsSimulator::pollCq(ibv_cq *ibv_cq, int num_entries, ibv_wc *wc) {
+    auto cq = (CompletionQueue *)ibv_cq;
+    std::lock_guard<std::mutex> poll_lock(cq->poll_mutex);
+    std::vector<WorkRequest> request_list;
+    {
+        std::lock_guard<std::mutex> lock(cq->mutex);
+        if (cq->pending_map.empty()) return 0;
+        uint64_t now = nowInNano();
+        while (!cq->pending_map.empty() &&
+               (int)request_list.size() < num_entries &&
+               cq->pending_map.begin()->first.first <= now) {
+            auto node = cq->pending_map.extract(cq->pending_map.begin());
+            request_list.push_back(std::move(node.mapped()));
+        }
+    }
+
+    int nr_poll = 0;
+    for (auto &request : request_list) {
+        auto status = execute(request);
+        request.qp->outstanding--;
+        completed_count_++;
+        // Unsignaled work requests only report errors
+        if (status == IBV_WC_SUCCESS && !request.signaled) continue;
+        auto &entry = wc[nr_poll++];
+        memset(&entry, 0, sizeof(ibv_wc));
+        entry.wr_id = request.wr_id;
+        entry.status = status;
+        entry.opcode = request.opcode == IBV_WR_RDMA_READ ? IBV_WC_RDMA_READ
+                                                          : IBV_WC_RDMA_WRITE;
+        entry.byte_len = request.length;
+        entry.qp_num = request.qp->qp.qp_num;
+    }
+    return nr_poll;
+}
+
+// Must be called with mutex_ held.
+bool VerbsSimulator::checkAccess(uint32_t key, ibv_context *context,
+                                 uint64_t addr, size_t length, int access) {
+    auto iter = mr_map_.find(key);
+    if (iter == mr_map_.end()) return false;
+    auto &mr = iter->second->mr;
+    if (mr.context != context || addr < (uint64_t)mr.addr ||
+        addr + length > (uint64_t)mr.addr + mr.length)
+        return false;
+    return (iter->second->access & access) == access;
+}
+
+ibv_wc_status VerbsSimulator::validate(const WorkRequest &request) {
+    int error_count = injected_error_count_;
+    while (error_count > 0 && !injected_error_count_.compare_exchange_weak(
+                                  error_count, error_count - 1))
+        ;
+    if (error_count > 0) return IBV_WC_RETRY_EXC_ERR;
+    const uint32_t kScale = 1000000;
+    if (options_.error_rate > 0 &&
+        SimpleRandom::Get().next(kScale) < options_.error_rate * kScale)
+        return IBV_WC_RETRY_EXC_ERR;
+
+    auto qp = request.qp;
+    bool is_read = request.opcode == IBV_WR_RDMA_READ;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &sge : request.sge_list)
+        if (!checkAccess(sge.lkey, qp->qp.context, sge.addr, sge.length,
+                         is_read ? IBV_ACCESS_LOCAL_WRITE : 0))
+            return IBV_WC_LOC_PROT_ERR;
+    auto iter = qp_map_.find(qp->dest_qp_num);
+    if (iter == qp_map_.end()) return IBV_WC_RETRY_EXC_ERR;
+    auto peer = iter->second;
+    if (peer->state < IBV_QPS_RTR || peer->state == IBV_QPS_ERR)
+        return IBV_WC_RETRY_EXC_ERR;
+    if (!checkAccess(request.rkey, peer->qp.context, request.remote_addr,
+                     request.length,
+                     is_read ? IBV_ACCESS_REMOTE_READ : IBV_ACCESS_REMOTE_WRITE))
+        return IBV_WC_REM_ACCESS_ERR;
+    return IBV_WC_SUCCESS;
+}
+
+ibv_wc_status VerbsSimulator::execute(WorkRequest &request) {
+    auto qp = request.qp;
+    if (qp->state == IBV_QPS_ERR) return IBV_WC_WR_FLUSH_ERR;
+    auto status = validate(request);
+    if (status != IBV_WC_SUCCESS) {
+        qp->state = IBV_QPS_ERR;
+        qp->qp.state = IBV_QPS_ERR;
+        return status;
+    }
+
+    char *remote = (char *)request.remote_addr;
+    if (!request.inline_data.empty())
+        memcpy(remote, request.inline_data.data(), request.length);
+    for (auto &sge : request.sge_list) {
+        if (request.opcode == IBV_WR_RDMA_READ)
+            memcpy((void *)sge.addr, remote, sge.length);
+        else
+            memcpy(remote, (void *)sge.addr, sge.length);
+        remote += sge.length;
+    }
+    return IBV_WC_SUCCESS;
+}
+}  // namespace mooncake
@@ -22,6 +22,7 @@
 #include "transport/rdma_transport/rdma_context.h"
 #include "transport/rdma_transport/rdma_endpoint.h"
 #include "transport/rdma_transport/rdma_transport.h"
+#include "transport/rdma_transport/verbs_provider.h"
 
 #ifdef USE_CUDA
 #include <cuda_runtime.h>
@@ -35,6 +36,42 @@ namespace mooncake {
 
 const static int kTransferWorkerCount = globalConfig().workers_per_ctx;
 
+static inline void localCopy(TransferRequest::OpCode opcode, void *source_addr,
+                             void *dest_addr, size_t length) {
+#ifdef USE_CUDA
+    if (opcode == TransferRequest::READ)
+        cudaMemcpy(source_addr, dest_addr, length, cudaMemcpyDefault);
+    else
+        cudaMemcpy(dest_addr, source_addr, length, cudaMemcpyDefault);
+#else
+    if (opcode == TransferRequest::READ)
+        memcpy(source_addr, dest_addr, length);
+    else
+        memcpy(dest_addr, source_addr, length);
+#endif
+}
+
+static inline int shardOf(SegmentID target_id, int device_id, int shard_count) {
+    return (target_id * 10007 + device_id) % shard_count;
+}
+
+// The slices of a call to one peer NIC go to consecutive shards from its
+// own, in runs of kShardRunLength, so that the workers of several shards
+// post to a hot peer. slice_count counts the slices per first shard.
+//
+// Runs in different shards may be posted in any order. Nothing depended
+// on the order of posts to a peer NIC: each post already picks one of the
+// QPs of the endpoint at random, RC orders work requests only within a QP,
+// and a task completes when all of its slices have, whatever their order.
+const static size_t kShardRunLength = 16;
+
+static inline int nextShardOf(SegmentID target_id, int device_id,
+                              size_t *slice_count, int shard_count) {
+    int shard_id = shardOf(target_id, device_id, shard_count);
+    return (shard_id + slice_count[shard_id]++ / kShardRunLength) %
+           shard_count;
+}
+
 WorkerPool::WorkerPool(RdmaContext &context, int numa_socket_id)
     : context_(context),
       numa_socket_id_(numa_socket_id),
@@ -43,9 +80,11 @@ WorkerPool::WorkerPool(RdmaContext &context, int numa_socket_id)
       redispatch_counter_(0),
       submitted_slice_count_(0),
       processed_slice_count_(0) {
-    for (int i = 0; i < kShardCount; ++i)
+    for (int i = 0; i < kShardCount; ++i) {
         slice_queue_count_[i].store(0, std::memory_order_relaxed);
-    collective_slice_queue_.resize(kTransferWorkerCount);
+        post_queue_count_[i].store(0, std::memory_order_relaxed);
+        post_redispatch_counter_[i] = 0;
+    }
     for (int i = 0; i < kTransferWorkerCount; ++i)
         worker_thread_.emplace_back(
             std::thread(std::bind(&WorkerPool::transferWorker, this, i)));
@@ -104,13 +143,14 @@ int WorkerPool::submitPostSend(
 #endif  // CONFIG_CACHE_SEGMENT_DESC
 
     SliceList slice_list_map[kShardCount];
+    size_t shard_slice_count[kShardCount] = {0};
     uint64_t submitted_slice_count = 0;
     for (auto &slice : slice_list) {
         auto &peer_segment_desc = segment_desc_map[slice->target_id];
         int buffer_id, device_id;
-        if (RdmaTransport::selectDevice(peer_segment_desc.get(),
-                                        slice->rdma.dest_addr, slice->length,
-                                        buffer_id, device_id)) {
+        if (context_.engine().selectPeerDevice(
+                peer_segment_desc.get(), slice->rdma.dest_addr, slice->length,
+                buffer_id, device_id)) {
             LOG(WARNING) << "Reselect remote NIC for address "
                          << (void *)slice->rdma.dest_addr << " on segment #"
                          << slice->target_id;
@@ -118,15 +158,17 @@ int WorkerPool::submitPostSend(
                 slice->target_id, true);
             if (!peer_segment_desc) {
                 LOG(ERROR) << "Cannot get target segment #" << slice->target_id;
+                context_.releaseOutstandingBytes(slice->length);
                 slice->markFailed();
                 continue;
             }
-            if (RdmaTransport::selectDevice(
+            if (context_.engine().selectPeerDevice(
                     peer_segment_desc.get(), slice->rdma.dest_addr,
                     slice->length, buffer_id, device_id)) {
                 LOG(ERROR) << "Failed to select remote NIC for address "
                            << (void *)slice->rdma.dest_addr << " on segment #"
                            << slice->target_id;
+                context_.releaseOutstandingBytes(slice->length);
                 slice->markFailed();
                 continue;
             }
@@ -137,11 +179,19 @@ int WorkerPool::submitPostSend(
             MakeNicPath(peer_segment_desc->name,
                         peer_segment_desc->devices[device_id].name);
         slice->peer_nic_path = peer_nic_path;
-        int shard_id = (slice->target_id * 10007 + device_id) % kShardCount;
+        int shard_id = nextShardOf(slice->target_id, device_id,
+                                   shard_slice_count, kShardCount);
         slice_list_map[shard_id].push_back(slice);
         submitted_slice_count++;
     }
 
+    submitted_slice_count_.fetch_add(submitted_slice_count,
+                                     std::memory_order_relaxed);
+    enqueue(slice_list_map);
+    return 0;
+}
+
+void WorkerPool::enqueue(SliceList (&slice_list_map)[kShardCount]) {
     for (int shard_id = 0; shard_id < kShardCount; ++shard_id) {
         if (slice_list_map[shard_id].empty()) continue;
         slice_queue_lock_[shard_id].lock();
@@ -151,21 +201,41 @@ int WorkerPool::submitPostSend(
                                                std::memory_order_relaxed);
         slice_queue_lock_[shard_id].unlock();
     }
-
-    submitted_slice_count_.fetch_add(submitted_slice_count,
-                                     std::memory_order_relaxed);
     if (suspended_flag_.load(std::memory_order_relaxed)) cond_var_.notify_all();
-
-    return 0;
 }
 
 void WorkerPool::performPostSend(int thread_id) {
-    auto &local_slice_queue = collective_slice_queue_[thread_id];
+    SliceList failed_slice_list;
+    bool has_home_work = false;
     for (int shard_id = thread_id; shard_id < kShardCount;
-         shard_id += kTransferWorkerCount) {
-        if (slice_queue_count_[shard_id].load(std::memory_order_relaxed) == 0)
-            continue;
+         shard_id += kTransferWorkerCount)
+        if (processShard(shard_id, failed_slice_list)) has_home_work = true;
+
+    // Nothing to post in the home shards: take over the shards that are
+    // pending but not being posted by their home workers, e.g. when one hot
+    // peer keeps a worker busy.
+    if (!has_home_work) {
+        for (int i = 0; i < kShardCount; ++i) {
+            int shard_id = (thread_id + i) % kShardCount;
+            if (shard_id % kTransferWorkerCount == thread_id) continue;
+            processShard(shard_id, failed_slice_list);
+        }
+    }
+
+    if (!failed_slice_list.empty()) {
+        for (auto &slice : failed_slice_list) slice->rdma.retry_cnt++;
+        redispatch(failed_slice_list);
+    }
+}
 
+bool WorkerPool::processShard(int shard_id, SliceList &failed_slice_list) {
+    if (slice_queue_count_[shard_id].load(std::memory_order_relaxed) == 0 &&
+        post_queue_count_[shard_id].load(std::memory_order_relaxed) == 0)
+        return false;
+    if (!post_lock_[shard_id].try_lock()) return false;
+
+    auto &local_slice_queue = post_queue_[shard_id];
+    if (slice_queue_count_[shard_id].load(std::memory_order_relaxed)) {
         slice_queue_lock_[shard_id].lock();
         for (auto &entry : slice_queue_[shard_id]) {
             for (auto &slice : entry.second)
@@ -177,16 +247,19 @@ void WorkerPool::performPostSend(int thread_id) {
     }
 
     // Redispatch slices to other endpoints, for temporary failures
-    thread_local int tl_redispatch_counter = 0;
-    if (tl_redispatch_counter <
-        redispatch_counter_.load(std::memory_order_relaxed)) {
-        tl_redispatch_counter =
-            redispatch_counter_.load(std::memory_order_relaxed);
-        auto local_slice_queue_clone = local_slice_queue;
+    int redispatch_counter =
+        redispatch_counter_.load(std::memory_order_relaxed);
+    if (post_redispatch_counter_[shard_id] < redispatch_counter) {
+        post_redispatch_counter_[shard_id] = redispatch_counter;
+        SliceList slice_list;
+        for (auto &entry : local_slice_queue)
+            slice_list.insert(slice_list.end(), entry.second.begin(),
+                              entry.second.end());
         local_slice_queue.clear();
-        for (auto &entry : local_slice_queue_clone)
-            redispatch(entry.second, thread_id);
-        return;
+        post_queue_count_[shard_id].store(0, std::memory_order_relaxed);
+        post_lock_[shard_id].unlock();
+        redispatch(slice_list);
+        return true;
     }
 
 #ifdef CONFIG_CACHE_ENDPOINT
@@ -200,30 +273,24 @@ void WorkerPool::performPostSend(int thread_id) {
     }
 #endif
 
-    SliceList failed_slice_list;
     for (auto &entry : local_slice_queue) {
         if (entry.second.empty()) continue;
 
         if (entry.second[0]->target_id == LOCAL_SEGMENT_ID) {
             for (auto &slice : entry.second) {
                 LOG_ASSERT(slice->target_id == LOCAL_SEGMENT_ID);
-#ifdef USE_CUDA
-                if (slice->opcode == TransferRequest::READ)
-                    cudaMemcpy(slice->source_addr,
-                               (void *)slice->rdma.dest_addr, slice->length,
-                               cudaMemcpyDefault);
-                else
-                    cudaMemcpy((void *)slice->rdma.dest_addr,
-                               slice->source_addr, slice->length,
-                               cudaMemcpyDefault);
-#else
-                if (slice->opcode == TransferRequest::READ)
-                    memcpy(slice->source_addr, (void *)slice->rdma.dest_addr,
-                           slice->length);
-                else
-                    memcpy((void *)slice->rdma.dest_addr, slice->source_addr,
-                           slice->length);
-#endif
+                char *dest_addr = (char *)slice->rdma.dest_addr;
+                if (slice->sg_list.empty()) {
+                    localCopy(slice->opcode, slice->source_addr, dest_addr,
+                              slice->length);
+                } else {
+                    for (auto &sge : slice->sg_list) {
+                        localCopy(slice->opcode, sge.addr, dest_addr,
+                                  sge.length);
+                        dest_addr += sge.length;
+                    }
+                }
+                context_.releaseOutstandingBytes(slice->length);
                 slice->markSuccess();
             }
             processed_slice_count_.fetch_add(entry.second.size());
@@ -232,7 +299,10 @@ void WorkerPool::performPostSend(int thread_id) {
         }
 
 #ifdef USE_FAKE_POST_SEND
-        for (auto &slice : entry.second) slice->markSuccess();
+        for (auto &slice : entry.second) {
+            context_.releaseOutstandingBytes(slice->length);
+            slice->markSuccess();
+        }
         processed_slice_count_.fetch_add(entry.second.size());
         entry.second.clear();
 #else
@@ -245,6 +315,7 @@ void WorkerPool::performPostSend(int thread_id) {
 #endif
         if (!endpoint) {
             LOG(ERROR) << "Worker: Cannot allocate endpoint: " << entry.first;
+            context_.engine().peerHealth().markFailure(entry.first);
             for (auto &slice : entry.second) failed_slice_list.push_back(slice);
             entry.second.clear();
             continue;
@@ -252,6 +323,7 @@ void WorkerPool::performPostSend(int thread_id) {
         if (!endpoint->connected() && endpoint->setupConnectionsByActive()) {
             LOG(ERROR) << "Worker: Cannot make connection for endpoint: "
                        << entry.first;
+            context_.engine().peerHealth().markFailure(entry.first);
             for (auto &slice : entry.second) failed_slice_list.push_back(slice);
             entry.second.clear();
             continue;
@@ -260,16 +332,21 @@ void WorkerPool::performPostSend(int thread_id) {
 #endif
     }
 
-    if (!failed_slice_list.empty()) {
-        for (auto &slice : failed_slice_list) slice->rdma.retry_cnt++;
-        redispatch(failed_slice_list, thread_id);
-    }
+
+    uint64_t pending_slice_count = 0;
+    for (auto &entry : local_slice_queue)
+        pending_slice_count += entry.second.size();
+    post_queue_count_[shard_id].store(pending_slice_count,
+                                      std::memory_order_relaxed);
+    post_lock_[shard_id].unlock();
+    return true;
 }
 
 void WorkerPool::performPollCq(int thread_id) {
     int processed_slice_count = 0;
     const static size_t kPollCount = 64;
     std::unordered_map<volatile int *, int> qp_depth_set;
+    SliceList slice_list, retry_slice_list;
     for (int cq_index = thread_id; cq_index < context_.cqCount();
          cq_index += kTransferWorkerCount) {
         ibv_wc wc[kPollCount];
@@ -279,45 +356,30 @@ void WorkerPool::performPollCq(int thread_id) {
             continue;
         }
 
+        int wr_count = 0;
         for (int i = 0; i < nr_poll; ++i) {
+            // The signaled work request ending the group fails as well, and
+            // the whole group is handled then.
+            if (wc[i].wr_id & RdmaEndPoint::kUnsignaledFlag) continue;
             Transport::Slice *slice = (Transport::Slice *)wc[i].wr_id;
             assert(slice);
-            if (qp_depth_set.count(slice->rdma.qp_depth))
-                qp_depth_set[slice->rdma.qp_depth]++;
-            else
-                qp_depth_set[slice->rdma.qp_depth] = 1;
-            // __sync_fetch_and_sub(slice->rdma.qp_depth, 1);
-            if (wc[i].status != IBV_WC_SUCCESS) {
-                LOG(ERROR) << "Worker: Process failed for slice (opcode: "
-                           << slice->opcode
-                           << ", source_addr: " << slice->source_addr
-                           << ", length: " << slice->length
-                           << ", dest_addr: " << slice->rdma.dest_addr
-                           << ", local_nic: " << context_.deviceName()
-                           << ", peer_nic: " << slice->peer_nic_path
-                           << ", dest_rkey: " << slice->rdma.dest_rkey
-                           << ", retry_cnt: " << slice->rdma.retry_cnt
-                           << "): " << ibv_wc_status_str(wc[i].status);
-                context_.deleteEndpoint(slice->peer_nic_path);
-                slice->rdma.retry_cnt++;
-                if (slice->rdma.retry_cnt >= slice->rdma.max_retry_cnt) {
-                    slice->markFailed();
-                    processed_slice_count_++;
-                } else {
-                    collective_slice_queue_[thread_id][slice->peer_nic_path]
-                        .push_back(slice);
-                    redispatch_counter_++;
-                    // std::vector<RdmaTransport::Slice *> slice_list { slice };
-                    // redispatch(slice_list, thread_id);
-                }
-            } else {
-                slice->markSuccess();
-                processed_slice_count++;
-            }
+            // Collect the group before any slice of it is marked, as a
+            // completed task may be freed by the user at once.
+            slice_list.clear();
+            for (; slice; slice = slice->rdma.covered_slice)
+                slice_list.push_back(slice);
+            int group_wr_count =
+                slice_list.size() + slice_list[0]->rdma.extra_wr_count;
+            qp_depth_set[slice_list[0]->rdma.qp_depth] += group_wr_count;
+            wr_count += group_wr_count;
+            updateHealth(slice_list[0]->peer_nic_path, wc[i].status);
+            for (auto entry : slice_list)
+                processCompletion(entry, wc[i].status, retry_slice_list,
+                                  processed_slice_count);
         }
-        if (nr_poll)
+        if (wr_count)
             __sync_fetch_and_sub(context_.cqOutstandingCount(cq_index),
-                                 nr_poll);
+                                 wr_count);
     }
 
     for (auto &entry : qp_depth_set)
@@ -325,10 +387,57 @@ void WorkerPool::performPollCq(int thread_id) {
 
     if (processed_slice_count)
         processed_slice_count_.fetch_add(processed_slice_count);
+
+    if (!retry_slice_list.empty()) redispatch(retry_slice_list);
+}
+
+void WorkerPool::processCompletion(Transport::Slice *slice,
+                                   ibv_wc_status status,
+                                   SliceList &retry_slice_list,
+                                   int &processed_slice_count) {
+    if (status != IBV_WC_SUCCESS) {
+        LOG(ERROR) << "Worker: Process failed for slice (opcode: "
+                   << slice->opcode << ", source_addr: " << slice->source_addr
+                   << ", length: " << slice->length
+                   << ", dest_addr: " << slice->rdma.dest_addr
+                   << ", local_nic: " << context_.deviceName()
+                   << ", peer_nic: " << slice->peer_nic_path
+                   << ", dest_rkey: " << slice->rdma.dest_rkey
+                   << ", retry_cnt: " << slice->rdma.retry_cnt
+                   << "): " << ibv_wc_status_str(status);
+        context_.deleteEndpoint(slice->peer_nic_path);
+        slice->rdma.retry_cnt++;
+        if (slice->rdma.retry_cnt >= slice->rdma.max_retry_cnt) {
+            context_.releaseOutstandingBytes(slice->length);
+            slice->markFailed();
+            processed_slice_count_++;
+        } else {
+            retry_slice_list.push_back(slice);
+            redispatch_counter_++;
+        }
+    } else {
+        context_.releaseOutstandingBytes(slice->length);
+        slice->markSuccess();
+        processed_slice_count++;
+    }
 }
 
-void WorkerPool::redispatch(std::vector<Transport::Slice *> &slice_list,
-                            int thread_id) {
+void WorkerPool::updateHealth(const std::string &peer_nic_path,
+                              ibv_wc_status status) {
+    auto &engine = context_.engine();
+    if (status == IBV_WC_SUCCESS) {
+        engine.deviceHealth().markSuccess(context_.health(),
+                                          context_.deviceName());
+        engine.peerHealth().markSuccess(peer_nic_path);
+    } else if (status != IBV_WC_WR_FLUSH_ERR) {
+        // Flushed work requests only follow the failure that is counted
+        engine.deviceHealth().markFailure(context_.health(),
+                                          context_.deviceName());
+        engine.peerHealth().markFailure(peer_nic_path);
+    }
+}
+
+void WorkerPool::redispatch(SliceList &slice_list) {
     std::unordered_map<SegmentID, std::shared_ptr<Transport::SegmentDesc>>
         segment_desc_map;
     for (auto &slice : slice_list) {
@@ -339,18 +448,22 @@ void WorkerPool::redispatch(std::vector<Transport::Slice *> &slice_list,
         }
     }
 
+    SliceList slice_list_map[kShardCount];
+    size_t shard_slice_count[kShardCount] = {0};
     for (auto &slice : slice_list) {
         if (slice->rdma.retry_cnt == slice->rdma.max_retry_cnt) {
+            context_.releaseOutstandingBytes(slice->length);
             slice->markFailed();
             processed_slice_count_++;
         } else {
             auto &peer_segment_desc = segment_desc_map[slice->target_id];
             int buffer_id, device_id;
             if (!peer_segment_desc ||
-                RdmaTransport::selectDevice(peer_segment_desc.get(),
-                                            slice->rdma.dest_addr,
-                                            slice->length, buffer_id, device_id,
-                                            slice->rdma.retry_cnt)) {
+                context_.engine().selectPeerDevice(
+                    peer_segment_desc.get(), slice->rdma.dest_addr,
+                    slice->length, buffer_id, device_id,
+                    slice->rdma.retry_cnt)) {
+                context_.releaseOutstandingBytes(slice->length);
                 slice->markFailed();
                 processed_slice_count_++;
                 continue;
@@ -361,9 +474,12 @@ void WorkerPool::redispatch(std::vector<Transport::Slice *> &slice_list,
                 MakeNicPath(peer_segment_desc->name,
                             peer_segment_desc->devices[device_id].name);
             slice->peer_nic_path = peer_nic_path;
-            collective_slice_queue_[thread_id][peer_nic_path].push_back(slice);
+            int shard_id = nextShardOf(slice->target_id, device_id,
+                                       shard_slice_count, kShardCount);
+            slice_list_map[shard_id].push_back(slice);
         }
     }
+    enqueue(slice_list_map);
 }
 
 void WorkerPool::transferWorker(int thread_id) {
@@ -395,7 +511,8 @@ void WorkerPool::transferWorker(int thread_id) {
 
 int WorkerPool::doProcessContextEvents() {
     ibv_async_event event;
-    if (ibv_get_async_event(context_.context(), &event) < 0) return ERR_CONTEXT;
+    if (verbs().getAsyncEvent(context_.context(), &event) < 0)
+        return ERR_CONTEXT;
     LOG(WARNING) << "Worker: Received context async event "
                  << ibv_event_type_str(event.event_type) << " for context "
                  << context_.deviceName();
@@ -413,7 +530,7 @@ int WorkerPool::doProcessContextEvents() {
         LOG(INFO) << "Worker: Context " << context_.deviceName()
                   << " is now active";
     }
-    ibv_ack_async_event(&event);
+    verbs().ackAsyncEvent(&event);
     return 0;
 }
 
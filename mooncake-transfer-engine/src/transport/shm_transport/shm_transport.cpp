@@ -0,0 +1,293 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/shm_transport/shm_transport.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+
+#include "error.h"
+
+namespace mooncake {
+struct SharedAllocation {
+    size_t length;
+    int fd;
+};
+
+// Memory handed out by allocateSharedMemory(), keyed by base address.
+static std::mutex g_allocation_mutex;
+static std::map<uint64_t, SharedAllocation> g_allocation_map;
+
+ShmTransport::ShmTransport() {}
+
+ShmTransport::~ShmTransport() {
+    if (listener_id_ >= 0) metadata_->removeSegmentListener(listener_id_);
+}
+
+ShmTransport::MappedRegion::~MappedRegion() {
+    munmap(addr - padding, length + padding);
+}
+
+const std::string &ShmTransport::hostId() {
+    static std::string host_id = []() {
+        std::string id;
+        std::ifstream file("/proc/sys/kernel/random/boot_id");
+        if (file) std::getline(file, id);
+        if (id.empty()) {
+            char hostname[256] = {0};
+            gethostname(hostname, sizeof(hostname) - 1);
+            id = hostname;
+        }
+        return id;
+    }();
+    return host_id;
+}
+
+void *ShmTransport::allocateSharedMemory(size_t size) {
+    int fd = memfd_create("mooncake-shm", MFD_CLOEXEC);
+    if (fd < 0) {
+        PLOG(ERROR) << "ShmTransport: Failed to create memfd";
+        return nullptr;
+    }
+    if (ftruncate(fd, size)) {
+        PLOG(ERROR) << "ShmTransport: Failed to resize memfd to " << size;
+        close(fd);
+        return nullptr;
+    }
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "ShmTransport: Failed to map memfd";
+        close(fd);
+        return nullptr;
+    }
+    addSharedMemory(addr, size, fd);
+    return addr;
+}
+
+int ShmTransport::addSharedMemory(void *addr, size_t length, int fd) {
+    std::lock_guard<std::mutex> lock(g_allocation_mutex);
+    auto iter = g_allocation_map.upper_bound((uint64_t)addr);
+    if (iter != g_allocation_map.end() &&
+        iter->first < (uint64_t)addr + length)
+        return ERR_ADDRESS_OVERLAPPED;
+    if (iter != g_allocation_map.begin() &&
+        std::prev(iter)->first + std::prev(iter)->second.length >
+            (uint64_t)addr)
+        return ERR_ADDRESS_OVERLAPPED;
+    g_allocation_map[(uint64_t)addr] = {length, fd};
+    return 0;
+}
+
+int ShmTransport::freeSharedMemory(void *addr) {
+    std::lock_guard<std::mutex> lock(g_allocation_mutex);
+    auto iter = g_allocation_map.find((uint64_t)addr);
+    if (iter == g_allocation_map.end()) return ERR_ADDRESS_NOT_REGISTERED;
+    munmap(addr, iter->second.length);
+    close(iter->second.fd);
+    g_allocation_map.erase(iter);
+    return 0;
+}
+
+int ShmTransport::install(std::string &local_server_name,
+                          std::shared_ptr<TransferMetadata> meta,
+                          std::shared_ptr<Topology> topo) {
+    int ret = LocalTransport::install(local_server_name, meta, topo);
+    if (ret) return ret;
+    ret = metadata_->setLocalHostId(hostId());
+    if (ret) {
+        LOG(ERROR) << "ShmTransport: Local segment is not allocated, install "
+                      "a network transport first";
+        return ret;
+    }
+    // Copies still in flight hold their own reference of the mapping
+    listener_id_ =
+        metadata_->addSegmentListener([this](const std::string &name) {
+            RWSpinlock::WriteGuard guard(mapping_lock_);
+            mapping_map_.erase(name);
+        });
+    return 0;
+}
+
+int ShmTransport::registerLocalMemory(void *addr, size_t length,
+                                      const std::string &location,
+                                      bool remote_accessible,
+                                      bool update_metadata) {
+    if (!remote_accessible) return 0;
+    TransferMetadata::ShmBufferDesc buffer_desc;
+    {
+        std::lock_guard<std::mutex> lock(g_allocation_mutex);
+        auto iter = g_allocation_map.upper_bound((uint64_t)addr);
+        if (iter == g_allocation_map.begin()) return 0;
+        --iter;
+        if ((uint64_t)addr + length > iter->first + iter->second.length)
+            return 0;  // not shared memory, only reachable by the network
+        buffer_desc.addr = (uint64_t)addr;
+        buffer_desc.length = length;
+        buffer_desc.path = "/proc/" + std::to_string(getpid()) + "/fd/" +
+                           std::to_string(iter->second.fd);
+        buffer_desc.offset = (uint64_t)addr - iter->first;
+        struct stat st;
+        if (fstat(iter->second.fd, &st)) {
+            PLOG(ERROR) << "ShmTransport: Failed to stat memfd";
+            return ERR_MEMORY;
+        }
+        buffer_desc.dev = st.st_dev;
+        buffer_desc.ino = st.st_ino;
+    }
+    return metadata_->addLocalShmBuffer(buffer_desc, update_metadata);
+}
+
+int ShmTransport::unregisterLocalMemory(void *addr, bool update_metadata) {
+    return metadata_->removeLocalShmBuffer(addr, update_metadata);
+}
+
+int ShmTransport::registerLocalMemoryBatch(
+    const std::vector<BufferEntry> &buffer_list, const std::string &location) {
+    for (auto &buffer : buffer_list) {
+        int ret = registerLocalMemory(buffer.addr, buffer.length, location,
+                                      true, false);
+        if (ret) return ret;
+    }
+    return metadata_->updateLocalSegmentDesc();
+}
+
+int ShmTransport::unregisterLocalMemoryBatch(
+    const std::vector<void *> &addr_list) {
+    for (auto &addr : addr_list) unregisterLocalMemory(addr, false);
+    return metadata_->updateLocalSegmentDesc();
+}
+
+bool ShmTransport::reachable(const SegmentDesc &desc, uint64_t target_offset,
+                             size_t length) {
+    return translate(desc, target_offset, length) != nullptr;
+}
+
+char *ShmTransport::translate(const SegmentDesc &desc, uint64_t target_offset,
+                              size_t length, std::shared_ptr<void> *hold) {
+    if (desc.shm_buffers.empty() || desc.host_id != hostId()) return nullptr;
+    int buffer_id = desc.shm_buffer_index.find(target_offset, length);
+    if (buffer_id < 0) return nullptr;
+    auto &buffer_desc = desc.shm_buffers[buffer_id];
+
+    // The fd path may be reused by the owner for another file, so the file
+    // identity and the published address are part of the key.
+    auto key = buffer_desc.path + "@" + std::to_string(buffer_desc.ino) + "@" +
+               std::to_string(buffer_desc.addr);
+    std::shared_ptr<MappedRegion> region;
+    bool found = false;
+    {
+        RWSpinlock::ReadGuard guard(mapping_lock_);
+        auto segment_iter = mapping_map_.find(desc.name);
+        if (segment_iter != mapping_map_.end()) {
+            auto iter = segment_iter->second.find(key);
+            if (iter != segment_iter->second.end()) {
+                region = iter->second;
+                found = true;
+            }
+        }
+    }
+    if (!found) {
+        RWSpinlock::WriteGuard guard(mapping_lock_);
+        auto &region_map = mapping_map_[desc.name];
+        auto iter = region_map.find(key);
+        if (iter == region_map.end())
+            iter = region_map.emplace(key, mapRegion(desc, buffer_desc)).first;
+        region = iter->second;
+    }
+    if (!region) return nullptr;
+    if (hold) *hold = region;
+    return region->addr + (target_offset - buffer_desc.addr);
+}
+
+std::shared_ptr<ShmTransport::MappedRegion> ShmTransport::mapRegion(
+    const SegmentDesc &desc,
+    const TransferMetadata::ShmBufferDesc &buffer_desc) {
+    if (!buffer_desc.ino) {
+        LOG(WARNING) << "ShmTransport: Segment " << desc.name
+                     << " does not publish the identity of "
+                     << buffer_desc.path;
+        return nullptr;
+    }
+    int fd = open(buffer_desc.path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        PLOG(WARNING) << "ShmTransport: Cannot open " << buffer_desc.path
+                      << " of segment " << desc.name;
+        return nullptr;
+    }
+    // The path is resolved in our pid namespace, which may lead to a file of
+    // another process than the owner, e.g. in another container.
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t)st.st_dev != buffer_desc.dev ||
+        (uint64_t)st.st_ino != buffer_desc.ino) {
+        LOG(WARNING) << "ShmTransport: " << buffer_desc.path
+                     << " is not the file of segment " << desc.name;
+        close(fd);
+        return nullptr;
+    }
+    const static size_t kPageSize = sysconf(_SC_PAGESIZE);
+    size_t padding = buffer_desc.offset % kPageSize;
+    void *addr = mmap(nullptr, buffer_desc.length + padding,
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                      buffer_desc.offset - padding);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        PLOG(WARNING) << "ShmTransport: Cannot map " << buffer_desc.path
+                      << " of segment " << desc.name;
+        return nullptr;
+    }
+    auto region = std::make_shared<MappedRegion>();
+    region->addr = (char *)addr + padding;
+    region->length = buffer_desc.length;
+    region->padding = padding;
+    return region;
+}
+
+Status ShmTransport::submitTransferTask(
+    const std::vector<TransferRequest *> &request_list,
+    const std::vector<TransferTask *> &task_list) {
+    for (size_t index = 0; index < request_list.size(); ++index) {
+        auto &request = *request_list[index];
+        auto desc = metadata_->getSegmentDescByID(request.target_id);
+        if (!desc) {
+            LOG(ERROR) << "ShmTransport: Incorrect target segment id "
+                       << request.target_id;
+            return Status::InvalidArgument(
+                "ShmTransport: incorrect target segment id " +
+                std::to_string(request.target_id));
+        }
+        std::shared_ptr<void> hold;
+        char *dest =
+            translate(*desc, request.target_offset, request.length, &hold);
+        if (!dest) {
+            LOG(ERROR) << "ShmTransport: Address not in shared memory "
+                       << (void *)request.target_offset << " of segment "
+                       << desc->name;
+            return Status::AddressNotRegistered(
+                "ShmTransport: not in shared memory, address: " +
+                std::to_string(request.target_offset));
+        }
+        submitCopy(request.opcode, request.source, dest, request.length,
+                   *task_list[index], std::move(hold));
+    }
+    return Status::OK();
+}
+}  // namespace mooncake
@@ -16,170 +16,412 @@
 
 #include <bits/stdint-uintn.h>
 #include <glog/logging.h>
+#include <sys/socket.h>
 
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <iomanip>
 #include <memory>
 
 #include "common.h"
+#include "config.h"
 #include "transfer_engine.h"
 #include "transfer_metadata.h"
+#include "transport/tcp_transport/tcp_connection_pool.h"
+#include "transport/tcp_transport/tcp_frame.h"
 #include "transport/transport.h"
 
 namespace mooncake {
 using tcpsocket = boost::asio::ip::tcp::socket;
 const static size_t kDefaultBufferSize = 65536;
 
-struct SessionHeader {
-    uint64_t size;
-    uint64_t addr;
-    uint8_t opcode;
+struct Frame {
+    FrameHeader header;
+    std::vector<FrameEntry> entry_list;
+    std::vector<boost::asio::const_buffer> payload;
+
+    std::vector<boost::asio::const_buffer> bufferSequence() const {
+        std::vector<boost::asio::const_buffer> buffers;
+        buffers.reserve(payload.size() + 2);
+        buffers.emplace_back(&header, sizeof(FrameHeader));
+        buffers.emplace_back(entry_list.data(),
+                             entry_list.size() * sizeof(FrameEntry));
+        buffers.insert(buffers.end(), payload.begin(), payload.end());
+        return buffers;
+    }
 };
 
+static void appendBuffers(std::vector<boost::asio::mutable_buffer> &buffers,
+                          Transport::Slice *slice) {
+    if (slice->sg_list.empty())
+        buffers.emplace_back(slice->source_addr, slice->length);
+    for (auto &entry : slice->sg_list)
+        buffers.emplace_back(entry.addr, entry.length);
+}
+
+// Base of both ends of a connection. Frames are written one at a time from
+// write_queue_, while the socket is continuously read for incoming frames.
 struct Session : public std::enable_shared_from_this<Session> {
-    explicit Session(tcpsocket socket) : socket_(std::move(socket)) {}
+    explicit Session(tcpsocket socket)
+        : socket_(std::move(socket)), writing_(false), closed_(false) {
+        boost::system::error_code ec;
+        socket_.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+    }
 
-    tcpsocket socket_;
-    SessionHeader header_;
-    uint64_t total_transferred_bytes_;
-    char *local_buffer_;
-    std::function<void(TransferStatusEnum)> on_finalize_;
-    std::mutex session_mutex_;
+    virtual ~Session() {}
+
+    void start() { readHeader(); }
 
-    void initiate(void *buffer, uint64_t dest_addr, size_t size,
-                  TransferRequest::OpCode opcode) {
-        session_mutex_.lock();
-        local_buffer_ = (char *)buffer;
-        header_.addr = htole64(dest_addr);
-        header_.size = htole64(size);
-        header_.opcode = (uint8_t)opcode;
-        total_transferred_bytes_ = 0;
-        writeHeader();
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+        boost::system::error_code ec;
+        socket_.close(ec);
+        onClose();
     }
 
-    void onAccept() {
-        session_mutex_.lock();
-        total_transferred_bytes_ = 0;
-        readHeader();
+   protected:
+    // Called with the received header and entries, returns the buffers that
+    // receive the payload, or false if the frame is malformed.
+    virtual bool onFrame(std::vector<boost::asio::mutable_buffer> &buffers) = 0;
+
+    // Called once the payload of the frame has been received.
+    virtual void onPayload() = 0;
+
+    virtual void onClose() = 0;
+
+    void sendFrame(Frame &&frame) {
+        write_queue_.push_back(std::move(frame));
+        if (!writing_) writeFrame();
     }
 
    private:
-    void writeHeader() {
-        // LOG(INFO) << "writeHeader";
+    void writeFrame() {
         auto self(shared_from_this());
+        writing_ = true;
         boost::asio::async_write(
-            socket_, boost::asio::buffer(&header_, sizeof(SessionHeader)),
-            [this, self](const boost::system::error_code &ec, std::size_t len) {
-                if (ec || len != sizeof(SessionHeader)) {
-                    if (on_finalize_) on_finalize_(TransferStatusEnum::FAILED);
-                    session_mutex_.unlock();
+            socket_, write_queue_.front().bufferSequence(),
+            [this, self](const boost::system::error_code &ec, std::size_t) {
+                writing_ = false;
+                if (ec) {
+                    close();
                     return;
                 }
-                if (header_.opcode == (uint8_t)TransferRequest::WRITE)
-                    writeBody();
-                else
-                    readBody();
+                write_queue_.pop_front();
+                if (!write_queue_.empty() && !closed_) writeFrame();
             });
     }
 
     void readHeader() {
-        // LOG(INFO) << "readHeader";
         auto self(shared_from_this());
         boost::asio::async_read(
-            socket_, boost::asio::buffer(&header_, sizeof(SessionHeader)),
-            [this, self](const boost::system::error_code &ec, std::size_t len) {
-                if (ec || len != sizeof(SessionHeader)) {
-                    if (on_finalize_) on_finalize_(TransferStatusEnum::FAILED);
-                    session_mutex_.unlock();
+            socket_, boost::asio::buffer(&header_, sizeof(FrameHeader)),
+            [this, self](const boost::system::error_code &ec, std::size_t) {
+                if (ec) {
+                    close();
                     return;
                 }
-
-                local_buffer_ = (char *)(le64toh(header_.addr));
-                if (header_.opcode == (uint8_t)TransferRequest::WRITE)
-                    readBody();
-                else
-                    writeBody();
+                uint32_t entry_count = le32toh(header_.entry_count);
+                if (le32toh(header_.magic) != kFrameMagic ||
+                    entry_count > kMaxFrameEntries) {
+                    LOG(ERROR) << "TcpTransport: Malformed frame header";
+                    close();
+                    return;
+                }
+                entry_list_.resize(entry_count);
+                readEntries();
             });
     }
 
-    void writeBody() {
-        // LOG(INFO) << "writeBody";
+    void readEntries() {
         auto self(shared_from_this());
-        uint64_t size = le64toh(header_.size);
-        char *addr = local_buffer_;
-
-        size_t buffer_size =
-            std::min(kDefaultBufferSize, size - total_transferred_bytes_);
-        if (buffer_size == 0) {
-            if (on_finalize_) on_finalize_(TransferStatusEnum::COMPLETED);
-            session_mutex_.unlock();
-            return;
-        }
-
-        boost::asio::async_write(
+        boost::asio::async_read(
             socket_,
-            boost::asio::buffer(addr + total_transferred_bytes_, buffer_size),
-            [this, addr, self](const boost::system::error_code &ec,
-                               std::size_t transferred_bytes) {
+            boost::asio::buffer(entry_list_.data(),
+                                entry_list_.size() * sizeof(FrameEntry)),
+            [this, self](const boost::system::error_code &ec, std::size_t) {
                 if (ec) {
-                    if (on_finalize_) on_finalize_(TransferStatusEnum::FAILED);
-                    session_mutex_.unlock();
+                    close();
                     return;
                 }
-                total_transferred_bytes_ += transferred_bytes;
-                writeBody();
+                std::vector<boost::asio::mutable_buffer> buffers;
+                if (!onFrame(buffers) ||
+                    boost::asio::buffer_size(buffers) !=
+                        le64toh(header_.payload_size)) {
+                    LOG(ERROR) << "TcpTransport: Malformed frame";
+                    close();
+                    return;
+                }
+                readPayload(buffers);
             });
     }
 
-    void readBody() {
-        // LOG(INFO) << "readBody";
+    void readPayload(const std::vector<boost::asio::mutable_buffer> &buffers) {
         auto self(shared_from_this());
-        uint64_t size = le64toh(header_.size);
-        char *addr = local_buffer_;
-
-        size_t buffer_size =
-            std::min(kDefaultBufferSize, size - total_transferred_bytes_);
-        if (buffer_size == 0) {
-            if (on_finalize_) on_finalize_(TransferStatusEnum::COMPLETED);
-            session_mutex_.unlock();
-            return;
+        boost::asio::async_read(
+            socket_, buffers,
+            [this, self](const boost::system::error_code &ec, std::size_t) {
+                if (ec) {
+                    close();
+                    return;
+                }
+                onPayload();
+                if (!closed_) readHeader();
+            });
+    }
+
+   public:
+    tcpsocket socket_;
+
+   protected:
+    FrameHeader header_;
+    std::vector<FrameEntry> entry_list_;
+
+   private:
+    std::deque<Frame> write_queue_;
+    bool writing_;
+    bool closed_;
+};
+
+// Passive side: serves the request frames sent by a peer. Every frame is
+// answered by a response frame carrying the status of each entry.
+struct ServerSession : public Session {
+    using Validator = std::function<bool(uint64_t addr, uint64_t size)>;
+
+    ServerSession(tcpsocket socket, Validator validator)
+        : Session(std::move(socket)), validator_(std::move(validator)) {}
+
+   protected:
+    bool onFrame(std::vector<boost::asio::mutable_buffer> &buffers) override {
+        for (auto &entry : entry_list_) {
+            uint64_t addr = le64toh(entry.addr);
+            uint64_t size = le64toh(entry.size);
+            entry.status = validator_(addr, size) ? 0 : 1;
+            if (entry.opcode != (uint8_t)TransferRequest::WRITE) continue;
+            if (!entry.status) {
+                buffers.emplace_back((void *)addr, size);
+                continue;
+            }
+            // Drain the data of rejected writes
+            discard_buffer_.resize(kDefaultBufferSize);
+            for (uint64_t offset = 0; offset < size;
+                 offset += kDefaultBufferSize)
+                buffers.emplace_back(
+                    discard_buffer_.data(),
+                    std::min(kDefaultBufferSize, size - offset));
         }
+        return true;
+    }
 
-        boost::asio::async_read(
-            socket_,
-            boost::asio::buffer(addr + total_transferred_bytes_, buffer_size),
-            [this, addr, self](const boost::system::error_code &ec,
-                               std::size_t transferred_bytes) {
+    void onPayload() override {
+        Frame response;
+        response.entry_list.swap(entry_list_);
+        uint64_t payload_size = 0;
+        for (auto &entry : response.entry_list) {
+            if (entry.opcode == (uint8_t)TransferRequest::READ &&
+                !entry.status) {
+                response.payload.emplace_back((void *)le64toh(entry.addr),
+                                              le64toh(entry.size));
+                payload_size += le64toh(entry.size);
+            }
+        }
+        response.header.magic = htole32(kFrameMagic);
+        response.header.entry_count = htole32(response.entry_list.size());
+        response.header.payload_size = htole64(payload_size);
+        sendFrame(std::move(response));
+    }
+
+    void onClose() override {}
+
+   private:
+    Validator validator_;
+    std::vector<char> discard_buffer_;
+};
+
+// Active side: sends slices in request frames and completes them when the
+// matching responses arrive. Slices in flight when the connection breaks are
+// handed to on_close_.
+struct ClientSession : public Session {
+    explicit ClientSession(tcpsocket socket)
+        : Session(std::move(socket)), next_request_id_(0), inflight_bytes_(0) {}
+
+    void send(const std::vector<Transport::Slice *> &slice_list) {
+        Frame request;
+        uint64_t payload_size = 0;
+        for (auto slice : slice_list) {
+            FrameEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            uint64_t request_id = next_request_id_++;
+            entry.request_id = htole64(request_id);
+            entry.addr = htole64(slice->tcp.dest_addr);
+            entry.size = htole64(slice->length);
+            entry.opcode = (uint8_t)slice->opcode;
+            request.entry_list.push_back(entry);
+            if (slice->opcode == TransferRequest::WRITE) {
+                std::vector<boost::asio::mutable_buffer> buffers;
+                appendBuffers(buffers, slice);
+                request.payload.insert(request.payload.end(), buffers.begin(),
+                                       buffers.end());
+                payload_size += slice->length;
+            }
+            inflight_map_[request_id] = slice;
+            inflight_bytes_ += slice->length;
+        }
+        request.header.magic = htole32(kFrameMagic);
+        request.header.entry_count = htole32(request.entry_list.size());
+        request.header.payload_size = htole64(payload_size);
+        sendFrame(std::move(request));
+    }
+
+    uint64_t inflightBytes() const { return inflight_bytes_; }
+
+    std::function<void(std::vector<Transport::Slice *> &)> on_close_;
+    // Called after the slices of a response have been completed
+    std::function<void()> on_complete_;
+
+   protected:
+    bool onFrame(std::vector<boost::asio::mutable_buffer> &buffers) override {
+        completion_list_.clear();
+        for (auto &entry : entry_list_) {
+            auto iter = inflight_map_.find(le64toh(entry.request_id));
+            if (iter == inflight_map_.end()) return false;
+            auto slice = iter->second;
+            if (le64toh(entry.size) != slice->length ||
+                entry.opcode != (uint8_t)slice->opcode)
+                return false;
+            completion_list_.push_back(slice);
+            if (slice->opcode == TransferRequest::READ && !entry.status)
+                appendBuffers(buffers, slice);
+        }
+        return true;
+    }
+
+    void onPayload() override {
+        for (size_t i = 0; i < entry_list_.size(); ++i) {
+            auto slice = completion_list_[i];
+            inflight_map_.erase(le64toh(entry_list_[i].request_id));
+            inflight_bytes_ -= slice->length;
+            if (entry_list_[i].status) {
+                LOG(ERROR) << "TcpTransport: Address not registered by peer "
+                           << (void *)slice->tcp.dest_addr;
+                slice->markFailed();
+            } else {
+                slice->markSuccess();
+            }
+        }
+        if (on_complete_) on_complete_();
+    }
+
+    void onClose() override {
+        std::vector<Transport::Slice *> slice_list;
+        for (auto &entry : inflight_map_) slice_list.push_back(entry.second);
+        inflight_map_.clear();
+        inflight_bytes_ = 0;
+        if (on_close_) {
+            auto on_close = std::move(on_close_);
+            on_close_ = nullptr;
+            on_close(slice_list);
+        }
+    }
+
+   private:
+    uint64_t next_request_id_;
+    uint64_t inflight_bytes_;
+    std::unordered_map<uint64_t, Transport::Slice *> inflight_map_;
+    std::vector<Transport::Slice *> completion_list_;
+};
+
+// Connections of the Boost.Asio backend to one peer segment, driven by the
+// io_context chosen for the peer.
+class AsioConnectionPool : public TcpConnectionPool<ClientSession> {
+   public:
+    AsioConnectionPool(boost::asio::io_context &io_context,
+                       const std::string &host, uint16_t port)
+        : TcpConnectionPool(host, port,
+                            globalConfig().tcp_connections_per_peer),
+          io_context_(io_context),
+          resolver_(io_context) {}
+
+   protected:
+    void post(std::function<void()> task) override {
+        boost::asio::post(io_context_, std::move(task));
+    }
+
+    void connect() override {
+        auto pool =
+            std::static_pointer_cast<AsioConnectionPool>(shared_from_this());
+        resolver_.async_resolve(
+            boost::asio::ip::tcp::v4(), host_, std::to_string(port_),
+            [pool](const boost::system::error_code &ec,
+                   boost::asio::ip::tcp::resolver::results_type endpoints) {
                 if (ec) {
-                    if (on_finalize_) on_finalize_(TransferStatusEnum::FAILED);
-                    session_mutex_.unlock();
+                    pool->onConnectFailed(ec.message());
                     return;
                 }
-                total_transferred_bytes_ += transferred_bytes;
-                readBody();
+                auto socket = std::make_shared<tcpsocket>(pool->io_context_);
+                boost::asio::async_connect(
+                    *socket, endpoints,
+                    [pool, socket](const boost::system::error_code &ec,
+                                   const boost::asio::ip::tcp::endpoint &) {
+                        if (ec) {
+                            pool->onConnectFailed(ec.message());
+                            return;
+                        }
+                        pool->onConnected(std::make_shared<ClientSession>(
+                            std::move(*socket)));
+                    });
             });
     }
+
+   private:
+    boost::asio::io_context &io_context_;
+    boost::asio::ip::tcp::resolver resolver_;
 };
 
 struct TcpContext {
-    TcpContext(short port)
-        : acceptor(io_context, boost::asio::ip::tcp::endpoint(
-                                   boost::asio::ip::tcp::v4(), port)) {}
+    TcpContext(short port, int io_thread_count,
+               ServerSession::Validator validator)
+        : validator(std::move(validator)), next_io_context(0) {
+        for (int i = 0; i < io_thread_count; ++i) {
+            io_context_list.emplace_back(
+                std::make_unique<boost::asio::io_context>());
+            work_guard_list.emplace_back(
+                boost::asio::make_work_guard(*io_context_list.back()));
+        }
+        acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(
+            *io_context_list[0],
+            boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port));
+    }
 
+    // Accepted sockets are spread over the io_contexts in round-robin order.
     void doAccept() {
-        acceptor.async_accept(
-            [this](boost::system::error_code ec, tcpsocket socket) {
-                if (!ec)
-                    std::make_shared<Session>(std::move(socket))->onAccept();
+        auto &io_context =
+            *io_context_list[next_io_context++ % io_context_list.size()];
+        acceptor->async_accept(
+            io_context, [this](boost::system::error_code ec, tcpsocket socket) {
                 doAccept();
+                if (ec) return;
+                auto session = std::make_shared<ServerSession>(
+                    std::move(socket), validator);
+                boost::asio::post(session->socket_.get_executor(),
+                                  [session]() { session->start(); });
             });
     }
 
-    boost::asio::io_context io_context;
-    boost::asio::ip::tcp::acceptor acceptor;
+    void stop() {
+        for (auto &io_context : io_context_list) io_context->stop();
+    }
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> io_context_list;
+    std::vector<boost::asio::executor_work_guard<
+        boost::asio::io_context::executor_type>>
+        work_guard_list;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+    ServerSession::Validator validator;
+    size_t next_io_context;  // only accessed by the thread of the acceptor
 };
 
 TcpTransport::TcpTransport() : context_(nullptr), running_(false) {
@@ -189,10 +431,12 @@ TcpTransport::TcpTransport() : context_(nullptr), running_(false) {
 TcpTransport::~TcpTransport() {
     if (running_) {
         running_ = false;
-        context_->io_context.stop();
-        thread_.join();
+        context_->stop();
+        for (auto &thread : thread_list_) thread.join();
     }
 
+    pool_map_.clear();
+
     if (context_) {
         delete context_;
         context_ = nullptr;
@@ -207,7 +451,10 @@ int TcpTransport::install(std::string &local_server_name,
     metadata_ = meta;
     local_server_name_ = local_server_name;
 
-    int ret = allocateLocalSegmentID();
+    int ret = startEventLoop();
+    if (ret) return ret;
+
+    ret = allocateLocalSegmentID();
     if (ret) {
         LOG(ERROR) << "TcpTransport: cannot allocate local segment";
         return -1;
@@ -220,17 +467,39 @@ int TcpTransport::install(std::string &local_server_name,
         return -1;
     }
 
-    context_ = new TcpContext(meta->localRpcMeta().rpc_port);
+    return 0;
+}
+
+uint16_t TcpTransport::listenPort() const {
+    return metadata_->isPeerToPeer() ? 0 : metadata_->localRpcMeta().rpc_port;
+}
+
+int TcpTransport::startEventLoop() {
+    context_ = new TcpContext(listenPort(), globalConfig().tcp_io_threads,
+                              [this](uint64_t addr, uint64_t size) {
+                                  return validateAccess(addr, size);
+                              });
+    data_port_ = context_->acceptor->local_endpoint().port();
+    context_->doAccept();
     running_ = true;
-    thread_ = std::thread(&TcpTransport::worker, this);
+    for (size_t i = 0; i < context_->io_context_list.size(); ++i)
+        thread_list_.emplace_back(&TcpTransport::worker, this, i);
     return 0;
 }
 
+bool TcpTransport::validateAccess(uint64_t addr, uint64_t size) {
+    auto desc = metadata_->peekSegmentDescByID(LOCAL_SEGMENT_ID);
+    if (!desc) return false;
+    return desc->buffer_index.find(addr, size) >= 0;
+}
+
 int TcpTransport::allocateLocalSegmentID() {
     auto desc = std::make_shared<SegmentDesc>();
     if (!desc) return ERR_MEMORY;
     desc->name = local_server_name_;
     desc->protocol = "tcp";
+    if (data_port_ != metadata_->localRpcMeta().rpc_port)
+        desc->tcp_data_port = data_port_;
     metadata_->addLocalSegment(LOCAL_SEGMENT_ID, local_server_name_,
                                std::move(desc));
     return 0;
@@ -255,15 +524,21 @@ int TcpTransport::unregisterLocalMemory(void *addr, bool update_metadata) {
 int TcpTransport::registerLocalMemoryBatch(
     const std::vector<Transport::BufferEntry> &buffer_list,
     const std::string &location) {
-    for (auto &buffer : buffer_list)
-        registerLocalMemory(buffer.addr, buffer.length, location, true, false);
-    return metadata_->updateLocalSegmentDesc();
+    std::vector<BufferDesc> buffer_desc_list;
+    for (auto &buffer : buffer_list) {
+        BufferDesc buffer_desc;
+        buffer_desc.name = local_server_name_;
+        buffer_desc.addr = (uint64_t)buffer.addr;
+        buffer_desc.length = buffer.length;
+        buffer_desc_list.push_back(buffer_desc);
+    }
+    return metadata_->addLocalMemoryBuffers(buffer_desc_list, true);
 }
 
 int TcpTransport::unregisterLocalMemoryBatch(
     const std::vector<void *> &addr_list) {
-    for (auto &addr : addr_list) unregisterLocalMemory(addr, false);
-    return metadata_->updateLocalSegmentDesc();
+    int rc = metadata_->removeLocalMemoryBuffers(addr_list, true);
+    return rc == ERR_ADDRESS_NOT_REGISTERED ? 0 : rc;
 }
 
 Status TcpTransport::getTransferStatus(BatchID batch_id, size_t task_id,
@@ -276,9 +551,10 @@ Status TcpTransport::getTransferStatus(BatchID batch_id, size_t task_id,
             std::to_string(batch_id));
     }
     auto &task = batch_desc.task_list[task_id];
-    status.transferred_bytes = task.transferred_bytes;
     uint64_t success_slice_count = task.success_slice_count;
     uint64_t failed_slice_count = task.failed_slice_count;
+    // Read after the counters, as markSuccess() adds the bytes first
+    status.transferred_bytes = task.transferred_bytes;
     if (success_slice_count + failed_slice_count ==
         task.slice_count) {
         if (failed_slice_count) {
@@ -319,7 +595,6 @@ Status TcpTransport::submitTransfer(BatchID batch_id,
         slice->task = &task;
         slice->target_id = request.target_id;
         slice->status = Slice::PENDING;
-        task.slice_count += 1;
         startTransfer(slice);
     }
 
@@ -341,55 +616,145 @@ Status TcpTransport::submitTransferTask(
         slice->task = &task;
         slice->target_id = request.target_id;
         slice->status = Slice::PENDING;
-        task.slice_count += 1;
         startTransfer(slice);
     }
     return Status::OK();
 }
 
-void TcpTransport::worker() {
+Status TcpTransport::submitVectoredTransferTask(
+    const std::vector<VectoredTransferRequest *> &request_list,
+    const std::vector<TransferTask *> &task_list) {
+    for (size_t index = 0; index < request_list.size(); ++index) {
+        auto &request = *request_list[index];
+        auto &task = *task_list[index];
+        task.total_bytes = request.length();
+        // Like in the RDMA transport, a request without data posts no slice
+        // and its task completes at once.
+        if (!task.total_bytes) continue;
+        auto slice = new Slice();
+        for (auto &entry : request.source_list)
+            if (entry.length)
+                slice->sg_list.push_back({entry.addr, entry.length, 0});
+        slice->source_addr = slice->sg_list[0].addr;
+        slice->length = task.total_bytes;
+        slice->opcode = request.opcode;
+        slice->tcp.dest_addr = request.target_offset;
+        slice->task = &task;
+        slice->target_id = request.target_id;
+        slice->status = Slice::PENDING;
+        startTransfer(slice);
+    }
+    return Status::OK();
+}
+
+void TcpTransport::worker(size_t index) {
+    if (globalConfig().tcp_io_numa_socket >= 0)
+        bindToSocket(globalConfig().tcp_io_numa_socket);
+    auto &io_context = *context_->io_context_list[index];
     while (running_) {
         try {
-            context_->doAccept();
-            context_->io_context.run();
+            io_context.run();
         } catch (std::exception &e) {
             LOG(ERROR) << "TcpTransport: exception: " << e.what();
         }
     }
 }
 
-void TcpTransport::startTransfer(Slice *slice) {
-    try {
-        boost::asio::ip::tcp::resolver resolver(context_->io_context);
-        boost::asio::ip::tcp::socket socket(context_->io_context);
-        auto desc = metadata_->getSegmentDescByID(slice->target_id);
-        if (!desc) {
-            slice->markFailed();
-            return;
-        }
+std::shared_ptr<TcpConnectionPoolBase> TcpTransport::getConnectionPool(
+    SegmentID target_id) {
+    {
+        RWSpinlock::ReadGuard guard(pool_lock_);
+        auto iter = pool_map_.find(target_id);
+        if (iter != pool_map_.end()) return iter->second;
+    }
 
-        TransferMetadata::RpcMetaDesc meta_entry;
-        if (metadata_->getRpcMetaEntry(desc->name, meta_entry)) {
-            slice->markFailed();
-            return;
+    auto desc = metadata_->getSegmentDescByID(target_id);
+    if (!desc) return nullptr;
+    TransferMetadata::RpcMetaDesc meta_entry;
+    if (metadata_->getRpcMetaEntry(desc->name, meta_entry)) return nullptr;
+    auto pool = createConnectionPool(
+        target_id, meta_entry.ip_or_host_name,
+        desc->tcp_data_port ? desc->tcp_data_port : meta_entry.rpc_port);
+    if (!pool) return nullptr;
+    pool->on_unreachable_ = [this, target_id, ptr = pool.get()]() {
+        RWSpinlock::WriteGuard guard(pool_lock_);
+        auto iter = pool_map_.find(target_id);
+        if (iter != pool_map_.end() && iter->second.get() == ptr)
+            pool_map_.erase(iter);
+    };
+
+    RWSpinlock::WriteGuard guard(pool_lock_);
+    auto &entry = pool_map_[target_id];
+    if (!entry) entry = pool;
+    return entry;
+}
+
+std::shared_ptr<TcpConnectionPoolBase> TcpTransport::createConnectionPool(
+    SegmentID target_id, const std::string &host, uint16_t port) {
+    // All connections to a peer are driven by the same io_context, chosen by
+    // the segment id so that peers are spread over the io threads.
+    auto &io_context_list = context_->io_context_list;
+    auto &io_context = *io_context_list[target_id % io_context_list.size()];
+    return std::make_shared<AsioConnectionPool>(io_context, host, port);
+}
+
+// Cuts [offset, offset + length) of the slice into a new slice.
+static Transport::Slice *cutSlice(Transport::Slice *slice, size_t offset,
+                                  size_t length) {
+    auto stripe = new Transport::Slice();
+    stripe->length = length;
+    stripe->opcode = slice->opcode;
+    stripe->tcp.dest_addr = slice->tcp.dest_addr + offset;
+    stripe->tcp.retry_cnt = 0;
+    stripe->task = slice->task;
+    stripe->target_id = slice->target_id;
+    stripe->status = Transport::Slice::PENDING;
+    if (slice->sg_list.empty()) {
+        stripe->source_addr = (char *)slice->source_addr + offset;
+        return stripe;
+    }
+    for (auto &entry : slice->sg_list) {
+        if (!length) break;
+        if (offset >= entry.length) {
+            offset -= entry.length;
+            continue;
         }
+        size_t size = std::min(entry.length - offset, length);
+        stripe->sg_list.push_back({(char *)entry.addr + offset, size, 0});
+        length -= size;
+        offset = 0;
+    }
+    stripe->source_addr = stripe->sg_list[0].addr;
+    return stripe;
+}
 
-        auto endpoint_iterator = resolver.resolve(
-            boost::asio::ip::tcp::v4(), meta_entry.ip_or_host_name,
-            std::to_string(meta_entry.rpc_port));
-        boost::asio::connect(socket, endpoint_iterator);
-        auto session = std::make_shared<Session>(std::move(socket));
-        session->on_finalize_ = [slice](TransferStatusEnum status) {
-            if (status == TransferStatusEnum::COMPLETED)
-                slice->markSuccess();
-            else
-                slice->markFailed();
-        };
-        session->initiate(slice->source_addr, slice->tcp.dest_addr,
-                          slice->length, slice->opcode);
-    } catch (std::exception &e) {
-        LOG(ERROR) << "TcpTransport: ASIO exception: " << e.what();
-        slice->markFailed();
+void TcpTransport::startTransfer(Slice *slice) {
+    // Large requests are split into contiguous stripes which the pool
+    // spreads over parallel connections, so that a single request is not
+    // limited by the congestion window of one flow.
+    std::vector<Slice *> slice_list;
+    size_t stripe_count = std::min((size_t)globalConfig().tcp_stripe_count,
+                                   slice->length / kMinStripeSize);
+    if (stripe_count > 1) {
+        size_t stripe_size = (slice->length + stripe_count - 1) / stripe_count;
+        for (size_t offset = 0; offset < slice->length; offset += stripe_size)
+            slice_list.push_back(cutSlice(
+                slice, offset, std::min(stripe_size, slice->length - offset)));
+        delete slice;
+    } else {
+        slice_list.push_back(slice);
+    }
+    // Account all stripes before any of them may complete.
+    slice_list[0]->task->slice_count += slice_list.size();
+    enqueueSlices(slice_list);
+}
+
+void TcpTransport::enqueueSlices(const std::vector<Slice *> &slice_list) {
+    auto pool = getConnectionPool(slice_list[0]->target_id);
+    if (!pool) {
+        for (auto slice : slice_list) slice->markFailed();
+        return;
     }
+    pool->enqueue(slice_list);
 }
 }  // namespace mooncake
\ No newline at end of file
@@ -0,0 +1,1119 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/tcp_transport/uring_tcp_transport.h"
+
+#include <endian.h>
+#include <glog/logging.h>
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "common.h"
+#include "config.h"
+#include "transport/tcp_transport/tcp_connection_pool.h"
+#include "transport/tcp_transport/tcp_frame.h"
+
+namespace mooncake {
+const static unsigned kRingEntries = 1024;
+// Provided buffers that multishot receives fill, shared by the connections
+// of a ring
+const static unsigned kRecvBufferCount = 256;
+const static size_t kRecvBufferSize = 16384;
+const static uint16_t kRecvBufferGroup = 0;
+// The rest of a payload at least this large is received in place instead
+// of being copied out of the provided buffers.
+const static size_t kDirectRecvThreshold = 262144;
+// Frames carrying at least this many bytes are sent with zero-copy sends
+const static size_t kZeroCopyThreshold = 65536;
+// Slots of the fixed buffer table of each ring. The kernel limits the size
+// of a fixed buffer to 1 GB, larger buffers take several slots.
+const static unsigned kMaxFixedBuffers = 256;
+const static size_t kMaxFixedBufferSize = 1ull << 30;
+const static size_t kDiscardBufferSize = 65536;
+
+// Thin wrapper of an io_uring instance using the raw system calls, so that
+// nothing beyond the kernel headers is needed.
+class IoUring {
+   public:
+    IoUring() : ring_fd_(-1), ring_(MAP_FAILED), sqes_(MAP_FAILED) {}
+
+    ~IoUring() {
+        if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+        if (ring_ != MAP_FAILED) munmap(ring_, ring_size_);
+        if (ring_fd_ >= 0) close(ring_fd_);
+    }
+
+    int init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd_ < 0) return -errno;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) return -ENOSYS;
+        ring_size_ = std::max(
+            params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (ring_ == MAP_FAILED) return -errno;
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) return -errno;
+
+        char *base = (char *)ring_;
+        sq_head_ = (unsigned *)(base + params.sq_off.head);
+        sq_tail_ = (unsigned *)(base + params.sq_off.tail);
+        sq_mask_ = *(unsigned *)(base + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = (unsigned *)(base + params.sq_off.array);
+        cq_head_ = (unsigned *)(base + params.cq_off.head);
+        cq_tail_ = (unsigned *)(base + params.cq_off.tail);
+        cq_mask_ = *(unsigned *)(base + params.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe *)(base + params.cq_off.cqes);
+        sqe_tail_ = *sq_tail_;
+        return 0;
+    }
+
+    // Returns nullptr if the submission queue is full.
+    io_uring_sqe *getSqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sqe_tail_ - head >= sq_entries_) return nullptr;
+        unsigned index = sqe_tail_ & sq_mask_;
+        auto sqe = &((io_uring_sqe *)sqes_)[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        sqe_tail_++;
+        return sqe;
+    }
+
+    // Submits all queued entries with a single system call and waits for
+    // at least wait_nr completions.
+    int submitAndWait(unsigned wait_nr) {
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        unsigned to_submit =
+            sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (!to_submit && !wait_nr) return 0;
+        int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    // Calls handler for every available completion.
+    template <typename Handler>
+    void reap(Handler &&handler) {
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            handler(cqe);
+        }
+    }
+
+    int registerSparseBuffers(unsigned count) {
+        io_uring_rsrc_register reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.nr = count;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        return doRegister(IORING_REGISTER_BUFFERS2, &reg, sizeof(reg));
+    }
+
+    // An empty buffer clears the slot.
+    int updateBuffer(unsigned slot, void *addr, size_t length) {
+        iovec iov = {addr, length};
+        uint64_t tag = 0;
+        io_uring_rsrc_update2 update;
+        memset(&update, 0, sizeof(update));
+        update.offset = slot;
+        update.data = (uint64_t)&iov;
+        update.tags = (uint64_t)&tag;
+        update.nr = 1;
+        int ret = doRegister(IORING_REGISTER_BUFFERS_UPDATE, &update,
+                             sizeof(update));
+        return ret < 0 ? ret : 0;
+    }
+
+    int registerBufferRing(void *ring_addr, unsigned entries, uint16_t group) {
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)ring_addr;
+        reg.ring_entries = entries;
+        reg.bgid = group;
+        return doRegister(IORING_REGISTER_PBUF_RING, &reg, 1);
+    }
+
+   private:
+    int doRegister(unsigned opcode, void *arg, unsigned nr_args) {
+        int ret = syscall(__NR_io_uring_register, ring_fd_, opcode, arg,
+                          nr_args);
+        return ret < 0 ? -errno : ret;
+    }
+
+   private:
+    int ring_fd_;
+    void *ring_;
+    size_t ring_size_;
+    void *sqes_;
+    size_t sqes_size_;
+    unsigned *sq_head_, *sq_tail_, *sq_array_;
+    unsigned sq_mask_, sq_entries_, sqe_tail_;
+    unsigned *cq_head_, *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+};
+
+// Completion callback of an operation. It runs for every completion of the
+// operation, and the operation is released after the last one, i.e. the one
+// without IORING_CQE_F_MORE.
+using UringCallback = std::function<void(int res, uint32_t flags)>;
+
+// A ring and the thread that submits its operations and reaps their
+// completions. Other threads hand work to it with post() or call().
+class UringWorker {
+   public:
+    UringWorker()
+        : event_fd_(-1),
+          event_value_(0),
+          running_(false),
+          stopping_(false),
+          zero_copy_(true),
+          recv_buffer_ring_(MAP_FAILED),
+          recv_buffer_tail_(0),
+          fixed_buffers_enabled_(false) {}
+
+    ~UringWorker() {
+        stop();
+        for (auto op : live_ops_) delete op;
+        if (recv_buffer_ring_ != MAP_FAILED)
+            munmap(recv_buffer_ring_,
+                   kRecvBufferCount * sizeof(io_uring_buf));
+        if (event_fd_ >= 0) close(event_fd_);
+    }
+
+    int start() {
+        int ret = ring_.init(kRingEntries);
+        if (ret) {
+            LOG(ERROR) << "TcpTransport: Failed to set up io_uring: "
+                       << strerror(-ret);
+            return ret;
+        }
+        event_fd_ = eventfd(0, EFD_CLOEXEC);
+        if (event_fd_ < 0) {
+            PLOG(ERROR) << "TcpTransport: Failed to create eventfd";
+            return -errno;
+        }
+        ret = setupRecvBuffers();
+        if (ret) {
+            LOG(ERROR) << "TcpTransport: Failed to register provided "
+                          "buffers: "
+                       << strerror(-ret);
+            return ret;
+        }
+        ret = ring_.registerSparseBuffers(kMaxFixedBuffers);
+        if (ret)
+            LOG(WARNING) << "TcpTransport: Fixed buffers are not available: "
+                         << strerror(-ret);
+        fixed_buffers_enabled_ = (ret == 0);
+        fixed_buffer_list_.resize(kMaxFixedBuffers, {nullptr, 0});
+        fixed_buffer_owner_.resize(kMaxFixedBuffers, nullptr);
+        running_ = true;
+        thread_ = std::thread(&UringWorker::run, this);
+        return 0;
+    }
+
+    void stop() {
+        if (!running_) return;
+        running_ = false;
+        post([]() {});
+        thread_.join();
+    }
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(task_mutex_);
+            task_list_.push_back(std::move(task));
+        }
+        uint64_t value = 1;
+        if (write(event_fd_, &value, sizeof(value)) < 0)
+            PLOG(ERROR) << "TcpTransport: Failed to wake up io_uring worker";
+    }
+
+    // Runs task in the worker thread and waits for it.
+    void call(std::function<void()> task) {
+        std::promise<void> promise;
+        post([&]() {
+            task();
+            promise.set_value();
+        });
+        promise.get_future().wait();
+    }
+
+    // The following functions must be called in the worker thread.
+
+    // Returns the entry of a new operation, or nullptr if the ring is full
+    // or being stopped.
+    io_uring_sqe *prepare(UringCallback callback) {
+        if (stopping_) return nullptr;
+        auto sqe = ring_.getSqe();
+        if (!sqe) {
+            ring_.submitAndWait(0);
+            sqe = ring_.getSqe();
+            if (!sqe) {
+                LOG(ERROR) << "TcpTransport: io_uring submission queue full";
+                return nullptr;
+            }
+        }
+        auto op = new UringCallback(std::move(callback));
+        live_ops_.insert(op);
+        sqe->user_data = (uint64_t)op;
+        return sqe;
+    }
+
+    // Cancels the operation whose entry was returned by prepare().
+    void cancel(uint64_t user_data) {
+        auto sqe = ring_.getSqe();
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data;
+        sqe->user_data = 0;
+    }
+
+    char *recvBuffer(uint16_t bid) {
+        return recv_buffer_pool_.data() + bid * kRecvBufferSize;
+    }
+
+    // Hands a provided buffer back to the kernel.
+    void recycleRecvBuffer(uint16_t bid) {
+        auto ring = (io_uring_buf *)recv_buffer_ring_;
+        auto buf = &ring[recv_buffer_tail_ & (kRecvBufferCount - 1)];
+        buf->addr = (uint64_t)recvBuffer(bid);
+        buf->len = kRecvBufferSize;
+        buf->bid = bid;
+        recv_buffer_tail_++;
+        __atomic_store_n(&((io_uring_buf_ring *)recv_buffer_ring_)->tail,
+                         recv_buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+    // Index of the fixed buffer covering [addr, addr + length), or -1.
+    int fixedBufferIndex(const void *addr, size_t length) const {
+        for (size_t i = 0; i < fixed_buffer_list_.size(); ++i) {
+            auto &entry = fixed_buffer_list_[i];
+            if (entry.iov_len && entry.iov_base <= addr &&
+                (char *)addr + length <=
+                    (char *)entry.iov_base + entry.iov_len)
+                return i;
+        }
+        return -1;
+    }
+
+    void registerFixedBuffer(void *addr, size_t length) {
+        if (!fixed_buffers_enabled_) return;
+        for (size_t offset = 0; offset < length;
+             offset += kMaxFixedBufferSize) {
+            size_t size = std::min(kMaxFixedBufferSize, length - offset);
+            auto iter = std::find(fixed_buffer_owner_.begin(),
+                                  fixed_buffer_owner_.end(), nullptr);
+            if (iter == fixed_buffer_owner_.end()) return;
+            unsigned slot = iter - fixed_buffer_owner_.begin();
+            int ret = ring_.updateBuffer(slot, (char *)addr + offset, size);
+            if (ret) {
+                LOG(WARNING) << "TcpTransport: Cannot use " << addr
+                             << " as fixed buffer: " << strerror(-ret);
+                return;
+            }
+            fixed_buffer_list_[slot] = {(char *)addr + offset, size};
+            fixed_buffer_owner_[slot] = addr;
+        }
+    }
+
+    void unregisterFixedBuffer(void *addr) {
+        for (size_t slot = 0; slot < fixed_buffer_owner_.size(); ++slot) {
+            if (fixed_buffer_owner_[slot] != addr) continue;
+            ring_.updateBuffer(slot, nullptr, 0);
+            fixed_buffer_list_[slot] = {nullptr, 0};
+            fixed_buffer_owner_[slot] = nullptr;
+        }
+    }
+
+    bool zeroCopy() const { return zero_copy_; }
+
+    void disableZeroCopy() {
+        if (zero_copy_)
+            LOG(WARNING) << "TcpTransport: Zero-copy send is not supported";
+        zero_copy_ = false;
+    }
+
+   private:
+    int setupRecvBuffers() {
+        size_t ring_size = kRecvBufferCount * sizeof(io_uring_buf);
+        recv_buffer_ring_ = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (recv_buffer_ring_ == MAP_FAILED) return -errno;
+        recv_buffer_pool_.resize(kRecvBufferCount * kRecvBufferSize);
+        int ret = ring_.registerBufferRing(recv_buffer_ring_, kRecvBufferCount,
+                                           kRecvBufferGroup);
+        if (ret) return ret;
+        for (uint16_t bid = 0; bid < kRecvBufferCount; ++bid)
+            recycleRecvBuffer(bid);
+        return 0;
+    }
+
+    void waitEvent() {
+        auto sqe = prepare([this](int res, uint32_t flags) {
+            std::vector<std::function<void()>> task_list;
+            {
+                std::lock_guard<std::mutex> lock(task_mutex_);
+                task_list.swap(task_list_);
+            }
+            for (auto &task : task_list) task();
+            if (running_) waitEvent();
+        });
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = event_fd_;
+        sqe->addr = (uint64_t)&event_value_;
+        sqe->len = sizeof(event_value_);
+    }
+
+    void complete(const io_uring_cqe &cqe) {
+        if (!cqe.user_data) return;
+        auto op = (UringCallback *)cqe.user_data;
+        (*op)(cqe.res, cqe.flags);
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            live_ops_.erase(op);
+            delete op;
+        }
+    }
+
+    void run() {
+        int numa_socket = globalConfig().tcp_io_numa_socket;
+        if (numa_socket >= 0) bindToSocket(numa_socket);
+        waitEvent();
+        while (running_) {
+            int ret = ring_.submitAndWait(1);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+                LOG(ERROR) << "TcpTransport: io_uring_enter failed: "
+                           << strerror(-ret);
+                break;
+            }
+            ring_.reap([this](const io_uring_cqe &cqe) { complete(cqe); });
+        }
+
+        // Cancel everything in flight and wait until the kernel no longer
+        // uses the buffers of those operations.
+        stopping_ = true;
+        auto sqe = ring_.getSqe();
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        }
+        while (!live_ops_.empty()) {
+            int ret = ring_.submitAndWait(1);
+            if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+                break;
+            ring_.reap([this](const io_uring_cqe &cqe) { complete(cqe); });
+        }
+    }
+
+   private:
+    IoUring ring_;
+    int event_fd_;
+    uint64_t event_value_;
+    std::atomic<bool> running_;
+    bool stopping_;
+    bool zero_copy_;
+    std::thread thread_;
+    std::mutex task_mutex_;
+    std::vector<std::function<void()>> task_list_;
+    std::unordered_set<UringCallback *> live_ops_;
+
+    void *recv_buffer_ring_;
+    std::vector<char> recv_buffer_pool_;
+    uint16_t recv_buffer_tail_;
+
+    bool fixed_buffers_enabled_;
+    std::vector<iovec> fixed_buffer_list_;
+    // Address passed to registerFixedBuffer(), nullptr for free slots
+    std::vector<void *> fixed_buffer_owner_;
+};
+
+struct UringFrame {
+    FrameHeader header;
+    std::vector<FrameEntry> entry_list;
+    std::vector<iovec> payload;
+    std::vector<iovec> iov_list;  // header, entries and payload
+    size_t total_bytes;
+
+    // Called once the header, entries and payload are filled.
+    void seal() {
+        iov_list.clear();
+        iov_list.push_back({&header, sizeof(FrameHeader)});
+        iov_list.push_back(
+            {entry_list.data(), entry_list.size() * sizeof(FrameEntry)});
+        iov_list.insert(iov_list.end(), payload.begin(), payload.end());
+        total_bytes = 0;
+        for (auto &entry : iov_list) total_bytes += entry.iov_len;
+    }
+};
+
+static void appendIovecs(std::vector<iovec> &iov_list,
+                         Transport::Slice *slice) {
+    if (slice->sg_list.empty())
+        iov_list.push_back({slice->source_addr, slice->length});
+    for (auto &entry : slice->sg_list)
+        iov_list.push_back({entry.addr, entry.length});
+}
+
+// Copies [offset, ...) of the concatenated iov_list into result, at most
+// max_count entries.
+static void sliceIovecs(const std::vector<iovec> &iov_list, size_t offset,
+                        size_t max_count, std::vector<iovec> &result) {
+    result.clear();
+    for (auto &entry : iov_list) {
+        if (result.size() >= max_count) break;
+        if (offset >= entry.iov_len) {
+            offset -= entry.iov_len;
+            continue;
+        }
+        result.push_back({(char *)entry.iov_base + offset,
+                          entry.iov_len - offset});
+        offset = 0;
+    }
+}
+
+// Base of both ends of a connection, the counterpart of Session in the
+// Boost.Asio backend. Frames are sent one at a time from write_queue_.
+// Incoming data is delivered by a multishot receive and parsed from the
+// provided buffers; only the tail of a large payload is received in place.
+class UringConnection : public std::enable_shared_from_this<UringConnection> {
+   public:
+    UringConnection(UringWorker *worker, int fd)
+        : worker_(worker),
+          fd_(fd),
+          write_offset_(0),
+          writing_(false),
+          closed_(false),
+          state_(kHeader),
+          received_bytes_(0),
+          recv_op_(0),
+          direct_recv_(false) {
+        int flag = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+
+    virtual ~UringConnection() { ::close(fd_); }
+
+    void start() { armReceive(); }
+
+    // In-flight operations fail once the socket is shut down. The fd is
+    // closed after all of them have released the connection.
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+        shutdown(fd_, SHUT_RDWR);
+        onClose();
+    }
+
+   protected:
+    // Called with the received header and entries, appends the buffers that
+    // receive the payload, or returns false if the frame is malformed.
+    virtual bool onFrame(std::vector<iovec> &iov_list) = 0;
+
+    // Called once the payload of the frame has been received.
+    virtual void onPayload() = 0;
+
+    virtual void onClose() = 0;
+
+    void sendFrame(std::shared_ptr<UringFrame> frame) {
+        frame->seal();
+        write_queue_.push_back(std::move(frame));
+        if (!writing_) writeFrame();
+    }
+
+   private:
+    enum ParseState { kHeader, kEntries, kPayload };
+
+    void writeFrame() {
+        auto frame = write_queue_.front();
+        sliceIovecs(frame->iov_list, write_offset_, IOV_MAX, send_iov_);
+        size_t length = 0;
+        for (auto &entry : send_iov_) length += entry.iov_len;
+        bool zero_copy = worker_->zeroCopy() && length >= kZeroCopyThreshold;
+
+        auto self(shared_from_this());
+        // The frame is captured until the notification of a zero-copy send
+        // tells that the kernel no longer references its memory.
+        auto sqe = worker_->prepare([this, self, frame, zero_copy](
+                                        int res, uint32_t flags) {
+            if (flags & IORING_CQE_F_NOTIF) return;
+            if (zero_copy && (res == -EINVAL || res == -EOPNOTSUPP)) {
+                worker_->disableZeroCopy();
+                writeFrame();
+                return;
+            }
+            if (res <= 0) {
+                writing_ = false;
+                close();
+                return;
+            }
+            write_offset_ += res;
+            if (write_offset_ == frame->total_bytes) {
+                write_queue_.pop_front();
+                write_offset_ = 0;
+            }
+            if (write_queue_.empty() || closed_)
+                writing_ = false;
+            else
+                writeFrame();
+        });
+        if (!sqe) {
+            close();
+            return;
+        }
+        writing_ = true;
+        sqe->fd = fd_;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        int fixed_index =
+            zero_copy && send_iov_.size() == 1
+                ? worker_->fixedBufferIndex(send_iov_[0].iov_base, length)
+                : -1;
+        if (fixed_index >= 0) {
+            sqe->opcode = IORING_OP_SEND_ZC;
+            sqe->addr = (uint64_t)send_iov_[0].iov_base;
+            sqe->len = std::min(length, kMaxFixedBufferSize);
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = fixed_index;
+        } else {
+            memset(&send_msg_, 0, sizeof(send_msg_));
+            send_msg_.msg_iov = send_iov_.data();
+            send_msg_.msg_iovlen = send_iov_.size();
+            sqe->opcode = zero_copy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+            sqe->addr = (uint64_t)&send_msg_;
+            sqe->len = 1;
+        }
+    }
+
+    void armReceive() {
+        auto self(shared_from_this());
+        auto sqe = worker_->prepare([this, self](int res, uint32_t flags) {
+            if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if (!closed_) consume(worker_->recvBuffer(bid), res);
+                worker_->recycleRecvBuffer(bid);
+            }
+            if (flags & IORING_CQE_F_MORE) return;
+            recv_op_ = 0;
+            if (closed_) return;
+            if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+                close();
+                return;
+            }
+            if (direct_recv_ && state_ == kPayload)
+                receivePayload();
+            else
+                armReceive();
+        });
+        if (!sqe) {
+            close();
+            return;
+        }
+        direct_recv_ = false;
+        recv_op_ = sqe->user_data;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd_;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kRecvBufferGroup;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+
+    // Parses data delivered by the multishot receive.
+    void consume(const char *data, size_t length) {
+        while (length && !closed_) {
+            if (state_ == kHeader) {
+                size_t size =
+                    std::min(length, sizeof(FrameHeader) - received_bytes_);
+                memcpy((char *)&header_ + received_bytes_, data, size);
+                data += size;
+                length -= size;
+                received_bytes_ += size;
+                if (received_bytes_ == sizeof(FrameHeader)) onHeader();
+            } else if (state_ == kEntries) {
+                size_t entry_bytes = entry_list_.size() * sizeof(FrameEntry);
+                size_t size = std::min(length, entry_bytes - received_bytes_);
+                memcpy((char *)entry_list_.data() + received_bytes_, data,
+                       size);
+                data += size;
+                length -= size;
+                received_bytes_ += size;
+                if (received_bytes_ == entry_bytes) onEntries();
+            } else {
+                size_t size =
+                    std::min(length, payload_bytes_ - received_bytes_);
+                std::vector<iovec> iov_list;
+                sliceIovecs(recv_iov_, received_bytes_, recv_iov_.size(),
+                            iov_list);
+                size_t copied = 0;
+                for (auto &entry : iov_list) {
+                    if (copied == size) break;
+                    size_t piece = std::min(entry.iov_len, size - copied);
+                    memcpy(entry.iov_base, data + copied, piece);
+                    copied += piece;
+                }
+                data += size;
+                length -= size;
+                received_bytes_ += size;
+                if (received_bytes_ == payload_bytes_) onFrameReceived();
+            }
+        }
+        // Stop copying a large payload: cancel the multishot receive, and
+        // receive the rest in place once it has terminated.
+        if (state_ == kPayload && !direct_recv_ && recv_op_ &&
+            payload_bytes_ - received_bytes_ >= kDirectRecvThreshold) {
+            direct_recv_ = true;
+            worker_->cancel(recv_op_);
+        }
+    }
+
+    void onHeader() {
+        uint32_t entry_count = le32toh(header_.entry_count);
+        if (le32toh(header_.magic) != kFrameMagic ||
+            entry_count > kMaxFrameEntries) {
+            LOG(ERROR) << "TcpTransport: Malformed frame header";
+            close();
+            return;
+        }
+        entry_list_.resize(entry_count);
+        state_ = kEntries;
+        received_bytes_ = 0;
+        if (!entry_count) onEntries();
+    }
+
+    void onEntries() {
+        recv_iov_.clear();
+        if (!onFrame(recv_iov_)) {
+            LOG(ERROR) << "TcpTransport: Malformed frame";
+            close();
+            return;
+        }
+        payload_bytes_ = 0;
+        for (auto &entry : recv_iov_) payload_bytes_ += entry.iov_len;
+        if (payload_bytes_ != le64toh(header_.payload_size)) {
+            LOG(ERROR) << "TcpTransport: Malformed frame";
+            close();
+            return;
+        }
+        state_ = kPayload;
+        received_bytes_ = 0;
+        if (!payload_bytes_) onFrameReceived();
+    }
+
+    void onFrameReceived() {
+        onPayload();
+        state_ = kHeader;
+        received_bytes_ = 0;
+    }
+
+    // Receives the rest of the payload in place, then resumes the multishot
+    // receive.
+    void receivePayload() {
+        if (received_bytes_ == payload_bytes_) {
+            onFrameReceived();
+            if (!closed_) armReceive();
+            return;
+        }
+        sliceIovecs(recv_iov_, received_bytes_, IOV_MAX, direct_iov_);
+        auto self(shared_from_this());
+        auto sqe = worker_->prepare([this, self](int res, uint32_t flags) {
+            if (closed_) return;
+            if (res <= 0) {
+                close();
+                return;
+            }
+            received_bytes_ += res;
+            receivePayload();
+        });
+        if (!sqe) {
+            close();
+            return;
+        }
+        sqe->fd = fd_;
+        int fixed_index =
+            direct_iov_.size() == 1
+                ? worker_->fixedBufferIndex(direct_iov_[0].iov_base,
+                                            direct_iov_[0].iov_len)
+                : -1;
+        if (fixed_index >= 0) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = (uint64_t)direct_iov_[0].iov_base;
+            sqe->len = std::min(direct_iov_[0].iov_len, kMaxFixedBufferSize);
+            sqe->buf_index = fixed_index;
+        } else {
+            memset(&recv_msg_, 0, sizeof(recv_msg_));
+            recv_msg_.msg_iov = direct_iov_.data();
+            recv_msg_.msg_iovlen = direct_iov_.size();
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uint64_t)&recv_msg_;
+            sqe->len = 1;
+        }
+    }
+
+   protected:
+    UringWorker *worker_;
+    int fd_;
+    FrameHeader header_;
+    std::vector<FrameEntry> entry_list_;
+
+   private:
+    std::deque<std::shared_ptr<UringFrame>> write_queue_;
+    size_t write_offset_;
+    bool writing_;
+    bool closed_;
+    std::vector<iovec> send_iov_;
+    msghdr send_msg_;
+
+    ParseState state_;
+    size_t received_bytes_;  // of the current header, entries or payload
+    size_t payload_bytes_;
+    std::vector<iovec> recv_iov_;  // receives the payload
+    uint64_t recv_op_;             // the multishot receive, 0 if none
+    bool direct_recv_;
+    std::vector<iovec> direct_iov_;
+    msghdr recv_msg_;
+};
+
+// Passive side: serves the request frames sent by a peer.
+class UringServerConnection : public UringConnection {
+   public:
+    using Validator = std::function<bool(uint64_t addr, uint64_t size)>;
+
+    UringServerConnection(UringWorker *worker, int fd, Validator validator)
+        : UringConnection(worker, fd), validator_(std::move(validator)) {}
+
+   protected:
+    bool onFrame(std::vector<iovec> &iov_list) override {
+        for (auto &entry : entry_list_) {
+            uint64_t addr = le64toh(entry.addr);
+            uint64_t size = le64toh(entry.size);
+            entry.status = validator_(addr, size) ? 0 : 1;
+            if (entry.opcode != (uint8_t)Transport::TransferRequest::WRITE)
+                continue;
+            if (!entry.status) {
+                iov_list.push_back({(void *)addr, size});
+                continue;
+            }
+            // Drain the data of rejected writes
+            discard_buffer_.resize(kDiscardBufferSize);
+            for (uint64_t offset = 0; offset < size;
+                 offset += kDiscardBufferSize)
+                iov_list.push_back(
+                    {discard_buffer_.data(),
+                     std::min(kDiscardBufferSize, size - offset)});
+        }
+        return true;
+    }
+
+    void onPayload() override {
+        auto response = std::make_shared<UringFrame>();
+        response->entry_list.swap(entry_list_);
+        uint64_t payload_size = 0;
+        for (auto &entry : response->entry_list) {
+            if (entry.opcode == (uint8_t)Transport::TransferRequest::READ &&
+                !entry.status) {
+                response->payload.push_back(
+                    {(void *)le64toh(entry.addr), le64toh(entry.size)});
+                payload_size += le64toh(entry.size);
+            }
+        }
+        response->header.magic = htole32(kFrameMagic);
+        response->header.entry_count = htole32(response->entry_list.size());
+        response->header.payload_size = htole64(payload_size);
+        sendFrame(response);
+    }
+
+    void onClose() override {}
+
+   private:
+    Validator validator_;
+    std::vector<char> discard_buffer_;
+};
+
+// Active side: sends slices in request frames and completes them when the
+// matching responses arrive.
+class UringClientConnection : public UringConnection {
+   public:
+    UringClientConnection(UringWorker *worker, int fd)
+        : UringConnection(worker, fd),
+          next_request_id_(0),
+          inflight_bytes_(0) {}
+
+    void send(const std::vector<Transport::Slice *> &slice_list) {
+        auto request = std::make_shared<UringFrame>();
+        uint64_t payload_size = 0;
+        for (auto slice : slice_list) {
+            FrameEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            uint64_t request_id = next_request_id_++;
+            entry.request_id = htole64(request_id);
+            entry.addr = htole64(slice->tcp.dest_addr);
+            entry.size = htole64(slice->length);
+            entry.opcode = (uint8_t)slice->opcode;
+            request->entry_list.push_back(entry);
+            if (slice->opcode == Transport::TransferRequest::WRITE) {
+                appendIovecs(request->payload, slice);
+                payload_size += slice->length;
+            }
+            inflight_map_[request_id] = slice;
+            inflight_bytes_ += slice->length;
+        }
+        request->header.magic = htole32(kFrameMagic);
+        request->header.entry_count = htole32(request->entry_list.size());
+        request->header.payload_size = htole64(payload_size);
+        sendFrame(request);
+    }
+
+    uint64_t inflightBytes() const { return inflight_bytes_; }
+
+    std::function<void(std::vector<Transport::Slice *> &)> on_close_;
+    // Called after the slices of a response have been completed
+    std::function<void()> on_complete_;
+
+   protected:
+    bool onFrame(std::vector<iovec> &iov_list) override {
+        completion_list_.clear();
+        for (auto &entry : entry_list_) {
+            auto iter = inflight_map_.find(le64toh(entry.request_id));
+            if (iter == inflight_map_.end()) return false;
+            auto slice = iter->second;
+            if (le64toh(entry.size) != slice->length ||
+                entry.opcode != (uint8_t)slice->opcode)
+                return false;
+            completion_list_.push_back(slice);
+            if (slice->opcode == Transport::TransferRequest::READ &&
+                !entry.status)
+                appendIovecs(iov_list, slice);
+        }
+        return true;
+    }
+
+    void onPayload() override {
+        for (size_t i = 0; i < entry_list_.size(); ++i) {
+            auto slice = completion_list_[i];
+            inflight_map_.erase(le64toh(entry_list_[i].request_id));
+            inflight_bytes_ -= slice->length;
+            if (entry_list_[i].status) {
+                LOG(ERROR) << "TcpTransport: Address not registered by peer "
+                           << (void *)slice->tcp.dest_addr;
+                slice->markFailed();
+            } else {
+                slice->markSuccess();
+            }
+        }
+        if (on_complete_) on_complete_();
+    }
+
+    void onClose() override {
+        std::vector<Transport::Slice *> slice_list;
+        for (auto &entry : inflight_map_) slice_list.push_back(entry.second);
+        inflight_map_.clear();
+        inflight_bytes_ = 0;
+        if (on_close_) {
+            auto on_close = std::move(on_close_);
+            on_close_ = nullptr;
+            on_close(slice_list);
+        }
+    }
+
+   private:
+    uint64_t next_request_id_;
+    uint64_t inflight_bytes_;
+    std::unordered_map<uint64_t, Transport::Slice *> inflight_map_;
+    std::vector<Transport::Slice *> completion_list_;
+};
+
+// Connections of the io_uring backend to one peer segment, driven by the
+// worker chosen for the peer.
+class UringConnectionPool : public TcpConnectionPool<UringClientConnection> {
+   public:
+    UringConnectionPool(UringWorker *worker, const sockaddr_in &addr,
+                        const std::string &host, uint16_t port)
+        : TcpConnectionPool(host, port,
+                            globalConfig().tcp_connections_per_peer),
+          worker_(worker),
+          addr_(addr) {}
+
+   protected:
+    void post(std::function<void()> task) override {
+        worker_->post(std::move(task));
+    }
+
+    void connect() override {
+        auto pool =
+            std::static_pointer_cast<UringConnectionPool>(shared_from_this());
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            int err = errno;
+            post([pool, err]() { pool->onConnectFailed(strerror(err)); });
+            return;
+        }
+        auto sqe = worker_->prepare([pool, fd](int res, uint32_t) {
+            if (res < 0) {
+                close(fd);
+                pool->onConnectFailed(strerror(-res));
+                return;
+            }
+            pool->onConnected(
+                std::make_shared<UringClientConnection>(pool->worker_, fd));
+        });
+        if (!sqe) {
+            close(fd);
+            post([pool]() { pool->onConnectFailed(strerror(EBUSY)); });
+            return;
+        }
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)&addr_;
+        sqe->off = sizeof(addr_);
+    }
+
+   private:
+    UringWorker *worker_;
+    sockaddr_in addr_;
+};
+
+UringTcpTransport::UringTcpTransport() : listen_fd_(-1), next_worker_(0) {}
+
+UringTcpTransport::~UringTcpTransport() {
+    worker_list_.clear();
+    if (listen_fd_ >= 0) close(listen_fd_);
+}
+
+int UringTcpTransport::startEventLoop() {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        PLOG(ERROR) << "TcpTransport: Failed to create socket";
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(listenPort());
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) ||
+        listen(listen_fd_, SOMAXCONN) ||
+        getsockname(listen_fd_, (sockaddr *)&addr, &addr_len)) {
+        PLOG(ERROR) << "TcpTransport: Failed to listen on port "
+                    << listenPort();
+        return -1;
+    }
+    data_port_ = ntohs(addr.sin_port);
+
+    for (int i = 0; i < globalConfig().tcp_io_threads; ++i) {
+        worker_list_.emplace_back(std::make_unique<UringWorker>());
+        if (worker_list_.back()->start()) return -1;
+    }
+    worker_list_[0]->post([this]() { acceptConnections(); });
+    return 0;
+}
+
+// Accepted sockets are spread over the workers in round-robin order.
+void UringTcpTransport::acceptConnections() {
+    auto worker = worker_list_[0].get();
+    auto sqe = worker->prepare([this, worker](int res, uint32_t flags) {
+        if (res >= 0) {
+            auto target =
+                worker_list_[next_worker_++ % worker_list_.size()].get();
+            target->post([this, target, res]() {
+                auto connection = std::make_shared<UringServerConnection>(
+                    target, res, [this](uint64_t addr, uint64_t size) {
+                        return validateAccess(addr, size);
+                    });
+                connection->start();
+            });
+        } else if (res != -ECANCELED) {
+            LOG(ERROR) << "TcpTransport: Failed to accept: "
+                       << strerror(-res);
+        }
+        if (!(flags & IORING_CQE_F_MORE) && res != -ECANCELED)
+            acceptConnections();
+    });
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd_;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+int UringTcpTransport::registerLocalMemory(void *addr, size_t length,
+                                           const std::string &location,
+                                           bool remote_accessible,
+                                           bool update_metadata) {
+    int ret = TcpTransport::registerLocalMemory(addr, length, location,
+                                                remote_accessible,
+                                                update_metadata);
+    if (ret) return ret;
+    for (auto &worker : worker_list_)
+        worker->call([&]() { worker->registerFixedBuffer(addr, length); });
+    return 0;
+}
+
+int UringTcpTransport::unregisterLocalMemory(void *addr,
+                                             bool update_metadata) {
+    for (auto &worker : worker_list_)
+        worker->call([&]() { worker->unregisterFixedBuffer(addr); });
+    return TcpTransport::unregisterLocalMemory(addr, update_metadata);
+}
+
+std::shared_ptr<TcpConnectionPoolBase> UringTcpTransport::createConnectionPool(
+    SegmentID target_id, const std::string &host, uint16_t port) {
+    addrinfo hints, *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int ret = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                          &result);
+    if (ret || !result) {
+        LOG(ERROR) << "TcpTransport: Failed to resolve " << host << ": "
+                   << gai_strerror(ret);
+        return nullptr;
+    }
+    sockaddr_in addr;
+    memcpy(&addr, result->ai_addr, sizeof(sockaddr_in));
+    freeaddrinfo(result);
+    // All connections to a peer are driven by the same worker, chosen by
+    // the segment id so that peers are spread over the io threads.
+    auto worker = worker_list_[target_id % worker_list_.size()].get();
+    return std::make_shared<UringConnectionPool>(worker, addr, host, port);
+}
+}  // namespace mooncake
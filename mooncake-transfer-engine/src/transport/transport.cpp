@@ -51,6 +51,29 @@ Status Transport::freeBatchID(BatchID batch_id) {
     return Status::OK();
 }
 
+Status Transport::submitVectoredTransferTask(
+    const std::vector<VectoredTransferRequest *> &request_list,
+    const std::vector<TransferTask *> &task_list) {
+    std::vector<TransferRequest> split_request_list;
+    std::vector<TransferTask *> split_task_list;
+    for (size_t index = 0; index < request_list.size(); ++index) {
+        auto &request = *request_list[index];
+        uint64_t target_offset = request.target_offset;
+        for (auto &entry : request.source_list) {
+            if (!entry.length) continue;
+            split_request_list.push_back({request.opcode, entry.addr,
+                                          request.target_id, target_offset,
+                                          entry.length});
+            split_task_list.push_back(task_list[index]);
+            target_offset += entry.length;
+        }
+    }
+    std::vector<TransferRequest *> split_request_ptr_list;
+    for (auto &request : split_request_list)
+        split_request_ptr_list.push_back(&request);
+    return submitTransferTask(split_request_ptr_list, split_task_list);
+}
+
 int Transport::install(std::string &local_server_name,
                        std::shared_ptr<TransferMetadata> meta,
                        std::shared_ptr<Topology> topo) {
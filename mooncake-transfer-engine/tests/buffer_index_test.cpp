@@ -0,0 +1,109 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "buffer_index.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+#include "transfer_metadata.h"
+#include "transport/rdma_transport/rdma_transport.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+TEST(BufferIndexTest, DisjointBuffers) {
+    BufferIndex index;
+    // Registered out of address order
+    index.build({{0x3000, 0x1000}, {0x1000, 0x1000}, {0x2000, 0x800}});
+    ASSERT_EQ(index.size(), 3u);
+    EXPECT_EQ(index.addr(0), 0x3000u);
+    EXPECT_EQ(index.find(0x1000, 0x1000), 1);
+    EXPECT_EQ(index.find(0x1800, 0x10), 1);
+    EXPECT_EQ(index.find(0x2000, 0x800), 2);
+    EXPECT_EQ(index.find(0x3fff, 1), 0);
+    // Spanning two buffers, or outside of all of them
+    EXPECT_EQ(index.find(0x1800, 0x1000), -1);
+    EXPECT_EQ(index.find(0x2800, 0x10), -1);
+    EXPECT_EQ(index.find(0x0, 0x10), -1);
+    EXPECT_EQ(index.find(0x4000, 0x10), -1);
+    EXPECT_EQ(index.find(0x1000, 0x10, 2), -1);
+}
+
+TEST(BufferIndexTest, OverlappingBuffers) {
+    BufferIndex index;
+    index.build({{0x2000, 0x1000}, {0x1000, 0x4000}, {0x2800, 0x100}});
+    EXPECT_EQ(index.find(0x2800, 0x10), 0);
+    EXPECT_EQ(index.find(0x2800, 0x10, 1), 1);
+    EXPECT_EQ(index.find(0x2800, 0x10, 2), 2);
+    EXPECT_EQ(index.find(0x2800, 0x1000), 1);
+    EXPECT_EQ(index.find(0x1000, 0x10), 1);
+    EXPECT_EQ(index.find(0x4800, 0x800), 1);
+    EXPECT_EQ(index.find(0x4800, 0x801), -1);
+}
+
+TEST(BufferIndexTest, MatchesLinearScan) {
+    std::mt19937_64 rng(42);
+    BufferIndex::RangeList range_list;
+    for (int i = 0; i < 64; ++i)
+        range_list.emplace_back(rng() % (1 << 20), 1 + rng() % (1 << 16));
+    BufferIndex index;
+    index.build(range_list);
+    for (int i = 0; i < 10000; ++i) {
+        uint64_t addr = rng() % (1 << 20), length = rng() % (1 << 14);
+        int expected = -1;
+        for (size_t id = 0; id < range_list.size(); ++id) {
+            auto &range = range_list[id];
+            if (range.first <= addr &&
+                addr + length <= range.first + range.second) {
+                expected = id;
+                break;
+            }
+        }
+        ASSERT_EQ(index.find(addr, length), expected);
+    }
+}
+
+TEST(BufferIndexTest, SegmentDescLookup) {
+    TransferMetadata::SegmentDesc desc;
+    desc.topology.parse("{\"cpu:0\" : [[\"mlx5_0\"],[]]}");
+    desc.devices.push_back({"mlx5_0", 0, ""});
+    for (uint32_t i = 0; i < 1024; ++i)
+        desc.buffers.push_back(
+            {"cpu:0", (1024 - i) << 20, 1 << 20, {i}, {i}});
+    desc.nvmeof_buffers.push_back({"/dev/nvme0n1", 4096, {}});
+    desc.nvmeof_buffers.push_back({"/dev/nvme1n1", 8192, {}});
+    desc.indexBuffers();
+
+    EXPECT_EQ(RdmaTransport::findBuffer(&desc, 1024 << 20, 4096), 0);
+    EXPECT_EQ(RdmaTransport::findBuffer(&desc, (1 << 20) + 4096, 4096), 1023);
+    EXPECT_EQ(RdmaTransport::findBuffer(&desc, (2 << 20) - 1, 2), -1);
+    int buffer_id, device_id;
+    ASSERT_EQ(RdmaTransport::selectDevice(&desc, 512 << 20, 4096, buffer_id,
+                                          device_id),
+              0);
+    EXPECT_EQ(buffer_id, 512);
+    EXPECT_EQ(device_id, 0);
+
+    EXPECT_EQ(desc.nvmeof_buffer_index.addr(1), 4096u);
+    EXPECT_EQ(desc.nvmeof_buffer_index.find(4096, 1), 1);
+    EXPECT_EQ(desc.nvmeof_buffer_index.find(4095, 1), 0);
+}
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
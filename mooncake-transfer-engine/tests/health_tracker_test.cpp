@@ -0,0 +1,157 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/rdma_transport/health_tracker.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "transfer_metadata.h"
+#include "transport/rdma_transport/rdma_transport.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+const uint64_t kMillisecond = 1000000;
+
+// Time of the trackers under test, moved forward by the tests
+static int64_t g_current_ts = 0;
+
+static int64_t fakeClock() { return g_current_ts; }
+
+TEST(HealthTrackerTest, BackoffAfterThreshold) {
+    HealthTracker tracker(100 * kMillisecond, 1000 * kMillisecond, 2);
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+    tracker.markFailure("mlx5_0");
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+    tracker.markFailure("mlx5_0");
+    ASSERT_FALSE(tracker.healthy("mlx5_0"));
+    ASSERT_TRUE(tracker.healthy("mlx5_1"));
+    tracker.markSuccess("mlx5_0");
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+}
+
+TEST(HealthTrackerTest, SuccessResetsFailureCount) {
+    HealthTracker tracker(100 * kMillisecond, 1000 * kMillisecond, 2);
+    tracker.markFailure("mlx5_0");
+    tracker.markSuccess("mlx5_0");
+    tracker.markFailure("mlx5_0");
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+}
+
+TEST(HealthTrackerTest, ProbeAfterBackoff) {
+    HealthTracker tracker(50 * kMillisecond, 1000 * kMillisecond, 1,
+                          fakeClock);
+    tracker.markFailure("mlx5_0");
+    ASSERT_FALSE(tracker.healthy("mlx5_0"));
+    g_current_ts += 49 * kMillisecond;
+    ASSERT_FALSE(tracker.healthy("mlx5_0"));
+    g_current_ts += 1 * kMillisecond;
+    // One probe per backoff period
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+    ASSERT_FALSE(tracker.healthy("mlx5_0"));
+
+    // The probe fails: the backoff doubles to 100ms.
+    tracker.markFailure("mlx5_0");
+    g_current_ts += 99 * kMillisecond;
+    ASSERT_FALSE(tracker.healthy("mlx5_0"));
+    g_current_ts += 1 * kMillisecond;
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+
+    // The probe succeeds.
+    tracker.markSuccess("mlx5_0");
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+    ASSERT_TRUE(tracker.healthy("mlx5_0"));
+}
+
+TEST(HealthTrackerTest, OwnedState) {
+    HealthTracker tracker(50 * kMillisecond, 1000 * kMillisecond, 2,
+                          fakeClock);
+    HealthState state;
+    ASSERT_TRUE(tracker.healthy(state));
+    tracker.markFailure(state, "mlx5_0");
+    ASSERT_TRUE(tracker.healthy(state));
+    tracker.markFailure(state, "mlx5_0");
+    ASSERT_FALSE(tracker.healthy(state));
+    g_current_ts += 50 * kMillisecond;
+    ASSERT_TRUE(tracker.healthy(state));
+    ASSERT_FALSE(tracker.healthy(state));
+    tracker.markSuccess(state, "mlx5_0");
+    ASSERT_TRUE(tracker.healthy(state));
+    // Owned states never create named entries
+    ASSERT_TRUE(tracker.empty());
+}
+
+TEST(HealthTrackerTest, EvictIdleEntries) {
+    HealthTracker tracker(50 * kMillisecond, 100 * kMillisecond, 1,
+                          fakeClock);
+    tracker.markFailure("gone@mlx5_0");
+    tracker.markFailure("used@mlx5_0");
+    ASSERT_FALSE(tracker.empty());
+
+    // The NIC still probed keeps backing off at 100ms
+    int probe_count = 0;
+    for (int i = 0; i < 10; ++i) {
+        g_current_ts += 50 * kMillisecond;
+        if (tracker.healthy("used@mlx5_0")) {
+            tracker.markFailure("used@mlx5_0");
+            probe_count++;
+        }
+    }
+    ASSERT_EQ(probe_count, 5);
+
+    // Nobody asked about the other one for two max backoff periods
+    tracker.markSuccess("used@mlx5_0");
+    ASSERT_TRUE(tracker.empty());
+}
+
+TEST(HealthTrackerTest, PeerSelectionAvoidsUnhealthyNic) {
+    RdmaTransport transport;
+    TransferMetadata::SegmentDesc desc;
+    desc.name = "peer";
+    desc.topology.parse("{\"cpu:0\" : [[\"mlx5_0\", \"mlx5_1\"],[]]}");
+    for (auto &name : desc.topology.getHcaList())
+        desc.devices.push_back({name, 0, ""});
+    desc.buffers.push_back({"cpu:0", 1 << 20, 1 << 20, {}, {}});
+    desc.indexBuffers();
+    const int unhealthy_id = 0;
+    transport.peerHealth().markFailure(
+        MakeNicPath(desc.name, desc.devices[unhealthy_id].name));
+
+    int buffer_id, device_id;
+    for (int retry_cnt = 0; retry_cnt < 8; ++retry_cnt) {
+        ASSERT_EQ(transport.selectPeerDevice(&desc, 1 << 20, 4096, buffer_id,
+                                             device_id, retry_cnt),
+                  0);
+        ASSERT_EQ(buffer_id, 0);
+        ASSERT_NE(device_id, unhealthy_id);
+    }
+
+    // With every NIC backing off, the usual choice is kept.
+    transport.peerHealth().markFailure(
+        MakeNicPath(desc.name, desc.devices[1 - unhealthy_id].name));
+    ASSERT_EQ(transport.selectPeerDevice(&desc, 1 << 20, 4096, buffer_id,
+                                         device_id, 1),
+              0);
+    ASSERT_EQ(device_id, 0);
+    ASSERT_NE(transport.selectPeerDevice(&desc, 4096, 4096, buffer_id,
+                                         device_id),
+              0);
+}
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
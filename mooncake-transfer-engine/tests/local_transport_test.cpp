@@ -0,0 +1,135 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/local_transport/local_transport.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "transfer_engine.h"
+#include "transport/transport.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+
+class LocalTransportTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        google::InitGoogleLogging("LocalTransportTest");
+        FLAGS_logtostderr = 1;
+
+        const char *env = std::getenv("MC_METADATA_SERVER");
+        if (env) metadata_server = env;
+        LOG(INFO) << "metadata_server: " << metadata_server;
+
+        env = std::getenv("MC_LOCAL_SERVER_NAME");
+        if (env)
+            local_server_name = env;
+        else
+            local_server_name = "127.0.0.2:12345";
+        LOG(INFO) << "local_server_name: " << local_server_name;
+    }
+
+    void TearDown() override { google::ShutdownGoogleLogging(); }
+
+    void transferAndWait(TransferEngine *engine, TransferRequest entry) {
+        auto batch_id = engine->allocateBatchID(1);
+        Status s = engine->submitTransfer(batch_id, {entry});
+        ASSERT_TRUE(s.ok());
+        TransferStatus status;
+        while (true) {
+            s = engine->getTransferStatus(batch_id, 0, status);
+            ASSERT_TRUE(s.ok());
+            ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+            if (status.s == TransferStatusEnum::COMPLETED) break;
+        }
+        ASSERT_EQ(status.transferred_bytes, entry.length);
+        s = engine->freeBatchID(batch_id);
+        ASSERT_TRUE(s.ok());
+    }
+
+    std::string metadata_server;
+    std::string local_server_name;
+};
+
+TEST(LocalTransportCopyTest, MemoryCopy) {
+    const size_t kLength = (1ull << 20) + 77;
+    std::vector<char> source(kLength), dest(kLength + 64);
+    for (size_t i = 0; i < kLength; ++i) source[i] = 'a' + lrand48() % 26;
+    // Unaligned destinations exercise the head and tail of the streaming copy.
+    for (size_t shift : {0, 1, 13, 63}) {
+        for (size_t length : {(size_t)100, (size_t)300000, kLength}) {
+            memset(dest.data(), 0, dest.size());
+            LocalTransport::memoryCopy(dest.data() + shift, source.data(),
+                                       length);
+            ASSERT_EQ(0, memcmp(dest.data() + shift, source.data(), length));
+            ASSERT_EQ(0, dest[shift + length]);
+        }
+    }
+}
+
+TEST_F(LocalTransportTest, WriteAndRead) {
+    const size_t kDataLength = 16ull << 20;
+    const size_t kBufferSize = 64ull << 20;
+    // disable topology auto discovery for testing.
+    auto engine = std::make_unique<TransferEngine>(false);
+    auto hostname_port = parseHostNameWithPort(local_server_name);
+    engine->init(metadata_server, local_server_name,
+                 hostname_port.first.c_str(), hostname_port.second);
+    ASSERT_NE(engine->installTransport("tcp", nullptr), nullptr);
+    ASSERT_NE(engine->installTransport("local", nullptr), nullptr);
+
+    char *addr = (char *)malloc(kBufferSize);
+    ASSERT_NE(addr, nullptr);
+    int rc = engine->registerLocalMemory(addr, kBufferSize, "cpu:0");
+    ASSERT_EQ(rc, 0);
+    char *source = (char *)malloc(2 * kDataLength);
+    ASSERT_NE(source, nullptr);
+    for (size_t offset = 0; offset < kDataLength; ++offset)
+        source[offset] = 'a' + lrand48() % 26;
+
+    auto segment_id = engine->openSegment(local_server_name);
+    ASSERT_EQ(segment_id, LOCAL_SEGMENT_ID);
+    for (size_t length : {(size_t)4096, kDataLength}) {
+        transferAndWait(engine.get(), {TransferRequest::WRITE, source,
+                                       segment_id, (uint64_t)addr, length});
+        ASSERT_EQ(0, memcmp(addr, source, length));
+        transferAndWait(engine.get(),
+                        {TransferRequest::READ, source + kDataLength,
+                         segment_id, (uint64_t)addr, length});
+        ASSERT_EQ(0, memcmp(source + kDataLength, source, length));
+    }
+
+    auto batch_id = engine->allocateBatchID(1);
+    Status s = engine->submitTransfer(
+        batch_id, {{TransferRequest::WRITE, source, segment_id,
+                    (uint64_t)addr + kBufferSize - 1, 2}});
+    ASSERT_FALSE(s.ok());
+
+    engine->unregisterLocalMemory(addr);
+    free(source);
+    free(addr);
+}
+
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -123,3 +123,71 @@ TEST(MemoryLocationTest, MallocMultipleNodes) {
 
     numa_free(addr, size);
 }
+
+// Large enough to be probed in several chunks, and sampled
+static void checkLargeRegion(bool sample) {
+    int nodea = 0;
+    int nodeb = numa_max_node();
+    std::string locationa = "cpu:" + std::to_string(nodea);
+    std::string locationb = "cpu:" + std::to_string(nodeb);
+
+    const size_t num_pages = 65536;
+    const size_t size = 4096 * num_pages;
+    void *addr = numa_alloc_onnode(size, nodea);
+    ASSERT_NE(addr, nullptr);
+    memset(addr, 0, size);
+
+    // move pages [1000, 3000) to nodeb, wider than the sample stride
+    const size_t first = 1000, count = 2000;
+    std::vector<void *> pages;
+    std::vector<int> nodes(count, nodeb), status(count);
+    for (size_t i = 0; i < count; ++i)
+        pages.push_back((void *)((uint64_t)addr + 4096 * (first + i)));
+    int rc = numa_move_pages(0, count, pages.data(), nodes.data(),
+                             status.data(), MPOL_MF_MOVE);
+    ASSERT_EQ(rc, 0);
+
+    auto entries = mooncake::getMemoryLocation(addr, size, sample);
+    if (nodea == nodeb) {
+        ASSERT_EQ(entries.size(), static_cast<size_t>(1));
+        EXPECT_EQ(entries[0].start, reinterpret_cast<uint64_t>(addr));
+        EXPECT_EQ(entries[0].location, locationa);
+        EXPECT_EQ(entries[0].len, size);
+    } else {
+        ASSERT_EQ(entries.size(), static_cast<size_t>(3));
+        EXPECT_EQ(entries[0].location, locationa);
+        EXPECT_EQ(entries[0].len, 4096 * first);
+        EXPECT_EQ(entries[1].start,
+                  reinterpret_cast<uint64_t>(addr) + 4096 * first);
+        EXPECT_EQ(entries[1].location, locationb);
+        EXPECT_EQ(entries[1].len, 4096 * count);
+        EXPECT_EQ(entries[2].location, locationa);
+        EXPECT_EQ(entries[2].len, size - 4096 * (first + count));
+    }
+
+    numa_free(addr, size);
+}
+
+TEST(MemoryLocationTest, LargeRegion) { checkLargeRegion(false); }
+
+TEST(MemoryLocationTest, LargeRegionSampled) { checkLargeRegion(true); }
+
+TEST(MemoryLocationTest, HugePages) {
+    const size_t size = 2 << 20;
+    void *addr = mmap(nullptr, size * 2, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr == MAP_FAILED) GTEST_SKIP() << "no huge pages available";
+    memset(addr, 0, size * 2);
+
+    // not page aligned
+    void *start = (void *)((uint64_t)addr + 4096);
+    auto entries = mooncake::getMemoryLocation(start, size * 2 - 8192);
+    ASSERT_GE(entries.size(), static_cast<size_t>(1));
+    EXPECT_EQ(entries[0].start, reinterpret_cast<uint64_t>(start));
+    EXPECT_NE(entries[0].location, "*");
+    uint64_t len = 0;
+    for (auto &entry : entries) len += entry.len;
+    EXPECT_EQ(len, size * 2 - 8192);
+
+    munmap(addr, size * 2);
+}
@@ -0,0 +1,434 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/rdma_transport/verbs_simulator.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "transfer_engine.h"
+#include "transport/transport.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+
+TEST(VerbsSimulatorTest, ParseOptions) {
+    VerbsSimulator::Options options;
+    ASSERT_EQ(options.parse(""), 0);
+    ASSERT_EQ(options.device_count, 2);
+    ASSERT_EQ(options.parse("devices=4,latency_us=5,bandwidth_gbps=100"), 0);
+    ASSERT_EQ(options.device_count, 4);
+    ASSERT_EQ(options.latency_ns, 5000u);
+    ASSERT_EQ(options.bandwidth, 12500000000u);
+    ASSERT_EQ(options.parse("error_rate=0.5,bandwidth_gbps=0"), 0);
+    ASSERT_EQ(options.error_rate, 0.5);
+    ASSERT_EQ(options.bandwidth, 0u);
+    ASSERT_NE(options.parse("devices=0"), 0);
+    ASSERT_NE(options.parse("error_rate=2"), 0);
+    ASSERT_NE(options.parse("latency_us"), 0);
+    ASSERT_NE(options.parse("unknown=1"), 0);
+    // Failed parsing keeps the previous options
+    ASSERT_EQ(options.device_count, 4);
+}
+
+class VerbsSimulatorQpTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        VerbsSimulator::Options options;
+        options.latency_ns = 0;
+        simulator_ = std::make_unique<VerbsSimulator>(options);
+        auto devices = simulator_->getDeviceList(nullptr);
+        context_ = simulator_->openDevice(devices[0]);
+        simulator_->freeDeviceList(devices);
+        pd_ = simulator_->allocPd(context_);
+        cq_ = simulator_->createCq(context_, 64, nullptr, nullptr, 0);
+        for (int i = 0; i < 2; ++i) {
+            ibv_qp_init_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.send_cq = attr.recv_cq = cq_;
+            attr.qp_type = IBV_QPT_RC;
+            attr.cap.max_send_wr = 16;
+            attr.cap.max_send_sge = 4;
+            qp_[i] = simulator_->createQp(pd_, &attr);
+        }
+        for (int i = 0; i < 2; ++i) {
+            ibv_qp_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.dest_qp_num = qp_[1 - i]->qp_num;
+            attr.qp_state = IBV_QPS_RTS;
+            simulator_->modifyQp(qp_[i], &attr,
+                                 IBV_QP_STATE | IBV_QP_DEST_QPN);
+        }
+    }
+
+    void TearDown() override {
+        for (int i = 0; i < 2; ++i) simulator_->destroyQp(qp_[i]);
+        simulator_->destroyCq(cq_);
+        simulator_->deallocPd(pd_);
+        simulator_->closeDevice(context_);
+    }
+
+    int post(ibv_wr_opcode opcode, ibv_mr *local, ibv_mr *remote,
+             uint64_t wr_id) {
+        ibv_sge sge;
+        sge.addr = (uint64_t)local->addr;
+        sge.length = local->length;
+        sge.lkey = local->lkey;
+        ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = wr_id;
+        wr.opcode = opcode;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = (uint64_t)remote->addr;
+        wr.wr.rdma.rkey = remote->rkey;
+        return simulator_->postSend(qp_[0], &wr, &bad_wr);
+    }
+
+    ibv_wc pollOne() {
+        ibv_wc wc;
+        while (simulator_->pollCq(cq_, 1, &wc) == 0);
+        return wc;
+    }
+
+    std::unique_ptr<VerbsSimulator> simulator_;
+    ibv_context *context_;
+    ibv_pd *pd_;
+    ibv_cq *cq_;
+    ibv_qp *qp_[2];
+};
+
+TEST_F(VerbsSimulatorQpTest, WriteAndRead) {
+    char source[4096], dest[4096];
+    for (size_t i = 0; i < sizeof(source); ++i) source[i] = 'a' + i % 26;
+    memset(dest, 0, sizeof(dest));
+    int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                 IBV_ACCESS_REMOTE_READ;
+    auto source_mr = simulator_->regMr(pd_, source, sizeof(source), access);
+    auto dest_mr = simulator_->regMr(pd_, dest, sizeof(dest), access);
+
+    ASSERT_EQ(post(IBV_WR_RDMA_WRITE, source_mr, dest_mr, 1), 0);
+    auto wc = pollOne();
+    ASSERT_EQ(wc.status, IBV_WC_SUCCESS);
+    ASSERT_EQ(wc.wr_id, 1u);
+    ASSERT_EQ(0, memcmp(source, dest, sizeof(dest)));
+
+    dest[0] = 'z';
+    ASSERT_EQ(post(IBV_WR_RDMA_READ, source_mr, dest_mr, 2), 0);
+    wc = pollOne();
+    ASSERT_EQ(wc.status, IBV_WC_SUCCESS);
+    ASSERT_EQ(source[0], 'z');
+    ASSERT_EQ(simulator_->completedCount(), 2u);
+
+    simulator_->deregMr(source_mr);
+    simulator_->deregMr(dest_mr);
+}
+
+TEST_F(VerbsSimulatorQpTest, RemoteAccessError) {
+    char source[64], dest[64];
+    auto source_mr =
+        simulator_->regMr(pd_, source, sizeof(source), IBV_ACCESS_LOCAL_WRITE);
+    auto dest_mr =
+        simulator_->regMr(pd_, dest, sizeof(dest), IBV_ACCESS_REMOTE_READ);
+
+    ASSERT_EQ(post(IBV_WR_RDMA_WRITE, source_mr, dest_mr, 1), 0);
+    ASSERT_EQ(post(IBV_WR_RDMA_READ, source_mr, dest_mr, 2), 0);
+    auto wc = pollOne();
+    ASSERT_EQ(wc.status, IBV_WC_REM_ACCESS_ERR);
+    // The QP is in the error state, so the next work request is flushed
+    wc = pollOne();
+    ASSERT_EQ(wc.status, IBV_WC_WR_FLUSH_ERR);
+    ASSERT_EQ(wc.wr_id, 2u);
+
+    simulator_->deregMr(source_mr);
+    simulator_->deregMr(dest_mr);
+}
+
+class RdmaSimulatorTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        google::InitGoogleLogging("RdmaSimulatorTest");
+        FLAGS_logtostderr = 1;
+
+        const char *env = std::getenv("MC_METADATA_SERVER");
+        if (env) metadata_server = env;
+        LOG(INFO) << "metadata_server: " << metadata_server;
+
+        env = std::getenv("MC_LOCAL_SERVER_NAME");
+        if (env)
+            local_server_name = env;
+        else
+            local_server_name = "127.0.0.2:12345";
+        LOG(INFO) << "local_server_name: " << local_server_name;
+
+        VerbsSimulator::Options options;
+        options.device_count = 2;
+        simulator = std::make_shared<VerbsSimulator>(options);
+        setVerbsProvider(simulator);
+    }
+
+    void TearDown() override { google::ShutdownGoogleLogging(); }
+
+    std::unique_ptr<TransferEngine> createEngine() {
+        return createEngine(local_server_name);
+    }
+
+    std::unique_ptr<TransferEngine> createEngine(
+        const std::string &server_name) {
+        // disable topology auto discovery for testing.
+        auto engine = std::make_unique<TransferEngine>(false);
+        auto hostname_port = parseHostNameWithPort(server_name);
+        engine->init(metadata_server, server_name,
+                     hostname_port.first.c_str(), hostname_port.second);
+        std::string nic_priority_matrix =
+            "{\"cpu:0\": [[\"" + VerbsSimulator::deviceName(0) + "\", \"" +
+            VerbsSimulator::deviceName(1) + "\"], []]}";
+        void *args[2] = {(void *)nic_priority_matrix.c_str(), nullptr};
+        if (!engine->installTransport("rdma", args)) return nullptr;
+        return engine;
+    }
+
+    void transferAndWait(TransferEngine *engine, TransferRequest entry) {
+        auto batch_id = engine->allocateBatchID(1);
+        Status s = engine->submitTransfer(batch_id, {entry});
+        ASSERT_TRUE(s.ok());
+        TransferStatus status;
+        while (true) {
+            s = engine->getTransferStatus(batch_id, 0, status);
+            ASSERT_TRUE(s.ok());
+            ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+            if (status.s == TransferStatusEnum::COMPLETED) break;
+        }
+        ASSERT_EQ(status.transferred_bytes, entry.length);
+        s = engine->freeBatchID(batch_id);
+        ASSERT_TRUE(s.ok());
+    }
+
+    std::string metadata_server;
+    std::string local_server_name;
+    std::shared_ptr<VerbsSimulator> simulator;
+};
+
+TEST_F(RdmaSimulatorTest, LoopbackWriteAndRead) {
+    const size_t kDataLength = 8ull << 20;
+    auto engine = createEngine();
+    ASSERT_NE(engine, nullptr);
+
+    char *buffer = (char *)malloc(2 * kDataLength);
+    char *source = (char *)malloc(2 * kDataLength);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_NE(source, nullptr);
+    ASSERT_EQ(engine->registerLocalMemory(buffer, 2 * kDataLength, "cpu:0"),
+              0);
+    ASSERT_EQ(engine->registerLocalMemory(source, 2 * kDataLength, "cpu:0"),
+              0);
+    for (size_t offset = 0; offset < kDataLength; ++offset)
+        source[offset] = 'a' + lrand48() % 26;
+
+    auto segment_id = engine->openSegment(local_server_name);
+    for (size_t length : {(size_t)32, (size_t)4096, kDataLength}) {
+        memset(buffer, 0, length);
+        transferAndWait(engine.get(), {TransferRequest::WRITE, source,
+                                       segment_id, (uint64_t)buffer, length});
+        ASSERT_EQ(0, memcmp(buffer, source, length));
+        transferAndWait(engine.get(),
+                        {TransferRequest::READ, source + kDataLength,
+                         segment_id, (uint64_t)buffer, length});
+        ASSERT_EQ(0, memcmp(source + kDataLength, source, length));
+    }
+
+    // Failed work requests are retried on a new connection.
+    simulator->injectErrors(2);
+    memset(buffer, 0, kDataLength);
+    transferAndWait(engine.get(), {TransferRequest::WRITE, source, segment_id,
+                                   (uint64_t)buffer, kDataLength});
+    ASSERT_EQ(0, memcmp(buffer, source, kDataLength));
+
+    ASSERT_EQ(engine->unregisterLocalMemory(source), 0);
+    ASSERT_EQ(engine->unregisterLocalMemory(buffer), 0);
+    engine.reset();
+    free(source);
+    free(buffer);
+}
+
+TEST_F(RdmaSimulatorTest, ConcurrentBatches) {
+    const int kThreadCount = 4;
+    const int kBatchCount = 16;
+    const size_t kBatchSize = 32;
+    const size_t kRequestLength = 16384;
+    const size_t kThreadLength = kBatchSize * kRequestLength;
+    auto engine = createEngine();
+    ASSERT_NE(engine, nullptr);
+
+    // Small requests from several threads, spread by the workers of both
+    // devices, must all land in place.
+    char *buffer = (char *)malloc(kThreadCount * kThreadLength);
+    char *source = (char *)malloc(kThreadCount * kThreadLength);
+    ASSERT_EQ(engine->registerLocalMemory(buffer, kThreadCount * kThreadLength,
+                                          "cpu:0"),
+              0);
+    ASSERT_EQ(engine->registerLocalMemory(source, kThreadCount * kThreadLength,
+                                          "cpu:0"),
+              0);
+    auto segment_id = engine->openSegment(local_server_name);
+    std::atomic<int> failed_count(0);
+    std::vector<std::thread> threads;
+    for (int thread_id = 0; thread_id < kThreadCount; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+            char *local = source + thread_id * kThreadLength;
+            char *remote = buffer + thread_id * kThreadLength;
+            for (int batch = 0; batch < kBatchCount; ++batch) {
+                memset(local, 'a' + (thread_id + batch) % 26, kThreadLength);
+                std::vector<TransferRequest> requests;
+                for (size_t i = 0; i < kBatchSize; ++i)
+                    requests.push_back(
+                        {TransferRequest::WRITE, local + i * kRequestLength,
+                         segment_id,
+                         (uint64_t)(remote + i * kRequestLength),
+                         kRequestLength});
+                auto batch_id = engine->allocateBatchID(kBatchSize);
+                if (!engine->submitTransfer(batch_id, requests).ok()) {
+                    failed_count++;
+                    return;
+                }
+                for (size_t i = 0; i < kBatchSize; ++i) {
+                    TransferStatus status;
+                    do {
+                        engine->getTransferStatus(batch_id, i, status);
+                    } while (status.s != TransferStatusEnum::COMPLETED &&
+                             status.s != TransferStatusEnum::FAILED);
+                    if (status.s == TransferStatusEnum::FAILED) failed_count++;
+                }
+                engine->freeBatchID(batch_id);
+                if (memcmp(local, remote, kThreadLength)) failed_count++;
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    ASSERT_EQ(failed_count, 0);
+
+    ASSERT_EQ(engine->unregisterLocalMemory(source), 0);
+    ASSERT_EQ(engine->unregisterLocalMemory(buffer), 0);
+    engine.reset();
+    free(source);
+    free(buffer);
+}
+
+TEST_F(RdmaSimulatorTest, RegisterMemoryBatch) {
+    const size_t kBufferCount = 256;
+    const size_t kBufferLength = 4096;
+    auto engine = createEngine();
+    ASSERT_NE(engine, nullptr);
+
+    // More buffers than hardware threads
+    char *base = (char *)malloc(kBufferCount * kBufferLength);
+    ASSERT_NE(base, nullptr);
+    std::vector<BufferEntry> buffer_list;
+    std::vector<void *> addr_list;
+    for (size_t i = 0; i < kBufferCount; ++i) {
+        buffer_list.push_back({base + i * kBufferLength, kBufferLength});
+        addr_list.push_back(base + i * kBufferLength);
+    }
+    ASSERT_EQ(engine->registerLocalMemoryBatch(buffer_list, "cpu:0"), 0);
+    auto desc = engine->getMetadata()->getSegmentDescByID(LOCAL_SEGMENT_ID);
+    ASSERT_EQ(desc->buffers.size(), kBufferCount);
+    ASSERT_EQ(engine->unregisterLocalMemoryBatch(addr_list), 0);
+    desc = engine->getMetadata()->getSegmentDescByID(LOCAL_SEGMENT_ID);
+    ASSERT_TRUE(desc->buffers.empty());
+
+    engine.reset();
+    free(base);
+}
+
+TEST_F(RdmaSimulatorTest, RejectedPostToPeer) {
+    const size_t kRequestCount = 64;
+    const size_t kRequestLength = 16384;
+    const size_t kDataLength = kRequestCount * kRequestLength;
+    // Only transfers to another segment go through the devices
+    auto target = createEngine("127.0.0.1:12346");
+    auto initiator = createEngine("127.0.0.1:12347");
+    ASSERT_NE(target, nullptr);
+    ASSERT_NE(initiator, nullptr);
+
+    char *buffer = (char *)malloc(kDataLength);
+    char *source = (char *)malloc(kDataLength);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_NE(source, nullptr);
+    ASSERT_EQ(target->registerLocalMemory(buffer, kDataLength, "cpu:0"), 0);
+    ASSERT_EQ(initiator->registerLocalMemory(source, kDataLength, "cpu:0"),
+              0);
+    for (size_t offset = 0; offset < kDataLength; ++offset)
+        source[offset] = 'a' + lrand48() % 26;
+
+    // Small requests, so that every post carries unsignaled work requests
+    auto segment_id = initiator->openSegment("127.0.0.1:12346");
+    auto write_all = [&]() {
+        memset(buffer, 0, kDataLength);
+        std::vector<TransferRequest> requests;
+        for (size_t i = 0; i < kRequestCount; ++i)
+            requests.push_back({TransferRequest::WRITE,
+                                source + i * kRequestLength, segment_id,
+                                (uint64_t)(buffer + i * kRequestLength),
+                                kRequestLength});
+        auto batch_id = initiator->allocateBatchID(kRequestCount);
+        ASSERT_TRUE(initiator->submitTransfer(batch_id, requests).ok());
+        for (size_t i = 0; i < kRequestCount; ++i) {
+            TransferStatus status;
+            do {
+                ASSERT_TRUE(
+                    initiator->getTransferStatus(batch_id, i, status).ok());
+                ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+            } while (status.s != TransferStatusEnum::COMPLETED);
+        }
+        ASSERT_TRUE(initiator->freeBatchID(batch_id).ok());
+        ASSERT_EQ(0, memcmp(buffer, source, kDataLength));
+    };
+
+    uint64_t completed_count = simulator->completedCount();
+    write_all();
+    ASSERT_EQ(simulator->completedCount() - completed_count, kRequestCount);
+
+    // Work requests posted before the rejected one stay in flight and are
+    // not posted again; at most one empty write ends their group.
+    simulator->injectPostErrors(1);
+    completed_count = simulator->completedCount();
+    write_all();
+    ASSERT_LE(simulator->completedCount() - completed_count,
+              kRequestCount + 1);
+
+    // The send queue depth is still accounted for
+    write_all();
+
+    ASSERT_EQ(initiator->unregisterLocalMemory(source), 0);
+    ASSERT_EQ(target->unregisterLocalMemory(buffer), 0);
+    initiator.reset();
+    target.reset();
+    free(source);
+    free(buffer);
+}
+
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
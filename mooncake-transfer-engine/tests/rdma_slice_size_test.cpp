@@ -0,0 +1,137 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "config.h"
+#include "transfer_metadata.h"
+#include "transport/rdma_transport/rdma_transport.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+class RdmaSliceSizeTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        saved_config_ = globalConfig();
+        globalConfig().slice_size = 65536;
+        globalConfig().max_slice_size = 4ull << 20;
+        globalConfig().num_qp_per_ep = 2;
+        globalConfig().max_wr = 256;
+
+        // Two NICs preferred for cpu:0, four for cpu:1.
+        desc_.topology.parse(
+            "{\"cpu:0\" : [[\"mlx5_0\", \"mlx5_1\"],[\"mlx5_2\"]],"
+            "\"cpu:1\" : [[\"mlx5_0\", \"mlx5_1\", \"mlx5_2\", "
+            "\"mlx5_3\"],[]]}");
+        desc_.buffers.push_back({"cpu:0", kBase, kBufferSize, {}, {}});
+        desc_.buffers.push_back(
+            {"cpu:1", kBase + kBufferSize, kBufferSize, {}, {}});
+        desc_.indexBuffers();
+    }
+
+    void TearDown() override { globalConfig() = saved_config_; }
+
+    size_t sliceCount(uint64_t offset, size_t length) {
+        size_t slice_size =
+            RdmaTransport::selectSliceSize(&desc_, offset, length);
+        return (length + slice_size - 1) / slice_size;
+    }
+
+    const uint64_t kBase = 1ull << 40;
+    const uint64_t kBufferSize = 1ull << 40;
+    GlobalConfig saved_config_;
+    TransferMetadata::SegmentDesc desc_;
+};
+
+TEST_F(RdmaSliceSizeTest, SmallRequestIsSingleSlice) {
+    EXPECT_EQ(sliceCount(kBase, 1), 1u);
+    EXPECT_EQ(sliceCount(kBase, 4096), 1u);
+    EXPECT_EQ(sliceCount(kBase, 65536), 1u);
+    EXPECT_EQ(sliceCount(kBase, 131071), 1u);
+}
+
+TEST_F(RdmaSliceSizeTest, SpreadOverAllQueuePairs) {
+    // 2 NICs x 2 QPs
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, 1 << 20),
+              256u << 10);
+    EXPECT_EQ(sliceCount(kBase, 131072), 2u);
+    EXPECT_EQ(sliceCount(kBase, 196608), 3u);
+    // 4 NICs x 2 QPs
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase + kBufferSize,
+                                             1 << 20),
+              128u << 10);
+    EXPECT_EQ(sliceCount(kBase + kBufferSize, 8 << 20), 8u);
+}
+
+TEST_F(RdmaSliceSizeTest, SliceSizeIsAligned) {
+    size_t slice_size = RdmaTransport::selectSliceSize(&desc_, kBase, 1000000);
+    EXPECT_EQ(slice_size % 4096, 0u);
+    EXPECT_EQ(sliceCount(kBase, 1000000), 4u);
+}
+
+TEST_F(RdmaSliceSizeTest, LargeRequestUsesMaxSliceSize) {
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, 1ull << 30),
+              4u << 20);
+    EXPECT_EQ(sliceCount(kBase, 1ull << 30), 256u);
+}
+
+TEST_F(RdmaSliceSizeTest, HugeRequestFitsWorkRequestBudget) {
+    // 4 QPs x 256 work requests
+    size_t length = 64ull << 30;
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, length),
+              64u << 20);
+    EXPECT_LE(sliceCount(kBase, length), 1024u);
+}
+
+TEST_F(RdmaSliceSizeTest, HugeRequestCappedAtMaxMsgSize) {
+    // 4 QPs x 256 work requests would need 64 MB slices; the rest queue.
+    size_t length = 64ull << 30;
+    size_t max_msg_size = 16u << 20;
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, length,
+                                             max_msg_size),
+              max_msg_size);
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, 1ull << 30,
+                                             max_msg_size),
+              4u << 20);
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, 96u << 10,
+                                             65536),
+              65536u);
+}
+
+TEST_F(RdmaSliceSizeTest, UnknownBufferUsesOneDevice) {
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, 4096, 1 << 20),
+              512u << 10);
+    EXPECT_EQ(RdmaTransport::selectSliceSize(nullptr, 4096, 1 << 20),
+              512u << 10);
+}
+
+TEST_F(RdmaSliceSizeTest, FollowsGlobalConfig) {
+    globalConfig().slice_size = 1 << 20;
+    EXPECT_EQ(sliceCount(kBase, 1 << 20), 1u);
+    globalConfig().slice_size = 65536;
+    globalConfig().max_slice_size = 65536;
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, 1ull << 30),
+              1u << 20);
+    globalConfig().num_qp_per_ep = 8;
+    EXPECT_EQ(RdmaTransport::selectSliceSize(&desc_, kBase, 1 << 20),
+              65536u);
+}
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,183 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "segment_desc_codec.h"
+
+#include <gtest/gtest.h>
+
+#include "error.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+using SegmentDesc = TransferMetadata::SegmentDesc;
+
+static SegmentDesc makeRdmaSegment() {
+    SegmentDesc desc;
+    desc.name = "192.168.0.1:12345";
+    desc.protocol = "rdma";
+    desc.devices.push_back({"mlx5_0", 1, "fe80::1"});
+    desc.devices.push_back({"mlx5_1", 65535, "fe80::2"});
+    desc.topology.parse(
+        "{\"cpu:1\" : [[\"mlx5_1\"],[\"mlx5_0\"]],\"cpu:0\" "
+        ": [[\"mlx5_0\"],[\"mlx5_1\"]]}");
+    for (int i = 0; i < 4; ++i) {
+        TransferMetadata::BufferDesc buffer;
+        buffer.name = "cpu:" + std::to_string(i % 2);
+        buffer.addr = 0x7f0000000000ull + (uint64_t)i * 0x100000;
+        buffer.length = 0x100000;
+        buffer.lkey = {(uint32_t)i, 0xffffffffu};
+        buffer.rkey = {(uint32_t)i + 100, 127};
+        desc.buffers.push_back(buffer);
+    }
+    desc.host_id = "host-0";
+    desc.shm_buffers.push_back(
+        {0x7f0000000000ull, 0x100000, "/mooncake", 0, 0x1a, 0x2b3c});
+    desc.indexBuffers();
+    return desc;
+}
+
+static void expectSameSegment(const SegmentDesc &lhs, const SegmentDesc &rhs) {
+    EXPECT_EQ(lhs.name, rhs.name);
+    EXPECT_EQ(lhs.protocol, rhs.protocol);
+    ASSERT_EQ(lhs.devices.size(), rhs.devices.size());
+    for (size_t i = 0; i < lhs.devices.size(); ++i) {
+        EXPECT_EQ(lhs.devices[i].name, rhs.devices[i].name);
+        EXPECT_EQ(lhs.devices[i].lid, rhs.devices[i].lid);
+        EXPECT_EQ(lhs.devices[i].gid, rhs.devices[i].gid);
+    }
+    EXPECT_EQ(lhs.topology.toString(), rhs.topology.toString());
+    EXPECT_EQ(lhs.topology.getHcaList(), rhs.topology.getHcaList());
+    ASSERT_EQ(lhs.buffers.size(), rhs.buffers.size());
+    for (size_t i = 0; i < lhs.buffers.size(); ++i) {
+        EXPECT_EQ(lhs.buffers[i].name, rhs.buffers[i].name);
+        EXPECT_EQ(lhs.buffers[i].addr, rhs.buffers[i].addr);
+        EXPECT_EQ(lhs.buffers[i].length, rhs.buffers[i].length);
+        EXPECT_EQ(lhs.buffers[i].lkey, rhs.buffers[i].lkey);
+        EXPECT_EQ(lhs.buffers[i].rkey, rhs.buffers[i].rkey);
+    }
+    EXPECT_EQ(lhs.host_id, rhs.host_id);
+    ASSERT_EQ(lhs.shm_buffers.size(), rhs.shm_buffers.size());
+    for (size_t i = 0; i < lhs.shm_buffers.size(); ++i) {
+        EXPECT_EQ(lhs.shm_buffers[i].addr, rhs.shm_buffers[i].addr);
+        EXPECT_EQ(lhs.shm_buffers[i].length, rhs.shm_buffers[i].length);
+        EXPECT_EQ(lhs.shm_buffers[i].path, rhs.shm_buffers[i].path);
+        EXPECT_EQ(lhs.shm_buffers[i].offset, rhs.shm_buffers[i].offset);
+        EXPECT_EQ(lhs.shm_buffers[i].dev, rhs.shm_buffers[i].dev);
+        EXPECT_EQ(lhs.shm_buffers[i].ino, rhs.shm_buffers[i].ino);
+    }
+    EXPECT_EQ(lhs.buffer_index.size(), rhs.buffer_index.size());
+}
+
+TEST(SegmentDescCodecTest, JsonRoundTrip) {
+    auto desc = makeRdmaSegment();
+    Json::Value value;
+    ASSERT_EQ(SegmentDescCodec::encode(desc, false, value), 0);
+    EXPECT_FALSE(value.isMember("format"));
+    SegmentDesc decoded;
+    ASSERT_EQ(SegmentDescCodec::decode(value, decoded), 0);
+    expectSameSegment(desc, decoded);
+}
+
+TEST(SegmentDescCodecTest, BinaryRoundTrip) {
+    auto desc = makeRdmaSegment();
+    Json::Value value;
+    ASSERT_EQ(SegmentDescCodec::encode(desc, true, value), 0);
+    EXPECT_EQ(value["format"].asString(), "binary");
+    SegmentDesc decoded;
+    ASSERT_EQ(SegmentDescCodec::decode(value, decoded), 0);
+    expectSameSegment(desc, decoded);
+    EXPECT_EQ(decoded.buffer_index.find(0x7f0000100010ull, 0x10), 1);
+
+    // Devices get the same ids as with JSON
+    Json::Value json_value;
+    ASSERT_EQ(SegmentDescCodec::encode(desc, false, json_value), 0);
+    SegmentDesc json_decoded;
+    ASSERT_EQ(SegmentDescCodec::decode(json_value, json_decoded), 0);
+    expectSameSegment(json_decoded, decoded);
+
+    std::string data;
+    ASSERT_EQ(SegmentDescCodec::encodeBinary(desc, data), 0);
+    EXPECT_LT(data.size(), json_value.toStyledString().size());
+}
+
+TEST(SegmentDescCodecTest, TcpRoundTrip) {
+    SegmentDesc desc;
+    desc.name = "192.168.0.1:12345";
+    desc.protocol = "tcp";
+    desc.buffers.push_back({"cpu:0", 0x1000, 0x2000, {}, {}});
+    desc.tcp_data_port = 23456;
+    desc.indexBuffers();
+    for (bool use_binary : {false, true}) {
+        Json::Value value;
+        ASSERT_EQ(SegmentDescCodec::encode(desc, use_binary, value), 0);
+        SegmentDesc decoded;
+        ASSERT_EQ(SegmentDescCodec::decode(value, decoded), 0);
+        expectSameSegment(desc, decoded);
+        EXPECT_EQ(decoded.tcp_data_port, 23456);
+    }
+}
+
+TEST(SegmentDescCodecTest, CorruptedBinary) {
+    auto desc = makeRdmaSegment();
+    std::string data;
+    ASSERT_EQ(SegmentDescCodec::encodeBinary(desc, data), 0);
+
+    // Every truncation is rejected
+    for (size_t size = 0; size < data.size(); ++size) {
+        SegmentDesc decoded;
+        EXPECT_EQ(SegmentDescCodec::decodeBinary(data.substr(0, size), decoded),
+                  ERR_METADATA);
+    }
+
+    SegmentDesc decoded;
+    EXPECT_EQ(SegmentDescCodec::decodeBinary(data + '\0', decoded),
+              ERR_METADATA);
+    std::string bad_version = data;
+    bad_version[0] = SegmentDescCodec::kBinaryVersion + 1;
+    EXPECT_EQ(SegmentDescCodec::decodeBinary(bad_version, decoded),
+              ERR_METADATA);
+
+    Json::Value value;
+    value["format"] = "binary";
+    value["data"] = "not base64!";
+    EXPECT_EQ(SegmentDescCodec::decode(value, decoded), ERR_METADATA);
+    value["format"] = "protobuf";
+    EXPECT_EQ(SegmentDescCodec::decode(value, decoded), ERR_METADATA);
+}
+
+TEST(SegmentDescCodecTest, LegacyJson) {
+    // As published by peers without the codec
+    Json::Value value;
+    Json::Reader reader;
+    ASSERT_TRUE(reader.parse(
+        "{\"name\": \"node\", \"protocol\": \"rdma\","
+        " \"devices\": [{\"name\": \"mlx5_0\", \"lid\": 3, \"gid\": \"g\"}],"
+        " \"buffers\": [{\"name\": \"cpu:0\", \"addr\": 4096,"
+        " \"length\": 4096, \"rkey\": [7], \"lkey\": [8]}],"
+        " \"priority_matrix\": {\"cpu:0\": [[\"mlx5_0\"], []]}}",
+        value));
+    SegmentDesc decoded;
+    ASSERT_EQ(SegmentDescCodec::decode(value, decoded), 0);
+    EXPECT_EQ(decoded.devices[0].lid, 3);
+    EXPECT_EQ(decoded.buffers[0].rkey[0], 7u);
+    EXPECT_EQ(decoded.topology.getHcaList().size(), 1u);
+    EXPECT_EQ(decoded.buffer_index.find(4096, 4096), 0);
+}
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
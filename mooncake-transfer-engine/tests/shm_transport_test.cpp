@@ -0,0 +1,180 @@
+// Copyright 2024 KVCache.AI
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transport/shm_transport/shm_transport.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "error.h"
+#include "transfer_engine.h"
+#include "transport/transport.h"
+
+using namespace mooncake;
+
+namespace mooncake {
+
+class ShmTransportTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        google::InitGoogleLogging("ShmTransportTest");
+        FLAGS_logtostderr = 1;
+
+        const char *env = std::getenv("MC_METADATA_SERVER");
+        if (env) metadata_server = env;
+        LOG(INFO) << "metadata_server: " << metadata_server;
+    }
+
+    void TearDown() override { google::ShutdownGoogleLogging(); }
+
+    std::unique_ptr<TransferEngine> createEngine(
+        const std::string &server_name) {
+        // disable topology auto discovery for testing.
+        auto engine = std::make_unique<TransferEngine>(false);
+        auto hostname_port = parseHostNameWithPort(server_name);
+        engine->init(metadata_server, server_name,
+                     hostname_port.first.c_str(), hostname_port.second);
+        LOG_ASSERT(engine->installTransport("tcp", nullptr));
+        LOG_ASSERT(engine->installTransport("shm", nullptr));
+        return engine;
+    }
+
+    void transferAndWait(TransferEngine *engine, TransferRequest entry) {
+        auto batch_id = engine->allocateBatchID(1);
+        Status s = engine->submitTransfer(batch_id, {entry});
+        ASSERT_TRUE(s.ok());
+        TransferStatus status;
+        while (true) {
+            s = engine->getTransferStatus(batch_id, 0, status);
+            ASSERT_TRUE(s.ok());
+            ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+            if (status.s == TransferStatusEnum::COMPLETED) break;
+        }
+        s = engine->freeBatchID(batch_id);
+        ASSERT_TRUE(s.ok());
+    }
+
+    std::string metadata_server;
+};
+
+TEST_F(ShmTransportTest, WriteAndReadPeerSegment) {
+    const size_t kSegmentSize = 32ull << 20;
+    const size_t kDataLength = 8ull << 20;
+    // Both engines live in this process, but the initiator reaches the
+    // target segment through the published memfd path like any other
+    // process on this host would.
+    auto target = createEngine("127.0.0.1:12346");
+    auto initiator = createEngine("127.0.0.1:12347");
+
+    char *segment = (char *)ShmTransport::allocateSharedMemory(kSegmentSize);
+    ASSERT_NE(segment, nullptr);
+    ASSERT_EQ(target->registerLocalMemory(segment, kSegmentSize, "cpu:0"), 0);
+
+    char *buffer = (char *)malloc(2 * kDataLength);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(initiator->registerLocalMemory(buffer, 2 * kDataLength, "cpu:0",
+                                             false),
+              0);
+    for (size_t offset = 0; offset < kDataLength; ++offset)
+        buffer[offset] = 'a' + lrand48() % 26;
+
+    auto segment_id = initiator->openSegment("127.0.0.1:12346");
+    auto segment_desc =
+        initiator->getMetadata()->getSegmentDescByID(segment_id);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_EQ(segment_desc->shm_buffers.size(), 1u);
+    ASSERT_EQ(segment_desc->host_id, ShmTransport::hostId());
+
+    uint64_t remote_addr = (uint64_t)segment + 4096 + 7;
+    auto shm_transport =
+        (ShmTransport *)initiator->installTransport("shm", nullptr);
+    ASSERT_TRUE(
+        shm_transport->reachable(*segment_desc, remote_addr, kDataLength));
+    ASSERT_FALSE(shm_transport->reachable(*segment_desc, remote_addr,
+                                          kSegmentSize));
+    // A path that leads to another file than the published one is refused
+    auto forged_desc = *segment_desc;
+    forged_desc.shm_buffers[0].ino += 1;
+    ASSERT_FALSE(
+        shm_transport->reachable(forged_desc, remote_addr, kDataLength));
+    for (size_t length : {(size_t)100, kDataLength}) {
+        transferAndWait(initiator.get(), {TransferRequest::WRITE, buffer,
+                                          segment_id, remote_addr, length});
+        ASSERT_EQ(0, memcmp(segment + 4096 + 7, buffer, length));
+        transferAndWait(initiator.get(),
+                        {TransferRequest::READ, buffer + kDataLength,
+                         segment_id, remote_addr, length});
+        ASSERT_EQ(0, memcmp(buffer + kDataLength, buffer, length));
+    }
+
+    ASSERT_EQ(target->unregisterLocalMemory(segment), 0);
+    ASSERT_EQ(initiator->unregisterLocalMemory(buffer), 0);
+    initiator.reset();
+    target.reset();
+    ASSERT_EQ(ShmTransport::freeSharedMemory(segment), 0);
+    free(buffer);
+}
+
+TEST_F(ShmTransportTest, AddSharedMemory) {
+    const size_t kSegmentSize = 4ull << 20;
+    auto target = createEngine("127.0.0.1:12346");
+    auto initiator = createEngine("127.0.0.1:12347");
+
+    // Memory mapped by the caller, as the store does for aligned segments
+    int fd = memfd_create("shm-transport-test", MFD_CLOEXEC);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, kSegmentSize), 0);
+    char *segment = (char *)mmap(nullptr, kSegmentSize, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+    ASSERT_NE(segment, MAP_FAILED);
+    ASSERT_EQ(ShmTransport::addSharedMemory(segment, kSegmentSize, fd), 0);
+    ASSERT_EQ(ShmTransport::addSharedMemory(segment + 4096, 4096, -1),
+              ERR_ADDRESS_OVERLAPPED);
+    ASSERT_EQ(target->registerLocalMemory(segment, kSegmentSize, "cpu:0"), 0);
+
+    auto segment_id = initiator->openSegment("127.0.0.1:12346");
+    auto segment_desc =
+        initiator->getMetadata()->getSegmentDescByID(segment_id);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_EQ(segment_desc->shm_buffers.size(), 1u);
+
+    char buffer[64];
+    memset(buffer, 'x', sizeof(buffer));
+    ASSERT_EQ(initiator->registerLocalMemory(buffer, sizeof(buffer), "cpu:0",
+                                             false),
+              0);
+    transferAndWait(initiator.get(),
+                    {TransferRequest::WRITE, buffer, segment_id,
+                     (uint64_t)segment + 128, sizeof(buffer)});
+    ASSERT_EQ(0, memcmp(segment + 128, buffer, sizeof(buffer)));
+
+    ASSERT_EQ(target->unregisterLocalMemory(segment), 0);
+    ASSERT_EQ(initiator->unregisterLocalMemory(buffer), 0);
+    initiator.reset();
+    target.reset();
+    ASSERT_EQ(ShmTransport::freeSharedMemory(segment), 0);
+}
+
+}  // namespace mooncake
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
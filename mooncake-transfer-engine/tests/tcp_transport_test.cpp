@@ -90,6 +90,8 @@ static void *allocateMemoryPool(size_t size, int socket_id,
     return numa_alloc_onnode(size, socket_id);
 }
 
+static void freeMemoryPool(void *addr, size_t size) { numa_free(addr, size); }
+
 TEST_F(TCPTransportTest, GetTcpTest) {
     // disable topology auto discovery for testing.
     auto engine = std::make_unique<TransferEngine>(false);
@@ -145,6 +147,8 @@ TEST_F(TCPTransportTest, Writetest) {
     }
     s = engine->freeBatchID(batch_id);
     ASSERT_EQ(s, Status::OK());
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
 }
 
 TEST_F(TCPTransportTest, WriteAndReadtest) {
@@ -217,6 +221,8 @@ TEST_F(TCPTransportTest, WriteAndReadtest) {
     }
     LOG_ASSERT(0 == memcmp((uint8_t *)(addr), (uint8_t *)(addr) + kDataLength,
                            kDataLength));
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
 }
 
 TEST_F(TCPTransportTest, WriteAndRead2test) {
@@ -339,6 +345,364 @@ TEST_F(TCPTransportTest, WriteAndRead2test) {
     }
     LOG_ASSERT(0 == memcmp((uint8_t *)(addr), (uint8_t *)(addr) + kDataLength,
                            kDataLength));
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
+}
+
+TEST_F(TCPTransportTest, VectoredWriteAndReadTest) {
+    const size_t kPageSize = 4096;
+    const size_t kPageCount = 16;
+    void *addr = nullptr;
+    const size_t ram_buffer_size = 1ull << 30;
+    // disable topology auto discovery for testing.
+    auto engine = std::make_unique<TransferEngine>(false);
+    auto hostname_port = parseHostNameWithPort(local_server_name);
+    engine->init(metadata_server, local_server_name,
+                 hostname_port.first.c_str(), hostname_port.second);
+    Transport *xport = nullptr;
+    xport = engine->installTransport("tcp", nullptr);
+    LOG_ASSERT(xport != nullptr);
+
+    addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    int rc = engine->registerLocalMemory(addr, ram_buffer_size, "cpu:0");
+    LOG_ASSERT(!rc);
+
+    // Non-contiguous pages are gathered into one remote range, then scattered
+    // back into another set of non-contiguous pages.
+    char *base = (char *)addr;
+    const size_t kSourceBase = 1ull << 24, kDestBase = 1ull << 25;
+    std::vector<BufferEntry> source_list, dest_list;
+    for (size_t i = 0; i < kPageCount; ++i) {
+        char *page = base + kSourceBase + i * 3 * kPageSize;
+        for (size_t offset = 0; offset < kPageSize; ++offset)
+            page[offset] = 'a' + lrand48() % 26;
+        source_list.push_back({page, kPageSize});
+        dest_list.push_back({base + kDestBase + i * 2 * kPageSize, kPageSize});
+    }
+
+    auto segment_id = engine->openSegment(local_server_name);
+    auto segment_desc = engine->getMetadata()->getSegmentDescByID(segment_id);
+    uint64_t remote_base = (uint64_t)segment_desc->buffers[0].addr;
+    for (auto opcode : {TransferRequest::WRITE, TransferRequest::READ}) {
+        auto batch_id = engine->allocateBatchID(1);
+        VectoredTransferRequest entry;
+        entry.opcode = opcode;
+        entry.source_list =
+            opcode == TransferRequest::WRITE ? source_list : dest_list;
+        entry.target_id = segment_id;
+        entry.target_offset = remote_base;
+        Status s = engine->submitVectoredTransfer(batch_id, {entry});
+        ASSERT_TRUE(s.ok());
+        TransferStatus status;
+        while (true) {
+            s = engine->getTransferStatus(batch_id, 0, status);
+            ASSERT_TRUE(s.ok());
+            ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+            if (status.s == TransferStatusEnum::COMPLETED) break;
+        }
+        ASSERT_EQ(status.transferred_bytes, kPageSize * kPageCount);
+        s = engine->freeBatchID(batch_id);
+        ASSERT_TRUE(s.ok());
+    }
+
+    // A request of empty pieces completes without reaching the peer
+    auto batch_id = engine->allocateBatchID(1);
+    VectoredTransferRequest empty_entry;
+    empty_entry.opcode = TransferRequest::WRITE;
+    empty_entry.source_list = {{base + kSourceBase, 0}, {nullptr, 0}};
+    empty_entry.target_id = segment_id;
+    empty_entry.target_offset = remote_base;
+    Status s = engine->submitVectoredTransfer(batch_id, {empty_entry});
+    ASSERT_TRUE(s.ok());
+    TransferStatus status;
+    s = engine->getTransferStatus(batch_id, 0, status);
+    ASSERT_TRUE(s.ok());
+    ASSERT_EQ(status.s, TransferStatusEnum::COMPLETED);
+    ASSERT_EQ(status.transferred_bytes, 0u);
+    s = engine->freeBatchID(batch_id);
+    ASSERT_TRUE(s.ok());
+
+    for (size_t i = 0; i < kPageCount; ++i) {
+        char *remote_page = (char *)remote_base + i * kPageSize;
+        ASSERT_EQ(0, memcmp(source_list[i].addr, remote_page, kPageSize));
+        ASSERT_EQ(0, memcmp(source_list[i].addr, dest_list[i].addr, kPageSize));
+    }
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
+}
+
+TEST_F(TCPTransportTest, ManySmallTransfersTest) {
+    const size_t kBlockSize = 4096;
+    const size_t kBatchSize = 128;
+    const int kRounds = 16;
+    const size_t ram_buffer_size = 1ull << 30;
+    // disable topology auto discovery for testing.
+    auto engine = std::make_unique<TransferEngine>(false);
+    auto hostname_port = parseHostNameWithPort(local_server_name);
+    engine->init(metadata_server, local_server_name,
+                 hostname_port.first.c_str(), hostname_port.second);
+    Transport *xport = engine->installTransport("tcp", nullptr);
+    LOG_ASSERT(xport != nullptr);
+
+    void *addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    int rc = engine->registerLocalMemory(addr, ram_buffer_size, "cpu:0");
+    LOG_ASSERT(!rc);
+    char *source = (char *)addr;
+    char *target = source + kBlockSize * kBatchSize;
+
+    auto segment_id = engine->openSegment(local_server_name);
+    // Connections to the peer are kept and reused across batches.
+    auto start_ts = getCurrentTimeInNano();
+    for (int round = 0; round < kRounds; ++round) {
+        for (size_t i = 0; i < kBlockSize * kBatchSize; ++i)
+            source[i] = 'a' + lrand48() % 26;
+        std::vector<TransferRequest> entries;
+        for (size_t i = 0; i < kBatchSize; ++i)
+            entries.push_back({TransferRequest::WRITE, source + i * kBlockSize,
+                               segment_id,
+                               (uint64_t)target + i * kBlockSize, kBlockSize});
+        auto batch_id = engine->allocateBatchID(kBatchSize);
+        Status s = engine->submitTransfer(batch_id, entries);
+        ASSERT_TRUE(s.ok());
+        for (size_t task_id = 0; task_id < kBatchSize; ++task_id) {
+            TransferStatus status;
+            while (true) {
+                s = engine->getTransferStatus(batch_id, task_id, status);
+                ASSERT_TRUE(s.ok());
+                ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+                if (status.s == TransferStatusEnum::COMPLETED) break;
+            }
+        }
+        s = engine->freeBatchID(batch_id);
+        ASSERT_TRUE(s.ok());
+        ASSERT_EQ(0, memcmp(source, target, kBlockSize * kBatchSize));
+    }
+    LOG(INFO) << "Average latency per " << kBlockSize << " bytes transfer: "
+              << (getCurrentTimeInNano() - start_ts) / (kRounds * kBatchSize)
+              << " ns";
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
+}
+
+TEST_F(TCPTransportTest, PipelinedSmallReadsTest) {
+    const size_t kBlockSize = 4096;
+    const size_t kBatchSize = 1024;
+    const size_t ram_buffer_size = 1ull << 30;
+    // disable topology auto discovery for testing.
+    auto engine = std::make_unique<TransferEngine>(false);
+    auto hostname_port = parseHostNameWithPort(local_server_name);
+    engine->init(metadata_server, local_server_name,
+                 hostname_port.first.c_str(), hostname_port.second);
+    Transport *xport = engine->installTransport("tcp", nullptr);
+    LOG_ASSERT(xport != nullptr);
+
+    void *addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    int rc = engine->registerLocalMemory(addr, ram_buffer_size, "cpu:0");
+    LOG_ASSERT(!rc);
+    char *source = (char *)addr;
+    char *target = source + kBlockSize * kBatchSize;
+    for (size_t i = 0; i < kBlockSize * kBatchSize; ++i)
+        target[i] = 'a' + lrand48() % 26;
+
+    // Reads of one batch are packed into frames sharing a few connections
+    // and may complete in any order.
+    auto segment_id = engine->openSegment(local_server_name);
+    std::vector<TransferRequest> entries;
+    for (size_t i = 0; i < kBatchSize; ++i)
+        entries.push_back({TransferRequest::READ, source + i * kBlockSize,
+                           segment_id, (uint64_t)target + i * kBlockSize,
+                           kBlockSize});
+    auto batch_id = engine->allocateBatchID(kBatchSize);
+    Status s = engine->submitTransfer(batch_id, entries);
+    ASSERT_TRUE(s.ok());
+    for (size_t task_id = 0; task_id < kBatchSize; ++task_id) {
+        TransferStatus status;
+        while (true) {
+            s = engine->getTransferStatus(batch_id, task_id, status);
+            ASSERT_TRUE(s.ok());
+            ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+            if (status.s == TransferStatusEnum::COMPLETED) break;
+        }
+    }
+    s = engine->freeBatchID(batch_id);
+    ASSERT_TRUE(s.ok());
+    ASSERT_EQ(0, memcmp(source, target, kBlockSize * kBatchSize));
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
+}
+
+TEST_F(TCPTransportTest, UnregisteredTargetTest) {
+    const size_t kDataLength = 4096;
+    const size_t ram_buffer_size = 1ull << 30;
+    // disable topology auto discovery for testing.
+    auto engine = std::make_unique<TransferEngine>(false);
+    auto hostname_port = parseHostNameWithPort(local_server_name);
+    engine->init(metadata_server, local_server_name,
+                 hostname_port.first.c_str(), hostname_port.second);
+    Transport *xport = engine->installTransport("tcp", nullptr);
+    LOG_ASSERT(xport != nullptr);
+
+    void *addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    int rc = engine->registerLocalMemory(addr, ram_buffer_size, "cpu:0");
+    LOG_ASSERT(!rc);
+    std::vector<char> unregistered(kDataLength);
+
+    // The peer rejects the request, while the connection stays usable.
+    auto segment_id = engine->openSegment(local_server_name);
+    std::vector<TransferRequest> entries;
+    entries.push_back({TransferRequest::WRITE, addr, segment_id,
+                       (uint64_t)unregistered.data(), kDataLength});
+    entries.push_back({TransferRequest::WRITE, addr, segment_id,
+                       (uint64_t)addr + kDataLength, kDataLength});
+    auto batch_id = engine->allocateBatchID(entries.size());
+    Status s = engine->submitTransfer(batch_id, entries);
+    ASSERT_TRUE(s.ok());
+    TransferStatusEnum expected[] = {TransferStatusEnum::FAILED,
+                                     TransferStatusEnum::COMPLETED};
+    for (size_t task_id = 0; task_id < entries.size(); ++task_id) {
+        TransferStatus status;
+        while (true) {
+            s = engine->getTransferStatus(batch_id, task_id, status);
+            ASSERT_TRUE(s.ok());
+            if (status.s != TransferStatusEnum::WAITING) break;
+        }
+        ASSERT_EQ(status.s, expected[task_id]);
+    }
+    s = engine->freeBatchID(batch_id);
+    ASSERT_TRUE(s.ok());
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
+}
+
+TEST_F(TCPTransportTest, StripedLargeTransferTest) {
+    const size_t kDataLength = 64ull << 20;
+    const size_t kPieceCount = 7;
+    const size_t ram_buffer_size = 1ull << 30;
+    // disable topology auto discovery for testing.
+    auto engine = std::make_unique<TransferEngine>(false);
+    auto hostname_port = parseHostNameWithPort(local_server_name);
+    engine->init(metadata_server, local_server_name,
+                 hostname_port.first.c_str(), hostname_port.second);
+    Transport *xport = engine->installTransport("tcp", nullptr);
+    LOG_ASSERT(xport != nullptr);
+
+    void *addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    int rc = engine->registerLocalMemory(addr, ram_buffer_size, "cpu:0");
+    LOG_ASSERT(!rc);
+    char *source = (char *)addr;
+    char *target = source + kDataLength;
+    char *dest = target + kDataLength;
+    for (size_t i = 0; i < kDataLength; ++i) source[i] = 'a' + lrand48() % 26;
+
+    // The write is striped over parallel connections, and so is the read
+    // back into scattered pieces whose boundaries differ from the stripes.
+    auto segment_id = engine->openSegment(local_server_name);
+    auto batch_id = engine->allocateBatchID(1);
+    Status s = engine->submitTransfer(
+        batch_id, {{TransferRequest::WRITE, source, segment_id,
+                    (uint64_t)target, kDataLength}});
+    ASSERT_TRUE(s.ok());
+    TransferStatus status;
+    while (true) {
+        s = engine->getTransferStatus(batch_id, 0, status);
+        ASSERT_TRUE(s.ok());
+        ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+        if (status.s == TransferStatusEnum::COMPLETED) break;
+    }
+    ASSERT_EQ(status.transferred_bytes, kDataLength);
+    s = engine->freeBatchID(batch_id);
+    ASSERT_TRUE(s.ok());
+
+    VectoredTransferRequest entry;
+    entry.opcode = TransferRequest::READ;
+    size_t piece_size = kDataLength / kPieceCount;
+    for (size_t offset = 0; offset < kDataLength; offset += piece_size)
+        entry.source_list.push_back(
+            {dest + offset, std::min(piece_size, kDataLength - offset)});
+    entry.target_id = segment_id;
+    entry.target_offset = (uint64_t)target;
+    batch_id = engine->allocateBatchID(1);
+    s = engine->submitVectoredTransfer(batch_id, {entry});
+    ASSERT_TRUE(s.ok());
+    while (true) {
+        s = engine->getTransferStatus(batch_id, 0, status);
+        ASSERT_TRUE(s.ok());
+        ASSERT_NE(status.s, TransferStatusEnum::FAILED);
+        if (status.s == TransferStatusEnum::COMPLETED) break;
+    }
+    ASSERT_EQ(status.transferred_bytes, kDataLength);
+    s = engine->freeBatchID(batch_id);
+    ASSERT_TRUE(s.ok());
+    ASSERT_EQ(0, memcmp(source, target, kDataLength));
+    ASSERT_EQ(0, memcmp(source, dest, kDataLength));
+    engine->unregisterLocalMemory(addr);
+    freeMemoryPool(addr, ram_buffer_size);
+}
+
+// without a metadata server, segments are fetched from the peer itself
+TEST_F(TCPTransportTest, PeerToPeerMetadataTest) {
+    const size_t kDataLength = 4096000;
+    const size_t ram_buffer_size = 16ull << 20;
+    const std::string target_name = "127.0.0.1:17101";
+    const std::string initiator_name = "127.0.0.1:17102";
+    auto target = std::make_unique<TransferEngine>(false);
+    auto initiator = std::make_unique<TransferEngine>(false);
+    ASSERT_EQ(target->init("p2p://", target_name, "127.0.0.1", 17101), 0);
+    ASSERT_EQ(initiator->init("p2p://", initiator_name, "127.0.0.1", 17102),
+              0);
+    ASSERT_NE(target->installTransport("tcp", nullptr), nullptr);
+    ASSERT_NE(initiator->installTransport("tcp", nullptr), nullptr);
+
+    void *target_addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    void *addr = allocateMemoryPool(ram_buffer_size, 0, false);
+    ASSERT_EQ(target->registerLocalMemory(target_addr, ram_buffer_size,
+                                          "cpu:0"),
+              0);
+    ASSERT_EQ(initiator->registerLocalMemory(addr, ram_buffer_size, "cpu:0"),
+              0);
+    for (size_t offset = 0; offset < kDataLength; ++offset)
+        *((char *)(addr) + offset) = 'a' + lrand48() % 26;
+
+    auto segment_id = initiator->openSegment(target_name);
+    ASSERT_NE(segment_id, (Transport::SegmentHandle)-1);
+    auto segment_desc =
+        initiator->getMetadata()->getSegmentDescByID(segment_id);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_NE(segment_desc->tcp_data_port, 0);
+    ASSERT_EQ(initiator->openSegment("127.0.0.1:17103"),
+              (Transport::SegmentHandle)-1);
+
+    uint64_t remote_base = (uint64_t)target_addr;
+    TransferRequest::OpCode opcode_list[] = {TransferRequest::WRITE,
+                                             TransferRequest::READ};
+    for (int i = 0; i < 2; ++i) {
+        auto batch_id = initiator->allocateBatchID(1);
+        TransferRequest entry;
+        entry.opcode = opcode_list[i];
+        entry.length = kDataLength;
+        entry.source = (uint8_t *)(addr) + i * kDataLength;
+        entry.target_id = segment_id;
+        entry.target_offset = remote_base;
+        Status s = initiator->submitTransfer(batch_id, {entry});
+        ASSERT_TRUE(s.ok());
+        TransferStatus status;
+        while (true) {
+            s = initiator->getTransferStatus(batch_id, 0, status);
+            ASSERT_TRUE(s.ok());
+            if (status.s != TransferStatusEnum::WAITING) break;
+        }
+        ASSERT_EQ(status.s, TransferStatusEnum::COMPLETED);
+        ASSERT_TRUE(initiator->freeBatchID(batch_id).ok());
+    }
+    ASSERT_EQ(0, memcmp(addr, target_addr, kDataLength));
+    ASSERT_EQ(0, memcmp(addr, (uint8_t *)(addr) + kDataLength, kDataLength));
+
+    initiator->unregisterLocalMemory(addr);
+    target->unregisterLocalMemory(target_addr);
+    initiator.reset();
+    target.reset();
+    freeMemoryPool(addr, ram_buffer_size);
+    freeMemoryPool(target_addr, ram_buffer_size);
 }
 
 }  // namespace mooncake
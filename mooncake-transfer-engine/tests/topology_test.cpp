@@ -3,7 +3,12 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "transfer_metadata.h"
+#include "transport/rdma_transport/verbs_provider.h"
+#include "transport/rdma_transport/verbs_simulator.h"
 
 TEST(ToplogyTest, GetTopologyMatrix) {
     mooncake::Topology topology;
@@ -105,6 +110,78 @@ TEST(ToplogyTest, TestSelectDeviceAny) {
     ASSERT_TRUE(items.empty());
 }
 
+TEST(ToplogyTest, TestSelectDeviceByLoad) {
+    mooncake::Topology topology;
+    std::string json_str =
+        "{\"cpu:0\" : [[\"erdma_0\", \"erdma_1\"],[\"erdma_2\"]]}";
+    topology.clear();
+    topology.parse(json_str);
+    std::vector<uint64_t> load = {1000, 0, 0};
+    auto device_load = [&](int device_id) { return load[device_id]; };
+    // With two preferred devices, the less loaded one always wins.
+    for (int i = 0; i < 100; ++i)
+        ASSERT_EQ(topology.selectDevice("cpu:0", 0, device_load), 1);
+    load[1] = 2000;
+    for (int i = 0; i < 100; ++i)
+        ASSERT_EQ(topology.selectDevice("cpu:0", 0, device_load), 0);
+    // Retries still rotate over all devices.
+    ASSERT_EQ(topology.selectDevice("cpu:0", 3, device_load), 2);
+}
+
+TEST(ToplogyTest, TestSelectDeviceBalance) {
+    mooncake::Topology topology;
+    std::string json_str =
+        "{\"cpu:0\" : [[\"erdma_0\", \"erdma_1\", \"erdma_2\", "
+        "\"erdma_3\"],[]],"
+        "\"cpu:1\" : [[\"erdma_4\", \"erdma_5\"],[]]}";
+    topology.clear();
+    topology.parse(json_str);
+    const uint64_t kSliceSize = 65536;
+    const int kSliceCount = 10000;
+    auto &hca_list = topology.getHcaList();
+    auto id = [&](const std::string &name) {
+        return std::find(hca_list.begin(), hca_list.end(), name) -
+               hca_list.begin();
+    };
+
+    // Equal devices never drained: loads stay within a few slices, where
+    // random picks would typically differ by dozens.
+    std::vector<uint64_t> load(hca_list.size(), 0);
+    auto device_load = [&](int device_id) { return load[device_id]; };
+    for (int i = 0; i < kSliceCount; ++i)
+        load[topology.selectDevice("cpu:0", 0, device_load)] += kSliceSize;
+    uint64_t min_load = UINT64_MAX, max_load = 0;
+    for (auto name : {"erdma_0", "erdma_1", "erdma_2", "erdma_3"}) {
+        min_load = std::min(min_load, load[id(name)]);
+        max_load = std::max(max_load, load[id(name)]);
+    }
+    ASSERT_LE(max_load - min_load, 8 * kSliceSize);
+
+    // erdma_5 drains three times faster than erdma_4, so it takes about
+    // three times the slices.
+    auto slow = id("erdma_4"), fast = id("erdma_5");
+    std::vector<int> picks(hca_list.size(), 0);
+    for (int i = 0; i < kSliceCount; ++i) {
+        int device_id = topology.selectDevice("cpu:1", 0, device_load);
+        load[device_id] += kSliceSize;
+        picks[device_id]++;
+        load[slow] -= std::min(load[slow], kSliceSize / 4);
+        load[fast] -= std::min(load[fast], kSliceSize * 3 / 4);
+    }
+    ASSERT_GT(picks[fast], 2 * picks[slow]);
+    ASSERT_LT(picks[fast], 4 * picks[slow]);
+}
+
+TEST(ToplogyTest, DiscoverSimulatedDevices) {
+    mooncake::setVerbsProvider(std::make_shared<mooncake::VerbsSimulator>());
+    mooncake::Topology topology;
+    topology.discover();
+    auto hca_list = topology.getHcaList();
+    std::set<std::string> hca_set(hca_list.begin(), hca_list.end());
+    ASSERT_TRUE(hca_set.count("sim_0"));
+    ASSERT_TRUE(hca_set.count("sim_1"));
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
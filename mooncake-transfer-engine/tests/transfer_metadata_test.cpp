@@ -14,13 +14,20 @@
 
 #include "transfer_metadata.h"
 
+#include <arpa/inet.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
+#include <thread>
 
+#include "common.h"
+#include "transfer_metadata_plugin.h"
 #include "transport/transport.h"
 
 using namespace mooncake;
@@ -119,6 +126,321 @@ TEST_F(TransferMetadataTest, RpcMetaEntryTest) {
     ASSERT_EQ(re, 0);
 }
 
+// readers see consistent descriptors while buffers are added and removed
+TEST_F(TransferMetadataTest, ConcurrentLocalSegmentUpdate) {
+    auto segment_des = std::make_shared<TransferMetadata::SegmentDesc>();
+    segment_des->name = "test_concurrent_local";
+    segment_des->protocol = "tcp";
+    int re = metadata_client->addLocalSegment(
+        LOCAL_SEGMENT_ID, "test_concurrent_local", std::move(segment_des));
+    ASSERT_EQ(re, 0);
+
+    const int kBufferCount = 1000;
+    std::atomic<bool> running(true);
+    std::vector<std::thread> reader_list;
+    for (int i = 0; i < 4; ++i)
+        reader_list.emplace_back([&]() {
+            while (running) {
+                auto desc =
+                    metadata_client->peekSegmentDescByID(LOCAL_SEGMENT_ID);
+                ASSERT_TRUE(desc);
+                ASSERT_EQ(desc->buffer_index.size(), desc->buffers.size());
+                if (!desc->buffers.empty()) {
+                    ASSERT_GE(desc->buffer_index.find(
+                                  desc->buffers.back().addr, 1),
+                              0);
+                }
+            }
+        });
+    for (int i = 0; i < kBufferCount; ++i) {
+        TransferMetadata::BufferDesc buffer_des;
+        buffer_des.addr = 0x100000 + i * 2048;
+        buffer_des.length = 1024;
+        ASSERT_EQ(metadata_client->addLocalMemoryBuffer(buffer_des, false), 0);
+    }
+    for (int i = 0; i < kBufferCount; i += 2) {
+        uint64_t addr = 0x100000 + i * 2048;
+        ASSERT_EQ(metadata_client->removeLocalMemoryBuffer((void*)addr, false),
+                  0);
+    }
+    running = false;
+    for (auto& thread : reader_list) thread.join();
+    auto desc = metadata_client->getSegmentDescByID(LOCAL_SEGMENT_ID);
+    ASSERT_EQ(desc->buffers.size(), kBufferCount / 2u);
+    ASSERT_EQ(desc->buffer_index.find(0x100000 + 2048, 1024), 0);
+    ASSERT_EQ(desc->buffer_index.find(0x100000, 1024), -1);
+}
+
+// buffers registered in batches or concurrently are all published
+TEST_F(TransferMetadataTest, BatchLocalMemoryBuffer) {
+    const std::string segment_name = "test_batch_segment";
+    auto segment_des = std::make_shared<TransferMetadata::SegmentDesc>();
+    segment_des->name = segment_name;
+    segment_des->protocol = "tcp";
+    int re = metadata_client->addLocalSegment(LOCAL_SEGMENT_ID, segment_name,
+                                              std::move(segment_des));
+    ASSERT_EQ(re, 0);
+
+    const uint64_t kBase = 0x100000;
+    std::vector<TransferMetadata::BufferDesc> buffer_list;
+    for (int i = 0; i < 1000; ++i)
+        buffer_list.push_back({"cpu:0", kBase + i * 2048, 1024, {}, {}});
+    ASSERT_EQ(metadata_client->addLocalMemoryBuffers(buffer_list, true), 0);
+
+    std::vector<std::thread> thread_list;
+    for (int i = 0; i < 8; ++i)
+        thread_list.emplace_back([&, i]() {
+            for (int j = 0; j < 50; ++j) {
+                TransferMetadata::BufferDesc buffer_des{
+                    "cpu:0", kBase + (1000 + i * 50 + j) * 2048, 1024, {}, {}};
+                ASSERT_EQ(
+                    metadata_client->addLocalMemoryBuffer(buffer_des, true),
+                    0);
+            }
+        });
+    for (auto& thread : thread_list) thread.join();
+    auto desc = metadata_client->getSegmentDesc(segment_name);
+    ASSERT_TRUE(desc);
+    ASSERT_EQ(desc->buffers.size(), 1400u);
+
+    std::vector<void*> addr_list;
+    for (int i = 0; i < 1400; i += 2)
+        addr_list.push_back((void*)(kBase + i * 2048));
+    ASSERT_EQ(metadata_client->removeLocalMemoryBuffers(addr_list, true), 0);
+    addr_list = {(void*)(kBase + 2048), (void*)(kBase + 1)};
+    ASSERT_EQ(metadata_client->removeLocalMemoryBuffers(addr_list, true),
+              ERR_ADDRESS_NOT_REGISTERED);
+    desc = metadata_client->getSegmentDesc(segment_name);
+    ASSERT_TRUE(desc);
+    ASSERT_EQ(desc->buffers.size(), 699u);
+    ASSERT_EQ(desc->buffer_index.find(kBase + 3 * 2048, 1024), 0);
+    ASSERT_EQ(metadata_client->removeSegmentDesc(segment_name), 0);
+}
+
+// concurrent lookups of a new segment share one fetch and one ID
+TEST_F(TransferMetadataTest, ConcurrentSegmentFetch) {
+    const std::string segment_name = "test_concurrent_segment";
+    TransferMetadata::SegmentDesc desc;
+    desc.name = segment_name;
+    desc.protocol = "tcp";
+    desc.buffers.push_back({"cpu:0", 0x10000, 0x1000, {}, {}});
+    ASSERT_EQ(metadata_client->updateSegmentDesc(segment_name, desc), 0);
+
+    const int kThreadCount = 8;
+    std::vector<TransferMetadata::SegmentID> id_list(kThreadCount);
+    std::vector<std::thread> thread_list;
+    for (int i = 0; i < kThreadCount; ++i)
+        thread_list.emplace_back([&, i]() {
+            id_list[i] = metadata_client->getSegmentID(segment_name);
+        });
+    for (auto& thread : thread_list) thread.join();
+    for (auto id : id_list) ASSERT_EQ(id, id_list[0]);
+    auto segment_desc = metadata_client->getSegmentDescByID(id_list[0]);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_EQ(segment_desc->buffer_index.find(0x10800, 0x10), 0);
+    ASSERT_EQ(metadata_client->removeSegmentDesc(segment_name), 0);
+}
+
+// a missing segment is not fetched again right away, unless it is published
+TEST_F(TransferMetadataTest, MissingSegmentCache) {
+    const std::string segment_name = "test_missing_segment";
+    ASSERT_EQ(metadata_client->getSegmentDescByName(segment_name), nullptr);
+    auto start_ts = getCurrentTimeInNano();
+    for (int i = 0; i < 1000; ++i)
+        ASSERT_EQ(metadata_client->getSegmentDescByName(segment_name),
+                  nullptr);
+    // far less than 1000 round trips
+    ASSERT_LT(getCurrentTimeInNano() - start_ts, 100000000ull);
+
+    TransferMetadata::SegmentDesc desc;
+    desc.name = segment_name;
+    desc.protocol = "tcp";
+    ASSERT_EQ(metadata_client->updateSegmentDesc(segment_name, desc), 0);
+    ASSERT_NE(metadata_client->getSegmentDescByName(segment_name), nullptr);
+    ASSERT_EQ(metadata_client->removeSegmentDesc(segment_name), 0);
+}
+
+// a segment published by another node is refreshed in the cache by the
+// watch, without a forced update
+TEST_F(TransferMetadataTest, WatchSegmentChange) {
+    if (!metadata_client->isWatching()) GTEST_SKIP();
+    const std::string segment_name = "test_watch_segment";
+    TransferMetadata::SegmentDesc desc;
+    desc.name = segment_name;
+    desc.protocol = "tcp";
+    desc.buffers.push_back({"cpu:0", 0x10000, 0x1000, {}, {}});
+    auto peer_client = std::make_unique<TransferMetadata>(metadata_server);
+    ASSERT_EQ(peer_client->updateSegmentDesc(segment_name, desc), 0);
+    auto segment_desc = metadata_client->getSegmentDescByName(segment_name);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_EQ(segment_desc->buffers.size(), 1u);
+
+    desc.buffers.push_back({"cpu:0", 0x20000, 0x1000, {}, {}});
+    ASSERT_EQ(peer_client->updateSegmentDesc(segment_name, desc), 0);
+    for (int i = 0; i < 500; ++i) {
+        segment_desc = metadata_client->getSegmentDescByName(segment_name);
+        if (segment_desc->buffers.size() == 2) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(segment_desc->buffers.size(), 2u);
+    ASSERT_EQ(segment_desc->buffer_index.find(0x20000, 0x10), 1);
+    ASSERT_EQ(peer_client->removeSegmentDesc(segment_name), 0);
+}
+
+// instances using the same memory:// store see each other's segments
+TEST_F(TransferMetadataTest, MemoryStorage) {
+    auto client = std::make_unique<TransferMetadata>("memory://test");
+    auto peer_client = std::make_unique<TransferMetadata>("memory://test");
+    auto other_client = std::make_unique<TransferMetadata>("memory://other");
+    const std::string segment_name = "test_memory_segment";
+    TransferMetadata::SegmentDesc desc;
+    desc.name = segment_name;
+    desc.protocol = "tcp";
+    desc.buffers.push_back({"cpu:0", 0x10000, 0x1000, {}, {}});
+    ASSERT_EQ(peer_client->updateSegmentDesc(segment_name, desc), 0);
+    auto segment_desc = client->getSegmentDescByName(segment_name);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_EQ(segment_desc->buffers.size(), 1u);
+    ASSERT_EQ(other_client->getSegmentDescByName(segment_name), nullptr);
+    ASSERT_EQ(peer_client->removeSegmentDesc(segment_name), 0);
+    ASSERT_EQ(client->getSegmentDescByName(segment_name, true), nullptr);
+}
+
+// in peer-to-peer mode, descriptors are served by the handshake daemon of
+// the process that published them
+TEST_F(TransferMetadataTest, PeerToPeerSegmentFetch) {
+    const std::string segment_name = "127.0.0.1:17201";
+    auto client = std::make_unique<TransferMetadata>("p2p://");
+    auto peer_client = std::make_unique<TransferMetadata>("p2p://");
+    ASSERT_TRUE(peer_client->isPeerToPeer());
+    ASSERT_EQ(peer_client->startHandshakeDaemon(nullptr, 17201), 0);
+    TransferMetadata::SegmentDesc desc;
+    desc.name = segment_name;
+    desc.protocol = "tcp";
+    desc.buffers.push_back({"cpu:0", 0x10000, 0x1000, {}, {}});
+    desc.tcp_data_port = 17299;
+    ASSERT_EQ(peer_client->updateSegmentDesc(segment_name, desc), 0);
+
+    auto segment_desc = client->getSegmentDescByName(segment_name);
+    ASSERT_TRUE(segment_desc);
+    ASSERT_EQ(segment_desc->buffers.size(), 1u);
+    ASSERT_EQ(segment_desc->tcp_data_port, 17299);
+    TransferMetadata::RpcMetaDesc rpc_meta;
+    ASSERT_EQ(client->getRpcMetaEntry(segment_name, rpc_meta), 0);
+    ASSERT_EQ(rpc_meta.ip_or_host_name, "127.0.0.1");
+    ASSERT_EQ(rpc_meta.rpc_port, 17201);
+
+    // not published, or no daemon listening
+    ASSERT_EQ(client->getSegmentDescByName("127.0.0.1:17201/other"), nullptr);
+    ASSERT_EQ(client->getSegmentDescByName("127.0.0.1:17202"), nullptr);
+}
+
+// concurrent handshakes to a peer share one connection and are batched
+TEST_F(TransferMetadataTest, ConcurrentHandshakes) {
+    const std::string server_name = "127.0.0.1:17301";
+    auto client = std::make_unique<TransferMetadata>("p2p://");
+    auto peer_client = std::make_unique<TransferMetadata>("p2p://");
+    std::atomic<int> handshake_count(0);
+    ASSERT_EQ(peer_client->startHandshakeDaemon(
+                  [&](const TransferMetadata::HandShakeDesc& peer_desc,
+                      TransferMetadata::HandShakeDesc& local_desc) {
+                      handshake_count++;
+                      local_desc.local_nic_path = peer_desc.peer_nic_path;
+                      local_desc.peer_nic_path = peer_desc.local_nic_path;
+                      local_desc.qp_num = peer_desc.qp_num;
+                      local_desc.local_gid = peer_desc.local_gid;
+                      local_desc.local_lid = peer_desc.local_lid + 1;
+                      return 0;
+                  },
+                  17301),
+              0);
+
+    const int kThreadCount = 64;
+    std::vector<int> ret_list(kThreadCount, -1);
+    std::vector<TransferMetadata::HandShakeDesc> reply_list(kThreadCount);
+    std::vector<std::thread> thread_list;
+    for (int i = 0; i < kThreadCount; ++i)
+        thread_list.emplace_back([&, i]() {
+            TransferMetadata::HandShakeDesc local_desc;
+            local_desc.local_nic_path = "local@mlx5_" + std::to_string(i);
+            local_desc.peer_nic_path = server_name + "@mlx5_0";
+            local_desc.qp_num = {(uint32_t)i, (uint32_t)i + 1};
+            local_desc.local_gid = "fe80::" + std::to_string(i);
+            local_desc.local_lid = i;
+            ret_list[i] =
+                client->sendHandshake(server_name, local_desc, reply_list[i]);
+        });
+    for (auto& thread : thread_list) thread.join();
+    for (int i = 0; i < kThreadCount; ++i) {
+        ASSERT_EQ(ret_list[i], 0);
+        ASSERT_EQ(reply_list[i].peer_nic_path,
+                  "local@mlx5_" + std::to_string(i));
+        ASSERT_EQ(reply_list[i].qp_num,
+                  std::vector<uint32_t>({(uint32_t)i, (uint32_t)i + 1}));
+        ASSERT_EQ(reply_list[i].local_gid, "fe80::" + std::to_string(i));
+        ASSERT_EQ(reply_list[i].local_lid, i + 1);
+    }
+    ASSERT_EQ(handshake_count.load(), kThreadCount);
+}
+
+// daemons that answer one message per connection, without batches
+TEST_F(TransferMetadataTest, LegacyHandshakeDaemon) {
+    const uint16_t kPort = 17302;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(listen_fd, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(listen_fd, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listen_fd, 16), 0);
+    std::atomic<int> connection_count(0);
+    std::thread daemon([&]() {
+        // echoes each message, like a handshake callback ignoring "type"
+        while (true) {
+            int conn_fd = accept(listen_fd, nullptr, nullptr);
+            if (conn_fd < 0) return;
+            connection_count++;
+            auto message = readString(conn_fd);
+            if (!message.empty()) writeString(conn_fd, message);
+            close(conn_fd);
+        }
+    });
+
+    auto plugin = HandShakePlugin::Create("");
+    // one by one, then concurrently
+    for (int i = 0; i < 3; ++i) {
+        Json::Value local, peer;
+        local["id"] = i;
+        ASSERT_EQ(plugin->send("127.0.0.1", kPort, local, peer), 0);
+        ASSERT_EQ(peer["id"].asInt(), i);
+    }
+    const int kThreadCount = 8;
+    std::vector<int> ret_list(kThreadCount, -1);
+    std::vector<Json::Value> reply_list(kThreadCount);
+    std::vector<std::thread> thread_list;
+    for (int i = 0; i < kThreadCount; ++i)
+        thread_list.emplace_back([&, i]() {
+            Json::Value local;
+            local["id"] = i;
+            ret_list[i] =
+                plugin->send("127.0.0.1", kPort, local, reply_list[i]);
+        });
+    for (auto& thread : thread_list) thread.join();
+    for (int i = 0; i < kThreadCount; ++i) {
+        ASSERT_EQ(ret_list[i], 0);
+        ASSERT_EQ(reply_list[i]["id"].asInt(), i);
+    }
+    plugin.reset();
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    daemon.join();
+    ASSERT_GE(connection_count.load(), 3 + kThreadCount);
+}
+
 }  // namespace mooncake
 
 int main(int argc, char** argv) {